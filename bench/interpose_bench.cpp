@@ -0,0 +1,400 @@
+/*
+ * Interposition overhead benchmark
+ *
+ * Times calls that never touch PLFS -- open/close, stat, read and write
+ * of 1 B to 1 MiB, fprintf and readdir on local files -- once in a
+ * process without soplfs and once in a process with LD_PRELOAD set to
+ * it, so the cost of the non-PLFS fast path is measured on its own.
+ *
+ * Output is one JSON object per line and case on stdout:
+ *
+ *   {"variant":"preload","op":"write","size":4096,"iters":20000,
+ *    "ns_per_op":812.3,"p50":790,"p90":850,"p99":1400,"p999":5200,
+ *    "max":31000,"syscalls_per_op":1.00,
+ *    "hist":[[1024,19877],[2048,101],...]}
+ *
+ * hist holds [upper bound in ns, samples] for the power-of-two buckets
+ * that are not empty.  syscalls_per_op is counted in a ptrace'd child
+ * and is null where ptrace is not permitted.  A summary with the
+ * per-call overhead goes to stderr.
+ *
+ *   bench/interpose_bench [-p ./libsoplfs.so] [-d /tmp] [-n iters]
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <time.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <sys/ptrace.h>
+#include <sys/syscall.h>
+
+#include <string>
+#include <vector>
+#include <map>
+#include <algorithm>
+
+
+#define FILE_SIZE (16 * 1024 * 1024)
+#define DIR_ENTRIES 64
+#define HIST_BUCKETS 40
+#define COUNT_ITERS 200
+
+struct bench_ctx {
+  std::string dir;
+  std::string file;
+  std::string list_dir;
+  size_t size;
+  int fd;
+  FILE *stream;
+  off_t offset;
+  std::vector<char> buf;
+  long i;
+};
+
+struct bench_op {
+  const char *name;
+  size_t size;
+  void (*prepare)(bench_ctx *c);
+  void (*call)(bench_ctx *c);
+  void (*finish)(bench_ctx *c);
+};
+
+
+static long long now_ns() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static void die(const char *what) {
+  perror(what);
+  exit(1);
+}
+
+
+static void none(bench_ctx *c) {
+}
+
+static void open_close(bench_ctx *c) {
+  int fd = open(c->file.c_str(), O_RDONLY);
+  if (fd < 0) die("open");
+  close(fd);
+}
+
+static void do_stat(bench_ctx *c) {
+  struct stat st;
+  if (stat(c->file.c_str(), &st) != 0) die("stat");
+}
+
+static void open_read(bench_ctx *c) {
+  c->fd = open(c->file.c_str(), O_RDONLY);
+  if (c->fd < 0) die("open");
+  c->buf.resize(c->size);
+  c->offset = 0;
+}
+
+static void open_write(bench_ctx *c) {
+  std::string path = c->dir + "/write.dat";
+  c->fd = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (c->fd < 0) die("open");
+  c->buf.assign(c->size, 'w');
+  c->offset = 0;
+}
+
+static void close_fd(bench_ctx *c) {
+  close(c->fd);
+}
+
+// both stay inside FILE_SIZE so the page cache footprint is fixed
+static void do_read(bench_ctx *c) {
+  if (c->offset + (off_t)c->size > FILE_SIZE) {
+    lseek(c->fd, 0, SEEK_SET);
+    c->offset = 0;
+  }
+  if (read(c->fd, &c->buf[0], c->size) != (ssize_t)c->size) die("read");
+  c->offset += c->size;
+}
+
+static void do_write(bench_ctx *c) {
+  if (c->offset + (off_t)c->size > FILE_SIZE) {
+    lseek(c->fd, 0, SEEK_SET);
+    c->offset = 0;
+  }
+  if (write(c->fd, &c->buf[0], c->size) != (ssize_t)c->size) die("write");
+  c->offset += c->size;
+}
+
+static void open_stream(bench_ctx *c) {
+  std::string path = c->dir + "/fprintf.dat";
+  c->stream = fopen(path.c_str(), "w");
+  if (c->stream == NULL) die("fopen");
+}
+
+static void do_fprintf(bench_ctx *c) {
+  fprintf(c->stream, "%ld %s %.3f\n", c->i++, "checkpoint", 0.5);
+}
+
+static void close_stream(bench_ctx *c) {
+  fclose(c->stream);
+}
+
+static void do_readdir(bench_ctx *c) {
+  DIR *d = opendir(c->list_dir.c_str());
+  if (d == NULL) die("opendir");
+  while (readdir(d) != NULL);
+  closedir(d);
+}
+
+static const bench_op ops[] = {
+  { "open_close", 0,       none,        open_close, none },
+  { "stat",       0,       none,        do_stat,    none },
+  { "read",       1,       open_read,   do_read,    close_fd },
+  { "read",       64,      open_read,   do_read,    close_fd },
+  { "read",       4096,    open_read,   do_read,    close_fd },
+  { "read",       65536,   open_read,   do_read,    close_fd },
+  { "read",       1048576, open_read,   do_read,    close_fd },
+  { "write",      1,       open_write,  do_write,   close_fd },
+  { "write",      64,      open_write,  do_write,   close_fd },
+  { "write",      4096,    open_write,  do_write,   close_fd },
+  { "write",      65536,   open_write,  do_write,   close_fd },
+  { "write",      1048576, open_write,  do_write,   close_fd },
+  { "fprintf",    0,       open_stream, do_fprintf, close_stream },
+  { "readdir",    DIR_ENTRIES, none,    do_readdir, none },
+};
+
+
+static void setup(const std::string &dir) {
+  mkdir(dir.c_str(), 0755);
+
+  std::string path = dir + "/read.dat";
+  struct stat st;
+  if (stat(path.c_str(), &st) != 0 || st.st_size != FILE_SIZE) {
+    int fd = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) die(path.c_str());
+    std::vector<char> block(1024 * 1024, 'r');
+    for (int i = 0; i < FILE_SIZE / (1024 * 1024); i++) {
+      if (write(fd, &block[0], block.size()) < 0) die("write");
+    }
+    close(fd);
+  }
+
+  std::string list = dir + "/list";
+  mkdir(list.c_str(), 0755);
+  for (int i = 0; i < DIR_ENTRIES - 2; i++) {
+    char name[32];
+    snprintf(name, sizeof(name), "/f%03d", i);
+    int fd = open((list + name).c_str(), O_WRONLY | O_CREAT, 0644);
+    if (fd >= 0) close(fd);
+  }
+}
+
+/*
+ * Syscalls per call: a child runs the call between two getppid()
+ * markers under PTRACE_SYSCALL and every syscall entry between them is
+ * counted.  Returns -1 when ptrace is not permitted.
+ */
+static double count_syscalls(const bench_op &op, bench_ctx &c) {
+  pid_t pid = fork();
+  if (pid == 0) {
+    op.prepare(&c);
+    if (ptrace(PTRACE_TRACEME, 0, NULL, NULL) != 0) _exit(2);
+    raise(SIGSTOP);
+    syscall(SYS_getppid);
+    for (int i = 0; i < COUNT_ITERS; i++) op.call(&c);
+    syscall(SYS_getppid);
+    _exit(0);
+  }
+
+  int status;
+  if (waitpid(pid, &status, 0) < 0 || !WIFSTOPPED(status)) {
+    if (pid > 0) waitpid(pid, &status, 0);
+    return -1;
+  }
+  ptrace(PTRACE_SETOPTIONS, pid, NULL, PTRACE_O_TRACESYSGOOD | PTRACE_O_EXITKILL);
+
+  int markers = 0;
+  long calls = 0;
+  int sig = 0;
+  while (1) {
+    if (ptrace(PTRACE_SYSCALL, pid, NULL, sig) != 0) break;
+    sig = 0;
+    if (waitpid(pid, &status, 0) < 0 || WIFEXITED(status) || WIFSIGNALED(status)) break;
+    if (!WIFSTOPPED(status)) continue;
+    if (WSTOPSIG(status) != (SIGTRAP | 0x80)) {
+      sig = WSTOPSIG(status);
+      continue;
+    }
+
+    struct __ptrace_syscall_info info;
+    if (ptrace(PTRACE_GET_SYSCALL_INFO, pid, sizeof(info), &info) <= 0) continue;
+    if (info.op != PTRACE_SYSCALL_INFO_ENTRY) continue;
+    if (info.entry.nr == SYS_getppid) {
+      markers++;
+    } else if (markers == 1) {
+      calls++;
+    }
+  }
+  waitpid(pid, &status, 0);
+
+  return markers == 2 ? (double)calls / COUNT_ITERS : -1;
+}
+
+static void run(const char *variant, const bench_op &op, bench_ctx &c, long iters) {
+  c.size = op.size;
+  c.i = 0;
+
+  // the big transfers are capped by volume instead of count
+  if (op.size > 0) iters = std::max(64L, std::min(iters, (long)(256 * 1024 * 1024 / op.size)));
+
+  double syscalls = count_syscalls(op, c);
+
+  op.prepare(&c);
+  for (long i = 0; i < iters / 10; i++) op.call(&c);
+
+  // ns_per_op from an untimed loop, the distribution from per-call samples
+  long long start = now_ns();
+  for (long i = 0; i < iters; i++) op.call(&c);
+  double ns_per_op = (double)(now_ns() - start) / iters;
+
+  std::vector<long long> lat(iters);
+  for (long i = 0; i < iters; i++) {
+    long long t0 = now_ns();
+    op.call(&c);
+    lat[i] = now_ns() - t0;
+  }
+  op.finish(&c);
+
+  long hist[HIST_BUCKETS];
+  memset(hist, 0, sizeof(hist));
+  for (long i = 0; i < iters; i++) {
+    int b = 0;
+    while (b < HIST_BUCKETS - 1 && lat[i] >= (1LL << b)) b++;
+    hist[b]++;
+  }
+  std::sort(lat.begin(), lat.end());
+
+  printf("{\"variant\":\"%s\",\"op\":\"%s\",\"size\":%zu,\"iters\":%ld,"
+         "\"ns_per_op\":%.1f,\"p50\":%lld,\"p90\":%lld,\"p99\":%lld,\"p999\":%lld,"
+         "\"max\":%lld,\"syscalls_per_op\":",
+         variant, op.name, op.size, iters, ns_per_op,
+         lat[iters / 2], lat[iters * 9 / 10], lat[iters * 99 / 100],
+         lat[iters * 999 / 1000], lat.back());
+  if (syscalls < 0) printf("null");
+  else printf("%.2f", syscalls);
+  printf(",\"hist\":[");
+  const char *sep = "";
+  for (int b = 0; b < HIST_BUCKETS; b++) {
+    if (hist[b] == 0) continue;
+    printf("%s[%lld,%ld]", sep, 1LL << b, hist[b]);
+    sep = ",";
+  }
+  printf("]}\n");
+  fflush(stdout);
+}
+
+static int run_variant(const char *variant, const std::string &dir, long iters) {
+  bench_ctx c;
+  c.dir = dir;
+  c.file = dir + "/read.dat";
+  c.list_dir = dir + "/list";
+
+  for (size_t i = 0; i < sizeof(ops) / sizeof(ops[0]); i++) {
+    run(variant, ops[i], c, iters);
+  }
+  return 0;
+}
+
+// runs one variant in a fresh process and passes its records through
+static void spawn(char *self, const char *variant, const char *preload,
+                  const std::string &dir, long iters,
+                  std::map<std::string, double> &result) {
+  int fds[2];
+  if (pipe(fds) != 0) die("pipe");
+
+  pid_t pid = fork();
+  if (pid == 0) {
+    dup2(fds[1], 1);
+    close(fds[0]);
+    close(fds[1]);
+    if (preload != NULL) setenv("LD_PRELOAD", preload, 1);
+    else unsetenv("LD_PRELOAD");
+
+    char n[32];
+    snprintf(n, sizeof(n), "%ld", iters);
+    execl("/proc/self/exe", self, "-v", variant, "-d", dir.c_str(), "-n", n, (char*)NULL);
+    die("exec");
+  }
+  close(fds[1]);
+
+  FILE *in = fdopen(fds[0], "r");
+  char line[4096];
+  while (fgets(line, sizeof(line), in) != NULL) {
+    fputs(line, stdout);
+
+    char op[64];
+    size_t size;
+    double ns;
+    if (sscanf(line, "{\"variant\":\"%*[^\"]\",\"op\":\"%63[^\"]\",\"size\":%zu,"
+               "\"iters\":%*d,\"ns_per_op\":%lf", op, &size, &ns) == 3) {
+      char key[96];
+      snprintf(key, sizeof(key), "%-10s %8zu", op, size);
+      result[key] = ns;
+    }
+  }
+  fclose(in);
+
+  int status;
+  waitpid(pid, &status, 0);
+  if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+    fprintf(stderr, "%s run failed\n", variant);
+    exit(1);
+  }
+}
+
+int main(int argc, char **argv) {
+  const char *preload = "./libsoplfs.so";
+  const char *variant = NULL;
+  std::string dir = "/tmp";
+  long iters = 20000;
+
+  int opt;
+  while ((opt = getopt(argc, argv, "p:d:n:v:")) != -1) {
+    switch (opt) {
+      case 'p': preload = optarg; break;
+      case 'd': dir = optarg; break;
+      case 'n': iters = atol(optarg); break;
+      case 'v': variant = optarg; break;
+      default:
+        fprintf(stderr, "usage: %s [-p preload.so] [-d dir] [-n iters]\n", argv[0]);
+        return 1;
+    }
+  }
+  if (iters < 100) iters = 100;
+
+  if (variant != NULL) {
+    return run_variant(variant, dir, iters);
+  }
+
+  char real[4096];
+  if (realpath(preload, real) == NULL) die(preload);
+  dir += "/interpose_bench";
+  setup(dir);
+
+  std::map<std::string, double> native, preloaded;
+  spawn(argv[0], "native", NULL, dir, iters, native);
+  spawn(argv[0], "preload", real, dir, iters, preloaded);
+
+  fprintf(stderr, "%-19s %12s %12s %12s\n", "op", "native_ns", "preload_ns", "overhead_ns");
+  for (std::map<std::string, double>::iterator itr = native.begin(); itr != native.end(); itr++) {
+    double p = preloaded[itr->first];
+    fprintf(stderr, "%-19s %12.1f %12.1f %12.1f\n",
+            itr->first.c_str(), itr->second, p, p - itr->second);
+  }
+
+  return 0;
+}
@@ -0,0 +1,352 @@
+/*
+ * Checkpoint workload benchmark
+ *
+ * IOR-style write-then-read of the access patterns PLFS was built for,
+ * meant to run under LD_PRELOAD=libsoplfs.so against a PLFS (or
+ * plfs_stub) mount:
+ *
+ *   n1-strided    one shared file, every transfer interleaved by task:
+ *                 task r writes transfer i of segment s at
+ *                 ((s * B/t + i) * R + r) * t
+ *   n1-segmented  one shared file, every task writes a contiguous block
+ *                 per segment at (s * R + r) * B + i * t
+ *   nn            one file per task, (s * B) + i * t
+ *
+ * with R tasks, block size B and transfer size t.  Tasks are -N
+ * processes of -T threads each; all of them meet at a process-shared
+ * barrier between open, transfer and close, so the phases are timed
+ * separately.  Transfers use lseek+write/read like IOR's POSIX backend,
+ * or pwrite/pread with -x.  Per pattern and phase it prints bandwidth,
+ * open and close time and transfer latency percentiles:
+ *
+ *   LD_PRELOAD=./libsoplfs.so bench/ior_bench -d /mnt/plfs -t 1m -b 16m -N 4
+ *
+ * Threads of one process share soplfs' descriptor table, so -T > 1
+ * also measures its locking.  -C reads the data another task wrote, -v
+ * checks it, -k keeps the files.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <time.h>
+#include <stdint.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+
+#include <string>
+#include <vector>
+#include <algorithm>
+
+
+enum { N1_STRIDED, N1_SEGMENTED, NN };
+static const char *pattern_names[] = { "n1-strided", "n1-segmented", "nn" };
+
+struct ior_opts {
+  std::string dir;
+  size_t xfer;
+  size_t block;
+  int segments;
+  int procs;
+  int threads;
+  int positional;
+  int reorder;
+  int verify;
+  int keep;
+};
+
+// per task and phase, on CLOCK_MONOTONIC which all processes share
+struct task_times {
+  long long open_start;
+  long long open_end;
+  long long xfer_end;
+  long long close_end;
+  long errors;
+};
+
+struct ior_shared {
+  pthread_barrier_t barrier;
+  task_times times[1];   // [phase * tasks + task], sized at mmap time
+};
+
+static ior_opts opts;
+static int pattern;
+static ior_shared *shared;
+static long long *latencies;   // [phase][task][op]
+static long ops_per_task;
+static int tasks;
+
+
+static long long now_ns() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static size_t parse_size(const char *s) {
+  char *end;
+  size_t v = strtoull(s, &end, 10);
+  switch (*end) {
+    case 'k': case 'K': v <<= 10; break;
+    case 'm': case 'M': v <<= 20; break;
+    case 'g': case 'G': v <<= 30; break;
+  }
+  return v;
+}
+
+static task_times* times_of(int phase, int task) {
+  return &shared->times[phase * tasks + task];
+}
+
+static std::string file_of(int task) {
+  char name[64];
+  if (pattern == NN) snprintf(name, sizeof(name), "/ior_bench.nn.%d", task);
+  else snprintf(name, sizeof(name), "/ior_bench.n1");
+  return opts.dir + name;
+}
+
+static off_t offset_of(int task, long op) {
+  long per_block = opts.block / opts.xfer;
+  long s = op / per_block;
+  long i = op % per_block;
+
+  switch (pattern) {
+    case N1_STRIDED:
+      return ((off_t)(s * per_block + i) * tasks + task) * opts.xfer;
+    case N1_SEGMENTED:
+      return ((off_t)s * tasks + task) * opts.block + (off_t)i * opts.xfer;
+    default:
+      return (off_t)s * opts.block + (off_t)i * opts.xfer;
+  }
+}
+
+// every 8-byte word holds its own file offset
+static void fill(char *buf, off_t offset) {
+  uint64_t *w = (uint64_t*)buf;
+  for (size_t k = 0; k < opts.xfer / 8; k++) w[k] = offset + k * 8;
+}
+
+static long check(const char *buf, off_t offset) {
+  const uint64_t *w = (const uint64_t*)buf;
+  long bad = 0;
+  for (size_t k = 0; k < opts.xfer / 8; k++) {
+    if (w[k] != (uint64_t)(offset + k * 8)) bad++;
+  }
+  return bad;
+}
+
+static void run_phase(int phase, int task) {
+  // with -C a task reads back what its neighbour wrote
+  int owner = (phase == 1 && opts.reorder) ? (task + 1) % tasks : task;
+  std::string path = file_of(owner);
+  task_times *t = times_of(phase, task);
+  long long *lat = latencies + ((long)phase * tasks + task) * ops_per_task;
+  std::vector<char> buf(opts.xfer);
+
+  pthread_barrier_wait(&shared->barrier);
+  t->open_start = now_ns();
+  int fd = phase == 0 ? open(path.c_str(), O_WRONLY | O_CREAT, 0644)
+                      : open(path.c_str(), O_RDONLY);
+  t->open_end = now_ns();
+  if (fd < 0) {
+    perror(path.c_str());
+    t->errors++;
+  }
+
+  pthread_barrier_wait(&shared->barrier);
+  for (long op = 0; fd >= 0 && op < ops_per_task; op++) {
+    off_t offset = offset_of(owner, op);
+    if (phase == 0) fill(&buf[0], offset);
+
+    long long t0 = now_ns();
+    ssize_t n;
+    if (opts.positional) {
+      n = phase == 0 ? pwrite(fd, &buf[0], opts.xfer, offset)
+                     : pread(fd, &buf[0], opts.xfer, offset);
+    } else {
+      lseek(fd, offset, SEEK_SET);
+      n = phase == 0 ? write(fd, &buf[0], opts.xfer)
+                     : read(fd, &buf[0], opts.xfer);
+    }
+    lat[op] = now_ns() - t0;
+
+    if (n != (ssize_t)opts.xfer) t->errors++;
+    else if (phase == 1 && opts.verify) t->errors += check(&buf[0], offset) > 0;
+  }
+  t->xfer_end = now_ns();
+
+  pthread_barrier_wait(&shared->barrier);
+  if (fd >= 0 && close(fd) != 0) t->errors++;
+  t->close_end = now_ns();
+}
+
+static void* task_main(void *arg) {
+  long task = (long)arg;
+  run_phase(0, task);
+  run_phase(1, task);
+  return NULL;
+}
+
+static void process_main(int proc) {
+  if (opts.threads == 1) {
+    task_main((void*)(long)proc);
+    return;
+  }
+
+  std::vector<pthread_t> threads(opts.threads);
+  for (int i = 0; i < opts.threads; i++) {
+    pthread_create(&threads[i], NULL, task_main, (void*)(long)(proc * opts.threads + i));
+  }
+  for (int i = 0; i < opts.threads; i++) pthread_join(threads[i], NULL);
+}
+
+static long report(int phase) {
+  long long open_start = 0, open_end = 0, xfer_end = 0, close_start = 0, close_end = 0;
+  long errors = 0;
+  std::vector<long long> lat;
+
+  for (int task = 0; task < tasks; task++) {
+    task_times *t = times_of(phase, task);
+    if (task == 0 || t->open_start < open_start) open_start = t->open_start;
+    open_end = std::max(open_end, t->open_end);
+    xfer_end = std::max(xfer_end, t->xfer_end);
+    close_end = std::max(close_end, t->close_end);
+    errors += t->errors;
+
+    long long *l = latencies + ((long)phase * tasks + task) * ops_per_task;
+    lat.insert(lat.end(), l, l + ops_per_task);
+  }
+  // everyone enters close at the barrier that follows the slowest transfer
+  close_start = xfer_end;
+  std::sort(lat.begin(), lat.end());
+
+  double mib = (double)tasks * ops_per_task * opts.xfer / (1024.0 * 1024.0);
+  printf("%-13s %-5s %10.1f %10.1f %10.3f %10.3f %10lld %10lld %10lld %8ld\n",
+         pattern_names[pattern],
+         phase == 0 ? "write" : "read",
+         mib / ((close_end - open_start) / 1e9),
+         mib / ((xfer_end - open_end) / 1e9),
+         (open_end - open_start) / 1e6,
+         (close_end - close_start) / 1e6,
+         lat[lat.size() / 2],
+         lat[lat.size() * 99 / 100],
+         lat.back(),
+         errors);
+  return errors;
+}
+
+static int run_pattern() {
+  for (int task = 0; task < tasks; task++) unlink(file_of(task).c_str());
+  memset(shared->times, 0, 2 * tasks * sizeof(task_times));
+
+  std::vector<pid_t> pids;
+  for (int proc = 0; proc < opts.procs; proc++) {
+    pid_t pid = fork();
+    if (pid == 0) {
+      process_main(proc);
+      _exit(0);
+    }
+    pids.push_back(pid);
+  }
+
+  int failed = 0;
+  for (size_t i = 0; i < pids.size(); i++) {
+    int status;
+    waitpid(pids[i], &status, 0);
+    if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) failed = 1;
+  }
+  if (failed) {
+    fprintf(stderr, "%s: a task died\n", pattern_names[pattern]);
+    return 1;
+  }
+
+  long errors = report(0) + report(1);
+  fflush(stdout);
+
+  if (!opts.keep) {
+    for (int task = 0; task < tasks; task++) unlink(file_of(task).c_str());
+  }
+  return errors != 0;
+}
+
+static void usage(const char *self) {
+  fprintf(stderr,
+          "usage: %s -d dir [-p n1-strided|n1-segmented|nn|all] [-t xfer] [-b block]\n"
+          "       [-s segments] [-N procs] [-T threads] [-x] [-C] [-v] [-k]\n", self);
+  exit(1);
+}
+
+int main(int argc, char **argv) {
+  const char *which = "all";
+  opts.xfer = 1024 * 1024;
+  opts.block = 16 * 1024 * 1024;
+  opts.segments = 1;
+  opts.procs = 1;
+  opts.threads = 1;
+  opts.positional = 0;
+  opts.reorder = 0;
+  opts.verify = 0;
+  opts.keep = 0;
+
+  int opt;
+  while ((opt = getopt(argc, argv, "d:p:t:b:s:N:T:xCvk")) != -1) {
+    switch (opt) {
+      case 'd': opts.dir = optarg; break;
+      case 'p': which = optarg; break;
+      case 't': opts.xfer = parse_size(optarg); break;
+      case 'b': opts.block = parse_size(optarg); break;
+      case 's': opts.segments = atoi(optarg); break;
+      case 'N': opts.procs = atoi(optarg); break;
+      case 'T': opts.threads = atoi(optarg); break;
+      case 'x': opts.positional = 1; break;
+      case 'C': opts.reorder = 1; break;
+      case 'v': opts.verify = 1; break;
+      case 'k': opts.keep = 1; break;
+      default: usage(argv[0]);
+    }
+  }
+  if (opts.dir.empty() || opts.xfer < 8 || opts.xfer % 8 != 0 ||
+      opts.block < opts.xfer || opts.block % opts.xfer != 0 ||
+      opts.segments < 1 || opts.procs < 1 || opts.threads < 1) {
+    usage(argv[0]);
+  }
+
+  tasks = opts.procs * opts.threads;
+  ops_per_task = (long)opts.segments * (opts.block / opts.xfer);
+
+  // results and the barrier live in memory shared with the task processes
+  size_t shared_size = sizeof(ior_shared) + 2 * tasks * sizeof(task_times);
+  size_t lat_size = 2 * tasks * ops_per_task * sizeof(long long);
+  shared = (ior_shared*)mmap(NULL, shared_size, PROT_READ | PROT_WRITE,
+                             MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+  latencies = (long long*)mmap(NULL, lat_size, PROT_READ | PROT_WRITE,
+                               MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+  if (shared == MAP_FAILED || latencies == MAP_FAILED) {
+    perror("mmap");
+    return 1;
+  }
+
+  pthread_barrierattr_t attr;
+  pthread_barrierattr_init(&attr);
+  pthread_barrierattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+  pthread_barrier_init(&shared->barrier, &attr, tasks);
+
+  printf("# %s, %d tasks (%d x %d), xfer %zu, block %zu, %d segments, %s%s\n",
+         opts.dir.c_str(), tasks, opts.procs, opts.threads, opts.xfer, opts.block,
+         opts.segments, opts.positional ? "pwrite/pread" : "lseek+write/read",
+         opts.reorder ? ", reordered reads" : "");
+  printf("%-13s %-5s %10s %10s %10s %10s %10s %10s %10s %8s\n",
+         "pattern", "phase", "MiB/s", "xfer_MiB/s", "open_ms", "close_ms",
+         "p50_ns", "p99_ns", "max_ns", "errors");
+  fflush(stdout);
+
+  int ret = 0;
+  for (pattern = N1_STRIDED; pattern <= NN; pattern++) {
+    if (strcmp(which, "all") != 0 && strcmp(which, pattern_names[pattern]) != 0) continue;
+    ret |= run_pattern();
+  }
+
+  return ret;
+}
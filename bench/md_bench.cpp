@@ -0,0 +1,316 @@
+/*
+ * Metadata workload benchmark
+ *
+ * mdtest-like create/stat/list/remove storms, meant to run under
+ * LD_PRELOAD=libsoplfs.so against a PLFS (or plfs_stub) mount.  Every
+ * task builds a tree below <dir>/md_bench:
+ *
+ *   md.<task>/d<j>/f<i>     -b directories of -n/-b files each
+ *
+ * or, with -S, all tasks put their files into the same -b directories
+ * so the entries of one directory come from many tasks.  Tasks are -N
+ * processes of -T threads each and run the phases in lock step behind
+ * a process-shared barrier:
+ *
+ *   dir_create   mkdir                    (not with -S)
+ *   file_create  open(O_CREAT), -w bytes of write, close
+ *   file_stat    stat
+ *   dir_list     opendir, readdir to the end, closedir; counts entries
+ *   file_remove  unlink
+ *   dir_remove   rmdir                    (not with -S)
+ *
+ * and prints operations per second for each phase across all tasks,
+ * and task_ops/s, the rate of the slowest task:
+ *
+ *   LD_PRELOAD=./libsoplfs.so bench/md_bench -d /mnt/plfs -n 1000 -N 4
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+
+#include <string>
+#include <vector>
+#include <algorithm>
+
+
+enum { DIR_CREATE, FILE_CREATE, FILE_STAT, DIR_LIST, FILE_REMOVE, DIR_REMOVE, PHASES };
+static const char *phase_names[] = {
+  "dir_create", "file_create", "file_stat", "dir_list", "file_remove", "dir_remove"
+};
+
+struct md_opts {
+  std::string dir;
+  int files;
+  int dirs;
+  int procs;
+  int threads;
+  int shared_dirs;
+  size_t write_bytes;
+};
+
+// per task and phase, on CLOCK_MONOTONIC which all processes share
+struct phase_times {
+  long long start;
+  long long end;
+  long ops;
+  long errors;
+};
+
+struct md_shared {
+  pthread_barrier_t barrier;
+  phase_times times[1];   // [phase * tasks + task], sized at mmap time
+};
+
+static md_opts opts;
+static md_shared *shared;
+static int tasks;
+
+
+static long long now_ns() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static phase_times* times_of(int phase, int task) {
+  return &shared->times[phase * tasks + task];
+}
+
+static std::string task_dir(int task) {
+  char name[32];
+  if (opts.shared_dirs) snprintf(name, sizeof(name), "/shared");
+  else snprintf(name, sizeof(name), "/md.%d", task);
+  return opts.dir + name;
+}
+
+static std::string leaf_dir(int task, int j) {
+  char name[32];
+  snprintf(name, sizeof(name), "/d%d", j);
+  return task_dir(task) + name;
+}
+
+// file i of a task lives in leaf i % dirs; names carry the task for -S
+static std::string file_path(int task, int i) {
+  char name[48];
+  snprintf(name, sizeof(name), "/f%d.%d", task, i);
+  return leaf_dir(task, i % opts.dirs) + name;
+}
+
+static void run_phase(int phase, int task, std::vector<char> &buf) {
+  phase_times *t = times_of(phase, task);
+
+  pthread_barrier_wait(&shared->barrier);
+  t->start = now_ns();
+
+  switch (phase) {
+    case DIR_CREATE:
+      if (opts.shared_dirs) break;
+      if (mkdir(task_dir(task).c_str(), 0755) != 0) t->errors++;
+      t->ops++;
+      for (int j = 0; j < opts.dirs; j++, t->ops++) {
+        if (mkdir(leaf_dir(task, j).c_str(), 0755) != 0) t->errors++;
+      }
+      break;
+
+    case FILE_CREATE:
+      for (int i = 0; i < opts.files; i++, t->ops++) {
+        int fd = open(file_path(task, i).c_str(), O_WRONLY | O_CREAT | O_EXCL, 0644);
+        if (fd < 0) {
+          t->errors++;
+          continue;
+        }
+        if (opts.write_bytes > 0 && write(fd, &buf[0], opts.write_bytes) != (ssize_t)opts.write_bytes) {
+          t->errors++;
+        }
+        if (close(fd) != 0) t->errors++;
+      }
+      break;
+
+    case FILE_STAT:
+      for (int i = 0; i < opts.files; i++, t->ops++) {
+        struct stat st;
+        if (stat(file_path(task, i).c_str(), &st) != 0 ||
+            (size_t)st.st_size != opts.write_bytes) {
+          t->errors++;
+        }
+      }
+      break;
+
+    case DIR_LIST:
+      for (int j = 0; j < opts.dirs; j++) {
+        DIR *d = opendir(leaf_dir(task, j).c_str());
+        if (d == NULL) {
+          t->errors++;
+          continue;
+        }
+        while (readdir(d) != NULL) t->ops++;
+        closedir(d);
+      }
+      break;
+
+    case FILE_REMOVE:
+      for (int i = 0; i < opts.files; i++, t->ops++) {
+        if (unlink(file_path(task, i).c_str()) != 0) t->errors++;
+      }
+      break;
+
+    case DIR_REMOVE:
+      if (opts.shared_dirs) break;
+      for (int j = 0; j < opts.dirs; j++, t->ops++) {
+        if (rmdir(leaf_dir(task, j).c_str()) != 0) t->errors++;
+      }
+      if (rmdir(task_dir(task).c_str()) != 0) t->errors++;
+      t->ops++;
+      break;
+  }
+
+  t->end = now_ns();
+}
+
+static void* task_main(void *arg) {
+  long task = (long)arg;
+  std::vector<char> buf(opts.write_bytes + 1, 'm');
+  for (int phase = 0; phase < PHASES; phase++) run_phase(phase, task, buf);
+  return NULL;
+}
+
+static void process_main(int proc) {
+  if (opts.threads == 1) {
+    task_main((void*)(long)proc);
+    return;
+  }
+
+  std::vector<pthread_t> threads(opts.threads);
+  for (int i = 0; i < opts.threads; i++) {
+    pthread_create(&threads[i], NULL, task_main, (void*)(long)(proc * opts.threads + i));
+  }
+  for (int i = 0; i < opts.threads; i++) pthread_join(threads[i], NULL);
+}
+
+static long report(int phase) {
+  long long start = 0, end = 0, slowest = 0;
+  long ops = 0, errors = 0;
+
+  for (int task = 0; task < tasks; task++) {
+    phase_times *t = times_of(phase, task);
+    if (task == 0 || t->start < start) start = t->start;
+    end = std::max(end, t->end);
+    slowest = std::max(slowest, t->end - t->start);
+    ops += t->ops;
+    errors += t->errors;
+  }
+
+  if (ops == 0) {
+    printf("%-12s %10s %10s %12s %12s %8ld\n", phase_names[phase], "-", "-", "-", "-", errors);
+    return errors;
+  }
+
+  double secs = (end - start) / 1e9;
+  printf("%-12s %10ld %10.3f %12.1f %12.1f %8ld\n",
+         phase_names[phase], ops, secs, ops / secs,
+         (double)ops / tasks / (slowest / 1e9), errors);
+  return errors;
+}
+
+static void usage(const char *self) {
+  fprintf(stderr,
+          "usage: %s -d dir [-n files_per_task] [-b dirs_per_task] [-N procs]\n"
+          "       [-T threads] [-w bytes] [-S]\n", self);
+  exit(1);
+}
+
+int main(int argc, char **argv) {
+  opts.files = 1000;
+  opts.dirs = 10;
+  opts.procs = 1;
+  opts.threads = 1;
+  opts.shared_dirs = 0;
+  opts.write_bytes = 0;
+
+  int opt;
+  while ((opt = getopt(argc, argv, "d:n:b:N:T:w:S")) != -1) {
+    switch (opt) {
+      case 'd': opts.dir = optarg; break;
+      case 'n': opts.files = atoi(optarg); break;
+      case 'b': opts.dirs = atoi(optarg); break;
+      case 'N': opts.procs = atoi(optarg); break;
+      case 'T': opts.threads = atoi(optarg); break;
+      case 'w': opts.write_bytes = strtoull(optarg, NULL, 10); break;
+      case 'S': opts.shared_dirs = 1; break;
+      default: usage(argv[0]);
+    }
+  }
+  if (opts.dir.empty() || opts.files < 1 || opts.dirs < 1 ||
+      opts.procs < 1 || opts.threads < 1) {
+    usage(argv[0]);
+  }
+
+  tasks = opts.procs * opts.threads;
+  opts.dir += "/md_bench";
+  mkdir(opts.dir.c_str(), 0755);
+
+  // with -S the directories are set up here and not timed
+  if (opts.shared_dirs) {
+    mkdir(task_dir(0).c_str(), 0755);
+    for (int j = 0; j < opts.dirs; j++) mkdir(leaf_dir(0, j).c_str(), 0755);
+  }
+
+  size_t shared_size = sizeof(md_shared) + PHASES * tasks * sizeof(phase_times);
+  shared = (md_shared*)mmap(NULL, shared_size, PROT_READ | PROT_WRITE,
+                            MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+  if (shared == MAP_FAILED) {
+    perror("mmap");
+    return 1;
+  }
+
+  pthread_barrierattr_t attr;
+  pthread_barrierattr_init(&attr);
+  pthread_barrierattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+  pthread_barrier_init(&shared->barrier, &attr, tasks);
+
+  std::vector<pid_t> pids;
+  for (int proc = 0; proc < opts.procs; proc++) {
+    pid_t pid = fork();
+    if (pid == 0) {
+      process_main(proc);
+      _exit(0);
+    }
+    pids.push_back(pid);
+  }
+
+  int failed = 0;
+  for (size_t i = 0; i < pids.size(); i++) {
+    int status;
+    waitpid(pids[i], &status, 0);
+    if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) failed = 1;
+  }
+  if (failed) {
+    fprintf(stderr, "a task died\n");
+    return 1;
+  }
+
+  if (opts.shared_dirs) {
+    for (int j = 0; j < opts.dirs; j++) rmdir(leaf_dir(0, j).c_str());
+    rmdir(task_dir(0).c_str());
+  }
+  rmdir(opts.dir.c_str());
+
+  printf("# %s, %d tasks (%d x %d), %d files and %d %sdirectories per task, %zu bytes per file\n",
+         opts.dir.c_str(), tasks, opts.procs, opts.threads, opts.files, opts.dirs,
+         opts.shared_dirs ? "shared " : "", opts.write_bytes);
+  printf("%-12s %10s %10s %12s %12s %8s\n",
+         "phase", "ops", "seconds", "ops/s", "task_ops/s", "errors");
+
+  long errors = 0;
+  for (int phase = 0; phase < PHASES; phase++) errors += report(phase);
+
+  return errors != 0;
+}
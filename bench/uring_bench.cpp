@@ -0,0 +1,160 @@
+/*
+ * Small-read channel benchmark
+ *
+ * Reads a file sequentially in small requests the way soplfs' read()
+ * serves requests below the 1 MiB split, once per strategy:
+ *
+ *   lseek-read      the old channel: sync rfd's offset with two lseeks,
+ *                   read(rfd), then move the fake descriptor
+ *   pread           positioned read on rfd, no read-ahead
+ *   readahead       read-ahead window filled with one pread (SOPLFS_URING=0)
+ *   readahead-uring read-ahead window filled with parallel io_uring reads
+ *
+ * and prints syscalls per MiB and per-request latency.  Point it at a
+ * directory on tmpfs or on a FUSE mount:
+ *
+ *   bench/uring_bench /dev/shm [read_size] [file_mib]
+ */
+#include "soplfs_uring.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <sys/syscall.h>
+
+#include <string>
+#include <vector>
+#include <algorithm>
+
+
+static unsigned long bench_syscalls = 0;
+
+static long long now_ns() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static off_t sys_lseek(int fd, off_t offset, int whence) {
+  bench_syscalls++;
+  return lseek(fd, offset, whence);
+}
+
+static int make_file(const std::string &path, size_t size) {
+  struct stat st;
+  if (stat(path.c_str(), &st) == 0 && (size_t)st.st_size == size) return 0;
+
+  int fd = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (fd < 0) return -1;
+
+  std::vector<char> block(1024 * 1024);
+  for (size_t i = 0; i < block.size(); i++) block[i] = (char)i;
+  for (size_t done = 0; done < size; done += block.size()) {
+    if (write(fd, &block[0], std::min(block.size(), size - done)) < 0) {
+      close(fd);
+      return -1;
+    }
+  }
+  close(fd);
+  return 0;
+}
+
+static void run(const char *mode, const std::string &path, size_t rsize) {
+  int rfd = open(path.c_str(), O_RDONLY);
+  FILE *fake = tmpfile();
+  if (rfd < 0 || fake == NULL) {
+    perror(path.c_str());
+    exit(1);
+  }
+  int fd = fileno(fake);
+
+  ra_state *ra = ra_create(1024 * 1024, 8);   // soplfs' defaults
+  std::vector<char> buf(rsize);
+  std::vector<long long> lat;
+  size_t total = 0;
+
+  long long start = now_ns();
+  while (1) {
+    long long t0 = now_ns();
+    ssize_t n;
+
+    if (strcmp(mode, "lseek-read") == 0) {
+      off_t o = sys_lseek(fd, 0, SEEK_CUR);
+      sys_lseek(rfd, o, SEEK_SET);
+      bench_syscalls++;
+      n = read(rfd, &buf[0], rsize);
+      if (n > 0) sys_lseek(fd, n, SEEK_CUR);
+    } else {
+      off_t o = sys_lseek(fd, 0, SEEK_CUR);
+      if (strcmp(mode, "pread") == 0) {
+        bench_syscalls++;
+        n = pread(rfd, &buf[0], rsize, o);
+      } else {
+        n = ra_read(ra, rfd, &buf[0], rsize, o);
+      }
+      if (n > 0) sys_lseek(fd, o + n, SEEK_SET);
+    }
+
+    if (n <= 0) break;
+    lat.push_back(now_ns() - t0);
+    total += n;
+  }
+  long long elapsed = now_ns() - start;
+
+  std::sort(lat.begin(), lat.end());
+  double mib = total / (1024.0 * 1024.0);
+  unsigned long calls = bench_syscalls + uring_syscalls;
+
+  printf("%-16s %10.1f %10.1f %10lld %10lld %10lld\n",
+         mode,
+         calls / mib,
+         mib / (elapsed / 1e9),
+         lat.empty() ? 0 : lat[lat.size() / 2],
+         lat.empty() ? 0 : lat[lat.size() * 99 / 100],
+         lat.empty() ? 0 : lat.back());
+
+  ra_destroy(ra);
+  close(rfd);
+  fclose(fake);
+}
+
+int main(int argc, char **argv) {
+  if (argc < 2) {
+    fprintf(stderr, "usage: %s <dir> [read_size] [file_mib]\n", argv[0]);
+    return 1;
+  }
+
+  std::string path = std::string(argv[1]) + "/uring_bench.dat";
+  size_t rsize = argc > 2 ? strtoull(argv[2], NULL, 10) : 4096;
+  size_t size = (argc > 3 ? strtoull(argv[3], NULL, 10) : 64) * 1024 * 1024;
+
+  if (make_file(path, size) != 0) {
+    perror(path.c_str());
+    return 1;
+  }
+
+  printf("# %s, %zu byte reads, %zu MiB\n", path.c_str(), rsize, size >> 20);
+  printf("%-16s %10s %10s %10s %10s %10s\n",
+         "mode", "calls/MiB", "MiB/s", "p50_ns", "p99_ns", "max_ns");
+  fflush(stdout);
+
+  const char *modes[] = { "lseek-read", "pread", "readahead", "readahead-uring" };
+  for (size_t i = 0; i < sizeof(modes) / sizeof(modes[0]); i++) {
+    // a fresh process per mode: the engine reads its settings once
+    pid_t pid = fork();
+    if (pid == 0) {
+      setenv("SOPLFS_URING", strcmp(modes[i], "readahead-uring") == 0 ? "1" : "0", 1);
+      run(modes[i], path, rsize);
+      fflush(stdout);
+      _exit(0);
+    }
+    waitpid(pid, NULL, 0);
+  }
+
+  return 0;
+}
@@ -0,0 +1,108 @@
+#ifndef PLFS_STUB_H
+#define PLFS_STUB_H
+
+/*
+ * Stand-in for the subset of the PLFS API that soplfs uses.
+ *
+ * Signatures follow plfs.h of PLFS 2.5 so soplfs builds unchanged
+ * against either.  See plfs_stub.cpp for the backend.
+ */
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/statvfs.h>
+#include <stdarg.h>
+#include <string.h>
+#include <errno.h>
+
+#ifdef __cplusplus
+class Plfs_fd;
+extern "C" {
+#else
+typedef struct Plfs_fd Plfs_fd;
+#endif
+
+// values match errno so plfs_error_to_errno is the identity
+typedef enum {
+  PLFS_SUCCESS   = 0,
+  PLFS_EPERM     = EPERM,
+  PLFS_ENOENT    = ENOENT,
+  PLFS_EIO       = EIO,
+  PLFS_EBADF     = EBADF,
+  PLFS_EAGAIN    = EAGAIN,
+  PLFS_ENOMEM    = ENOMEM,
+  PLFS_EACCES    = EACCES,
+  PLFS_EEXIST    = EEXIST,
+  PLFS_EXDEV     = EXDEV,
+  PLFS_ENOTDIR   = ENOTDIR,
+  PLFS_EISDIR    = EISDIR,
+  PLFS_EINVAL    = EINVAL,
+  PLFS_ENFILE    = ENFILE,
+  PLFS_EMFILE    = EMFILE,
+  PLFS_EFBIG     = EFBIG,
+  PLFS_ENOSPC    = ENOSPC,
+  PLFS_EROFS     = EROFS,
+  PLFS_ERANGE    = ERANGE,
+  PLFS_ENAMETOOLONG = ENAMETOOLONG,
+  PLFS_ENOSYS    = ENOSYS,
+  PLFS_ENOTEMPTY = ENOTEMPTY,
+  PLFS_ENOTSUP   = ENOTSUP,
+  PLFS_TBD       = 1000
+} plfs_error_t;
+
+typedef enum {
+  PLFS_API,
+  PLFS_POSIX,
+  PLFS_MPIIO
+} plfs_interface;
+
+typedef struct {
+  char *index_stream;
+  int buffer_index;
+  plfs_interface pinter;
+  int reopen;
+} Plfs_open_opt;
+
+typedef struct {
+  void *pinfo;
+  plfs_interface pinter;
+  int num_procs;
+} Plfs_close_opt;
+
+plfs_error_t plfs_open(Plfs_fd **pfd, const char *path, int flags, pid_t pid,
+                       mode_t mode, Plfs_open_opt *open_opt);
+plfs_error_t plfs_close(Plfs_fd *fd, pid_t pid, uid_t uid, int open_flags,
+                        Plfs_close_opt *close_opt, int *num_ref);
+plfs_error_t plfs_read(Plfs_fd *fd, char *buf, size_t size, off_t offset,
+                       ssize_t *bytes_read);
+plfs_error_t plfs_write(Plfs_fd *fd, const char *buf, size_t size,
+                        off_t offset, pid_t pid, ssize_t *bytes_written);
+plfs_error_t plfs_sync(Plfs_fd *fd);
+plfs_error_t plfs_trunc(Plfs_fd *fd, const char *path, off_t offset,
+                        int open_file);
+
+plfs_error_t plfs_getattr(Plfs_fd *fd, const char *path, struct stat *st,
+                          int size_only);
+plfs_error_t plfs_access(const char *path, int mask);
+plfs_error_t plfs_mode(const char *path, mode_t *mode);
+plfs_error_t plfs_chmod(const char *path, mode_t mode);
+plfs_error_t plfs_chown(const char *path, uid_t uid, gid_t gid);
+plfs_error_t plfs_statvfs(const char *path, struct statvfs *stbuf);
+
+plfs_error_t plfs_readdir(const char *path, void *buf);
+plfs_error_t plfs_mkdir(const char *path, mode_t mode);
+plfs_error_t plfs_rmdir(const char *path);
+plfs_error_t plfs_rename(const char *from, const char *to);
+plfs_error_t plfs_unlink(const char *path);
+
+plfs_error_t plfs_expand_path(const char *logical, char **physical,
+                              void **pmountp, void **pbackp);
+
+int plfs_error_to_errno(plfs_error_t plfs_err);
+plfs_error_t errno_to_plfs_error(int err);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,324 @@
+/*
+ * Stand-in PLFS backend
+ *
+ * Implements the part of plfs.h that soplfs calls on top of a plain local
+ * directory: a logical path is stored as the ordinary file of the same
+ * name, so a mount_point in plfsrc that names a local directory (tmpfs
+ * for an in-memory store) is at the same time the "PLFS container" and
+ * the "FUSE mount" soplfs uses for small reads.  expand_path is the
+ * identity.
+ *
+ * Every call goes through raw syscalls: soplfs interposes libc, and the
+ * stub must not be routed back into it.
+ *
+ * Knobs, all optional:
+ *   PLFS_STUB_LATENCY_US=<spec>  sleep before an operation
+ *   PLFS_STUB_EAGAIN=<spec>      fail every Nth call of an operation
+ *                                with PLFS_EAGAIN
+ *   PLFS_STUB_STATS=1            per-operation call counts on stderr at exit
+ *
+ * <spec> is either a number for every operation or a list such as
+ * "read:200,write:50,*:10" using the operation names in stub_op_names.
+ */
+
+#include "plfs.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/syscall.h>
+
+#include <string>
+#include <set>
+
+
+class Plfs_fd {
+ public:
+  int fd;
+  int refs;
+  std::string path;
+};
+
+enum stub_op {
+  STUB_OPEN, STUB_CLOSE, STUB_READ, STUB_WRITE, STUB_SYNC, STUB_TRUNC,
+  STUB_GETATTR, STUB_ACCESS, STUB_MODE, STUB_CHMOD, STUB_CHOWN, STUB_STATVFS,
+  STUB_READDIR, STUB_MKDIR, STUB_RMDIR, STUB_RENAME, STUB_UNLINK, STUB_EXPAND,
+  STUB_NOPS
+};
+
+static const char *stub_op_names[STUB_NOPS] = {
+  "open", "close", "read", "write", "sync", "trunc",
+  "getattr", "access", "mode", "chmod", "chown", "statvfs",
+  "readdir", "mkdir", "rmdir", "rename", "unlink", "expand_path"
+};
+
+static pthread_once_t stub_once = PTHREAD_ONCE_INIT;
+static unsigned long stub_latency_us[STUB_NOPS];
+static unsigned long stub_eagain_every[STUB_NOPS];
+static unsigned long stub_calls[STUB_NOPS];
+static unsigned long stub_eagains[STUB_NOPS];
+static unsigned long stub_bytes[STUB_NOPS];
+
+
+static void stub_parse(const char *spec, unsigned long *table) {
+  if (spec == NULL) return;
+
+  std::string s(spec);
+  size_t pos = 0;
+  while (pos <= s.size()) {
+    size_t end = s.find(',', pos);
+    if (end == std::string::npos) end = s.size();
+    std::string item = s.substr(pos, end - pos);
+    pos = end + 1;
+
+    size_t colon = item.find(':');
+    if (colon == std::string::npos) {
+      unsigned long v = strtoul(item.c_str(), NULL, 10);
+      for (int i = 0; i < STUB_NOPS; i++) table[i] = v;
+      continue;
+    }
+
+    std::string name = item.substr(0, colon);
+    unsigned long v = strtoul(item.c_str() + colon + 1, NULL, 10);
+    for (int i = 0; i < STUB_NOPS; i++) {
+      if (name == "*" || name == stub_op_names[i]) table[i] = v;
+    }
+  }
+}
+
+static void stub_report() {
+  char line[256];
+  for (int i = 0; i < STUB_NOPS; i++) {
+    if (stub_calls[i] == 0) continue;
+    int n = snprintf(line, sizeof(line), "plfs_stub: %-12s calls %10lu eagain %8lu bytes %14lu\n",
+                     stub_op_names[i], stub_calls[i], stub_eagains[i], stub_bytes[i]);
+    syscall(SYS_write, 2, line, n);
+  }
+}
+
+static void stub_init() {
+  stub_parse(getenv("PLFS_STUB_LATENCY_US"), stub_latency_us);
+  stub_parse(getenv("PLFS_STUB_EAGAIN"), stub_eagain_every);
+
+  const char *v = getenv("PLFS_STUB_STATS");
+  if (v != NULL && strcmp(v, "0") != 0) atexit(stub_report);
+}
+
+// returns 1 when the call has to fail with PLFS_EAGAIN
+static int stub_enter(stub_op op) {
+  pthread_once(&stub_once, stub_init);
+
+  unsigned long n = __sync_add_and_fetch(&stub_calls[op], 1);
+
+  if (stub_latency_us[op] != 0) {
+    struct timespec ts;
+    ts.tv_sec = stub_latency_us[op] / 1000000;
+    ts.tv_nsec = (stub_latency_us[op] % 1000000) * 1000;
+    while (nanosleep(&ts, &ts) != 0 && errno == EINTR) {}
+  }
+
+  if (stub_eagain_every[op] != 0 && n % stub_eagain_every[op] == 0) {
+    __sync_add_and_fetch(&stub_eagains[op], 1);
+    return 1;
+  }
+  return 0;
+}
+
+static plfs_error_t stub_error(long ret) {
+  return ret < 0 ? errno_to_plfs_error(errno) : PLFS_SUCCESS;
+}
+
+
+extern "C" {
+
+plfs_error_t plfs_open(Plfs_fd **pfd, const char *path, int flags, pid_t pid,
+                       mode_t mode, Plfs_open_opt *open_opt) {
+  if (stub_enter(STUB_OPEN)) return PLFS_EAGAIN;
+
+  if (*pfd != NULL) {
+    // another writer on an open container
+    __sync_add_and_fetch(&(*pfd)->refs, 1);
+    return PLFS_SUCCESS;
+  }
+
+  // PLFS writes are positioned; O_APPEND would make pwrite ignore offsets.
+  // Open read-write when allowed so a handle can read what it wrote.
+  int sys_flags = (flags & ~(O_APPEND | O_ACCMODE)) | O_CLOEXEC;
+  long fd = syscall(SYS_openat, AT_FDCWD, path, sys_flags | O_RDWR, mode);
+  if (fd < 0 && (errno == EACCES || errno == EISDIR || errno == EROFS)) {
+    fd = syscall(SYS_openat, AT_FDCWD, path, sys_flags | (flags & O_ACCMODE), mode);
+  }
+  if (fd < 0) return stub_error(fd);
+
+  Plfs_fd *f = new Plfs_fd();
+  f->fd = fd;
+  f->refs = 1;
+  f->path = path;
+  *pfd = f;
+
+  return PLFS_SUCCESS;
+}
+
+plfs_error_t plfs_close(Plfs_fd *fd, pid_t pid, uid_t uid, int open_flags,
+                        Plfs_close_opt *close_opt, int *num_ref) {
+  if (stub_enter(STUB_CLOSE)) return PLFS_EAGAIN;
+
+  int refs = __sync_sub_and_fetch(&fd->refs, 1);
+  if (num_ref != NULL) *num_ref = refs;
+  if (refs > 0) return PLFS_SUCCESS;
+
+  long ret = syscall(SYS_close, fd->fd);
+  delete fd;
+  return stub_error(ret);
+}
+
+plfs_error_t plfs_read(Plfs_fd *fd, char *buf, size_t size, off_t offset,
+                       ssize_t *bytes_read) {
+  if (stub_enter(STUB_READ)) return PLFS_EAGAIN;
+
+  long ret = syscall(SYS_pread64, fd->fd, buf, size, offset);
+  if (ret < 0) return stub_error(ret);
+
+  __sync_add_and_fetch(&stub_bytes[STUB_READ], ret);
+  *bytes_read = ret;
+  return PLFS_SUCCESS;
+}
+
+plfs_error_t plfs_write(Plfs_fd *fd, const char *buf, size_t size,
+                        off_t offset, pid_t pid, ssize_t *bytes_written) {
+  if (stub_enter(STUB_WRITE)) return PLFS_EAGAIN;
+
+  long ret = syscall(SYS_pwrite64, fd->fd, buf, size, offset);
+  if (ret < 0) return stub_error(ret);
+
+  __sync_add_and_fetch(&stub_bytes[STUB_WRITE], ret);
+  *bytes_written = ret;
+  return PLFS_SUCCESS;
+}
+
+plfs_error_t plfs_sync(Plfs_fd *fd) {
+  if (stub_enter(STUB_SYNC)) return PLFS_EAGAIN;
+  return stub_error(syscall(SYS_fsync, fd->fd));
+}
+
+plfs_error_t plfs_trunc(Plfs_fd *fd, const char *path, off_t offset,
+                        int open_file) {
+  if (stub_enter(STUB_TRUNC)) return PLFS_EAGAIN;
+
+  if (fd != NULL) return stub_error(syscall(SYS_ftruncate, fd->fd, offset));
+  return stub_error(syscall(SYS_truncate, path, offset));
+}
+
+plfs_error_t plfs_getattr(Plfs_fd *fd, const char *path, struct stat *st,
+                          int size_only) {
+  if (stub_enter(STUB_GETATTR)) return PLFS_EAGAIN;
+
+  // as PLFS (and FUSE's getattr), a symbolic link is not followed
+  if (fd != NULL) return stub_error(syscall(SYS_fstat, fd->fd, st));
+  return stub_error(syscall(SYS_newfstatat, AT_FDCWD, path, st, AT_SYMLINK_NOFOLLOW));
+}
+
+plfs_error_t plfs_access(const char *path, int mask) {
+  if (stub_enter(STUB_ACCESS)) return PLFS_EAGAIN;
+  return stub_error(syscall(SYS_faccessat, AT_FDCWD, path, mask));
+}
+
+plfs_error_t plfs_mode(const char *path, mode_t *mode) {
+  if (stub_enter(STUB_MODE)) return PLFS_EAGAIN;
+
+  struct stat st;
+  long ret = syscall(SYS_newfstatat, AT_FDCWD, path, &st, 0);
+  if (ret == 0) *mode = st.st_mode;
+  return stub_error(ret);
+}
+
+plfs_error_t plfs_chmod(const char *path, mode_t mode) {
+  if (stub_enter(STUB_CHMOD)) return PLFS_EAGAIN;
+  return stub_error(syscall(SYS_fchmodat, AT_FDCWD, path, mode));
+}
+
+plfs_error_t plfs_chown(const char *path, uid_t uid, gid_t gid) {
+  if (stub_enter(STUB_CHOWN)) return PLFS_EAGAIN;
+  return stub_error(syscall(SYS_fchownat, AT_FDCWD, path, uid, gid, 0));
+}
+
+plfs_error_t plfs_statvfs(const char *path, struct statvfs *stbuf) {
+  if (stub_enter(STUB_STATVFS)) return PLFS_EAGAIN;
+  // statvfs(3) has no syscall of its own and does not touch soplfs' hooks
+  return stub_error(statvfs(path, stbuf));
+}
+
+struct stub_dirent64 {
+  uint64_t d_ino;
+  int64_t d_off;
+  unsigned short d_reclen;
+  unsigned char d_type;
+  char d_name[];
+};
+
+plfs_error_t plfs_readdir(const char *path, void *buf) {
+  if (stub_enter(STUB_READDIR)) return PLFS_EAGAIN;
+
+  std::set<std::string> *entries = (std::set<std::string>*)buf;
+
+  long fd = syscall(SYS_openat, AT_FDCWD, path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  if (fd < 0) return stub_error(fd);
+
+  char dents[32768];
+  long n;
+  while ((n = syscall(SYS_getdents64, fd, dents, sizeof(dents))) > 0) {
+    for (long pos = 0; pos < n; ) {
+      struct stub_dirent64 *d = (struct stub_dirent64*)(dents + pos);
+      entries->insert(d->d_name);
+      pos += d->d_reclen;
+    }
+  }
+
+  plfs_error_t ret = stub_error(n);
+  syscall(SYS_close, fd);
+  return ret;
+}
+
+plfs_error_t plfs_mkdir(const char *path, mode_t mode) {
+  if (stub_enter(STUB_MKDIR)) return PLFS_EAGAIN;
+  return stub_error(syscall(SYS_mkdirat, AT_FDCWD, path, mode));
+}
+
+plfs_error_t plfs_rmdir(const char *path) {
+  if (stub_enter(STUB_RMDIR)) return PLFS_EAGAIN;
+  return stub_error(syscall(SYS_unlinkat, AT_FDCWD, path, AT_REMOVEDIR));
+}
+
+plfs_error_t plfs_rename(const char *from, const char *to) {
+  if (stub_enter(STUB_RENAME)) return PLFS_EAGAIN;
+  return stub_error(syscall(SYS_renameat, AT_FDCWD, from, AT_FDCWD, to));
+}
+
+plfs_error_t plfs_unlink(const char *path) {
+  if (stub_enter(STUB_UNLINK)) return PLFS_EAGAIN;
+  return stub_error(syscall(SYS_unlinkat, AT_FDCWD, path, 0));
+}
+
+plfs_error_t plfs_expand_path(const char *logical, char **physical,
+                              void **pmountp, void **pbackp) {
+  if (stub_enter(STUB_EXPAND)) return PLFS_EAGAIN;
+
+  *physical = strdup(logical);
+  if (pmountp != NULL) *pmountp = NULL;
+  if (pbackp != NULL) *pbackp = NULL;
+  return *physical ? PLFS_SUCCESS : PLFS_ENOMEM;
+}
+
+int plfs_error_to_errno(plfs_error_t plfs_err) {
+  return plfs_err == PLFS_TBD ? EIO : (int)plfs_err;
+}
+
+plfs_error_t errno_to_plfs_error(int err) {
+  return (plfs_error_t)err;
+}
+
+}
@@ -1,14 +1,18 @@
 #define _LARGEFILE64_SOURCE
-#include "plfs.h"
+#include "soplfs_internal.h"
+#include "soplfs_uring.h"
+#include "soplfs_probes.h"
 
 #include <stdio.h>
 #include <stdlib.h>
 #include <dlfcn.h>
 #include <fcntl.h>
 #include <sys/mman.h>
+#include <sys/sendfile.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <signal.h>
+#include <spawn.h>
 #include <unistd.h>
 #include <dirent.h>
 #include <errno.h>
@@ -25,26 +29,10 @@
 #include <algorithm>
 
 
-#define MAP(func, ret) \
-    if (!(__libc_ ## func)) { \
-        __libc_ ## func = (ret) dlsym(RTLD_NEXT, #func); \
-        if (!(__libc_ ## func)) std::cerr  << "Failed to link symbol: " << #func << std::endl; \
-    }
-
-
-struct plfs_file_t {
-  Plfs_fd *fd;
-  std::string *path;
-  int rfd;   // for small reads, through FUSE
-  int flags;
-  FILE* tmp_file;
-  plfs_file_t(): fd(NULL), path(NULL), flags(0) {}
-};
-typedef plfs_file_t plfs_file;
-std::map<int, plfs_file*> plfs_files;
+std::map<int, plfs_file*> plfs_files SOPLFS_GLOBAL;
 
-std::vector<std::string> mount_points;
-std::map<std::string, std::string> phys_paths;
+std::vector<std::string> mount_points SOPLFS_GLOBAL;
+std::map<std::string, std::string> phys_paths SOPLFS_GLOBAL;
 
 
 struct plfs_dir_t {
@@ -55,8 +43,8 @@ struct plfs_dir_t {
   plfs_dir_t(): path(NULL), files(NULL), iter(NULL), dirFd(0) {}
 };
 typedef plfs_dir_t plfs_dir;
-std::map<DIR*, plfs_dir*> opendirs;
-std::map<int, DIR*> fd2dir;
+std::map<DIR*, plfs_dir*> opendirs SOPLFS_GLOBAL;
+std::map<int, DIR*> fd2dir SOPLFS_GLOBAL;
 
 
 int (*__libc_open)(const char* path, int flags, ...) = NULL;
@@ -119,6 +107,20 @@ int (*__libc_rename)(const char* frompath, const char* topath) = NULL;
 
 int (*__libc_fflush)(FILE* stream) = NULL;
 
+int (*__libc_fsync)(int fd) = NULL;
+int (*__libc_fdatasync)(int fd) = NULL;
+int (*__libc_syncfs)(int fd) = NULL;
+int (*__libc_sync_file_range)(int fd, off64_t offset, off64_t nbytes, unsigned int flags) = NULL;
+
+int (*__libc_aio_read)(struct aiocb *aiocbp) = NULL;
+int (*__libc_aio_write)(struct aiocb *aiocbp) = NULL;
+int (*__libc_aio_fsync)(int op, struct aiocb *aiocbp) = NULL;
+int (*__libc_aio_error)(const struct aiocb *aiocbp) = NULL;
+ssize_t (*__libc_aio_return)(struct aiocb *aiocbp) = NULL;
+int (*__libc_aio_suspend)(const struct aiocb *const list[], int nent, const struct timespec *timeout) = NULL;
+int (*__libc_aio_cancel)(int fd, struct aiocb *aiocbp) = NULL;
+int (*__libc_lio_listio)(int mode, struct aiocb *const list[], int nent, struct sigevent *sevp) = NULL;
+
 
 int (*__libc_unlink)(const char* pathname) = NULL;
 
@@ -128,16 +130,92 @@ int (*__libc___lxstat)(int vers, const char* path, struct stat* statbuf) = NULL;
 
 int (*__libc___xstat)(int vers, const char *path, struct stat *buf) = NULL;
 int (*__libc___fxstat)(int vers, int fd, struct stat *buf) = NULL;
+int (*__libc_fstat)(int fd, struct stat *buf) = NULL;
+int (*__libc_fstat64)(int fd, struct stat64 *buf) = NULL;
+
+void* (*__libc_mmap)(void *addr, size_t len, int prot, int flags, int fd, off_t offset) = NULL;
+void* (*__libc_mmap64)(void *addr, size_t len, int prot, int flags, int fd, off64_t offset) = NULL;
+int (*__libc_munmap)(void *addr, size_t len) = NULL;
+int (*__libc_madvise)(void *addr, size_t len, int advice) = NULL;
+int (*__libc_posix_fadvise)(int fd, off_t offset, off_t len, int advice) = NULL;
+int (*__libc_posix_fadvise64)(int fd, off64_t offset, off64_t len, int advice) = NULL;
+ssize_t (*__libc_readahead)(int fd, off64_t offset, size_t count) = NULL;
+
+ssize_t (*__libc_copy_file_range)(int fd_in, off64_t *off_in, int fd_out,
+                                  off64_t *off_out, size_t len, unsigned flags) = NULL;
+ssize_t (*__libc_sendfile)(int out_fd, int in_fd, off_t *offset, size_t count) = NULL;
+ssize_t (*__libc_sendfile64)(int out_fd, int in_fd, off64_t *offset, size_t count) = NULL;
+ssize_t (*__libc_splice)(int fd_in, loff_t *off_in, int fd_out, loff_t *off_out,
+                         size_t len, unsigned flags) = NULL;
+
+int (*__libc_execve)(const char *path, char *const argv[], char *const envp[]) = NULL;
+int (*__libc_execvpe)(const char *file, char *const argv[], char *const envp[]) = NULL;
+int (*__libc_posix_spawn)(pid_t *pid, const char *path,
+                          const posix_spawn_file_actions_t *actions,
+                          const posix_spawnattr_t *attr,
+                          char *const argv[], char *const envp[]) = NULL;
+int (*__libc_posix_spawnp)(pid_t *pid, const char *file,
+                           const posix_spawn_file_actions_t *actions,
+                           const posix_spawnattr_t *attr,
+                           char *const argv[], char *const envp[]) = NULL;
+
+int (*__libc_nftw)(const char *dirpath, walk_nftw_fn fn, int nopenfd, int flags) = NULL;
+int (*__libc_nftw64)(const char *dirpath,
+                     int (*fn)(const char*, const struct stat64*, int, struct FTW*),
+                     int nopenfd, int flags) = NULL;
+int (*__libc_ftw)(const char *dirpath, walk_ftw_fn fn, int nopenfd) = NULL;
+int (*__libc_ftw64)(const char *dirpath, int (*fn)(const char*, const struct stat64*, int),
+                    int nopenfd) = NULL;
+FTS* (*__libc_fts_open)(char *const *argv, int options,
+                        int (*compar)(const FTSENT**, const FTSENT**)) = NULL;
+FTSENT* (*__libc_fts_read)(FTS *ftsp) = NULL;
+FTSENT* (*__libc_fts_children)(FTS *ftsp, int instr) = NULL;
+int (*__libc_fts_set)(FTS *ftsp, FTSENT *f, int instr) = NULL;
+int (*__libc_fts_close)(FTS *ftsp) = NULL;
+FTS64* (*__libc_fts64_open)(char *const *argv, int options,
+                            int (*compar)(const FTSENT64**, const FTSENT64**)) = NULL;
+FTSENT64* (*__libc_fts64_read)(FTS64 *ftsp) = NULL;
+FTSENT64* (*__libc_fts64_children)(FTS64 *ftsp, int instr) = NULL;
+int (*__libc_fts64_set)(FTS64 *ftsp, FTSENT64 *f, int instr) = NULL;
+int (*__libc_fts64_close)(FTS64 *ftsp) = NULL;
+
+
+off64_t (*__libc_lseek64)(int fd, off64_t offset, int whence) = NULL;
+off_t (*__libc_lseek)(int fd, off_t offset, int whence) = NULL;
+
+#define SYM(func) { (void**)&__libc_ ## func, #func }
+
+static const struct {
+  void **ptr;
+  const char *name;
+} soplfs_symbols[] = {
+  SYM(open), SYM(open64), SYM(close), SYM(write), SYM(read), SYM(pread),
+  SYM(pwrite), SYM(pread64), SYM(pwrite64), SYM(tmpfile),
+  SYM(get_current_dir_name), SYM(fopen), SYM(fread), SYM(fwrite), SYM(fclose),
+  SYM(chmod), SYM(fgetc), SYM(getc), SYM(fgets), SYM(fputc), SYM(putc),
+  SYM(fputs), SYM(puts), SYM(printf), SYM(vfprintf), SYM(fprintf),
+  SYM(vprintf), SYM(mkdir), SYM(rmdir), SYM(opendir), SYM(readdir),
+  SYM(closedir), SYM(chdir), SYM(getcwd), SYM(fcntl), SYM(rename), SYM(fflush),
+  SYM(fsync), SYM(fdatasync), SYM(syncfs), SYM(sync_file_range), SYM(aio_read),
+  SYM(aio_write), SYM(aio_fsync), SYM(aio_error), SYM(aio_return),
+  SYM(aio_suspend), SYM(aio_cancel), SYM(lio_listio), SYM(unlink), SYM(stat),
+  SYM(__lxstat), SYM(__xstat), SYM(__fxstat), SYM(lseek64), SYM(lseek),
+  SYM(fstat), SYM(fstat64), SYM(mmap), SYM(mmap64), SYM(munmap), SYM(madvise),
+  SYM(copy_file_range), SYM(sendfile), SYM(sendfile64), SYM(splice),
+  SYM(posix_fadvise), SYM(posix_fadvise64), SYM(readahead), SYM(execve),
+  SYM(execvpe), SYM(posix_spawn), SYM(posix_spawnp), SYM(nftw), SYM(nftw64),
+  SYM(ftw), SYM(ftw64), SYM(fts_open), SYM(fts_read), SYM(fts_children),
+  SYM(fts_set), SYM(fts_close), SYM(fts64_open), SYM(fts64_read),
+  SYM(fts64_children), SYM(fts64_set), SYM(fts64_close)
+};
 
-
-off64_t (*__libc_lseek64)(int fd, off64_t, int whence) = NULL;
-off_t (*__libc_lseek)(int fd, off_t, int whence) = NULL;
+#undef SYM
 
 
 plfs_error_t plfs_logical_to_physical(const char *path, std::string& phys_path) {
   char* phys_path_ptr = NULL;
 
-  plfs_error_t ret = plfs_expand_path(path, &phys_path_ptr, NULL, NULL);
+  plfs_error_t ret = PLFS_CALL(plfs_expand_path(path, &phys_path_ptr, NULL, NULL));
   if(ret == PLFS_SUCCESS) {
     phys_path = phys_path_ptr;
     free(phys_path_ptr);
@@ -147,10 +225,6 @@ plfs_error_t plfs_logical_to_physical(const char *path, std::string& phys_path)
 }
 
 void loadMounts() {
-	MAP(open, int (*)(const char*, int, ...));
-	MAP(read, ssize_t (*)(int, void*, size_t));
-	MAP(close,int (*)(int));
-	
 	std::vector<std::string> possible_files;
 	if (getenv("PLFSRC")) {
 		std::string env_file = getenv("PLFSRC");
@@ -181,7 +255,9 @@ void loadMounts() {
 		std::stringstream ss (contents);
 		
 		std::string mp ("mount_point:");
-		std::string whitespace (" \t\n");
+		std::string key ("soplfs_");
+		std::string whitespace (" \t\r\n");
+		int mount = -1;   // soplfs_ keys before a mount_point apply to all
 		
 		while (ss.good()) {
 			char line[1024];
@@ -189,11 +265,33 @@ void loadMounts() {
 			
 			if (std::string(line).find(mp) != std::string::npos) {
 				std::string tmp = std::string(line).substr(std::string(line).find(mp) + mp.size());
-				mount_points.push_back(tmp.substr(tmp.find_first_not_of(whitespace),
-              tmp.find_last_not_of(whitespace) - tmp.find_first_not_of(whitespace) + 1));
+				size_t first = tmp.find_first_not_of(whitespace);
+				if (first == std::string::npos) continue;
+				tmp = tmp.substr(first, tmp.find_last_not_of(whitespace) - first + 1);
+
+				// matched as a path prefix: /mnt/plfs/ and /mnt/plfs are one mount
+				while (tmp.size() > 1 && tmp[tmp.size() - 1] == '/') tmp.erase(tmp.size() - 1);
+				mount = std::find(mount_points.begin(), mount_points.end(), tmp) - mount_points.begin();
+				if (mount == (int)mount_points.size()) {
+					mount_points.push_back(tmp);
+				}
+			} else {
+				// "soplfs_<key>: <value>", possibly behind a # for a PLFS
+				// that rejects keys it does not know
+				std::string tmp (line);
+				size_t first = tmp.find_first_not_of(whitespace + "#");
+				size_t colon = tmp.find(':');
+				if (first == std::string::npos || tmp.compare(first, key.size(), key) != 0 ||
+				    colon == std::string::npos) continue;
+				size_t vfirst = tmp.find_first_not_of(whitespace, colon + 1);
+				if (vfirst == std::string::npos) continue;
+				std::string name = tmp.substr(first + key.size(), colon - first - key.size());
+				name.erase(name.find_last_not_of(whitespace) + 1);
+				tune_set(mount, name, tmp.substr(vfirst, tmp.find_last_not_of(whitespace) - vfirst + 1));
 			}
 		}
 	}
+	tune_done(mount_points.size());
 	
 	if (mount_points.size() == 0) {
 		std::cerr << "There were no mount points defined." << std::endl;
@@ -201,9 +299,6 @@ void loadMounts() {
 }
 
 void loadPhysPaths() {
-
-  if (mount_points.size() == 0) loadMounts();
-
   for (std::vector<std::string>::iterator itr = mount_points.begin(); itr != mount_points.end(); itr++) {
     std::string phys_path;
     if(plfs_logical_to_physical(itr->c_str(), phys_path) == PLFS_SUCCESS) {
@@ -212,34 +307,79 @@ void loadPhysPaths() {
   }
 }
 
-int is_plfs_path(const char *path) {
+
+/*
+ * Initialization
+ *
+ * Runs once, from the constructor in soplfs_init.cpp when the library
+ * is loaded: binds every __libc_* symbol, reads plfsrc and resolves the
+ * mounts' physical paths, so no interposed call pays for it later.  A call that arrives earlier (from another library's
+ * constructor) runs it on the spot; calls the initialization makes
+ * itself see what it has set up so far.
+ */
+
+int soplfs_loaded = 0;
+int soplfs_ready = 0;
+long long soplfs_init_ns = 0;
+
+static pthread_once_t soplfs_once = PTHREAD_ONCE_INIT;
+static __thread int soplfs_in_init __attribute__((tls_model("initial-exec"))) = 0;
+
+static void soplfs_do_init() {
+  struct timespec t0, t1;
+  clock_gettime(CLOCK_MONOTONIC, &t0);
+  soplfs_in_init = 1;
+
+  for (size_t i = 0; i < sizeof(soplfs_symbols) / sizeof(soplfs_symbols[0]); i++) {
+    // missing ones are reported by MAP() if they are ever called
+    if (*soplfs_symbols[i].ptr == NULL) {
+      *soplfs_symbols[i].ptr = dlsym(RTLD_NEXT, soplfs_symbols[i].name);
+    }
+  }
+
+  loadMounts();
+  loadPhysPaths();
+
+  soplfs_in_init = 0;
+  clock_gettime(CLOCK_MONOTONIC, &t1);
+  soplfs_init_ns = (t1.tv_sec - t0.tv_sec) * 1000000000LL + (t1.tv_nsec - t0.tv_nsec);
+  __sync_synchronize();
+  soplfs_ready = 1;
+}
+
+// calls from other libraries' constructors run before soplfs' own C++
+// globals are constructed; they pass through to libc untouched
+void soplfs_init() {
+  if (soplfs_in_init || !soplfs_loaded) return;
+  pthread_once(&soplfs_once, soplfs_do_init);
+}
+
+// index of the mount point path lies under, -1 if none
+int plfs_mount_of(const char *path) {
   if(path == NULL) {
-    return 0;
+    return -1;
   }
 
-  if (mount_points.size() == 0)
-    loadMounts();
+  soplfs_check();
 
-  std::string p(path);
-  int ret = 0;
-  for (std::vector<std::string>::iterator itr = mount_points.begin();
-      itr != mount_points.end(); itr++) {
-    if (p.find(*itr) != std::string::npos) {
-      ret = 1;
-      break;
+  size_t len = strlen(path);
+  for (size_t i = 0; i < mount_points.size(); i++) {
+    const std::string &m = mount_points[i];
+    if (len >= m.size() && memcmp(path, m.data(), m.size()) == 0 &&
+        (path[m.size()] == '/' || path[m.size()] == '\0' || m.size() == 1)) {
+      return i;
     }
   }
 
-  return ret;
+  return -1;
 }
 
-inline int update_read_fd(plfs_file* pf, int fd) {
-  off_t o = lseek(fd, 0, SEEK_CUR);
-  if (o < 0) return -1;
-  return lseek(pf->rfd, o, SEEK_SET);
+int is_plfs_path(const char *path) {
+  int mount = plfs_mount_of(path);
+  if (mount >= 0 && stats_current) stats_current->mount = mount;
+  return mount >= 0;
 }
 
-
 int getflags(const char *mode) {
   std::string stmode = std::string(mode);
 
@@ -325,12 +465,178 @@ int isDuplicated(int fd) {
 	return 0;
 }
 
+// every write on a PLFS handle goes through here, so staged and direct
+// writes never reorder
+plfs_error_t plfs_file_write(plfs_file *pf, const char *buf, size_t count,
+                             off_t offset, ssize_t *written) {
+  plfs_error_t plfs_error;
+  if (pf->writer != inherit_pid) {
+    plfs_error = inherit_writer(pf);
+    if (plfs_error != PLFS_SUCCESS) return plfs_error;
+  }
+  if (pf->bb) {
+    plfs_error = bb_write(pf->bb, buf, count, offset, written);
+  } else {
+    plfs_error = PLFS_CALL(plfs_write(pf->fd, buf, count, offset, inherit_pid, written));
+  }
+
+  if (plfs_error == PLFS_SUCCESS && pf->sg) sync_mark(pf->sg, pf, *written);
+  if (pf->ra) ra_invalidate(pf->ra);
+  if (pf->fl) flight_written(pf->fl);
+  if (pf->hint) hint_written(pf);
+  acache_written(pf->path->c_str(), pf->mount);
+  return plfs_error;
+}
+
+ra_state* plfs_ra_create(int mount) {
+  const soplfs_tuning &tune = mount_tuning(mount);
+  return ra_create(tune.readahead, tune.readahead_chunks);
+}
+
+// sets up the modules' state of a handle whose fd, path, flags, rfd and
+// mount are filled in
+void plfs_file_attach(plfs_file *pf, mode_t mode) {
+  const char *path = pf->path->c_str();
+  pf->writer = inherit_pid;
+  if ((pf->flags & O_ACCMODE) != O_WRONLY) pf->ra = plfs_ra_create(pf->mount);
+  pf->fl = flight_open(path, pf->mount);   // writers too: they end sharing
+  bcache_open(pf, pf->flags);
+  pf->bb = bb_open(pf->fd, path, pf->flags, mode);
+  pf->sg = sync_open(pf);
+}
+
+// small reads go through FUSE, positioned, so rfd's own offset never
+// matters
+ssize_t plfs_file_small_read(plfs_file *pf, void *buf, size_t count, off_t offset) {
+  if (pf->ra) {
+    int hit = 0;
+    ssize_t ret = ra_read(pf->ra, pf->rfd, buf, count, offset, &hit);
+    stats_event(hit ? STATS_EV_RA_HIT : STATS_EV_RA_MISS, 1);
+    return ret;
+  }
+  return __libc_pread(pf->rfd, buf, count, offset);
+}
+
+ssize_t plfs_file_pread(plfs_file *pf, void *buf, size_t count, off_t offset) {
+  ssize_t ret = 0;
+  plfs_retry retry(pf->mount);
+  plfs_error_t plfs_error = PLFS_EAGAIN;
+  while (retry.again(plfs_error)) {
+    plfs_error = PLFS_CALL(plfs_read(pf->fd, (char *) buf, count, offset, &ret));
+  }
+  if(plfs_error != PLFS_SUCCESS) {
+    errno = plfs_error_to_errno(plfs_error);
+    ret = -1;
+  }
+  return ret;
+}
+
+// a positioned read down the given route, timed for route_pick()
+ssize_t plfs_file_read_on(plfs_file *pf, int fd, int route, void *buf,
+                          size_t count, off_t offset) {
+  if (pf->hint) {
+    // whatever was prefetched on a hint comes first
+    int eof;
+    ssize_t got = hint_read(pf, (char *) buf, count, offset, &eof);
+    if (got > 0 && ((size_t)got == count || eof)) return got;
+    if (got > 0) {
+      ssize_t ret = plfs_file_read_on(pf, fd, route, (char *) buf + got,
+                                      count - got, offset + got);
+      return ret < 0 ? got : got + ret;
+    }
+  }
+
+  ssize_t ret = 0;
+  unsigned long long start = stats_ticks();
+  if (route == STATS_PLFS_SMALL) {
+    PROBE_ENTRY(read_small, fd, offset, count, pf->path->c_str());
+    ret = plfs_file_small_read(pf, buf, count, offset);
+    PROBE_RETURN(read_small, fd, offset, ret, pf->path->c_str());
+  } else {
+    PROBE_ENTRY(read, fd, offset, count, pf->path->c_str());
+    if (pf->bc && bcache_usable(pf)) {
+      ret = bcache_read(pf, (char *) buf, count, offset);
+    } else if (pf->fl) {
+      ret = flight_read(pf, (char *) buf, count, offset);
+    } else {
+      ret = plfs_file_pread(pf, buf, count, offset);
+    }
+    PROBE_RETURN(read, fd, offset, ret, pf->path->c_str());
+  }
+  if (ret >= 0) route_done(pf, count, route, stats_ticks() - start);
+  return ret;
+}
+
+// SEEK_DATA/SEEK_HOLE without reading: the PLFS API has no extent query,
+// so with seek_holes the FUSE view of the file answers when it agrees
+// with PLFS on the size.  Otherwise the whole file counts as data, which
+// is never wrong.  PLFS' own FUSE daemon has no lseek and reports all
+// data anyway, hence off by default.
+off_t plfs_file_seek_data(plfs_file *pf, off_t offset, int whence) {
+  plfs_file_settle(pf);
+  struct stat st;
+  plfs_retry retry(pf->mount);
+  plfs_error_t plfs_error = PLFS_EAGAIN;
+  while (retry.again(plfs_error)) {
+    plfs_error = PLFS_CALL(plfs_getattr(pf->fd, NULL, &st, 1));
+  }
+  if (plfs_error != PLFS_SUCCESS) {
+    errno = plfs_error_to_errno(plfs_error);
+    return -1;
+  }
+  if (offset < 0) {
+    errno = EINVAL;
+    return -1;
+  }
+  if (offset >= st.st_size) {
+    errno = ENXIO;
+    return -1;
+  }
+
+  struct stat rst;
+  if (mount_tuning(pf->mount).seek_holes && pf->rfd >= 0 && fstat(pf->rfd, &rst) == 0 && rst.st_size == st.st_size) {
+    off_t ret = __libc_lseek(pf->rfd, offset, whence);
+    if (ret >= 0 || errno == ENXIO) return ret;   // ENXIO: only a hole is left
+  }
+  return whence == SEEK_DATA ? offset : st.st_size;
+}
+
+plfs_error_t plfs_file_sync(plfs_file *pf) {
+  if (pf->bb) return bb_sync(pf->bb);
+  plfs_retry retry(pf->mount);
+  plfs_error_t plfs_error = PLFS_EAGAIN;
+  while (retry.again(plfs_error)) {
+    plfs_error = PLFS_CALL(plfs_sync(pf->fd));
+  }
+  return plfs_error;
+}
+
+plfs_error_t plfs_file_close(plfs_file *pf) {
+  int num_refs;
+  plfs_error_t plfs_error = PLFS_SUCCESS;
+
+  stats_event(STATS_EV_HANDLES, -1);
+  paio_close(pf);
+  if (pf->sg) sync_close(pf->sg, pf);
+  if (pf->ra) ra_destroy(pf->ra);
+  if (pf->fl) flight_close(pf->fl);
+  if (pf->hint) hint_close(pf);
+  if (pf->bc) bcache_close(pf);
+  if (pf->bb && bb_close(pf->bb, &plfs_error)) return plfs_error;
+  if (pf->writer != inherit_pid) return plfs_error;   // the parent's, after fork
+
+  plfs_error_t close_error = PLFS_CALL(plfs_close(pf->fd, getpid(), getuid(), pf->flags, NULL, &num_refs));
+  if ((pf->flags & O_ACCMODE) != O_RDONLY) acache_written(pf->path->c_str(), pf->mount);
+  return plfs_error != PLFS_SUCCESS ? plfs_error : close_error;
+}
+
 // create tmp file descriptor
 FILE* common_plfs_open(const char* cpath, int flags, mode_t mode) {
   MAP(tmpfile, FILE *(*)(void));
   MAP(open,int (*)(const char*, int, ...));
 
   FILE* ret = NULL;
+  PROBE_ENTRY(open, -1, -1, flags, cpath);
 
   plfs_file *tmp = new plfs_file();
 
@@ -339,23 +645,42 @@ FILE* common_plfs_open(const char* cpath, int flags, mode_t mode) {
   opts.pinter = PLFS_MPIIO;
 
 
+  int mount = plfs_mount_of(cpath);
+  plfs_retry retry(mount);
   plfs_error_t plfs_error = PLFS_EAGAIN;
-  while(plfs_error == PLFS_EAGAIN) {
-    plfs_error = plfs_open(&(tmp->fd), cpath, flags, getpid(), mode, NULL);
+  while (retry.again(plfs_error)) {
+    plfs_error = PLFS_CALL(plfs_open(&(tmp->fd), cpath, flags, getpid(), mode, NULL));
   }
+  if (flags & (O_CREAT | O_TRUNC)) acache_changed(cpath);
 
-  // through FUSE
-  int fd = __libc_open(cpath, flags, mode);
+  if (plfs_error != PLFS_SUCCESS) {
+    errno = plfs_error_to_errno(plfs_error);
+    delete tmp;
+    PROBE_RETURN(open, -1, -1, -1, cpath);
+    return NULL;
+  }
+
+  // through FUSE; plfs_open already created or truncated the file, so
+  // O_EXCL would fail here.  Close-on-exec whatever the caller asked:
+  // inherit_export() hands it on only with the handle
+  int fd = __libc_open(cpath, (flags & ~(O_CREAT | O_EXCL | O_TRUNC)) | O_CLOEXEC, mode);
   if (fd < 0) {
+    int err = errno;
+    int num_refs = 0;
+    PLFS_CALL(plfs_close(tmp->fd, getpid(), getuid(), flags, NULL, &num_refs));
+    delete tmp;
+    errno = err;
+    PROBE_RETURN(open, -1, -1, -1, cpath);
     return NULL;
   }
 
   off_t size = 0;
   if (flags & O_APPEND) {
     struct stat st;
+    plfs_retry retry(mount);
     plfs_error = PLFS_EAGAIN;
-    while (plfs_error == PLFS_EAGAIN) {
-      plfs_error = plfs_getattr(tmp->fd, cpath, &st, 0);
+    while (retry.again(plfs_error)) {
+      plfs_error = PLFS_CALL(plfs_getattr(tmp->fd, cpath, &st, 0));
     }
     size = st.st_size;
   }
@@ -373,20 +698,45 @@ FILE* common_plfs_open(const char* cpath, int flags, mode_t mode) {
     }
     if(ret == NULL) {
       int num_refs = 0;
-      plfs_close(tmp->fd, getpid(), getuid(), flags, NULL, &num_refs);
+      PLFS_CALL(plfs_close(tmp->fd, getpid(), getuid(), flags, NULL, &num_refs));
       delete tmp;
     } else {
       tmp->path = new std::string(cpath);
       tmp->flags = flags;
       tmp->tmp_file = ret;
       tmp->rfd = fd;
+      tmp->mount = mount;
+      plfs_file_attach(tmp, mode);
+      if (flags & O_CLOEXEC) __libc_fcntl(fileno(ret), F_SETFD, FD_CLOEXEC);
       plfs_files.insert(std::pair<int, plfs_file *>(fileno(ret), tmp));
+      stats_event(STATS_EV_HANDLES, 1);
     }
   }
 
+  PROBE_RETURN(open, -1, -1, ret != NULL ? fileno(ret) : -1, cpath);
   return ret;
 }
 
+// getattr by path, answered from the node's attribute cache when the
+// mount has one
+plfs_error_t plfs_stat_path(const char *cpath, struct stat *buf) {
+  int mount = plfs_mount_of(cpath);
+  plfs_error_t plfs_error;
+  unsigned gen = 0;
+  if (acache_get(cpath, mount, buf, &plfs_error, &gen)) return plfs_error;
+
+  PROBE_ENTRY(getattr, -1, -1, 0, cpath);
+  plfs_retry retry(mount);
+  plfs_error = PLFS_EAGAIN;
+  while (retry.again(plfs_error)) {
+    plfs_error = PLFS_CALL(plfs_getattr(NULL, cpath, buf, 0));
+  }
+  PROBE_RETURN(getattr, -1, -1, plfs_error == PLFS_SUCCESS ? 0 : -1, cpath);
+
+  acache_put(cpath, mount, buf, plfs_error, gen);
+  return plfs_error;
+}
+
 #pragma GCC visibility push(default)
 
 #ifdef __cplusplus
@@ -404,6 +754,7 @@ FILE* common_plfs_open(const char* cpath, int flags, mode_t mode) {
 
 int open(const char *path, int flags, ...) {
   MAP(open,int (*)(const char*, int, ...));
+  stats_call sc(STATS_OPEN);
 
   int ret;
 
@@ -420,6 +771,8 @@ int open(const char *path, int flags, ...) {
   }
 
   if (is_plfs_path(cpath)) {
+    sc.route = STATS_PLFS;
+    sc.trace_path(cpath, flags, mode);
 
     FILE* fp = common_plfs_open(cpath, flags, mode);
     if(fp) {
@@ -433,6 +786,7 @@ int open(const char *path, int flags, ...) {
   }
 
   free(cpath);
+  sc.trace_result(ret);
   return ret;
 }
 
@@ -440,12 +794,14 @@ int open(const char *path, int flags, ...) {
 int open64(const char* path, int flags, ...) {
   MAP(open64,int (*)(const char*, int, ...));
   MAP(tmpfile, FILE *(*)(void));
+  stats_call sc(STATS_OPEN);
 
   int ret;
 
   char *cpath = resolvePath(path);
 
   if (is_plfs_path(cpath)) {
+    sc.route = STATS_PLFS;
 
     mode_t mode;
     if ((flags & O_CREAT) == O_CREAT) {
@@ -454,21 +810,31 @@ int open64(const char* path, int flags, ...) {
       mode = va_arg(argf, mode_t);
       va_end(argf);
     } else {
-      plfs_mode(cpath, &mode);
+      PLFS_CALL(plfs_mode(cpath, &mode));
     }
+    sc.trace_path(cpath, flags, mode);
+    PROBE_ENTRY(open, -1, -1, flags, cpath);
 
     plfs_file *tmp = new plfs_file();
+    tmp->mount = plfs_mount_of(cpath);
 
+    plfs_retry retry(tmp->mount);
     plfs_error_t plfs_error = PLFS_EAGAIN;
-    while(plfs_error == PLFS_EAGAIN) {
-      plfs_error = plfs_open(&(tmp->fd), cpath, flags, getpid(), mode, NULL);
+    while (retry.again(plfs_error)) {
+      plfs_error = PLFS_CALL(plfs_open(&(tmp->fd), cpath, flags, getpid(), mode, NULL));
     }
+    if (flags & (O_CREAT | O_TRUNC)) acache_changed(cpath);
 
     // for small reads
     // int fd = __libc_open64(cpath, flags, mode);
-    int fd = __libc_open(cpath, flags, mode);
-    if (fd < 0) {
-      return -1;
+    int fd = -1;
+    if (plfs_error == PLFS_SUCCESS) {
+      fd = __libc_open(cpath, (flags & ~(O_CREAT | O_EXCL | O_TRUNC)) | O_CLOEXEC, mode);
+      if (fd < 0) {
+        plfs_error = errno_to_plfs_error(errno);
+        int num_refs = 0;
+        PLFS_CALL(plfs_close(tmp->fd, getpid(), getuid(), flags, NULL, &num_refs));
+      }
     }
 
     if(plfs_error != PLFS_SUCCESS) {
@@ -481,9 +847,13 @@ int open64(const char* path, int flags, ...) {
       tmp->path = new std::string(cpath);
       tmp->flags = flags;
       tmp->rfd = fd;
+      plfs_file_attach(tmp, mode);
+      if (flags & O_CLOEXEC) __libc_fcntl(ret, F_SETFD, FD_CLOEXEC);
 
       plfs_files.insert(std::pair<int, plfs_file *>(ret, tmp));
+      stats_event(STATS_EV_HANDLES, 1);
     }
+    PROBE_RETURN(open, -1, -1, ret, cpath);
 
   } else {
     if ((flags & O_CREAT) == O_CREAT) {
@@ -499,198 +869,443 @@ int open64(const char* path, int flags, ...) {
 
   free(cpath);
 
+  sc.trace_result(ret);
   return ret;
 }
 
 
 ssize_t write(int fd, const void *buf, size_t count) {
   MAP(write,ssize_t (*)(int, const void*, size_t));
+  stats_call sc(STATS_WRITE);
 
   ssize_t ret = -1;
   if (plfs_files.find(fd) != plfs_files.end()) {
+    sc.route = STATS_PLFS;
 
     plfs_file *tmp = plfs_files.find(fd)->second;
-    update_read_fd(tmp, fd);
+    sc.mount = tmp->mount;
 
     off_t offset = lseek(fd, 0x0, SEEK_CUR);
+    sc.trace_fd(fd, count, offset);
+    PROBE_ENTRY(write, fd, offset, count, tmp->path->c_str());
     // tmp fake file descriptor, use system provided seek
     // functions to set different in different process.
     // container global fd.
 
     if(offset != (off_t)-1) {
 
-      plfs_error_t plfs_error = plfs_write(tmp->fd,
-                                           (const char*)buf,
-                                           count,
-                                           offset,
-                                           getpid(),
-                                           &ret);
+      plfs_error_t plfs_error = plfs_file_write(tmp,
+                                                (const char*)buf,
+                                                count,
+                                                offset,
+                                                &ret);
 
       if(plfs_error != PLFS_SUCCESS) {
         errno = plfs_error_to_errno(plfs_error);
         ret = -1;
       } else {
         lseek(fd, offset + ret, SEEK_SET);
-        lseek(tmp->rfd, offset + ret, SEEK_SET);
       }
     }
+    PROBE_RETURN(write, fd, offset, ret, tmp->path->c_str());
 
   } else {
     ret = __libc_write(fd, buf, count);
   }
 
+  if (ret > 0) sc.bytes = ret;
+  sc.trace_result(ret);
   return ret;
 }
 
 ssize_t read(int fd, void *buf, size_t count) {
   MAP(read,ssize_t (*)(int, void*, size_t));
+  MAP(pread, ssize_t (*)(int, void*, size_t, off_t));
+  stats_call sc(STATS_READ);
 
   // Idea:
   // small reads redirect to FUSE
   // big reads through POSIX IO directly
+  // (route_pick() moves the line to where the mount is fastest)
   ssize_t ret = 0;
   if (plfs_files.find(fd) != plfs_files.end()) {
     plfs_file *tmp = plfs_files.find(fd)->second;
-    update_read_fd(tmp, fd);
-    if (count >= 1024 * 1024) {   // big request: 1MB
-      std::string path = *tmp->path;
-
-      off_t offset = lseek(fd, 0, SEEK_CUR);
-      if (offset != (off_t) -1) {
-
-        plfs_error_t plfs_error = PLFS_EAGAIN;
-        while(plfs_error == PLFS_EAGAIN) {
-          plfs_error = plfs_read(tmp->fd, (char *) buf, count, offset, &ret);
-        }
-
-        if(plfs_error != PLFS_SUCCESS) {
-          errno = plfs_error_to_errno(plfs_error);
-          ret = -1;
-        } else {
-          offset = offset + ret;
-          lseek(fd, offset, SEEK_SET);
-          lseek(tmp->rfd, offset, SEEK_SET);  // update fd and rfd
-        }
-      }
-    } else {
-      ret = __libc_read(tmp->rfd, buf, count);    // read through FUSE
-      if (ret < 0) return ret;
-      if(lseek(fd, ret, SEEK_CUR) < 0) return -1;
-    }
+    sc.mount = tmp->mount;
+    plfs_file_settle(tmp);
+    int seed = count >= mount_tuning(tmp->mount).read_split ? STATS_PLFS : STATS_PLFS_SMALL;
+    sc.route = route_pick(tmp, count, seed);
+
+    off_t offset = lseek(fd, 0, SEEK_CUR);
+    if (offset == (off_t) -1) return -1;
+    sc.trace_fd(fd, count, offset);
+    ret = plfs_file_read_on(tmp, fd, sc.route, buf, count, offset);
+    sc.trace_result(ret);
+    if (ret < 0) return ret;
+    if(lseek(fd, offset + ret, SEEK_SET) < 0) return -1;
 
   } else {
     ret = __libc_read(fd, buf, count);
   }
 
+  if (ret > 0) sc.bytes = ret;
+  sc.trace_result(ret);
   return ret;
 }
 
 
-// TODO: big and small
 ssize_t pread(int fd, void* buf, size_t count, off_t offset) {
   MAP(pread, ssize_t (*)(int, void*, size_t, off_t));
+  stats_call sc(STATS_PREAD);
 
   ssize_t ret;
   if (plfs_files.find(fd) != plfs_files.end()) {
+    sc.route = STATS_PLFS;
     plfs_file* tmp = plfs_files.find(fd)->second;
-    update_read_fd(tmp, fd);
-
-    plfs_error_t plfs_error = PLFS_EAGAIN;
-    while(plfs_error == PLFS_EAGAIN) {
-      plfs_error = plfs_read(tmp->fd, (char *) buf, count, offset, &ret);
-    }
-    if(plfs_error != PLFS_SUCCESS) {
-      errno = plfs_error_to_errno(plfs_error);
-      ret = -1;
-    } else {
-      // update offset?
-    }
+    sc.mount = tmp->mount;
+    sc.trace_fd(fd, count, offset);
+    plfs_file_settle(tmp);
+
+    const soplfs_tuning &tune = mount_tuning(tmp->mount);
+    int seed = tune.pread_split && count < tune.read_split ? STATS_PLFS_SMALL : STATS_PLFS;
+    sc.route = route_pick(tmp, count, seed);
+    ret = plfs_file_read_on(tmp, fd, sc.route, buf, count, offset);
   } else {
     ret = __libc_pread(fd, buf, count, offset);
   }
 
+  if (ret > 0) sc.bytes = ret;
+  sc.trace_result(ret);
   return ret;
 }
 
 ssize_t pwrite(int fd, const void* buf, size_t count, off_t offset) {
   MAP(pwrite, ssize_t (*)(int, const void*, size_t, off_t));
+  stats_call sc(STATS_PWRITE);
 
   ssize_t ret;
   if (plfs_files.find(fd) != plfs_files.end()) {
+    sc.route = STATS_PLFS;
     plfs_file* tmp = plfs_files.find(fd)->second;
-    update_read_fd(tmp, fd);
-
-    plfs_error_t plfs_error = plfs_write(tmp->fd,
-                                         (const char*)buf,
-                                         count,
-                                         offset,
-                                         getpid(),
-                                         &ret);
+    sc.mount = tmp->mount;
+    sc.trace_fd(fd, count, offset);
+    PROBE_ENTRY(write, fd, offset, count, tmp->path->c_str());
+
+    plfs_error_t plfs_error = plfs_file_write(tmp,
+                                              (const char*)buf,
+                                              count,
+                                              offset,
+                                              &ret);
     if(plfs_error != PLFS_SUCCESS) {
       errno = plfs_error_to_errno(plfs_error);
       ret = -1;
     } else {
       // update offset?
     }
+    PROBE_RETURN(write, fd, offset, ret, tmp->path->c_str());
   } else {
     ret = __libc_pwrite(fd, buf, count, offset);
   }
 
+  if (ret > 0) sc.bytes = ret;
+  sc.trace_result(ret);
   return ret;
 }
 
-// TODO: big and small
 ssize_t pread64(int fd, void *buf, size_t count, off64_t offset) {
   MAP(pread64,ssize_t (*)(int, void*, size_t, off64_t));
+  stats_call sc(STATS_PREAD);
 
   ssize_t ret;
   if (plfs_files.find(fd) != plfs_files.end()) {
+    sc.route = STATS_PLFS;
     plfs_file* tmp = plfs_files.find(fd)->second;
-    update_read_fd(tmp, fd);
-
-    plfs_error_t plfs_error = PLFS_EAGAIN;
-    while(plfs_error == PLFS_EAGAIN) {
-      plfs_error = plfs_read(tmp->fd, (char *) buf, count, offset, &ret);
-    }
-    if(plfs_error != PLFS_SUCCESS) {
-      errno = plfs_error_to_errno(plfs_error);
-      ret = -1;
-    } else {
-      // update offset?
-    }
-
+    sc.mount = tmp->mount;
+    sc.trace_fd(fd, count, offset);
+    plfs_file_settle(tmp);
+
+    const soplfs_tuning &tune = mount_tuning(tmp->mount);
+    int seed = tune.pread_split && count < tune.read_split ? STATS_PLFS_SMALL : STATS_PLFS;
+    sc.route = route_pick(tmp, count, seed);
+    ret = plfs_file_read_on(tmp, fd, sc.route, buf, count, offset);
   } else {
     ret = __libc_pread64(fd, buf, count, offset);
   }
 
+  if (ret > 0) sc.bytes = ret;
+  sc.trace_result(ret);
   return ret;
 }
 
 ssize_t pwrite64(int fd, const void *buf, size_t count, off64_t offset) {
   MAP(pwrite64,ssize_t (*)(int, const void*, size_t, off64_t));
+  stats_call sc(STATS_PWRITE);
 
   ssize_t ret;
   if (plfs_files.find(fd) != plfs_files.end()) {
+    sc.route = STATS_PLFS;
     plfs_file* tmp  = plfs_files.find(fd)->second;
-    update_read_fd(tmp, fd);
-
-    plfs_error_t plfs_error = plfs_write(tmp->fd,
-                                         (const char *)buf,
-                                         count,
-                                         offset,
-                                         getpid(),
-                                         &ret);
+    sc.mount = tmp->mount;
+    sc.trace_fd(fd, count, offset);
+    PROBE_ENTRY(write, fd, offset, count, tmp->path->c_str());
+
+    plfs_error_t plfs_error = plfs_file_write(tmp,
+                                              (const char *)buf,
+                                              count,
+                                              offset,
+                                              &ret);
     if(plfs_error != PLFS_SUCCESS) {
       errno = plfs_error_to_errno(plfs_error);
       ret = -1;
     } else {
       // update offset?
     }
+    PROBE_RETURN(write, fd, offset, ret, tmp->path->c_str());
 
   } else {
     ret = __libc_pwrite64(fd, buf, count, offset);
   }
 
+  if (ret > 0) sc.bytes = ret;
+  sc.trace_result(ret);
+  return ret;
+}
+
+// only SEEK_DATA and SEEK_HOLE need PLFS: the fake descriptor carries
+// the file position for everything else
+off_t lseek(int fd, off_t offset, int whence) {
+  MAP(lseek, off_t (*)(int, off_t, int));
+  if (whence != SEEK_DATA && whence != SEEK_HOLE) return __libc_lseek(fd, offset, whence);
+  stats_call sc(STATS_LSEEK);
+
+  off_t ret;
+  if (plfs_files.find(fd) != plfs_files.end()) {
+    sc.route = STATS_PLFS;
+    plfs_file* tmp = plfs_files.find(fd)->second;
+    sc.mount = tmp->mount;
+    sc.trace_fd(fd, 0, offset);
+    sc.flags = whence;
+    ret = plfs_file_seek_data(tmp, offset, whence);
+    if (ret >= 0) ret = __libc_lseek(fd, ret, SEEK_SET);
+  } else {
+    ret = __libc_lseek(fd, offset, whence);
+  }
+
+  sc.trace_result(ret);
+  return ret;
+}
+
+off64_t lseek64(int fd, off64_t offset, int whence) {
+  MAP(lseek64, off64_t (*)(int, off64_t, int));
+  if (whence != SEEK_DATA && whence != SEEK_HOLE) return __libc_lseek64(fd, offset, whence);
+  stats_call sc(STATS_LSEEK);
+
+  off64_t ret;
+  if (plfs_files.find(fd) != plfs_files.end()) {
+    sc.route = STATS_PLFS;
+    plfs_file* tmp = plfs_files.find(fd)->second;
+    sc.mount = tmp->mount;
+    sc.trace_fd(fd, 0, offset);
+    sc.flags = whence;
+    ret = plfs_file_seek_data(tmp, offset, whence);
+    if (ret >= 0) ret = __libc_lseek64(fd, ret, SEEK_SET);
+  } else {
+    ret = __libc_lseek64(fd, offset, whence);
+  }
+
+  sc.trace_result(ret);
+  return ret;
+}
+
+void* mmap(void *addr, size_t len, int prot, int flags, int fd, off_t offset) {
+  MAP(mmap, void* (*)(void*, size_t, int, int, int, off_t));
+  if (fd < 0 || (flags & MAP_ANONYMOUS)) return __libc_mmap(addr, len, prot, flags, fd, offset);
+  stats_call sc(STATS_MMAP);
+
+  void *ret;
+  if (plfs_files.find(fd) != plfs_files.end()) {
+    sc.route = STATS_PLFS;
+    plfs_file* tmp = plfs_files.find(fd)->second;
+    sc.mount = tmp->mount;
+    sc.trace_fd(fd, len, offset);
+    sc.flags = flags;
+    ret = pmap_map(tmp, addr, len, prot, flags, offset);
+  } else {
+    ret = __libc_mmap(addr, len, prot, flags, fd, offset);
+  }
+
+  sc.trace_result(ret == MAP_FAILED ? -1 : 0);
+  return ret;
+}
+
+void* mmap64(void *addr, size_t len, int prot, int flags, int fd, off64_t offset) {
+  MAP(mmap64, void* (*)(void*, size_t, int, int, int, off64_t));
+  if (fd < 0 || (flags & MAP_ANONYMOUS)) return __libc_mmap64(addr, len, prot, flags, fd, offset);
+  if (plfs_files.find(fd) == plfs_files.end()) return __libc_mmap64(addr, len, prot, flags, fd, offset);
+  return mmap(addr, len, prot, flags, fd, offset);
+}
+
+int munmap(void *addr, size_t len) {
+  MAP(munmap, int (*)(void*, size_t));
+  int ret = __libc_munmap(addr, len);
+  if (ret == 0) pmap_unmap(addr, len);
+  return ret;
+}
+
+int madvise(void *addr, size_t len, int advice) {
+  MAP(madvise, int (*)(void*, size_t, int));
+  if (pmap_advise(addr, len, advice)) return 0;
+  return __libc_madvise(addr, len, advice);
+}
+
+
+// hints return an error number, not -1 and errno
+int posix_fadvise(int fd, off_t offset, off_t len, int advice) {
+  MAP(posix_fadvise, int (*)(int, off_t, off_t, int));
+  if (plfs_files.find(fd) == plfs_files.end()) return __libc_posix_fadvise(fd, offset, len, advice);
+  stats_call sc(STATS_FADVISE);
+
+  sc.route = STATS_PLFS;
+  plfs_file* tmp = plfs_files.find(fd)->second;
+  sc.mount = tmp->mount;
+  sc.trace_fd(fd, len, offset);
+  sc.flags = advice;
+  int ret = hint_advise(tmp, offset, len, advice);
+
+  sc.trace_result(ret ? -1 : 0);
+  return ret;
+}
+
+int posix_fadvise64(int fd, off64_t offset, off64_t len, int advice) {
+  MAP(posix_fadvise64, int (*)(int, off64_t, off64_t, int));
+  if (plfs_files.find(fd) == plfs_files.end()) return __libc_posix_fadvise64(fd, offset, len, advice);
+  return posix_fadvise(fd, offset, len, advice);
+}
+
+ssize_t readahead(int fd, off64_t offset, size_t count) {
+  MAP(readahead, ssize_t (*)(int, off64_t, size_t));
+  if (plfs_files.find(fd) == plfs_files.end()) return __libc_readahead(fd, offset, count);
+
+  int err = posix_fadvise(fd, offset, count, POSIX_FADV_WILLNEED);
+  if (err != 0) {
+    errno = err;
+    return -1;
+  }
+  return 0;
+}
+
+
+// the kernel cannot move data into or out of a PLFS file: copy it here.
+// A NULL offset means the descriptor's own position, which moves along.
+static ssize_t plfs_copy(stats_call &sc, int fd_in, off64_t *off_in,
+                         int fd_out, off64_t *off_out, size_t len) {
+  xfer_end in, out;
+  xfer_open(&in, fd_in);
+  xfer_open(&out, fd_out);
+
+  plfs_file *tmp = in.pf ? in.pf : out.pf;
+  sc.route = STATS_PLFS;
+  sc.mount = tmp->mount;
+
+  // the kernel checks the ends' access modes; the placeholders cannot tell
+  if ((in.pf && (in.pf->flags & O_ACCMODE) == O_WRONLY) ||
+      (out.pf && (out.pf->flags & O_ACCMODE) == O_RDONLY)) {
+    errno = EBADF;
+    return -1;
+  }
+
+  off64_t in_pos = 0, out_pos = 0;
+  if (off_in) in_pos = *off_in;
+  else if (in.seekable) in_pos = __libc_lseek64(fd_in, 0, SEEK_CUR);
+  if (off_out) out_pos = *off_out;
+  else if (out.seekable) out_pos = __libc_lseek64(fd_out, 0, SEEK_CUR);
+  if (in_pos < 0 || out_pos < 0) return -1;
+  sc.trace_fd(in.pf ? fd_in : fd_out, len, in.pf ? in_pos : out_pos);
+
+  ssize_t ret = xfer_copy(&in, in_pos, &out, out_pos, len);
+  if (ret > 0) {
+    if (off_in) *off_in += ret;
+    else if (in.seekable) __libc_lseek64(fd_in, in_pos + ret, SEEK_SET);
+    if (off_out) *off_out += ret;
+    else if (out.seekable) __libc_lseek64(fd_out, out_pos + ret, SEEK_SET);
+    sc.bytes = ret;
+  }
+  return ret;
+}
+
+static int is_plfs_xfer(int fd_in, int fd_out) {
+  return plfs_files.find(fd_in) != plfs_files.end() ||
+         plfs_files.find(fd_out) != plfs_files.end();
+}
+
+ssize_t copy_file_range(int fd_in, off64_t *off_in, int fd_out, off64_t *off_out,
+                        size_t len, unsigned flags) {
+  MAP(copy_file_range, ssize_t (*)(int, off64_t*, int, off64_t*, size_t, unsigned));
+  if (!is_plfs_xfer(fd_in, fd_out)) {
+    return __libc_copy_file_range(fd_in, off_in, fd_out, off_out, len, flags);
+  }
+  stats_call sc(STATS_COPY);
+
+  ssize_t ret;
+  if (flags != 0) {
+    errno = EINVAL;
+    ret = -1;
+  } else {
+    ret = plfs_copy(sc, fd_in, off_in, fd_out, off_out, len);
+  }
+
+  sc.trace_result(ret);
+  return ret;
+}
+
+ssize_t sendfile64(int out_fd, int in_fd, off64_t *offset, size_t count) {
+  MAP(sendfile64, ssize_t (*)(int, int, off64_t*, size_t));
+  if (!is_plfs_xfer(in_fd, out_fd)) return __libc_sendfile64(out_fd, in_fd, offset, count);
+  stats_call sc(STATS_COPY);
+
+  ssize_t ret = plfs_copy(sc, in_fd, offset, out_fd, NULL, count);
+
+  sc.trace_result(ret);
+  return ret;
+}
+
+ssize_t sendfile(int out_fd, int in_fd, off_t *offset, size_t count) {
+  MAP(sendfile, ssize_t (*)(int, int, off_t*, size_t));
+  if (!is_plfs_xfer(in_fd, out_fd)) return __libc_sendfile(out_fd, in_fd, offset, count);
+  if (offset == NULL) return sendfile64(out_fd, in_fd, NULL, count);
+
+  off64_t pos = *offset;
+  ssize_t ret = sendfile64(out_fd, in_fd, &pos, count);
+  *offset = pos;
+  return ret;
+}
+
+ssize_t splice(int fd_in, loff_t *off_in, int fd_out, loff_t *off_out,
+               size_t len, unsigned flags) {
+  MAP(splice, ssize_t (*)(int, loff_t*, int, loff_t*, size_t, unsigned));
+  if (!is_plfs_xfer(fd_in, fd_out)) {
+    return __libc_splice(fd_in, off_in, fd_out, off_out, len, flags);
+  }
+  stats_call sc(STATS_COPY);
+
+  // one end has to be a pipe, and a PLFS file never is
+  int fd_pipe = plfs_files.find(fd_in) != plfs_files.end() ? fd_out : fd_in;
+  loff_t *off_pipe = fd_pipe == fd_in ? off_in : off_out;
+  struct stat st;
+
+  ssize_t ret;
+  if (fstat(fd_pipe, &st) < 0) {
+    ret = -1;
+  } else if (!S_ISFIFO(st.st_mode)) {
+    errno = EINVAL;
+    ret = -1;
+  } else if (off_pipe != NULL) {
+    errno = ESPIPE;
+    ret = -1;
+  } else {
+    ret = plfs_copy(sc, fd_in, off_in, fd_out, off_out, len);
+  }
+
+  sc.trace_result(ret);
   return ret;
 }
 
@@ -698,20 +1313,21 @@ ssize_t pwrite64(int fd, const void *buf, size_t count, off64_t offset) {
 int close(int fd) {
   MAP(close, int (*)(int));
   MAP(fclose, int (*)(FILE*));
+  stats_call sc(STATS_CLOSE);
 
-  int num_refs;
+  plfs_error_t plfs_error = PLFS_SUCCESS;
 
   int ret;
   if (plfs_files.find(fd) != plfs_files.end()) {
+    sc.route = STATS_PLFS;
     plfs_file *tmp = plfs_files.find(fd)->second;
+    sc.mount = tmp->mount;
+    sc.trace_fd(fd, 0);
 
     if (!isDuplicated(fd)) {
-      plfs_error_t plfs_error = plfs_close(tmp->fd,
-                                           getpid(),
-                                           getuid(),
-                                           tmp->flags,
-                                           NULL,
-                                           &num_refs);
+      PROBE_ENTRY(close, fd, -1, 0, tmp->path->c_str());
+      plfs_error = plfs_file_close(tmp);
+      PROBE_RETURN(close, fd, -1, plfs_error == PLFS_SUCCESS ? 0 : -1, tmp->path->c_str());
       delete tmp->path;
       delete tmp;
     }
@@ -720,7 +1336,12 @@ int close(int fd) {
   }
 
   ret = __libc_close(fd);
+  if (ret == 0 && plfs_error != PLFS_SUCCESS) {
+    errno = plfs_error_to_errno(plfs_error);
+    ret = -1;
+  }
 
+  sc.trace_result(ret);
   return ret;
 }
 
@@ -730,7 +1351,7 @@ char* get_current_dir_name(void) {
 
   char* ret = NULL;
 
-  if (phys_paths.size() == 0) loadPhysPaths();
+  soplfs_check();
 
   char* real_cwd = __libc_get_current_dir_name();
   std::string real_cwd_str(real_cwd);
@@ -760,6 +1381,7 @@ char* get_current_dir_name(void) {
 FILE* fopen(const char* pathname, const char* mode) {
   MAP(fopen, FILE* (*)(const char*, const char*));
   MAP(tmpfile, FILE *(*)(void));  // to build fake descriptor
+  stats_call sc(STATS_FOPEN);
 
   FILE* ret;
 
@@ -767,7 +1389,9 @@ FILE* fopen(const char* pathname, const char* mode) {
   int flags = getflags(mode);
 
   if (is_plfs_path(cpath)) {
+    sc.route = STATS_PLFS;
     mode_t m = S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP | S_IROTH | S_IWOTH;
+    sc.trace_path(cpath, flags, m);
     FILE* fp = common_plfs_open(cpath, flags, m);
     if(fp == NULL) {
       ret = NULL;
@@ -779,25 +1403,33 @@ FILE* fopen(const char* pathname, const char* mode) {
   }
 
   free(cpath);
+  sc.trace_result(ret != NULL ? fileno(ret) : -1);
   return ret;
 }
 
 size_t fread(void* ptr, size_t size, size_t nmemb, FILE* stream) {
   MAP(fread, size_t (*)(void*, size_t, size_t, FILE*));
+  stats_call sc(STATS_FREAD);
 
   int fd = fileno(stream);
 
   ssize_t ret = 0;
   if (plfs_files.find(fd) != plfs_files.end()) {
+    sc.route = STATS_PLFS;
 
     plfs_file *tmp = plfs_files.find(fd)->second;
+    sc.mount = tmp->mount;
+    plfs_file_settle(tmp);
 
     long offset = ftell(stream);    // get current FILE offset
+    sc.trace_fd(fd, size * nmemb, offset);
+    PROBE_ENTRY(read, fd, offset, size * nmemb, tmp->path->c_str());
     if (offset != (off_t) -1) {
 
+      plfs_retry retry(tmp->mount);
       plfs_error_t plfs_error = PLFS_EAGAIN;
-      while(plfs_error == PLFS_EAGAIN) {
-        plfs_error = plfs_read(tmp->fd, (char *) ptr, size*nmemb, offset, &ret);
+      while (retry.again(plfs_error)) {
+        plfs_error = PLFS_CALL(plfs_read(tmp->fd, (char *) ptr, size*nmemb, offset, &ret));
       }
 
       if(plfs_error != PLFS_SUCCESS) {
@@ -807,31 +1439,38 @@ size_t fread(void* ptr, size_t size, size_t nmemb, FILE* stream) {
         fseek(stream, ret, SEEK_CUR);   // update FILE offset
       }
     }
+    PROBE_RETURN(read, fd, offset, ret, tmp->path->c_str());
   } else {
     ret = __libc_fread(ptr, size, nmemb, stream);
   }
 
+  if (ret > 0) sc.bytes = ret;
+  sc.trace_result(ret);
   return ret;
 }
 
 size_t fwrite(const void* ptr, size_t size, size_t nmemb, FILE* stream) {
   MAP(fwrite, size_t (*)(const void* ptr, size_t, size_t, FILE*));
+  stats_call sc(STATS_FWRITE);
 
   int fd = fileno(stream);
   ssize_t ret = -1;
   if (plfs_files.find(fd) != plfs_files.end()) {
+    sc.route = STATS_PLFS;
 
     plfs_file *tmp = plfs_files.find(fd)->second;   // fake file descriptor
+    sc.mount = tmp->mount;
     off_t offset = ftell(stream);
+    sc.trace_fd(fd, size * nmemb, offset);
+    PROBE_ENTRY(write, fd, offset, size * nmemb, tmp->path->c_str());
 
     if(offset != (off_t)-1) {
 
-      plfs_error_t plfs_error = plfs_write(tmp->fd,
-                                           (const char *)ptr,
-                                           size * nmemb,
-                                           offset,
-                                           getpid(),
-                                           &ret);
+      plfs_error_t plfs_error = plfs_file_write(tmp,
+                                                (const char *)ptr,
+                                                size * nmemb,
+                                                offset,
+                                                &ret);
 
       if(plfs_error != PLFS_SUCCESS) {
         errno = plfs_error_to_errno(plfs_error);
@@ -840,30 +1479,34 @@ size_t fwrite(const void* ptr, size_t size, size_t nmemb, FILE* stream) {
         fseek(stream, ret, SEEK_CUR);
       }
     }
+    PROBE_RETURN(write, fd, offset, ret, tmp->path->c_str());
   } else {
     ret = __libc_fwrite(ptr, size, nmemb, stream);
   }
 
+  if (ret > 0) sc.bytes = ret;
+  sc.trace_result(ret);
   return ret;
 }
 
 int fclose(FILE* stream) {
   MAP(fclose, int (*)(FILE*));
+  stats_call sc(STATS_FCLOSE);
 
-  int num_refs;
+  plfs_error_t plfs_error = PLFS_SUCCESS;
   int fd = fileno(stream);
 
   if (plfs_files.find(fd) != plfs_files.end()) {
+    sc.route = STATS_PLFS;
 
     plfs_file *tmp = plfs_files.find(fd)->second;
+    sc.mount = tmp->mount;
+    sc.trace_fd(fd, 0);
 
     if (!isDuplicated(fd)) {
-      plfs_error_t plfs_error = plfs_close(tmp->fd,
-                                           getpid(),
-                                           getuid(),
-                                           tmp->flags,
-                                           NULL,
-                                           &num_refs);
+      PROBE_ENTRY(close, fd, -1, 0, tmp->path->c_str());
+      plfs_error = plfs_file_close(tmp);
+      PROBE_RETURN(close, fd, -1, plfs_error == PLFS_SUCCESS ? 0 : -1, tmp->path->c_str());
       delete plfs_files.find(fd)->second->path;
       delete plfs_files.find(fd)->second;
     }
@@ -871,18 +1514,27 @@ int fclose(FILE* stream) {
   }
 
   int ret = __libc_fclose(stream);
+  if (ret == 0 && plfs_error != PLFS_SUCCESS) {
+    errno = plfs_error_to_errno(plfs_error);
+    ret = EOF;
+  }
 
+  sc.trace_result(ret);
   return ret;
 }
 
 int chmod(const char* pathname, mode_t mode) {
   MAP(chmod, int (*)(const char*, mode_t));
+  stats_call sc(STATS_CHMOD);
 
   int ret;
   char* cpath = resolvePath(pathname);
 
   if (is_plfs_path(cpath)) {
-    plfs_error_t plfs_error = plfs_chmod(cpath, mode);
+    sc.route = STATS_PLFS;
+    sc.trace_path(cpath, 0, mode);
+    plfs_error_t plfs_error = PLFS_CALL(plfs_chmod(cpath, mode));
+    acache_changed(cpath);
     if (plfs_error != PLFS_SUCCESS) {
       errno = plfs_error_to_errno(plfs_error);
       ret = -1;
@@ -895,6 +1547,7 @@ int chmod(const char* pathname, mode_t mode) {
 
   free(cpath);
 
+  sc.trace_result(ret);
   return ret;
 }
 
@@ -903,25 +1556,33 @@ int chmod(const char* pathname, mode_t mode) {
 int fgetc(FILE* stream) {
   MAP(fgetc, int(*)(FILE*));
   MAP(getc, int(*)(FILE*));
+  stats_call sc(STATS_FGETC);
 
   int fd = fileno(stream);
   ssize_t ret;
   char c = 0;
 
   if (plfs_files.find(fd) != plfs_files.end()) {
+    sc.route = STATS_PLFS;
     plfs_file* tmp = plfs_files.find(fd)->second;
+    sc.mount = tmp->mount;
+    plfs_file_settle(tmp);
 
     off_t offset = ftell(stream);
+    sc.trace_fd(fd, 1, offset);
     if (offset != (off_t)-1) {
-      plfs_error_t plfs_error = plfs_read(tmp->fd, &c, 1, offset, &ret);
-      while (plfs_error == PLFS_EAGAIN) {
-        plfs_error = plfs_read(tmp->fd, &c, 1, offset, &ret);
+      plfs_retry retry(tmp->mount);
+      plfs_error_t plfs_error = PLFS_EAGAIN;
+      while (retry.again(plfs_error)) {
+        plfs_error = PLFS_CALL(plfs_read(tmp->fd, &c, 1, offset, &ret));
       }
       if (plfs_error != PLFS_SUCCESS) {
         errno = plfs_error_to_errno(plfs_error);
         ret = EOF;
+        sc.trace_result(-1);
       } else {
         fseek(stream, ret, SEEK_CUR);
+        sc.trace_result(ret);
       }
     }
   } else {
@@ -937,18 +1598,24 @@ int getc(FILE* stream) {
 
 char* fgets(char* str, int count, FILE* stream) {
   MAP(fgets, char*(*)(char*, int, FILE*));
+  stats_call sc(STATS_FGETS);
 
   int fd = fileno(stream);
   ssize_t ret;
 
   if (plfs_files.find(fd) != plfs_files.end()) {
+    sc.route = STATS_PLFS;
     plfs_file* tmp = plfs_files.find(fd)->second;
+    sc.mount = tmp->mount;
+    plfs_file_settle(tmp);
 
     off_t offset = ftell(stream);
+    sc.trace_fd(fd, count, offset);
     if (offset != (off_t)-1) {
-      plfs_error_t plfs_error = plfs_read(tmp->fd, str, count, offset, &ret);
-      while (plfs_error == PLFS_EAGAIN) {
-        plfs_error = plfs_read(tmp->fd, str, count, offset, &ret);
+      plfs_retry retry(tmp->mount);
+      plfs_error_t plfs_error = PLFS_EAGAIN;
+      while (retry.again(plfs_error)) {
+        plfs_error = PLFS_CALL(plfs_read(tmp->fd, str, count, offset, &ret));
       }
 
       if (plfs_error != PLFS_SUCCESS) {
@@ -962,6 +1629,7 @@ char* fgets(char* str, int count, FILE* stream) {
     str = __libc_fgets(str, count, stream);
   }
 
+  sc.trace_result(ret);
   return str;
 }
 
@@ -970,28 +1638,27 @@ char* fgets(char* str, int count, FILE* stream) {
 int fputc(int ch, FILE* stream) {
   MAP(fputc, int(*)(int, FILE*));
   MAP(putc, int(*)(int, FILE*));
+  stats_call sc(STATS_FPUTC);
 
   int fd = fileno(stream);
   ssize_t ret;
 
   char c = ch;
   if (plfs_files.find(fd) != plfs_files.end()) {
+    sc.route = STATS_PLFS;
     plfs_file* tmp = plfs_files.find(fd)->second;
+    sc.mount = tmp->mount;
 
     off_t offset = ftell(stream);
-    plfs_error_t plfs_error = plfs_write(tmp->fd,
-                                         &c,
-                                         1,
-                                         offset,
-                                         getpid(),
-                                         &ret);
-    while (plfs_error == PLFS_EAGAIN) {
-      plfs_error = plfs_write(tmp->fd,
-                              &c,
-                              1,
-                              offset,
-                              getpid(),
-                              &ret);
+    sc.trace_fd(fd, 1, offset);
+    plfs_retry retry(tmp->mount);
+    plfs_error_t plfs_error = PLFS_EAGAIN;
+    while (retry.again(plfs_error)) {
+      plfs_error = plfs_file_write(tmp,
+                                   &c,
+                                   1,
+                                   offset,
+                                   &ret);
     }
 
     if (plfs_error != PLFS_SUCCESS) {
@@ -1004,6 +1671,7 @@ int fputc(int ch, FILE* stream) {
     ret = __libc_fputc(ch, stream);
   }
 
+  sc.trace_result(ret);
   return ret;
 }
 
@@ -1014,34 +1682,31 @@ int putc(int c, FILE* stream) {
 
 int fputs(const char* str, FILE* stream) {
   MAP(fputs, int(*)(const char*, FILE*));
+  stats_call sc(STATS_FPUTS);
 
   int fd = fileno(stream);
   int ret = 0;
 
   if (plfs_files.find(fd) != plfs_files.end()) {
+    sc.route = STATS_PLFS;
     plfs_file* tmp = plfs_files.find(fd)->second;
+    sc.mount = tmp->mount;
 
     off_t offset = ftell(stream);
     int len = strlen(str);
+    sc.trace_fd(fd, len, offset);
     ssize_t bytes = 0;
     ssize_t written = 0;
 
     if (offset != (off_t)-1) {
-      plfs_error_t plfs_error = plfs_write(tmp->fd,
-                                           str+written,
-                                           len-written,
-                                           offset,
-                                           getpid(),
-                                           &bytes);
-      written += bytes;
-      offset += bytes;
-      while (plfs_error == PLFS_EAGAIN) {
-        plfs_error = plfs_write(tmp->fd,
-                                str+written,
-                                len-written,
-                                offset,
-                                getpid(),
-                                &bytes);
+      plfs_retry retry(tmp->mount);
+      plfs_error_t plfs_error = PLFS_EAGAIN;
+      while (retry.again(plfs_error)) {
+        plfs_error = plfs_file_write(tmp,
+                                     str+written,
+                                     len-written,
+                                     offset,
+                                     &bytes);
         written += bytes;
         offset += bytes;
       }
@@ -1059,16 +1724,19 @@ int fputs(const char* str, FILE* stream) {
     ret = __libc_fputs(str, stream);
   }
 
+  sc.trace_result(ret);
   return ret;
 }
 
 int puts(const char* str) {
   MAP(puts, int(*)(const char *));
+  stats_call sc(STATS_FPUTS);
 
   int fd = fileno(stdout);
   int ret;
 
   if (plfs_files.find(fd) != plfs_files.end()) {
+    sc.route = STATS_PLFS;
     ret = fputs(str, stdout);   // my fputs
   } else {
     ret = __libc_puts(str);
@@ -1081,12 +1749,16 @@ int puts(const char* str) {
 
 int mkdir(const char* pathname, mode_t mode) {
   MAP(mkdir, int(*)(const char*, mode_t));
+  stats_call sc(STATS_MKDIR);
 
   char* path = resolvePath(pathname);
 
   int ret = 0;
   if (is_plfs_path(path)) {
-    plfs_error_t plfs_error = plfs_mkdir(path, mode);
+    sc.route = STATS_PLFS;
+    sc.trace_path(path, 0, mode);
+    plfs_error_t plfs_error = PLFS_CALL(plfs_mkdir(path, mode));
+    acache_changed(path);
     if (plfs_error != PLFS_SUCCESS) {
       errno = plfs_error_to_errno(plfs_error);
       ret = -1;
@@ -1097,19 +1769,24 @@ int mkdir(const char* pathname, mode_t mode) {
 
   free(path);
 
+  sc.trace_result(ret);
   return ret;
 }
 
 
 int rmdir(const char* pathname) {
   MAP(rmdir, int (*)(const char *));
+  stats_call sc(STATS_RMDIR);
 
   int ret = 0;
 
   char *path = resolvePath(pathname);
   if (is_plfs_path(path)) {
+    sc.route = STATS_PLFS;
+    sc.trace_path(path);
 
-    plfs_error_t plfs_error = plfs_rmdir(path);
+    plfs_error_t plfs_error = PLFS_CALL(plfs_rmdir(path));
+    acache_changed(path);
     if(plfs_error != PLFS_SUCCESS) {
       errno = plfs_error_to_errno(plfs_error);
       ret = -1;
@@ -1123,28 +1800,36 @@ int rmdir(const char* pathname) {
 
   free(path);
 
+  sc.trace_result(ret);
   return ret;
 }
 
 
 DIR* opendir(const char* pathname) {
   MAP(opendir, DIR*(*)(const char*));
+  stats_call sc(STATS_OPENDIR);
 
   DIR* key;
   char *path = resolvePath(pathname);
 
   if (is_plfs_path(path)) {
+    sc.route = STATS_PLFS;
+    sc.trace_path(path);
     key = __libc_opendir("/");
 
     plfs_dir* d = new plfs_dir();
     d->path = new std::string(path);
     d->files = new std::set<std::string>();
 
-    plfs_error_t plfs_error = plfs_readdir(path, (void*)d->files);
+    PROBE_ENTRY(readdir, -1, -1, 0, path);
+    plfs_error_t plfs_error = PLFS_CALL(plfs_readdir(path, (void*)d->files));
+    PROBE_RETURN(readdir, -1, -1,
+                 plfs_error == PLFS_SUCCESS ? (long long)d->files->size() : -1, path);
     if (plfs_error != PLFS_SUCCESS) {
       delete d->path;
       delete d->files;
       delete d;
+      sc.trace_result(-1);
       return NULL;
     }
 
@@ -1159,16 +1844,20 @@ DIR* opendir(const char* pathname) {
 
   free(path);
 
+  sc.trace_result(key != NULL ? (long long)(intptr_t)key : -1);
   return key;
 }
 
 
 struct dirent* readdir(DIR* dir) {
   MAP(readdir, struct dirent*(*)(DIR*));
+  stats_call sc(STATS_READDIR);
 
   struct dirent* ret;
 
   if (opendirs.find(dir) != opendirs.end()) {
+    sc.route = STATS_PLFS;
+    sc.trace_fd((intptr_t)dir, 0);
     plfs_dir* d = opendirs.find(dir)->second;
 
     if (d->iter == d->files->end()) {
@@ -1180,7 +1869,7 @@ struct dirent* readdir(DIR* dir) {
       path += d->iter->c_str();
 
       struct stat stats;
-      plfs_getattr(NULL, path.c_str(), &stats, 0);
+      PLFS_CALL(plfs_getattr(NULL, path.c_str(), &stats, 0));
 
       tmp.d_ino = stats.st_ino;
       sprintf(tmp.d_name, "%s", d->iter->c_str());
@@ -1192,14 +1881,18 @@ struct dirent* readdir(DIR* dir) {
     ret = __libc_readdir(dir);
   }
 
+  sc.trace_result(ret != NULL);
   return ret;
 }
 
 
 int closedir(DIR* dir) {
   MAP(closedir, int(*)(DIR*));
+  stats_call sc(STATS_CLOSEDIR);
 
   if (opendirs.find(dir) != opendirs.end()) {
+    sc.route = STATS_PLFS;
+    sc.trace_fd((intptr_t)dir, 0);
     plfs_dir* tmp = opendirs.find(dir)->second;
     fd2dir.erase(tmp->dirFd);
     delete tmp->path;
@@ -1214,19 +1907,21 @@ int closedir(DIR* dir) {
 
 int chdir(const char* pathname) {
   MAP(chdir, int(*)(const char*));
+  stats_call sc(STATS_CHDIR);
 
   int ret = 0;
   char* path = resolvePath(pathname);
 
   if (is_plfs_path(path)) {
+    sc.route = STATS_PLFS;
     char* phys_path = NULL;
     char* mountp = NULL;
     char* backp = NULL;
 
-    plfs_error_t plfs_error = plfs_expand_path(path,
+    plfs_error_t plfs_error = PLFS_CALL(plfs_expand_path(path,
                                                &phys_path,
                                                (void**)&(mountp),
-                                               (void**)&backp);
+                                               (void**)&backp));
     if (plfs_error != PLFS_SUCCESS) {
       errno = plfs_error_to_errno(plfs_error);
       ret = -1;
@@ -1244,6 +1939,7 @@ int chdir(const char* pathname) {
 
 char* getcwd(char* buf, size_t size) {
   MAP(get_current_dir_name,char* (*)(void));
+  stats_call sc(STATS_GETCWD);
 
   char* ret = NULL;
 
@@ -1251,7 +1947,7 @@ char* getcwd(char* buf, size_t size) {
     errno = EINVAL;
     ret = NULL;
   } else {
-    if (phys_paths.size() == 0) loadPhysPaths();
+    soplfs_check();
 
     char* real_cwd = __libc_get_current_dir_name();
     std::string real_cwd_str(real_cwd);
@@ -1291,6 +1987,7 @@ char* getcwd(char* buf, size_t size) {
 
 int fcntl(int fildes, int cmd, ...){
   MAP(fcntl,int (*)(int, int, ...));
+  stats_call sc(STATS_FCNTL);
 
   int ret;
 
@@ -1323,6 +2020,9 @@ int fcntl(int fildes, int cmd, ...){
   va_end(vl);
 
   if (plfs_files.find(fildes) != plfs_files.end()) {
+    sc.route = STATS_PLFS;
+    sc.trace_fd(fildes, 0);
+    sc.flags = cmd;
     if(cmd == F_DUPFD || cmd == F_DUPFD_CLOEXEC) {
       if(ret != -1) {
         plfs_file *tmp = plfs_files.find(fildes)->second;
@@ -1331,27 +2031,36 @@ int fcntl(int fildes, int cmd, ...){
     }
   }
 
+  sc.trace_result(ret);
   return ret;
 }
 
 int rename(const char* frompath, const char* topath) {
   MAP(rename, int (*)(const char *, const char *));
+  stats_call sc(STATS_RENAME);
 
   int ret = 0;
 
   char *path_from = resolvePath(frompath);
   char *path_to = resolvePath(topath);
   if (is_plfs_path(path_from) && is_plfs_path(path_to)) {
-    plfs_error_t plfs_error = plfs_rename(path_from, path_to);
+    sc.route = STATS_PLFS;
+    sc.trace_path(path_from, 0, 0, path_to);
+    plfs_error_t plfs_error = PLFS_CALL(plfs_rename(path_from, path_to));
+    acache_changed(path_from);
+    acache_changed(path_to);
     if(plfs_error != PLFS_SUCCESS) {
       errno = plfs_error_to_errno(plfs_error);
       ret = -1;
+      if (errno == EXDEV) ret = xfer_rename(path_from, path_to, 1, 1);   // two mounts
     } else {
       ret = 0;
     }
   } else if (is_plfs_path(path_from) || is_plfs_path(path_to)) {
-    errno = ENOENT;
-    ret = -1;
+    // what mv does after EXDEV, without the file passing through FUSE
+    sc.route = STATS_PLFS;
+    sc.trace_path(path_from, 0, 0, path_to);
+    ret = xfer_rename(path_from, path_to, is_plfs_path(path_from), is_plfs_path(path_to));
   } else {
     ret = __libc_rename(frompath, topath);
   }
@@ -1359,25 +2068,30 @@ int rename(const char* frompath, const char* topath) {
   free(path_from);
   free(path_to);
 
+  sc.trace_result(ret);
   return ret;
 }
 
 
 int fflush(FILE* stream) {
   MAP(fflush, int (*)(FILE *));
+  stats_call sc(STATS_FFLUSH);
 
   int ret;
 
   if (NULL == stream) {
-    for (std::map<int,plfs_file*>::iterator itr = plfs_files.begin();
-         itr != plfs_files.end(); itr++) {
-      plfs_sync(itr->second->fd);
-    }
+    sync_commit_all();
     return __libc_fflush(stream);
   }
 
   if (plfs_files.find(fileno(stream)) != plfs_files.end()) {
-    plfs_error_t plfs_error = plfs_sync(plfs_files.find(fileno(stream))->second->fd);
+    sc.route = STATS_PLFS;
+    sc.trace_fd(fileno(stream), 0);
+    plfs_file *tmp = plfs_files.find(fileno(stream))->second;
+    PROBE_ENTRY(sync, fileno(stream), -1, 0, tmp->path->c_str());
+    plfs_error_t plfs_error = sync_commit(tmp->sg, tmp);
+    PROBE_RETURN(sync, fileno(stream), -1, plfs_error == PLFS_SUCCESS ? 0 : -1,
+                 tmp->path->c_str());
     if(plfs_error != PLFS_SUCCESS) {
       errno = plfs_error_to_errno(plfs_error);
       ret = EOF;
@@ -1388,10 +2102,323 @@ int fflush(FILE* stream) {
     ret = __libc_fflush(stream);
   }
 
+  sc.trace_result(ret);
+  return ret;
+}
+
+
+/*
+ * fsync and friends commit through the handle's sync group, so threads
+ * syncing the same container at once share one plfs_sync.  PLFS has no
+ * data-only or ranged sync: fdatasync is fsync, and sync_file_range
+ * syncs the whole container.
+ */
+int fsync(int fd) {
+  MAP(fsync, int (*)(int));
+  stats_call sc(STATS_FSYNC);
+
+  int ret = 0;
+
+  if (plfs_files.find(fd) != plfs_files.end()) {
+    sc.route = STATS_PLFS;
+    sc.trace_fd(fd, 0);
+    plfs_file *tmp = plfs_files.find(fd)->second;
+    PROBE_ENTRY(sync, fd, -1, 0, tmp->path->c_str());
+    plfs_error_t plfs_error = sync_commit(tmp->sg, tmp);
+    PROBE_RETURN(sync, fd, -1, plfs_error == PLFS_SUCCESS ? 0 : -1, tmp->path->c_str());
+    if (plfs_error != PLFS_SUCCESS) {
+      errno = plfs_error_to_errno(plfs_error);
+      ret = -1;
+    }
+  } else {
+    ret = __libc_fsync(fd);
+  }
+
+  sc.trace_result(ret);
+  return ret;
+}
+
+
+int fdatasync(int fd) {
+  MAP(fdatasync, int (*)(int));
+  stats_call sc(STATS_FSYNC);
+
+  int ret = 0;
+
+  if (plfs_files.find(fd) != plfs_files.end()) {
+    sc.route = STATS_PLFS;
+    sc.trace_fd(fd, 0);
+    plfs_file *tmp = plfs_files.find(fd)->second;
+    PROBE_ENTRY(sync, fd, -1, 0, tmp->path->c_str());
+    plfs_error_t plfs_error = sync_commit(tmp->sg, tmp);
+    PROBE_RETURN(sync, fd, -1, plfs_error == PLFS_SUCCESS ? 0 : -1, tmp->path->c_str());
+    if (plfs_error != PLFS_SUCCESS) {
+      errno = plfs_error_to_errno(plfs_error);
+      ret = -1;
+    }
+  } else {
+    ret = __libc_fdatasync(fd);
+  }
+
+  sc.trace_result(ret);
+  return ret;
+}
+
+
+int syncfs(int fd) {
+  MAP(syncfs, int (*)(int));
+  stats_call sc(STATS_FSYNC);
+
+  int ret = 0;
+
+  if (plfs_files.find(fd) != plfs_files.end()) {
+    sc.route = STATS_PLFS;
+    sc.trace_fd(fd, 0);
+    PROBE_ENTRY(sync, fd, -1, 0, plfs_files.find(fd)->second->path->c_str());
+    plfs_error_t plfs_error = sync_commit_all();
+    PROBE_RETURN(sync, fd, -1, plfs_error == PLFS_SUCCESS ? 0 : -1,
+                 plfs_files.find(fd)->second->path->c_str());
+    if (plfs_error != PLFS_SUCCESS) {
+      errno = plfs_error_to_errno(plfs_error);
+      ret = -1;
+    }
+  } else {
+    ret = __libc_syncfs(fd);
+  }
+
+  sc.trace_result(ret);
+  return ret;
+}
+
+
+int sync_file_range(int fd, off64_t offset, off64_t nbytes, unsigned int flags) {
+  MAP(sync_file_range, int (*)(int, off64_t, off64_t, unsigned int));
+  stats_call sc(STATS_FSYNC);
+
+  int ret = 0;
+
+  if (plfs_files.find(fd) != plfs_files.end()) {
+    sc.route = STATS_PLFS;
+    sc.trace_fd(fd, 0);
+    plfs_file *tmp = plfs_files.find(fd)->second;
+    sync_group *sg = tmp->sg;
+    if (flags & SYNC_FILE_RANGE_WAIT_AFTER) {
+      PROBE_ENTRY(sync, fd, offset, nbytes, tmp->path->c_str());
+      plfs_error_t plfs_error = sync_commit(sg, tmp);
+      PROBE_RETURN(sync, fd, offset, plfs_error == PLFS_SUCCESS ? 0 : -1, tmp->path->c_str());
+      if (plfs_error != PLFS_SUCCESS) {
+        errno = plfs_error_to_errno(plfs_error);
+        ret = -1;
+      }
+    } else if (flags & SYNC_FILE_RANGE_WRITE) {
+      sync_start(sg);   // start writeback, don't wait
+    }
+  } else {
+    ret = __libc_sync_file_range(fd, offset, nbytes, flags);
+  }
+
+  sc.trace_result(ret);
   return ret;
 }
 
 
+/*
+ * POSIX AIO
+ *
+ * aiocbs on PLFS descriptors go to soplfs' AIO engine; anything else,
+ * including aiocbs the engine has never seen, is handled by libc.
+ */
+int aio_read(struct aiocb *aiocbp) {
+  MAP(aio_read, int (*)(struct aiocb*));
+  stats_call sc(STATS_AIO);
+
+  int ret;
+
+  if (plfs_files.find(aiocbp->aio_fildes) != plfs_files.end()) {
+    sc.route = STATS_PLFS;
+    sc.trace_fd(aiocbp->aio_fildes, aiocbp->aio_nbytes, aiocbp->aio_offset);
+    ret = paio_submit(plfs_files.find(aiocbp->aio_fildes)->second, aiocbp, LIO_READ);
+  } else {
+    paio_forget(aiocbp);
+    ret = __libc_aio_read(aiocbp);
+  }
+
+  sc.trace_result(ret);
+  return ret;
+}
+
+int aio_write(struct aiocb *aiocbp) {
+  MAP(aio_write, int (*)(struct aiocb*));
+  stats_call sc(STATS_AIO);
+
+  int ret;
+
+  if (plfs_files.find(aiocbp->aio_fildes) != plfs_files.end()) {
+    sc.route = STATS_PLFS;
+    sc.trace_fd(aiocbp->aio_fildes, aiocbp->aio_nbytes, aiocbp->aio_offset);
+    sc.flags = LIO_WRITE;
+    ret = paio_submit(plfs_files.find(aiocbp->aio_fildes)->second, aiocbp, LIO_WRITE);
+  } else {
+    paio_forget(aiocbp);
+    ret = __libc_aio_write(aiocbp);
+  }
+
+  sc.trace_result(ret);
+  return ret;
+}
+
+int aio_fsync(int op, struct aiocb *aiocbp) {
+  MAP(aio_fsync, int (*)(int, struct aiocb*));
+  stats_call sc(STATS_AIO);
+
+  int ret;
+
+  if (plfs_files.find(aiocbp->aio_fildes) != plfs_files.end()) {
+    sc.route = STATS_PLFS;
+    if (op != O_SYNC && op != O_DSYNC) {
+      errno = EINVAL;
+      ret = -1;
+    } else {
+      ret = paio_submit(plfs_files.find(aiocbp->aio_fildes)->second, aiocbp, LIO_NOP);
+    }
+  } else {
+    paio_forget(aiocbp);
+    ret = __libc_aio_fsync(op, aiocbp);
+  }
+
+  return ret;
+}
+
+int aio_error(const struct aiocb *aiocbp) {
+  MAP(aio_error, int (*)(const struct aiocb*));
+  stats_call sc(STATS_AIO);
+
+  int ret;
+
+  if (paio_owns(aiocbp)) {
+    sc.route = STATS_PLFS;
+    ret = paio_error(aiocbp);
+  } else {
+    ret = __libc_aio_error(aiocbp);
+  }
+
+  return ret;
+}
+
+ssize_t aio_return(struct aiocb *aiocbp) {
+  MAP(aio_return, ssize_t (*)(struct aiocb*));
+  stats_call sc(STATS_AIO);
+
+  ssize_t ret;
+
+  if (paio_owns(aiocbp)) {
+    sc.route = STATS_PLFS;
+    ret = paio_return(aiocbp);
+  } else {
+    ret = __libc_aio_return(aiocbp);
+  }
+
+  return ret;
+}
+
+int aio_suspend(const struct aiocb *const list[], int nent, const struct timespec *timeout) {
+  MAP(aio_suspend, int (*)(const struct aiocb *const[], int, const struct timespec*));
+  stats_call sc(STATS_AIO);
+
+  int ret;
+
+  int ours = 0;
+  for (int i = 0; i < nent && !ours; i++) {
+    ours = (list[i] != NULL && paio_owns(list[i]));
+  }
+
+  if (ours) {
+    sc.route = STATS_PLFS;
+    ret = paio_suspend(list, nent, timeout);
+  } else {
+    ret = __libc_aio_suspend(list, nent, timeout);
+  }
+
+  return ret;
+}
+
+int aio_cancel(int fd, struct aiocb *aiocbp) {
+  MAP(aio_cancel, int (*)(int, struct aiocb*));
+  stats_call sc(STATS_AIO);
+
+  int ret;
+
+  if (plfs_files.find(fd) != plfs_files.end()) {
+    sc.route = STATS_PLFS;
+    ret = paio_cancel(plfs_files.find(fd)->second, aiocbp);
+  } else {
+    ret = __libc_aio_cancel(fd, aiocbp);
+  }
+
+  return ret;
+}
+
+int lio_listio(int mode, struct aiocb *const list[], int nent, struct sigevent *sevp) {
+  MAP(lio_listio, int (*)(int, struct aiocb *const[], int, struct sigevent*));
+  stats_call sc(STATS_LIO_LISTIO);
+
+  int ret;
+
+  int ours = 0;
+  for (int i = 0; i < nent && !ours; i++) {
+    ours = (list[i] != NULL && list[i]->aio_lio_opcode != LIO_NOP &&
+            plfs_files.find(list[i]->aio_fildes) != plfs_files.end());
+  }
+
+  if (ours) {
+    sc.route = STATS_PLFS;
+    ret = paio_listio(mode, list, nent, sevp);
+  } else {
+    for (int i = 0; i < nent; i++) {
+      if (list[i] != NULL) paio_forget(list[i]);
+    }
+    ret = __libc_lio_listio(mode, list, nent, sevp);
+  }
+
+  return ret;
+}
+
+#if __WORDSIZE == 64
+// struct aiocb64 is struct aiocb on LP64
+int aio_read64(struct aiocb64 *aiocbp) {
+  return aio_read((struct aiocb*)aiocbp);
+}
+
+int aio_write64(struct aiocb64 *aiocbp) {
+  return aio_write((struct aiocb*)aiocbp);
+}
+
+int aio_fsync64(int op, struct aiocb64 *aiocbp) {
+  return aio_fsync(op, (struct aiocb*)aiocbp);
+}
+
+int aio_error64(const struct aiocb64 *aiocbp) {
+  return aio_error((const struct aiocb*)aiocbp);
+}
+
+ssize_t aio_return64(struct aiocb64 *aiocbp) {
+  return aio_return((struct aiocb*)aiocbp);
+}
+
+int aio_suspend64(const struct aiocb64 *const list[], int nent, const struct timespec *timeout) {
+  return aio_suspend((const struct aiocb *const*)list, nent, timeout);
+}
+
+int aio_cancel64(int fd, struct aiocb64 *aiocbp) {
+  return aio_cancel(fd, (struct aiocb*)aiocbp);
+}
+
+int lio_listio64(int mode, struct aiocb64 *const list[], int nent, struct sigevent *sevp) {
+  return lio_listio(mode, (struct aiocb *const*)list, nent, sevp);
+}
+#endif
+
+
 // int unlink(const char* pathname) {
 //     MAP(unlink, int (*)(const char *));
 //    
@@ -1418,20 +2445,22 @@ int fflush(FILE* stream) {
 
 int vfprintf(FILE *stream, const char *format, va_list ap) {
   MAP(vfprintf, int(*)(FILE *stream, const char *format, va_list ap));
+  stats_call sc(STATS_FPRINTF);
 
   int ret;
 
   if (plfs_files.find(fileno(stream)) != plfs_files.end()) {
+    sc.route = STATS_PLFS;
     char* out_buffer = NULL;
     int out_length = vasprintf(&out_buffer, format, ap);
     long offset = ftell(stream);
+    sc.trace_fd(fileno(stream), out_length, offset);
     ssize_t bytes;
-    plfs_error_t plfs_error = plfs_write(plfs_files.find(fileno(stream))->second->fd,
-                                         out_buffer,
-                                         out_length,
-                                         offset,
-                                         getpid(),
-                                         &bytes);
+    plfs_error_t plfs_error = plfs_file_write(plfs_files.find(fileno(stream))->second,
+                                              out_buffer,
+                                              out_length,
+                                              offset,
+                                              &bytes);
 
     if(plfs_error != PLFS_SUCCESS) {
       errno = plfs_error_to_errno(plfs_error);
@@ -1445,6 +2474,7 @@ int vfprintf(FILE *stream, const char *format, va_list ap) {
     ret = __libc_vfprintf(stream, format, ap);
   }
 
+  sc.trace_result(ret);
   return ret;
 }
 
@@ -1463,17 +2493,18 @@ int fprintf(FILE* stream, const char* format, ...) {
 
 int stat(const char* pathname, struct stat* statbuf) {
   MAP(stat, int(*)(const char*, struct stat*));
+  stats_call sc(STATS_STAT);
   int ret = 0;
 
   char *cpath = resolvePath(pathname);
 
   if (is_plfs_path(cpath)) {
-    plfs_error_t plfs_error = plfs_getattr(NULL, cpath, statbuf, 0);
-    while (plfs_error == PLFS_EAGAIN) {
-      plfs_error = plfs_getattr(NULL, cpath, statbuf, 0);
-    }
+    sc.route = STATS_PLFS;
+    sc.trace_path(cpath);
+    plfs_error_t plfs_error = plfs_stat_path(cpath, statbuf);
 
     if (plfs_error != PLFS_SUCCESS) {
+      errno = plfs_error_to_errno(plfs_error);
       ret = -1;
     }
   } else {
@@ -1481,19 +2512,20 @@ int stat(const char* pathname, struct stat* statbuf) {
   }
 
   free(cpath);
+  sc.trace_result(ret);
   return ret;
 }
 
 int __lxstat(int vers, const char* path, struct stat* statbuf) {
   MAP(__lxstat, int(*)(int, const char*, struct stat*));
+  stats_call sc(STATS_STAT);
   int ret = 0;
   char* cpath = resolvePath(path);
 
   if (is_plfs_path(cpath)) {
-    plfs_error_t plfs_error = plfs_getattr(NULL, cpath, statbuf, 0);
-    while (plfs_error == PLFS_EAGAIN) {
-      plfs_error = plfs_getattr(NULL, cpath, statbuf, 0);
-    }
+    sc.route = STATS_PLFS;
+    sc.trace_path(cpath);
+    plfs_error_t plfs_error = plfs_stat_path(cpath, statbuf);
 
     if (plfs_error != PLFS_SUCCESS) {
       errno = plfs_error_to_errno(plfs_error);
@@ -1503,6 +2535,7 @@ int __lxstat(int vers, const char* path, struct stat* statbuf) {
     ret = __libc___lxstat(vers, path, statbuf);
   }
 
+  sc.trace_result(ret);
   return ret;
 }
 
@@ -1510,14 +2543,14 @@ int __lxstat(int vers, const char* path, struct stat* statbuf) {
 
 int __xstat(int vers, const char *path, struct stat *buf) {
   MAP(__xstat, int(*)(int, const char*, struct stat*));
+  stats_call sc(STATS_STAT);
   int ret = 0;
   char* cpath = resolvePath(path);
 
   if (is_plfs_path(cpath)) {
-    plfs_error_t plfs_error = plfs_getattr(NULL, cpath, buf, 0);
-    while (plfs_error == PLFS_EAGAIN) {
-      plfs_error = plfs_getattr(NULL, cpath, buf, 0);
-    }
+    sc.route = STATS_PLFS;
+    sc.trace_path(cpath);
+    plfs_error_t plfs_error = plfs_stat_path(cpath, buf);
 
     if (plfs_error != PLFS_SUCCESS) {
       errno = plfs_error_to_errno(plfs_error);
@@ -1528,20 +2561,23 @@ int __xstat(int vers, const char *path, struct stat *buf) {
   }
 
   free(cpath);
+  sc.trace_result(ret);
   return ret;
 }
 
 int __fxstat(int vers, int fd, struct stat *buf) {
   MAP(__fxstat, int(*)(int, int, struct stat*));
+  stats_call sc(STATS_FSTAT);
   int ret = 0;
 
 	for (std::map<DIR*, plfs_dir*>::iterator iter = opendirs.begin();
       iter != opendirs.end(); ++iter) {
 		if (iter->second->dirFd == fd) {
-			plfs_error_t plfs_error = plfs_getattr(NULL, 
+			sc.route = STATS_PLFS;
+			plfs_error_t plfs_error = PLFS_CALL(plfs_getattr(NULL, 
                                              iter->second->path->c_str(),
                                              buf,
-                                             0);
+                                             0));
 
 			if (plfs_error != PLFS_SUCCESS) {
 				errno = plfs_error_to_errno(plfs_error);
@@ -1553,11 +2589,18 @@ int __fxstat(int vers, int fd, struct stat *buf) {
 	}
 
   if (plfs_files.find(fd) != plfs_files.end()) {
+    sc.route = STATS_PLFS;
     plfs_file* tmp = plfs_files.find(fd)->second;
-    plfs_error_t plfs_error = plfs_getattr(tmp->fd, NULL, buf, 0);
-    while (plfs_error == PLFS_EAGAIN) {
-      plfs_error = plfs_getattr(tmp->fd, NULL, buf, 0);
+    sc.mount = tmp->mount;
+    sc.trace_fd(fd, 0);
+    PROBE_ENTRY(getattr, fd, -1, 0, tmp->path->c_str());
+    plfs_file_settle(tmp);
+    plfs_retry retry(tmp->mount);
+    plfs_error_t plfs_error = PLFS_EAGAIN;
+    while (retry.again(plfs_error)) {
+      plfs_error = PLFS_CALL(plfs_getattr(tmp->fd, NULL, buf, 0));
     }
+    PROBE_RETURN(getattr, fd, -1, plfs_error == PLFS_SUCCESS ? 0 : -1, tmp->path->c_str());
 
     if (plfs_error != PLFS_SUCCESS) {
       errno = plfs_error_to_errno(plfs_error);
@@ -1567,10 +2610,273 @@ int __fxstat(int vers, int fd, struct stat *buf) {
     ret = __libc___fxstat(vers, fd, buf);
   }
 
+  sc.trace_result(ret);
+  return ret;
+}
+
+// glibc 2.33 and later call fstat itself instead of __fxstat
+static int is_plfs_fd(int fd) {
+  if (!soplfs_loaded) return 0;   // opendirs is not constructed yet
+  if (plfs_files.find(fd) != plfs_files.end()) return 1;
+  for (std::map<DIR*, plfs_dir*>::iterator iter = opendirs.begin();
+       iter != opendirs.end(); ++iter) {
+    if (iter->second->dirFd == fd) return 1;
+  }
+  return 0;
+}
+
+int fstat(int fd, struct stat *buf) {
+  MAP(fstat, int(*)(int, struct stat*));
+  if (!is_plfs_fd(fd)) return __libc_fstat(fd, buf);
+  return __fxstat(0, fd, buf);
+}
+
+int fstat64(int fd, struct stat64 *buf) {
+  MAP(fstat64, int(*)(int, struct stat64*));
+  if (!is_plfs_fd(fd)) return __libc_fstat64(fd, buf);
+  return __fxstat(0, fd, (struct stat*)buf);   // the same layout on 64-bit Linux
+}
+
+
+/*
+ * Program execution
+ *
+ * exec*, posix_spawn
+ *
+ * The new program takes over the open PLFS handles (soplfs_inherit.cpp).
+ * glibc's exec variants call execve internally, so each one is wrapped.
+ */
+
+// runs exec with SOPLFS_HANDLES added to envp when there are handles
+static int exec_handles(int (*exec)(const char*, char *const*, char *const*),
+                        const char *file, char *const argv[], char *const envp[]) {
+  int fd = inherit_export(envp);
+  if (fd < 0) return exec(file, argv, envp);
+
+  std::string var;
+  std::vector<char*> env;
+  inherit_env(envp, fd, &var, &env);
+  exec(file, argv, &env[0]);
+  int err = errno;
+  inherit_unexport(fd);
+  errno = err;
+  return -1;
+}
+
+// the arguments of execl and friends, up to the NULL
+static void exec_args(const char *arg, va_list *ap, std::vector<char*> *argv) {
+  argv->push_back((char*)arg);
+  while (arg != NULL) {
+    arg = va_arg(*ap, const char*);
+    argv->push_back((char*)arg);
+  }
+}
+
+int execve(const char *path, char *const argv[], char *const envp[]) {
+  MAP(execve, int (*)(const char*, char *const*, char *const*));
+  return exec_handles(__libc_execve, path, argv, envp);
+}
+
+int execvpe(const char *file, char *const argv[], char *const envp[]) {
+  MAP(execvpe, int (*)(const char*, char *const*, char *const*));
+  return exec_handles(__libc_execvpe, file, argv, envp);
+}
+
+int execv(const char *path, char *const argv[]) {
+  return execve(path, argv, environ);
+}
+
+int execvp(const char *file, char *const argv[]) {
+  return execvpe(file, argv, environ);
+}
+
+int execl(const char *path, const char *arg, ...) {
+  std::vector<char*> argv;
+  va_list ap;
+  va_start(ap, arg);
+  exec_args(arg, &ap, &argv);
+  va_end(ap);
+  return execve(path, &argv[0], environ);
+}
+
+int execlp(const char *file, const char *arg, ...) {
+  std::vector<char*> argv;
+  va_list ap;
+  va_start(ap, arg);
+  exec_args(arg, &ap, &argv);
+  va_end(ap);
+  return execvpe(file, &argv[0], environ);
+}
+
+int execle(const char *path, const char *arg, ...) {
+  std::vector<char*> argv;
+  va_list ap;
+  va_start(ap, arg);
+  exec_args(arg, &ap, &argv);
+  char *const *envp = va_arg(ap, char *const*);
+  va_end(ap);
+  return execve(path, &argv[0], envp);
+}
+
+int posix_spawn(pid_t *pid, const char *path, const posix_spawn_file_actions_t *actions,
+                const posix_spawnattr_t *attr, char *const argv[], char *const envp[]) {
+  MAP(posix_spawn, int (*)(pid_t*, const char*, const posix_spawn_file_actions_t*,
+                           const posix_spawnattr_t*, char *const*, char *const*));
+  int fd = inherit_export(envp);
+  if (fd < 0) return __libc_posix_spawn(pid, path, actions, attr, argv, envp);
+
+  std::string var;
+  std::vector<char*> env;
+  inherit_env(envp, fd, &var, &env);
+  int ret = __libc_posix_spawn(pid, path, actions, attr, argv, &env[0]);
+  inherit_unexport(fd);   // the child has exec'ed by now
+  return ret;
+}
+
+int posix_spawnp(pid_t *pid, const char *file, const posix_spawn_file_actions_t *actions,
+                 const posix_spawnattr_t *attr, char *const argv[], char *const envp[]) {
+  MAP(posix_spawnp, int (*)(pid_t*, const char*, const posix_spawn_file_actions_t*,
+                            const posix_spawnattr_t*, char *const*, char *const*));
+  int fd = inherit_export(envp);
+  if (fd < 0) return __libc_posix_spawnp(pid, file, actions, attr, argv, envp);
+
+  std::string var;
+  std::vector<char*> env;
+  inherit_env(envp, fd, &var, &env);
+  int ret = __libc_posix_spawnp(pid, file, actions, attr, argv, &env[0]);
+  inherit_unexport(fd);
   return ret;
 }
 
 
+// nftw, ftw and fts on a PLFS tree list and stat it on the mount's
+// walk_threads threads (soplfs_walk.cpp); the caller's callbacks run
+// where they would under libc.  The 64-bit variants share the walk where
+// struct stat and struct stat64 are the same.
+static int walk_path(const char *path, std::string *cpath) {
+  if (path == NULL || *path == '\0') return 0;
+  char *c = resolvePath(path);
+  int wanted = walk_wanted(c);
+  if (wanted) *cpath = c;
+  free(c);
+  return wanted;
+}
+
+int nftw(const char *dirpath, walk_nftw_fn fn, int nopenfd, int flags) {
+  MAP(nftw, int (*)(const char*, walk_nftw_fn, int, int));
+  std::string cpath;
+  if (!walk_path(dirpath, &cpath)) return __libc_nftw(dirpath, fn, nopenfd, flags);
+  return walk_nftw(dirpath, cpath.c_str(), fn, NULL, flags);
+}
+
+int nftw64(const char *dirpath, int (*fn)(const char*, const struct stat64*, int, struct FTW*),
+           int nopenfd, int flags) {
+  MAP(nftw64, int (*)(const char*, int (*)(const char*, const struct stat64*, int, struct FTW*),
+                      int, int));
+  std::string cpath;
+  if (sizeof(struct stat) != sizeof(struct stat64) || !walk_path(dirpath, &cpath)) {
+    return __libc_nftw64(dirpath, fn, nopenfd, flags);
+  }
+  return walk_nftw(dirpath, cpath.c_str(), (walk_nftw_fn)fn, NULL, flags);
+}
+
+int ftw(const char *dirpath, walk_ftw_fn fn, int nopenfd) {
+  MAP(ftw, int (*)(const char*, walk_ftw_fn, int));
+  std::string cpath;
+  if (!walk_path(dirpath, &cpath)) return __libc_ftw(dirpath, fn, nopenfd);
+  return walk_nftw(dirpath, cpath.c_str(), NULL, fn, 0);
+}
+
+int ftw64(const char *dirpath, int (*fn)(const char*, const struct stat64*, int), int nopenfd) {
+  MAP(ftw64, int (*)(const char*, int (*)(const char*, const struct stat64*, int), int));
+  std::string cpath;
+  if (sizeof(struct stat) != sizeof(struct stat64) || !walk_path(dirpath, &cpath)) {
+    return __libc_ftw64(dirpath, fn, nopenfd);
+  }
+  return walk_nftw(dirpath, cpath.c_str(), NULL, (walk_ftw_fn)fn, 0);
+}
+
+// fts takes the walk when every path given is on such a mount
+static int walk_paths(char *const *argv, int options, std::vector<std::string> *cpaths) {
+  if (argv == NULL || *argv == NULL || (options & ~FTS_OPTIONMASK) != 0 ||
+      (options & (FTS_LOGICAL | FTS_PHYSICAL)) == 0) {
+    return 0;   // libc's fts fails those
+  }
+  for (; *argv != NULL; argv++) {
+    std::string cpath;
+    if (!walk_path(*argv, &cpath)) return 0;
+    cpaths->push_back(cpath);
+  }
+  return 1;
+}
+
+FTS* fts_open(char *const *argv, int options, int (*compar)(const FTSENT**, const FTSENT**)) {
+  MAP(fts_open, FTS* (*)(char *const*, int, int (*)(const FTSENT**, const FTSENT**)));
+  std::vector<std::string> cpaths;
+  if (!walk_paths(argv, options, &cpaths)) return __libc_fts_open(argv, options, compar);
+  return walk_fts_open(argv, cpaths, options, compar);
+}
+
+FTSENT* fts_read(FTS *ftsp) {
+  MAP(fts_read, FTSENT* (*)(FTS*));
+  if (walk_fts_owns(ftsp)) return walk_fts_read(ftsp);
+  return __libc_fts_read(ftsp);
+}
+
+FTSENT* fts_children(FTS *ftsp, int instr) {
+  MAP(fts_children, FTSENT* (*)(FTS*, int));
+  if (walk_fts_owns(ftsp)) return walk_fts_children(ftsp, instr);
+  return __libc_fts_children(ftsp, instr);
+}
+
+int fts_set(FTS *ftsp, FTSENT *f, int instr) {
+  MAP(fts_set, int (*)(FTS*, FTSENT*, int));
+  if (walk_fts_owns(ftsp)) return walk_fts_set(ftsp, f, instr);
+  return __libc_fts_set(ftsp, f, instr);
+}
+
+int fts_close(FTS *ftsp) {
+  MAP(fts_close, int (*)(FTS*));
+  if (walk_fts_owns(ftsp)) return walk_fts_close(ftsp);
+  return __libc_fts_close(ftsp);
+}
+
+FTS64* fts64_open(char *const *argv, int options,
+                  int (*compar)(const FTSENT64**, const FTSENT64**)) {
+  MAP(fts64_open, FTS64* (*)(char *const*, int, int (*)(const FTSENT64**, const FTSENT64**)));
+  std::vector<std::string> cpaths;
+  if (sizeof(struct stat) != sizeof(struct stat64) || !walk_paths(argv, options, &cpaths)) {
+    return __libc_fts64_open(argv, options, compar);
+  }
+  return (FTS64*)walk_fts_open(argv, cpaths, options,
+                               (int (*)(const FTSENT**, const FTSENT**))compar);
+}
+
+FTSENT64* fts64_read(FTS64 *ftsp) {
+  MAP(fts64_read, FTSENT64* (*)(FTS64*));
+  if (walk_fts_owns((FTS*)ftsp)) return (FTSENT64*)walk_fts_read((FTS*)ftsp);
+  return __libc_fts64_read(ftsp);
+}
+
+FTSENT64* fts64_children(FTS64 *ftsp, int instr) {
+  MAP(fts64_children, FTSENT64* (*)(FTS64*, int));
+  if (walk_fts_owns((FTS*)ftsp)) return (FTSENT64*)walk_fts_children((FTS*)ftsp, instr);
+  return __libc_fts64_children(ftsp, instr);
+}
+
+int fts64_set(FTS64 *ftsp, FTSENT64 *f, int instr) {
+  MAP(fts64_set, int (*)(FTS64*, FTSENT64*, int));
+  if (walk_fts_owns((FTS*)ftsp)) return walk_fts_set((FTS*)ftsp, (FTSENT*)f, instr);
+  return __libc_fts64_set(ftsp, f, instr);
+}
+
+int fts64_close(FTS64 *ftsp) {
+  MAP(fts64_close, int (*)(FTS64*));
+  if (walk_fts_owns((FTS*)ftsp)) return walk_fts_close((FTS*)ftsp);
+  return __libc_fts64_close(ftsp);
+}
+
+
 #ifdef __cplusplus
 #endif
 }
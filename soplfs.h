@@ -0,0 +1,55 @@
+#ifndef SOPLFS_H
+#define SOPLFS_H
+
+#include <sys/types.h>
+
+
+/*
+ * List I/O on PLFS descriptors (soplfs_lio.cpp)
+ *
+ * For programs that link libsoplfs.so, or run under it and find these
+ * with dlsym, and move many non-contiguous pieces of a file at once.
+ * One call reads or writes a whole list of (offset, len, buf) segments
+ * of a descriptor opened on a PLFS mount: runs of adjacent segments
+ * become one plfs_read or plfs_write (up to the mount's aio_coalesce)
+ * and the runs are spread over the aio worker threads, instead of one
+ * interposed call per piece.  The descriptor's file position is neither
+ * used nor moved.  Segments of one write list that overlap land in no
+ * particular order.
+ *
+ * The calls return the bytes moved over all segments, short only where
+ * a read reached the end of the file, or -1 with errno set from the
+ * first segment that failed.  A descriptor that is not a PLFS file, or
+ * not open for the direction asked, gives EBADF.
+ *
+ * The _start variants return at once; the buffers have to stay until
+ * soplfs_lio_wait() has returned, the segment array does not.
+ */
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+struct soplfs_seg {
+  off_t offset;
+  size_t len;
+  void *buf;
+};
+
+typedef struct soplfs_lio soplfs_lio;   /* a list in flight */
+
+ssize_t soplfs_read_list(int fd, const struct soplfs_seg *segs, int nsegs);
+ssize_t soplfs_write_list(int fd, const struct soplfs_seg *segs, int nsegs);
+
+/* NULL and errno set when the list could not be started */
+soplfs_lio* soplfs_read_list_start(int fd, const struct soplfs_seg *segs, int nsegs);
+soplfs_lio* soplfs_write_list_start(int fd, const struct soplfs_seg *segs, int nsegs);
+
+int soplfs_lio_test(soplfs_lio *lio);       /* 1 once every segment is done */
+ssize_t soplfs_lio_wait(soplfs_lio *lio);   /* the result as above; frees lio */
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,363 @@
+#include "soplfs_internal.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <signal.h>
+#include <sched.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <errno.h>
+
+#include <string>
+
+
+/*
+ * Node-wide attribute cache
+ *
+ * plfs_getattr results for paths, kept in a /dev/shm segment that every
+ * soplfs process of the same user and job on the node maps, so a path
+ * stat'ed by 64 ranks costs one backend call per TTL.  The mount's
+ * attr_ttl (ms) sets how long an entry is good for; 0, the default,
+ * leaves the mount out.  Missing files are cached too.
+ *
+ * The segment is a table of ACACHE_SLOTS entries; a path hashes to a run
+ * of ACACHE_PROBE of them.  Each entry is a seqlock: readers copy it and
+ * retry when its sequence changed under them, writers take it by moving
+ * the sequence to odd with a compare-and-swap and skip the entry when
+ * another writer has it.  A process that changes a path (write, create,
+ * rename, unlink, ...) expires the path and its parent directory in the
+ * shared table, so every process sees the change on its next stat; a
+ * write expires only the file.
+ *
+ * Expiring must not lose to a process storing a getattr it took before
+ * the change.  The path's home slot has a generation that an expire
+ * bumps; acache_get hands it out on a miss, and acache_put stores only
+ * if it is unchanged (and checks again before releasing the entry).  An
+ * expire that finds the entry taken waits for its writer to let go.  A
+ * writer killed while it held the entry would keep it odd for good, so
+ * an entry whose sequence has not moved for ACACHE_STALE_NS is taken
+ * over by the expire and emptied; the release is a compare-and-swap, so
+ * a writer that was only slow finds the entry gone from under it and
+ * leaves the sequence alone.
+ *
+ * The segment records the pids attached to it; the last one to leave
+ * removes it, so it does not outlive the job on the node.
+ */
+
+#define ACACHE_MAGIC "SOPLFSAC"
+#define ACACHE_VERSION 2
+#define ACACHE_SLOTS 16384
+#define ACACHE_PROBE 8
+#define ACACHE_PATH_MAX 256   // longer paths are not cached
+#define ACACHE_READ_TRIES 4
+#define ACACHE_STALE_NS 20000000LL   // a writer that holds on longer is dead
+
+struct acache_entry {
+  unsigned seq;                  // odd while a writer has the entry
+  unsigned error;                // plfs_error_t of the getattr
+  unsigned long long hash;       // 0: empty
+  long long expires;             // CLOCK_MONOTONIC ns
+  struct stat st;
+  char path[ACACHE_PATH_MAX];
+};
+
+struct acache_header {
+  char magic[8];
+  unsigned version;
+  unsigned slots;
+  char pad[48];
+  shm_users users;
+};
+
+static pthread_once_t acache_once = PTHREAD_ONCE_INIT;
+static acache_header *acache_head = NULL;
+static acache_entry *acache_table = NULL;   // NULL: no segment
+static unsigned *acache_gens = NULL;         // [ACACHE_SLOTS], after the table
+static std::string acache_name SOPLFS_GLOBAL;
+
+
+static size_t acache_size() {
+  return sizeof(acache_header) + ACACHE_SLOTS * (sizeof(acache_entry) + sizeof(unsigned));
+}
+
+// the job's processes on the node share segments; jobs and users do not
+std::string shm_job_segment(const char *kind) {
+  const char *vars[] = { "SOPLFS_JOB", "SLURM_JOB_ID", "PBS_JOBID", "LSB_JOBID", NULL };
+  const char *job = "0";
+  for (int i = 0; vars[i] != NULL; i++) {
+    const char *v = getenv(vars[i]);
+    if (v != NULL && *v != '\0') {
+      job = v;
+      break;
+    }
+  }
+
+  char buf[128];
+  snprintf(buf, sizeof(buf), "/soplfs-%s.%u.", kind, (unsigned)getuid());
+  std::string name = buf;
+  for (const char *c = job; *c && name.size() < 200; c++) name += *c == '/' ? '_' : *c;
+  return name;
+}
+
+// takes a free slot of the segment's pid table (or the one an exec'ed
+// image of this process already has); a full table just leaves us out
+void shm_job_attach(shm_users *u) {
+  int pid = getpid();
+  for (int i = 0; i < SHM_USERS; i++) {
+    if (__atomic_load_n(&u->pid[i], __ATOMIC_RELAXED) == pid) return;
+  }
+  for (int i = 0; i < SHM_USERS; i++) {
+    if (__sync_bool_compare_and_swap(&u->pid[i], 0, pid)) return;
+  }
+}
+
+// gives up our slot; removes the segment when no live process has one.
+// Processes that die without detaching count as gone
+void shm_job_detach(shm_users *u, const std::string &name) {
+  int pid = getpid();
+  for (int i = 0; i < SHM_USERS; i++) {
+    __sync_bool_compare_and_swap(&u->pid[i], pid, 0);
+  }
+  for (int i = 0; i < SHM_USERS; i++) {
+    int other = __atomic_load_n(&u->pid[i], __ATOMIC_RELAXED);
+    if (other != 0 && (kill(other, 0) == 0 || errno == EPERM)) return;
+  }
+  shm_unlink(name.c_str());
+}
+
+static void acache_exit() {
+  shm_job_detach(&acache_head->users, acache_name);
+}
+
+// a forked child uses the segment too
+static void acache_fork_child() {
+  shm_job_attach(&acache_head->users);
+}
+
+static void acache_do_init() {
+  soplfs_init();   // for the tuning
+  int wanted = 0;
+  for (size_t m = 0; m < mount_points.size(); m++) {
+    if (mount_tuning(m).attr_ttl > 0) wanted = 1;
+  }
+  if (!wanted) return;
+
+  std::string name = shm_job_segment("attr");
+  int fd = shm_open(name.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+  if (fd < 0) {
+    std::cerr << "soplfs: cannot open /dev/shm" << name
+              << ", attribute cache off" << std::endl;
+    return;
+  }
+
+  // whoever comes first sizes it; a zeroed table is an empty one
+  struct stat st;
+  void *p = MAP_FAILED;
+  if (__libc_fstat(fd, &st) == 0 &&
+      (st.st_size == (off_t)acache_size() || ftruncate(fd, acache_size()) == 0)) {
+    p = __libc_mmap(NULL, acache_size(), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  }
+  __libc_close(fd);
+  if (p == MAP_FAILED) return;
+
+  acache_header *h = (acache_header*)p;
+  if (h->version == 0) {
+    // racing initializers write the same bytes
+    memcpy(h->magic, ACACHE_MAGIC, 8);
+    h->slots = ACACHE_SLOTS;
+    __atomic_store_n(&h->version, ACACHE_VERSION, __ATOMIC_RELEASE);
+  }
+  if (memcmp(h->magic, ACACHE_MAGIC, 8) != 0 ||
+      __atomic_load_n(&h->version, __ATOMIC_ACQUIRE) != ACACHE_VERSION ||
+      h->slots != ACACHE_SLOTS) {
+    std::cerr << "soplfs: /dev/shm" << name
+              << " belongs to another soplfs version, attribute cache off" << std::endl;
+    __libc_munmap(p, acache_size());
+    return;
+  }
+  acache_head = h;
+  acache_table = (acache_entry*)(h + 1);
+  acache_gens = (unsigned*)(acache_table + ACACHE_SLOTS);
+  acache_name = name;
+  shm_job_attach(&h->users);
+  atexit(acache_exit);
+  pthread_atfork(NULL, NULL, acache_fork_child);
+}
+
+static long long acache_now() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static unsigned long long acache_hash(const char *path) {
+  unsigned long long h = 14695981039346656037ULL;   // FNV-1a
+  for (const unsigned char *c = (const unsigned char*)path; *c; c++) {
+    h = (h ^ *c) * 1099511628211ULL;
+  }
+  return h ? h : 1;
+}
+
+// the table, or NULL when the path is not cached
+static acache_entry* acache_for(const char *path, int mount) {
+  if (mount < 0 || mount_tuning(mount).attr_ttl <= 0) return NULL;
+  if (strlen(path) >= ACACHE_PATH_MAX) return NULL;
+  pthread_once(&acache_once, acache_do_init);
+  return acache_table;
+}
+
+// on a miss, *gen is what to hand acache_put with the getattr taken next
+int acache_get(const char *path, int mount, struct stat *st, plfs_error_t *err,
+               unsigned *gen) {
+  acache_entry *table = acache_for(path, mount);
+  if (table == NULL) return 0;
+
+  unsigned long long hash = acache_hash(path);
+  if (gen) *gen = __atomic_load_n(&acache_gens[hash % ACACHE_SLOTS], __ATOMIC_ACQUIRE);
+  long long now = acache_now();
+  for (int i = 0; i < ACACHE_PROBE; i++) {
+    acache_entry *e = &table[(hash + i) % ACACHE_SLOTS];
+    for (int tries = 0; tries < ACACHE_READ_TRIES; tries++) {
+      unsigned seq = __atomic_load_n(&e->seq, __ATOMIC_ACQUIRE);
+      if (seq & 1) continue;
+      if (e->hash != hash) break;
+
+      acache_entry copy;
+      memcpy(&copy, e, sizeof(copy));
+      __atomic_thread_fence(__ATOMIC_ACQUIRE);
+      if (__atomic_load_n(&e->seq, __ATOMIC_RELAXED) != seq) continue;
+
+      if (copy.hash != hash || strncmp(copy.path, path, ACACHE_PATH_MAX) != 0) break;
+      if (copy.expires <= now) {
+        stats_event(STATS_EV_ATTR_MISS, 1);
+        return 0;
+      }
+      *st = copy.st;
+      *err = (plfs_error_t)copy.error;
+      stats_event(STATS_EV_ATTR_HIT, 1);
+      return 1;
+    }
+  }
+  stats_event(STATS_EV_ATTR_MISS, 1);
+  return 0;
+}
+
+// takes e when no one else has it; returns the sequence to release with
+static int acache_lock(acache_entry *e, unsigned *seq) {
+  *seq = __atomic_load_n(&e->seq, __ATOMIC_RELAXED);
+  if (*seq & 1) return 0;
+  return __sync_bool_compare_and_swap(&e->seq, *seq, *seq + 1);
+}
+
+// a no-op when an expire took the entry over meanwhile
+static void acache_unlock(acache_entry *e, unsigned seq) {
+  __sync_bool_compare_and_swap(&e->seq, seq + 1, seq + 2);
+}
+
+// acache_lock, waiting out a writer that has it; a writer that has not
+// moved the sequence for ACACHE_STALE_NS is taken to be dead
+static void acache_lock_wait(acache_entry *e, unsigned *seq) {
+  unsigned held = 0;
+  long long since = 0;
+  for (int spins = 0; !acache_lock(e, seq); spins++) {
+    if (*seq != held || !(*seq & 1)) {
+      held = *seq;
+      since = 0;
+      spins = 0;
+    } else if ((spins & 63) == 0) {
+      long long now = acache_now();
+      if (since == 0) {
+        since = now;
+      } else if (now - since > ACACHE_STALE_NS) {
+        // keep it odd and ours: held + 2, released as held + 3
+        if (__sync_bool_compare_and_swap(&e->seq, held, held + 2)) {
+          e->hash = 0;
+          *seq = held + 1;
+          return;
+        }
+      }
+    }
+    sched_yield();
+  }
+}
+
+void acache_put(const char *path, int mount, const struct stat *st, plfs_error_t err,
+                unsigned gen) {
+  if (err != PLFS_SUCCESS && err != PLFS_ENOENT) return;
+  acache_entry *table = acache_for(path, mount);
+  if (table == NULL) return;
+
+  // the path's own entry, else a free or expired one, else the one
+  // closest to expiring
+  unsigned long long hash = acache_hash(path);
+  unsigned *path_gen = &acache_gens[hash % ACACHE_SLOTS];
+  long long now = acache_now();
+  acache_entry *victim = NULL;
+  for (int i = 0; i < ACACHE_PROBE; i++) {
+    acache_entry *e = &table[(hash + i) % ACACHE_SLOTS];
+    if (e->hash == hash && strncmp(e->path, path, ACACHE_PATH_MAX) == 0) {
+      victim = e;
+      break;
+    }
+    if (victim == NULL || (victim->expires > now && e->expires < victim->expires)) {
+      victim = e;
+    }
+  }
+
+  unsigned seq;
+  if (!acache_lock(victim, &seq)) return;   // busy: someone else is caching
+  if (__atomic_load_n(path_gen, __ATOMIC_SEQ_CST) != gen) {
+    acache_unlock(victim, seq);   // changed since the getattr started
+    return;
+  }
+  victim->hash = hash;
+  strncpy(victim->path, path, ACACHE_PATH_MAX);
+  victim->st = *st;
+  victim->error = err;
+  victim->expires = now + mount_tuning(mount).attr_ttl * 1000000LL;
+  // an expire that came in meanwhile may have given up on the entry
+  if (__atomic_load_n(path_gen, __ATOMIC_SEQ_CST) != gen) victim->expires = 0;
+  acache_unlock(victim, seq);
+}
+
+static void acache_expire(acache_entry *table, const char *path) {
+  unsigned long long hash = acache_hash(path);
+  __atomic_add_fetch(&acache_gens[hash % ACACHE_SLOTS], 1, __ATOMIC_SEQ_CST);
+  for (int i = 0; i < ACACHE_PROBE; i++) {
+    acache_entry *e = &table[(hash + i) % ACACHE_SLOTS];
+    if (e->hash != hash) continue;
+
+    // a writer that has it may be storing an older getattr: wait for it
+    unsigned seq;
+    acache_lock_wait(e, &seq);
+    if (strncmp(e->path, path, ACACHE_PATH_MAX) == 0) e->expires = 0;
+    acache_unlock(e, seq);
+  }
+}
+
+// the file's data changed: its size and times, not its directory's
+void acache_written(const char *path, int mount) {
+  acache_entry *table = acache_for(path, mount);
+  if (table == NULL) return;
+  acache_expire(table, path);
+}
+
+void acache_changed(const char *path) {
+  if (path == NULL) return;
+  acache_entry *table = acache_for(path, plfs_mount_of(path));
+  if (table == NULL) return;
+
+  acache_expire(table, path);
+  std::string dir = path;
+  size_t slash = dir.find_last_of('/');
+  if (slash != std::string::npos && slash > 0) {
+    dir.resize(slash);
+    acache_expire(table, dir.c_str());
+  }
+}
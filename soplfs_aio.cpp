@@ -0,0 +1,713 @@
+#define _LARGEFILE64_SOURCE
+#include "soplfs_internal.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/syscall.h>
+
+#include <list>
+#include <algorithm>
+
+
+/*
+ * POSIX AIO on PLFS descriptors
+ *
+ * Requests are queued as jobs for a pool of aio_threads workers
+ * that call plfs_read/plfs_file_write/sync_commit.  A job normally holds
+ * one aiocb; lio_listio sorts its PLFS entries per handle and opcode and
+ * merges runs of adjacent ranges (up to the mount's aio_coalesce) into
+ * one job, so a list of small strided pieces becomes a few large backend
+ * calls.  aiocbs on other descriptors are left to libc.
+ *
+ * The status of our aiocbs lives in paio_reqs until aio_return, or until
+ * the aiocb is handed to libc for another descriptor.  Closing a handle
+ * waits for its requests first: the workers use it.
+ */
+
+enum { PAIO_QUEUED, PAIO_RUNNING, PAIO_DONE };
+
+struct paio_list {
+  int pending;
+  int wait;               // LIO_WAIT: the submitter frees the list
+  struct sigevent sev;
+};
+
+struct paio_req {
+  struct aiocb *cb;
+  plfs_file *pf;
+  int op;                 // LIO_READ, LIO_WRITE or LIO_NOP for fsync
+  int state;
+  int error;
+  ssize_t ret;
+  unsigned long seq;
+  struct sigevent sev;
+  paio_list *list;
+};
+
+struct paio_job {
+  plfs_file *pf;
+  int op;
+  off_t offset;
+  size_t len;
+  std::vector<paio_req*> reqs;
+  // a LIO_NOWAIT list's entries on non-PLFS descriptors
+  std::vector<struct aiocb*> libc_list;
+  paio_list *list;
+};
+
+static pthread_once_t paio_once = PTHREAD_ONCE_INIT;
+static pthread_mutex_t paio_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t paio_work = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t paio_done = PTHREAD_COND_INITIALIZER;
+static std::list<paio_job*> paio_queue SOPLFS_GLOBAL;
+static std::map<const struct aiocb*, paio_req*> paio_reqs SOPLFS_GLOBAL;
+static unsigned long paio_seq = 0;
+
+
+
+struct paio_thread_arg {
+  void (*func)(union sigval);
+  union sigval value;
+};
+
+static void* paio_notify_thread(void *p) {
+  paio_thread_arg *arg = (paio_thread_arg*)p;
+  arg->func(arg->value);
+  delete arg;
+  return NULL;
+}
+
+static void paio_notify(const struct sigevent *sev) {
+  if (sev->sigev_notify == SIGEV_SIGNAL) {
+    // as glibc's aio: handlers tell completions apart by SI_ASYNCIO
+    siginfo_t info;
+    memset(&info, 0, sizeof(info));
+    info.si_signo = sev->sigev_signo;
+    info.si_code = SI_ASYNCIO;
+    info.si_pid = getpid();
+    info.si_uid = getuid();
+    info.si_value = sev->sigev_value;
+    syscall(SYS_rt_sigqueueinfo, info.si_pid, info.si_signo, &info);
+  } else if (sev->sigev_notify == SIGEV_THREAD) {
+    paio_thread_arg *arg = new paio_thread_arg();
+    arg->func = sev->sigev_notify_function;
+    arg->value = sev->sigev_value;
+
+    // the attributes are the application's: detached afterwards, not
+    // through them
+    const pthread_attr_t *attrp = (const pthread_attr_t*)sev->sigev_notify_attributes;
+    int detached = 0;
+    if (attrp != NULL) pthread_attr_getdetachstate(attrp, &detached);
+
+    pthread_t tid;
+    if (pthread_create(&tid, attrp, paio_notify_thread, arg) != 0) {
+      delete arg;
+    } else if (detached != PTHREAD_CREATE_DETACHED) {
+      pthread_detach(tid);
+    }
+  }
+}
+
+// called with paio_lock held
+static void paio_complete(paio_req *req, int error, ssize_t ret,
+                          std::vector<struct sigevent> &notify) {
+  req->state = PAIO_DONE;
+  req->error = error;
+  req->ret = error ? -1 : ret;
+  if (req->sev.sigev_notify != SIGEV_NONE) notify.push_back(req->sev);
+
+  paio_list *list = req->list;
+  req->list = NULL;
+  if (list != NULL && --list->pending == 0 && !list->wait) {
+    if (list->sev.sigev_notify != SIGEV_NONE) notify.push_back(list->sev);
+    delete list;
+  }
+}
+
+// an fsync covers every request on the handle that was queued before it
+static int paio_earlier_pending(paio_req *req) {
+  for (std::map<const struct aiocb*, paio_req*>::iterator itr = paio_reqs.begin();
+       itr != paio_reqs.end(); itr++) {
+    paio_req *r = itr->second;
+    if (r->pf == req->pf && r->seq < req->seq && r->state != PAIO_DONE) return 1;
+  }
+  return 0;
+}
+
+static ssize_t paio_read(plfs_file *pf, char *buf, size_t count, off_t offset, int *error) {
+  ssize_t ret = 0;
+  plfs_retry retry(pf->mount);
+  plfs_error_t plfs_error = PLFS_EAGAIN;
+  while (retry.again(plfs_error)) {
+    plfs_error = plfs_read(pf->fd, buf, count, offset, &ret);
+  }
+  *error = plfs_error == PLFS_SUCCESS ? 0 : plfs_error_to_errno(plfs_error);
+  return ret;
+}
+
+static void paio_run(paio_job *job, std::vector<struct sigevent> &notify) {
+  if (!job->libc_list.empty()) {
+    __libc_lio_listio(LIO_WAIT, &job->libc_list[0], job->libc_list.size(), NULL);
+
+    pthread_mutex_lock(&paio_lock);
+    paio_list *list = job->list;
+    if (--list->pending == 0 && !list->wait) {
+      if (list->sev.sigev_notify != SIGEV_NONE) notify.push_back(list->sev);
+      delete list;
+    }
+    pthread_cond_broadcast(&paio_done);
+    pthread_mutex_unlock(&paio_lock);
+    return;
+  }
+
+  int error = 0;
+  ssize_t ret = 0;
+
+  if (job->op == LIO_NOP) {
+    paio_req *req = job->reqs[0];
+    pthread_mutex_lock(&paio_lock);
+    while (paio_earlier_pending(req)) {
+      pthread_cond_wait(&paio_done, &paio_lock);
+    }
+    pthread_mutex_unlock(&paio_lock);
+
+    plfs_error_t plfs_error = sync_commit(job->pf->sg, job->pf);
+    if (plfs_error != PLFS_SUCCESS) error = plfs_error_to_errno(plfs_error);
+
+  } else if (job->reqs.size() == 1) {
+    struct aiocb *cb = job->reqs[0]->cb;
+    if (job->op == LIO_READ) {
+      plfs_file_settle(job->pf);
+      ret = paio_read(job->pf, (char*)cb->aio_buf, cb->aio_nbytes, cb->aio_offset, &error);
+    } else {
+      plfs_error_t plfs_error = plfs_file_write(job->pf, (const char*)cb->aio_buf,
+                                                cb->aio_nbytes, cb->aio_offset, &ret);
+      if (plfs_error != PLFS_SUCCESS) error = plfs_error_to_errno(plfs_error);
+    }
+
+  } else {
+    // merged run of adjacent aiocbs: one backend call through a bounce buffer
+    char *buf = (char*)malloc(job->len);
+    if (buf == NULL) {
+      error = ENOMEM;
+    } else if (job->op == LIO_READ) {
+      plfs_file_settle(job->pf);
+      ret = paio_read(job->pf, buf, job->len, job->offset, &error);
+      for (size_t i = 0; !error && i < job->reqs.size(); i++) {
+        struct aiocb *cb = job->reqs[i]->cb;
+        off_t at = cb->aio_offset - job->offset;
+        ssize_t n = std::max((ssize_t)0, std::min((ssize_t)cb->aio_nbytes, ret - (ssize_t)at));
+        memcpy((void*)cb->aio_buf, buf + at, n);
+      }
+    } else {
+      for (size_t i = 0; i < job->reqs.size(); i++) {
+        struct aiocb *cb = job->reqs[i]->cb;
+        memcpy(buf + (cb->aio_offset - job->offset), (const void*)cb->aio_buf, cb->aio_nbytes);
+      }
+      plfs_error_t plfs_error = plfs_file_write(job->pf, buf, job->len, job->offset, &ret);
+      if (plfs_error != PLFS_SUCCESS) error = plfs_error_to_errno(plfs_error);
+    }
+    free(buf);
+  }
+
+  pthread_mutex_lock(&paio_lock);
+  for (size_t i = 0; i < job->reqs.size(); i++) {
+    paio_req *req = job->reqs[i];
+    ssize_t n = ret;
+    if (job->reqs.size() > 1) {
+      off_t at = req->cb->aio_offset - job->offset;
+      n = std::max((ssize_t)0, std::min((ssize_t)req->cb->aio_nbytes, ret - (ssize_t)at));
+    }
+    paio_complete(req, error, n, notify);
+  }
+  pthread_cond_broadcast(&paio_done);
+  pthread_mutex_unlock(&paio_lock);
+}
+
+static void* paio_worker_main(void *) {
+  std::vector<struct sigevent> notify;
+
+  pthread_mutex_lock(&paio_lock);
+  while (1) {
+    if (paio_queue.empty()) {
+      pthread_cond_wait(&paio_work, &paio_lock);
+      continue;
+    }
+
+    paio_job *job = paio_queue.front();
+    paio_queue.pop_front();
+    for (size_t i = 0; i < job->reqs.size(); i++) {
+      job->reqs[i]->state = PAIO_RUNNING;
+    }
+    pthread_mutex_unlock(&paio_lock);
+
+    paio_run(job, notify);
+    delete job;
+
+    for (size_t i = 0; i < notify.size(); i++) {
+      paio_notify(&notify[i]);
+    }
+    notify.clear();
+
+    pthread_mutex_lock(&paio_lock);
+  }
+
+  pthread_mutex_unlock(&paio_lock);
+  return NULL;
+}
+
+static void paio_start_workers() {
+  int paio_threads = std::max(1, mount_tuning(-1).aio_threads);
+
+  pthread_attr_t attr;
+  pthread_attr_init(&attr);
+  pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+  for (int i = 0; i < paio_threads; i++) {
+    pthread_t tid;
+    if (pthread_create(&tid, &attr, paio_worker_main, NULL) != 0) {
+      std::cerr << "soplfs: cannot start aio worker" << std::endl;
+      break;
+    }
+  }
+  pthread_attr_destroy(&attr);
+}
+
+// the parent's requests are not the child's (POSIX: a child inherits no
+// asynchronous I/O); the workers did not come along
+static void paio_fork_child() {
+  pthread_mutex_init(&paio_lock, NULL);
+  pthread_cond_init(&paio_work, NULL);
+  pthread_cond_init(&paio_done, NULL);
+  paio_queue.clear();
+  for (std::map<const struct aiocb*, paio_req*>::iterator itr = paio_reqs.begin();
+       itr != paio_reqs.end(); itr++) {
+    paio_req *req = itr->second;
+    if (req->state == PAIO_DONE) continue;
+    req->state = PAIO_DONE;
+    req->error = ECANCELED;
+    req->ret = -1;
+    req->list = NULL;
+  }
+  paio_start_workers();
+}
+
+static void paio_do_init() {
+  pthread_atfork(NULL, NULL, paio_fork_child);
+  paio_start_workers();
+}
+
+// called with paio_lock held
+static paio_req* paio_track(struct aiocb *cb, plfs_file *pf, int op) {
+  std::map<const struct aiocb*, paio_req*>::iterator itr = paio_reqs.find(cb);
+  if (itr != paio_reqs.end()) {
+    if (itr->second->state != PAIO_DONE) return NULL;   // aiocb still in use
+    delete itr->second;
+    paio_reqs.erase(itr);
+  }
+
+  paio_req *req = new paio_req();
+  req->cb = cb;
+  req->pf = pf;
+  req->op = op;
+  req->state = PAIO_QUEUED;
+  req->error = EINPROGRESS;
+  req->ret = 0;
+  req->seq = paio_seq++;
+  req->sev = cb->aio_sigevent;
+  req->list = NULL;
+  paio_reqs[cb] = req;
+
+  return req;
+}
+
+// called with paio_lock held: a finished aiocb that is reused on another
+// descriptor is libc's again
+static void paio_forget_locked(const struct aiocb *cb) {
+  std::map<const struct aiocb*, paio_req*>::iterator itr = paio_reqs.find(cb);
+  if (itr != paio_reqs.end() && itr->second->state == PAIO_DONE) {
+    delete itr->second;
+    paio_reqs.erase(itr);
+  }
+}
+
+void paio_forget(const struct aiocb *cb) {
+  pthread_mutex_lock(&paio_lock);
+  paio_forget_locked(cb);
+  pthread_mutex_unlock(&paio_lock);
+}
+
+int paio_submit(plfs_file *pf, struct aiocb *cb, int op) {
+  pthread_once(&paio_once, paio_do_init);
+
+  pthread_mutex_lock(&paio_lock);
+  paio_req *req = paio_track(cb, pf, op);
+  if (req == NULL) {
+    pthread_mutex_unlock(&paio_lock);
+    errno = EAGAIN;
+    return -1;
+  }
+
+  paio_job *job = new paio_job();
+  job->pf = pf;
+  job->op = op;
+  job->offset = cb->aio_offset;
+  job->len = cb->aio_nbytes;
+  job->list = NULL;
+  job->reqs.push_back(req);
+
+  paio_queue.push_back(job);
+  pthread_cond_signal(&paio_work);
+  pthread_mutex_unlock(&paio_lock);
+
+  return 0;
+}
+
+static bool paio_req_before(const paio_req *a, const paio_req *b) {
+  if (a->pf != b->pf) return a->pf < b->pf;
+  if (a->op != b->op) return a->op < b->op;
+  if (a->cb->aio_offset != b->cb->aio_offset) return a->cb->aio_offset < b->cb->aio_offset;
+  return a->seq < b->seq;
+}
+
+// called with paio_lock held: merges adjacent ranges of the same handle
+// and opcode into one job
+static void paio_queue_merged(std::vector<paio_req*> &reqs) {
+  std::sort(reqs.begin(), reqs.end(), paio_req_before);
+  paio_job *job = NULL;
+  for (size_t i = 0; i < reqs.size(); i++) {
+    paio_req *req = reqs[i];
+    if (job != NULL && job->pf == req->pf && job->op == req->op &&
+        job->offset + (off_t)job->len == req->cb->aio_offset &&
+        job->len + req->cb->aio_nbytes <= mount_tuning(req->pf->mount).aio_coalesce) {
+      job->len += req->cb->aio_nbytes;
+      job->reqs.push_back(req);
+      continue;
+    }
+
+    job = new paio_job();
+    job->pf = req->pf;
+    job->op = req->op;
+    job->offset = req->cb->aio_offset;
+    job->len = req->cb->aio_nbytes;
+    job->list = NULL;
+    job->reqs.push_back(req);
+    paio_queue.push_back(job);
+  }
+}
+
+int paio_listio(int mode, struct aiocb *const list[], int nent, struct sigevent *sevp) {
+  pthread_once(&paio_once, paio_do_init);
+
+  if (mode != LIO_WAIT && mode != LIO_NOWAIT) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  std::vector<struct aiocb*> libc_list;
+  std::vector<paio_req*> reqs;
+  int refused = 0;
+
+  paio_list *pl = new paio_list();
+  pl->pending = 0;
+  pl->wait = (mode == LIO_WAIT);
+  memset(&pl->sev, 0, sizeof(pl->sev));
+  pl->sev.sigev_notify = SIGEV_NONE;
+  if (mode == LIO_NOWAIT && sevp != NULL) pl->sev = *sevp;
+
+  pthread_mutex_lock(&paio_lock);
+  for (int i = 0; i < nent; i++) {
+    struct aiocb *cb = list[i];
+    if (cb == NULL || cb->aio_lio_opcode == LIO_NOP) continue;
+
+    std::map<int, plfs_file*>::iterator itr = plfs_files.find(cb->aio_fildes);
+    if (itr == plfs_files.end()) {
+      libc_list.push_back(cb);
+      continue;
+    }
+
+    paio_req *req = paio_track(cb, itr->second, cb->aio_lio_opcode);
+    if (req == NULL) {   // aiocb still in use: that entry fails
+      refused++;
+      continue;
+    }
+    req->list = pl;
+    pl->pending++;
+    reqs.push_back(req);
+  }
+  for (size_t i = 0; i < libc_list.size(); i++) {
+    paio_forget_locked(libc_list[i]);
+  }
+
+  paio_queue_merged(reqs);
+
+  if (!libc_list.empty() && mode == LIO_NOWAIT && pl->sev.sigev_notify != SIGEV_NONE) {
+    // the list signal has to wait for libc's part too
+    paio_job *job = new paio_job();
+    job->pf = NULL;
+    job->op = LIO_NOP;
+    job->offset = 0;
+    job->len = 0;
+    job->libc_list = libc_list;
+    job->list = pl;
+    pl->pending++;
+    paio_queue.push_back(job);
+    libc_list.clear();
+  }
+
+  int empty = (pl->pending == 0);
+  pthread_cond_broadcast(&paio_work);
+  pthread_mutex_unlock(&paio_lock);
+
+  int ret = 0;
+  if (!libc_list.empty()) {
+    ret = __libc_lio_listio(mode, &libc_list[0], libc_list.size(), NULL);
+  }
+
+  if (mode == LIO_WAIT) {
+    pthread_mutex_lock(&paio_lock);
+    while (pl->pending > 0) {
+      pthread_cond_wait(&paio_done, &paio_lock);
+    }
+    for (size_t i = 0; i < reqs.size(); i++) {
+      if (reqs[i]->error != 0) {
+        errno = EIO;
+        ret = -1;
+      }
+    }
+    pthread_mutex_unlock(&paio_lock);
+    delete pl;
+  } else if (empty) {
+    if (pl->sev.sigev_notify != SIGEV_NONE) paio_notify(&pl->sev);
+    delete pl;
+  }
+
+  if (refused && ret == 0) {
+    errno = (mode == LIO_WAIT) ? EIO : EAGAIN;
+    ret = -1;
+  }
+  return ret;
+}
+
+// a list of aiocbs on PLFS descriptors that the caller waits for with
+// paio_list_wait and then collects with paio_return
+paio_list* paio_list_start(struct aiocb *const list[], int nent) {
+  pthread_once(&paio_once, paio_do_init);
+
+  paio_list *pl = new paio_list();
+  pl->pending = 0;
+  pl->wait = 1;
+  memset(&pl->sev, 0, sizeof(pl->sev));
+  pl->sev.sigev_notify = SIGEV_NONE;
+
+  std::vector<paio_req*> reqs;
+  pthread_mutex_lock(&paio_lock);
+  for (int i = 0; i < nent; i++) {
+    struct aiocb *cb = list[i];
+    if (cb == NULL) continue;
+    std::map<int, plfs_file*>::iterator itr = plfs_files.find(cb->aio_fildes);
+    if (itr == plfs_files.end()) continue;
+
+    paio_req *req = paio_track(cb, itr->second, cb->aio_lio_opcode);
+    if (req == NULL) continue;
+    req->list = pl;
+    pl->pending++;
+    reqs.push_back(req);
+  }
+  paio_queue_merged(reqs);
+  pthread_cond_broadcast(&paio_work);
+  pthread_mutex_unlock(&paio_lock);
+
+  return pl;
+}
+
+int paio_list_done(paio_list *pl) {
+  pthread_mutex_lock(&paio_lock);
+  int ret = (pl->pending == 0);
+  pthread_mutex_unlock(&paio_lock);
+  return ret;
+}
+
+void paio_list_wait(paio_list *pl) {
+  pthread_mutex_lock(&paio_lock);
+  while (pl->pending > 0) {
+    pthread_cond_wait(&paio_done, &paio_lock);
+  }
+  pthread_mutex_unlock(&paio_lock);
+  delete pl;
+}
+
+int paio_owns(const struct aiocb *cb) {
+  pthread_mutex_lock(&paio_lock);
+  int ret = paio_reqs.find(cb) != paio_reqs.end();
+  pthread_mutex_unlock(&paio_lock);
+
+  return ret;
+}
+
+int paio_error(const struct aiocb *cb) {
+  int ret = EINVAL;
+
+  pthread_mutex_lock(&paio_lock);
+  std::map<const struct aiocb*, paio_req*>::iterator itr = paio_reqs.find(cb);
+  if (itr != paio_reqs.end()) {
+    ret = itr->second->state == PAIO_DONE ? itr->second->error : EINPROGRESS;
+  }
+  pthread_mutex_unlock(&paio_lock);
+
+  return ret;
+}
+
+ssize_t paio_return(struct aiocb *cb) {
+  ssize_t ret = -1;
+
+  pthread_mutex_lock(&paio_lock);
+  std::map<const struct aiocb*, paio_req*>::iterator itr = paio_reqs.find(cb);
+  if (itr == paio_reqs.end() || itr->second->state != PAIO_DONE) {
+    errno = EINVAL;
+  } else {
+    if (itr->second->error != 0) errno = itr->second->error;
+    ret = itr->second->ret;
+    delete itr->second;
+    paio_reqs.erase(itr);
+  }
+  pthread_mutex_unlock(&paio_lock);
+
+  return ret;
+}
+
+// called with paio_lock held
+static int paio_any_done(const struct aiocb *const list[], int nent,
+                         std::vector<const struct aiocb*> &others) {
+  others.clear();
+  for (int i = 0; i < nent; i++) {
+    if (list[i] == NULL) continue;
+
+    std::map<const struct aiocb*, paio_req*>::iterator itr = paio_reqs.find(list[i]);
+    if (itr == paio_reqs.end()) {
+      others.push_back(list[i]);
+    } else if (itr->second->state == PAIO_DONE) {
+      return 1;
+    }
+  }
+  return 0;
+}
+
+int paio_suspend(const struct aiocb *const list[], int nent,
+                 const struct timespec *timeout) {
+  struct timespec deadline;
+  if (timeout != NULL) {
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += timeout->tv_sec;
+    deadline.tv_nsec += timeout->tv_nsec;
+    if (deadline.tv_nsec >= 1000000000) {
+      deadline.tv_sec++;
+      deadline.tv_nsec -= 1000000000;
+    }
+  }
+
+  std::vector<const struct aiocb*> others;
+
+  pthread_mutex_lock(&paio_lock);
+  while (!paio_any_done(list, nent, others)) {
+    if (others.empty()) {
+      int rc = timeout ? pthread_cond_timedwait(&paio_done, &paio_lock, &deadline)
+                       : pthread_cond_wait(&paio_done, &paio_lock);
+      if (rc == ETIMEDOUT) {
+        pthread_mutex_unlock(&paio_lock);
+        errno = EAGAIN;
+        return -1;
+      }
+      continue;
+    }
+
+    // mixed list: poll libc's part between our completions
+    pthread_mutex_unlock(&paio_lock);
+    struct timespec slice = { 0, 1000000 };
+    if (__libc_aio_suspend(&others[0], others.size(), &slice) == 0) return 0;
+    if (errno != EAGAIN) return -1;
+
+    pthread_mutex_lock(&paio_lock);
+    if (timeout != NULL) {
+      struct timespec now;
+      clock_gettime(CLOCK_REALTIME, &now);
+      if (now.tv_sec > deadline.tv_sec ||
+          (now.tv_sec == deadline.tv_sec && now.tv_nsec >= deadline.tv_nsec)) {
+        pthread_mutex_unlock(&paio_lock);
+        errno = EAGAIN;
+        return -1;
+      }
+    }
+  }
+  pthread_mutex_unlock(&paio_lock);
+
+  return 0;
+}
+
+int paio_cancel(plfs_file *pf, struct aiocb *cb) {
+  int canceled = 0;
+  int running = 0;
+  std::vector<struct sigevent> notify;
+
+  pthread_mutex_lock(&paio_lock);
+  for (std::list<paio_job*>::iterator itr = paio_queue.begin(); itr != paio_queue.end(); ) {
+    paio_job *job = *itr;
+    int match = (job->pf == pf);
+    if (match && cb != NULL) {
+      match = (job->reqs.size() == 1 && job->reqs[0]->cb == cb);
+    }
+    if (!match) {
+      itr++;
+      continue;
+    }
+
+    for (size_t i = 0; i < job->reqs.size(); i++) {
+      paio_complete(job->reqs[i], ECANCELED, -1, notify);
+    }
+    canceled++;
+    itr = paio_queue.erase(itr);
+    delete job;
+  }
+
+  for (std::map<const struct aiocb*, paio_req*>::iterator itr = paio_reqs.begin();
+       itr != paio_reqs.end(); itr++) {
+    paio_req *req = itr->second;
+    if (req->pf == pf && (cb == NULL || req->cb == cb) && req->state != PAIO_DONE) {
+      running++;
+    }
+  }
+  pthread_cond_broadcast(&paio_done);
+  pthread_mutex_unlock(&paio_lock);
+
+  for (size_t i = 0; i < notify.size(); i++) {
+    paio_notify(&notify[i]);
+  }
+
+  if (running) return AIO_NOTCANCELED;
+  return canceled ? AIO_CANCELED : AIO_ALLDONE;
+}
+
+// the handle is about to be freed: let its requests finish, queued ones
+// included, and keep only their results
+void paio_close(plfs_file *pf) {
+  pthread_mutex_lock(&paio_lock);
+  int busy = 1;
+  while (busy) {
+    busy = 0;
+    for (std::map<const struct aiocb*, paio_req*>::iterator itr = paio_reqs.begin();
+         itr != paio_reqs.end() && !busy; itr++) {
+      busy = (itr->second->pf == pf && itr->second->state != PAIO_DONE);
+    }
+    if (busy) pthread_cond_wait(&paio_done, &paio_lock);
+  }
+  for (std::map<const struct aiocb*, paio_req*>::iterator itr = paio_reqs.begin();
+       itr != paio_reqs.end(); itr++) {
+    if (itr->second->pf == pf) itr->second->pf = NULL;
+  }
+  pthread_mutex_unlock(&paio_lock);
+}
@@ -0,0 +1,657 @@
+#define _LARGEFILE64_SOURCE
+#include "soplfs_internal.h"
+#include "soplfs_probes.h"
+
+#include <stdlib.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+
+#include <list>
+#include <sstream>
+#include <algorithm>
+
+
+/*
+ * Node-local burst-buffer write staging
+ *
+ * Every PLFS handle opened while SOPLFS_BB_DIR is set gets its own log in
+ * that directory.  A write appends one record (offset, length, data) to the
+ * log and returns.  A single drain thread reads the logs back in batches of
+ * SOPLFS_BB_BATCH bytes, merges records that are contiguous in the file
+ * and replays them into plfs_write in log order.
+ *
+ * SOPLFS_BB_CLOSE selects what close and fflush/fsync promise:
+ *   drain  - (default) wait until the log is replayed into PLFS
+ *   local  - the log is fdatasync'ed on local storage; the drain thread
+ *            finishes the replay and closes the PLFS handle later
+ *
+ * A log whose owner died is found by the next process that enables the
+ * mode (it is no longer flock'ed).  Its drain thread replays it before
+ * anything staged in that process; the replay is an open, a pwrite and a
+ * close in the stats, the trace and the probes.
+ */
+
+#define BB_LOG_MAGIC "SOPLFSBB"
+#define BB_LOG_VERSION 1
+#define BB_REC_MAGIC 0x4c424253U
+
+struct bb_header {
+  char magic[8];
+  uint32_t version;
+  uint32_t path_len;
+  int32_t flags;
+  uint32_t mode;
+  uint64_t drained;   // log offset replayed into PLFS so far
+};
+
+struct bb_record {
+  uint32_t magic;
+  uint32_t pad;
+  uint64_t offset;
+  uint64_t length;
+};
+
+struct bb_log {
+  Plfs_fd *fd;
+  int mount;        // for plfs_retry
+  std::string path;
+  std::string log_path;
+  int flags;
+  int log_fd;
+  off_t base;       // offset of the first record
+  off_t tail;       // end of appended records
+  off_t drained;    // end of records replayed into PLFS
+  int closing;      // owner is gone, drain thread closes the PLFS handle
+  plfs_error_t error;
+  pthread_mutex_t append;
+};
+
+enum { BB_CLOSE_DRAIN, BB_CLOSE_LOCAL };
+
+static pthread_once_t bb_once = PTHREAD_ONCE_INIT;
+static pthread_mutex_t bb_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t bb_work = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t bb_progress = PTHREAD_COND_INITIALIZER;
+static std::list<bb_log*> bb_logs SOPLFS_GLOBAL;
+static std::vector<std::string> bb_stale SOPLFS_GLOBAL;   // dead processes' logs, for the drain thread
+
+static std::string bb_dir SOPLFS_GLOBAL;
+static int bb_close_mode = BB_CLOSE_DRAIN;
+static size_t bb_batch = 64 * 1024 * 1024;
+static off_t bb_max = 0;          // 0: logs may grow without bound
+static unsigned long bb_seq = 0;
+
+
+static size_t bb_env_size(const char *name, size_t def) {
+  const char *v = getenv(name);
+  if (v == NULL || *v == '\0') return def;
+
+  char *end = NULL;
+  unsigned long long n = strtoull(v, &end, 10);
+  switch (*end) {
+    case 'k': case 'K': n <<= 10; break;
+    case 'm': case 'M': n <<= 20; break;
+    case 'g': case 'G': n <<= 30; break;
+  }
+  return n;
+}
+
+static plfs_error_t bb_replay(bb_log *log, const char *buf, size_t count, off_t offset) {
+  while (count > 0) {
+    ssize_t bytes = 0;
+    plfs_retry retry(log->mount);
+    plfs_error_t plfs_error = PLFS_EAGAIN;
+    while (retry.again(plfs_error)) {
+      plfs_error = PLFS_CALL(plfs_write(log->fd, buf, count, offset, getpid(), &bytes));
+    }
+    if (plfs_error != PLFS_SUCCESS) return plfs_error;
+    if (bytes <= 0) return PLFS_EIO;
+
+    buf += bytes;
+    count -= bytes;
+    offset += bytes;
+  }
+  return PLFS_SUCCESS;
+}
+
+/*
+ * Replay records in [from, to) of the log.  Returns the log offset up to
+ * which records were replayed; a torn record at the end of a crashed log
+ * stops the replay without an error.
+ */
+static off_t bb_drain(bb_log *log, off_t from, off_t to, char *buf, plfs_error_t *err) {
+  *err = PLFS_SUCCESS;
+
+  while (from < to) {
+    if (to - from < (off_t)sizeof(bb_record)) return to;   // torn record
+
+    size_t n = std::min((off_t)bb_batch, to - from);
+    ssize_t got = __libc_pread(log->log_fd, buf, n, from);
+    if (got < (ssize_t)sizeof(bb_record)) {
+      *err = PLFS_EIO;
+      return from;
+    }
+
+    char *p = buf;
+    char *end = buf + got;
+    char *run = NULL;
+    size_t run_len = 0;
+    off_t run_off = 0;
+
+    while (end - p >= (ssize_t)sizeof(bb_record)) {
+      bb_record rec;
+      memcpy(&rec, p, sizeof(rec));
+      if (rec.magic != BB_REC_MAGIC) {
+        *err = PLFS_EIO;
+        break;
+      }
+      char *data = p + sizeof(rec);
+      if ((uint64_t)(end - data) < rec.length) break;
+
+      // squeeze the record headers out so contiguous records form one write
+      if (run != NULL && run_off + (off_t)run_len == (off_t)rec.offset) {
+        memmove(run + run_len, data, rec.length);
+        run_len += rec.length;
+      } else {
+        if (run != NULL) {
+          *err = bb_replay(log, run, run_len, run_off);
+          if (*err != PLFS_SUCCESS) return from;
+        }
+        run = data;
+        run_off = rec.offset;
+        run_len = rec.length;
+      }
+      p = data + rec.length;
+    }
+
+    if (run != NULL) {
+      plfs_error_t plfs_error = bb_replay(log, run, run_len, run_off);
+      if (plfs_error != PLFS_SUCCESS) *err = plfs_error;
+    }
+    if (*err != PLFS_SUCCESS) return from;
+
+    if (p == buf) {
+      // a single record larger than the batch buffer
+      bb_record rec;
+      memcpy(&rec, p, sizeof(rec));
+      off_t data_off = from + sizeof(rec);
+      if (data_off + (off_t)rec.length > to) return to;   // torn record
+
+      char *big = (char*)malloc(rec.length);
+      if (big == NULL) {
+        *err = PLFS_ENOMEM;
+        return from;
+      }
+      if (__libc_pread(log->log_fd, big, rec.length, data_off) != (ssize_t)rec.length) {
+        *err = PLFS_EIO;
+      } else {
+        *err = bb_replay(log, big, rec.length, rec.offset);
+      }
+      free(big);
+      if (*err != PLFS_SUCCESS) return from;
+      p = buf + sizeof(rec) + rec.length;
+    }
+
+    from += p - buf;
+  }
+
+  return from;
+}
+
+static void bb_save_watermark(bb_log *log, off_t drained) {
+  uint64_t d = drained;
+  __libc_pwrite(log->log_fd, &d, sizeof(d), offsetof(bb_header, drained));
+}
+
+static void bb_free(bb_log *log) {
+  __libc_close(log->log_fd);
+  unlink(log->log_path.c_str());
+  pthread_mutex_destroy(&log->append);
+  delete log;
+}
+
+static void bb_recover(const std::string &log_path);
+
+static void* bb_drain_main(void *) {
+  // what dead processes staged goes in before what we stage
+  pthread_mutex_lock(&bb_lock);
+  std::vector<std::string> stale;
+  stale.swap(bb_stale);
+  pthread_mutex_unlock(&bb_lock);
+  for (size_t i = 0; i < stale.size(); i++) bb_recover(stale[i]);
+
+  char *buf = (char*)malloc(bb_batch);
+
+  pthread_mutex_lock(&bb_lock);
+  while (1) {
+    bb_log *log = NULL;
+    for (std::list<bb_log*>::iterator itr = bb_logs.begin(); itr != bb_logs.end(); itr++) {
+      bb_log *l = *itr;
+      if ((l->error == PLFS_SUCCESS && l->drained < l->tail) ||
+          (l->closing && (l->drained == l->tail || l->error != PLFS_SUCCESS))) {
+        log = l;
+        // round robin between handles
+        bb_logs.erase(itr);
+        bb_logs.push_back(l);
+        break;
+      }
+    }
+    if (log == NULL) {
+      pthread_cond_wait(&bb_work, &bb_lock);
+      continue;
+    }
+
+    if (log->closing && (log->drained == log->tail || log->error != PLFS_SUCCESS)) {
+      bb_logs.remove(log);
+      pthread_mutex_unlock(&bb_lock);
+
+      int num_refs;
+      PLFS_CALL(plfs_close(log->fd, getpid(), getuid(), log->flags, NULL, &num_refs));
+      if (log->error != PLFS_SUCCESS) {
+        // keep the log so the next start can retry the replay
+        std::cerr << "soplfs: staged writes for " << log->path
+                  << " were not drained, kept in " << log->log_path << std::endl;
+        __libc_close(log->log_fd);
+        pthread_mutex_destroy(&log->append);
+        delete log;
+      } else {
+        bb_free(log);
+      }
+
+      pthread_mutex_lock(&bb_lock);
+      pthread_cond_broadcast(&bb_progress);
+      continue;
+    }
+
+    off_t from = log->drained;
+    off_t to = log->tail;
+    pthread_mutex_unlock(&bb_lock);
+
+    plfs_error_t plfs_error;
+    off_t done = bb_drain(log, from, to, buf, &plfs_error);
+    bb_save_watermark(log, done);
+
+    // recycle the log once everything in it is in PLFS
+    int recycle = (done == to && to - log->base >= (off_t)bb_batch &&
+                   pthread_mutex_trylock(&log->append) == 0);
+
+    pthread_mutex_lock(&bb_lock);
+    log->drained = done;
+    if (plfs_error != PLFS_SUCCESS) log->error = plfs_error;
+    if (recycle) {
+      if (!log->closing && log->tail == done && ftruncate(log->log_fd, log->base) == 0) {
+        log->tail = log->drained = log->base;
+        bb_save_watermark(log, log->base);
+      }
+      pthread_mutex_unlock(&log->append);
+    }
+    pthread_cond_broadcast(&bb_progress);
+  }
+
+  free(buf);
+  return NULL;
+}
+
+// replay the log of a process that died before its drain finished
+static void bb_recover(const std::string &log_path) {
+  int fd = __libc_open(log_path.c_str(), O_RDWR | O_CLOEXEC);
+  if (fd < 0) return;
+
+  if (flock(fd, LOCK_EX | LOCK_NB) != 0) {
+    __libc_close(fd);   // still owned by a live process
+    return;
+  }
+
+  bb_header hdr;
+  if (__libc_pread(fd, &hdr, sizeof(hdr), 0) != sizeof(hdr) ||
+      memcmp(hdr.magic, BB_LOG_MAGIC, sizeof(hdr.magic)) != 0 ||
+      hdr.version != BB_LOG_VERSION) {
+    __libc_close(fd);
+    return;
+  }
+
+  std::string path(hdr.path_len, '\0');
+  struct stat st;
+  if (__libc_pread(fd, &path[0], hdr.path_len, sizeof(hdr)) != (ssize_t)hdr.path_len ||
+      fstat(fd, &st) != 0) {
+    __libc_close(fd);
+    return;
+  }
+
+  bb_log *log = new bb_log();
+  log->fd = NULL;
+  log->mount = plfs_mount_of(path.c_str());
+  log->path = path;
+  log->log_path = log_path;
+  log->flags = (hdr.flags & ~(O_ACCMODE | O_TRUNC | O_EXCL | O_APPEND)) | O_WRONLY;
+  log->log_fd = fd;
+  log->base = sizeof(hdr) + hdr.path_len;
+  log->drained = std::max((off_t)hdr.drained, log->base);
+  log->tail = st.st_size;
+  log->closing = 0;
+  log->error = PLFS_SUCCESS;
+  pthread_mutex_init(&log->append, NULL);
+
+  plfs_error_t plfs_error = PLFS_SUCCESS;
+  if (log->drained < log->tail) {
+    {
+      stats_call sc(STATS_OPEN);
+      sc.route = STATS_PLFS;
+      sc.mount = log->mount;
+      sc.trace_path(path.c_str());
+      PROBE_ENTRY(open, -1, -1, log->flags, path.c_str());
+      plfs_retry retry(log->mount);
+      plfs_error = PLFS_EAGAIN;
+      while (retry.again(plfs_error)) {
+        plfs_error = PLFS_CALL(plfs_open(&log->fd, path.c_str(), log->flags, getpid(),
+                                         hdr.mode, NULL));
+      }
+      PROBE_RETURN(open, -1, -1, plfs_error == PLFS_SUCCESS ? 0 : -1, path.c_str());
+      sc.trace_result(plfs_error == PLFS_SUCCESS ? 0 : -1);
+    }
+    if (plfs_error == PLFS_SUCCESS) {
+      char *buf = (char*)malloc(bb_batch);
+      {
+        stats_call sc(STATS_PWRITE);
+        sc.route = STATS_PLFS;
+        sc.mount = log->mount;
+        sc.trace_path(path.c_str());
+        PROBE_ENTRY(write, -1, log->drained, log->tail - log->drained, path.c_str());
+        off_t done = log->drained;
+        if (buf == NULL) {
+          plfs_error = PLFS_ENOMEM;
+        } else {
+          done = bb_drain(log, log->drained, log->tail, buf, &plfs_error);
+        }
+        ssize_t ret = plfs_error == PLFS_SUCCESS ? done - log->drained : -1;
+        PROBE_RETURN(write, -1, log->drained, ret, path.c_str());
+        sc.trace_result(ret);
+      }
+      free(buf);
+
+      stats_call sc(STATS_CLOSE);
+      sc.route = STATS_PLFS;
+      sc.mount = log->mount;
+      sc.trace_path(path.c_str());
+      PROBE_ENTRY(close, -1, -1, 0, path.c_str());
+      int num_refs;
+      plfs_error_t close_error = PLFS_CALL(plfs_close(log->fd, getpid(), getuid(), log->flags,
+                                                      NULL, &num_refs));
+      PROBE_RETURN(close, -1, -1, close_error == PLFS_SUCCESS ? 0 : -1, path.c_str());
+      sc.trace_result(close_error == PLFS_SUCCESS ? 0 : -1);
+    }
+  }
+
+  if (plfs_error == PLFS_SUCCESS) {
+    bb_free(log);
+  } else {
+    std::cerr << "soplfs: failed to replay " << log_path << " into "
+              << path << std::endl;
+    __libc_close(fd);
+    pthread_mutex_destroy(&log->append);
+    delete log;
+  }
+}
+
+static void bb_shutdown() {
+  pthread_mutex_lock(&bb_lock);
+  while (1) {
+    int busy = 0;
+    for (std::list<bb_log*>::iterator itr = bb_logs.begin(); itr != bb_logs.end(); itr++) {
+      if ((*itr)->error == PLFS_SUCCESS && ((*itr)->closing || (*itr)->drained < (*itr)->tail)) {
+        busy = 1;
+        break;
+      }
+    }
+    if (!busy) break;
+    pthread_cond_signal(&bb_work);
+    pthread_cond_wait(&bb_progress, &bb_lock);
+  }
+  pthread_mutex_unlock(&bb_lock);
+}
+
+static int bb_start_drain() {
+  pthread_t tid;
+  pthread_attr_t attr;
+  pthread_attr_init(&attr);
+  pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+  int ret = pthread_create(&tid, &attr, bb_drain_main, NULL);
+  pthread_attr_destroy(&attr);
+  if (ret != 0) {
+    std::cerr << "soplfs: cannot start the drain thread" << std::endl;
+    return -1;
+  }
+  return 0;
+}
+
+// the logs open at the fork are the parent's to drain; the child gets a
+// drain thread for the ones it opens
+static void bb_fork_child() {
+  pthread_mutex_init(&bb_lock, NULL);
+  pthread_cond_init(&bb_work, NULL);
+  pthread_cond_init(&bb_progress, NULL);
+  bb_logs.clear();
+  bb_stale.clear();   // the parent's drain thread replays them
+  if (bb_start_drain() < 0) bb_dir.clear();
+}
+
+static void bb_do_init() {
+  MAP(open, int (*)(const char*, int, ...));
+  MAP(close, int (*)(int));
+  MAP(pread, ssize_t (*)(int, void*, size_t, off_t));
+  MAP(pwrite, ssize_t (*)(int, const void*, size_t, off_t));
+  MAP(fdatasync, int (*)(int));
+
+  const char *dir = getenv("SOPLFS_BB_DIR");
+  if (dir == NULL || *dir == '\0') return;
+
+  const char *mode = getenv("SOPLFS_BB_CLOSE");
+  if (mode != NULL && strcmp(mode, "local") == 0) {
+    bb_close_mode = BB_CLOSE_LOCAL;
+  }
+  bb_batch = std::max(bb_env_size("SOPLFS_BB_BATCH", bb_batch), (size_t)4096);
+  bb_max = bb_env_size("SOPLFS_BB_MAX", 0);
+
+  DIR *d = opendir(dir);
+  if (d == NULL) {
+    std::cerr << "soplfs: cannot open staging directory " << dir << std::endl;
+    return;
+  }
+  // replayed on the drain thread: a program should not wait for another's
+  // crashed log before main
+  struct dirent *e;
+  while ((e = readdir(d)) != NULL) {
+    if (strncmp(e->d_name, "soplfs-bb.", 10) == 0) {
+      bb_stale.push_back(std::string(dir) + "/" + e->d_name);
+    }
+  }
+  closedir(d);
+
+  if (bb_start_drain() < 0) return;
+  pthread_atfork(NULL, NULL, bb_fork_child);
+  atexit(bb_shutdown);
+  bb_dir = dir;
+}
+
+void bb_init() {
+  pthread_once(&bb_once, bb_do_init);
+}
+
+int bb_enabled() {
+  bb_init();
+  return !bb_dir.empty();
+}
+
+bb_log* bb_open(Plfs_fd *fd, const char *path, int flags, mode_t mode) {
+  if (!bb_enabled()) return NULL;
+  if ((flags & O_ACCMODE) == O_RDONLY) return NULL;
+
+  bb_header hdr;
+  memset(&hdr, 0, sizeof(hdr));
+  memcpy(hdr.magic, BB_LOG_MAGIC, sizeof(hdr.magic));
+  hdr.version = BB_LOG_VERSION;
+  hdr.path_len = strlen(path);
+  hdr.flags = flags;
+  hdr.mode = mode;
+  hdr.drained = sizeof(hdr) + hdr.path_len;
+
+  std::string log_path;
+  int log_fd = -1;
+  while (log_fd < 0) {
+    std::stringstream name;
+    pthread_mutex_lock(&bb_lock);
+    name << bb_dir << "/soplfs-bb." << getpid() << "." << bb_seq++;
+    pthread_mutex_unlock(&bb_lock);
+
+    log_path = name.str();
+    log_fd = __libc_open(log_path.c_str(), O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, 0600);
+    if (log_fd < 0 && errno != EEXIST) return NULL;
+  }
+
+  struct iovec iov[2];
+  iov[0].iov_base = &hdr;
+  iov[0].iov_len = sizeof(hdr);
+  iov[1].iov_base = (void*)path;
+  iov[1].iov_len = hdr.path_len;
+  if (flock(log_fd, LOCK_EX) != 0 ||
+      pwritev(log_fd, iov, 2, 0) != (ssize_t)(sizeof(hdr) + hdr.path_len)) {
+    __libc_close(log_fd);
+    unlink(log_path.c_str());
+    return NULL;
+  }
+
+  bb_log *log = new bb_log();
+  log->fd = fd;
+  log->mount = plfs_mount_of(path);
+  log->path = path;
+  log->log_path = log_path;
+  log->flags = flags;
+  log->log_fd = log_fd;
+  log->base = log->tail = log->drained = hdr.drained;
+  log->closing = 0;
+  log->error = PLFS_SUCCESS;
+  pthread_mutex_init(&log->append, NULL);
+
+  pthread_mutex_lock(&bb_lock);
+  bb_logs.push_back(log);
+  pthread_mutex_unlock(&bb_lock);
+
+  return log;
+}
+
+plfs_error_t bb_write(bb_log *log, const char *buf, size_t count,
+                      off_t offset, ssize_t *written) {
+  bb_record rec;
+  rec.magic = BB_REC_MAGIC;
+  rec.pad = 0;
+  rec.offset = offset;
+  rec.length = count;
+
+  struct iovec iov[2];
+  iov[0].iov_base = &rec;
+  iov[0].iov_len = sizeof(rec);
+  iov[1].iov_base = (void*)buf;
+  iov[1].iov_len = count;
+
+  pthread_mutex_lock(&log->append);
+
+  pthread_mutex_lock(&bb_lock);
+  while (bb_max != 0 && log->error == PLFS_SUCCESS && log->tail - log->drained > bb_max) {
+    pthread_cond_signal(&bb_work);
+    pthread_cond_wait(&bb_progress, &bb_lock);
+  }
+  plfs_error_t plfs_error = log->error;
+  off_t at = log->tail;
+  pthread_mutex_unlock(&bb_lock);
+
+  if (plfs_error == PLFS_SUCCESS) {
+    ssize_t bytes = pwritev(log->log_fd, iov, 2, at);
+    if (bytes != (ssize_t)(sizeof(rec) + count)) {
+      plfs_error = (bytes < 0 && errno == ENOSPC) ? PLFS_ENOSPC : PLFS_EIO;
+    } else {
+      pthread_mutex_lock(&bb_lock);
+      log->tail = at + bytes;
+      pthread_cond_signal(&bb_work);
+      pthread_mutex_unlock(&bb_lock);
+      *written = count;
+    }
+  }
+
+  pthread_mutex_unlock(&log->append);
+
+  return plfs_error;
+}
+
+plfs_error_t bb_wait(bb_log *log) {
+  pthread_mutex_lock(&bb_lock);
+  while (log->error == PLFS_SUCCESS && log->drained < log->tail) {
+    pthread_cond_signal(&bb_work);
+    pthread_cond_wait(&bb_progress, &bb_lock);
+  }
+  plfs_error_t plfs_error = log->error;
+  pthread_mutex_unlock(&bb_lock);
+
+  return plfs_error;
+}
+
+plfs_error_t bb_sync(bb_log *log) {
+  if (bb_close_mode == BB_CLOSE_LOCAL) {
+    pthread_mutex_lock(&bb_lock);
+    plfs_error_t plfs_error = log->error;
+    pthread_mutex_unlock(&bb_lock);
+
+    if (plfs_error == PLFS_SUCCESS && __libc_fdatasync(log->log_fd) != 0) {
+      plfs_error = PLFS_EIO;
+    }
+    return plfs_error;
+  }
+
+  plfs_error_t plfs_error = bb_wait(log);
+  if (plfs_error == PLFS_SUCCESS) {
+    plfs_retry retry(log->mount);
+    plfs_error = PLFS_EAGAIN;
+    while (retry.again(plfs_error)) {
+      plfs_error = PLFS_CALL(plfs_sync(log->fd));
+    }
+  }
+  return plfs_error;
+}
+
+/*
+ * Returns 1 when the drain thread took over closing the PLFS handle,
+ * 0 when the caller still has to plfs_close it.
+ */
+int bb_close(bb_log *log, plfs_error_t *err) {
+  if (bb_close_mode == BB_CLOSE_LOCAL) {
+    *err = bb_sync(log);
+    pthread_mutex_lock(&bb_lock);
+    log->closing = 1;
+    pthread_cond_signal(&bb_work);
+    pthread_mutex_unlock(&bb_lock);
+    return 1;
+  }
+
+  *err = bb_wait(log);
+
+  pthread_mutex_lock(&bb_lock);
+  bb_logs.remove(log);
+  pthread_mutex_unlock(&bb_lock);
+
+  if (*err == PLFS_SUCCESS) {
+    bb_free(log);
+  } else {
+    __libc_close(log->log_fd);
+    pthread_mutex_destroy(&log->append);
+    delete log;
+  }
+  return 0;
+}
@@ -0,0 +1,334 @@
+#include "soplfs_internal.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <string>
+#include <algorithm>
+
+
+/*
+ * Node-wide block cache
+ *
+ * plfs_reads of files opened read-only on a mount with a block_cache
+ * budget go through BCACHE_BLOCK-sized blocks in a /dev/shm segment that
+ * the job's soplfs processes on the node share, so an input file read by
+ * every rank comes from the backend once per node.  A block is keyed by
+ * the container's path and block number and only matches handles that
+ * saw the same container stamp (inode, size and mtime) at open.
+ *
+ * The segment is set-associative, BCACHE_WAYS blocks per set.  Entries
+ * are seqlocks as in the attribute cache: a reader copies out of the
+ * block and checks the sequence afterwards, a filler takes the entry by
+ * moving the sequence to odd with a compare-and-swap, writes its key and
+ * reads the block from PLFS straight into the segment.  A reader that
+ * finds its own block being filled polls until it is done instead of
+ * going to the backend too, unless the fill is older than BCACHE_STALE_NS
+ * (its process may have died).  Such an entry is read around, never
+ * taken over: a filler that is only slow would still write into the
+ * block afterwards.  Eviction is a clock over the set: a hit sets the
+ * entry's ref bit, the filler passes over entries with it set, clearing
+ * it.  When the set is all busy the read goes to PLFS uncached.
+ *
+ * The first process on the node sizes the segment from the largest
+ * block_cache of its mounts; the others use what they find.  The last
+ * one to exit removes it (shm_job_detach).
+ */
+
+#define BCACHE_MAGIC "SOPLFSBC"
+#define BCACHE_VERSION 2
+#define BCACHE_BLOCK (1024 * 1024)
+#define BCACHE_WAYS 8
+#define BCACHE_STALE_NS (10 * 1000000000LL)
+#define BCACHE_WAIT_US 50
+
+struct bcache_entry {
+  unsigned seq;                  // odd while being filled
+  unsigned ref;                  // hit since the clock last passed
+  unsigned long long key;        // path hash, 0: empty
+  unsigned long long stamp;
+  unsigned long long block;
+  long long fill_start;          // CLOCK_MONOTONIC ns
+  size_t len;                    // valid bytes, short at the end of the file
+};
+
+struct bcache_header {
+  char magic[8];
+  unsigned version;
+  unsigned block_size;
+  unsigned long long blocks;
+  char pad[40];
+  shm_users users;
+};
+
+struct bcache_file {
+  unsigned long long key;
+  unsigned long long stamp;
+  unsigned long gen;             // flight_gen() at open: later writes bypass
+};
+
+static pthread_once_t bcache_once = PTHREAD_ONCE_INIT;
+static bcache_header *bcache_head = NULL;
+static std::string bcache_name SOPLFS_GLOBAL;
+static bcache_entry *bcache_entries = NULL;   // NULL: no segment
+static char *bcache_data = NULL;
+static unsigned long long bcache_sets = 0;
+
+
+static size_t bcache_data_offset(unsigned long long blocks) {
+  size_t off = sizeof(bcache_header) + blocks * sizeof(bcache_entry);
+  return (off + 4095) & ~(size_t)4095;
+}
+
+static size_t bcache_size(unsigned long long blocks) {
+  return bcache_data_offset(blocks) + blocks * BCACHE_BLOCK;
+}
+
+static void bcache_exit() {
+  shm_job_detach(&bcache_head->users, bcache_name);
+}
+
+// a forked child uses the segment too
+static void bcache_fork_child() {
+  shm_job_attach(&bcache_head->users);
+}
+
+static void bcache_attach(void *p, unsigned long long blocks, const std::string &name) {
+  bcache_head = (bcache_header*)p;
+  bcache_entries = (bcache_entry*)(bcache_head + 1);
+  bcache_data = (char*)p + bcache_data_offset(blocks);
+  bcache_sets = blocks / BCACHE_WAYS;
+  bcache_name = name;
+  shm_job_attach(&bcache_head->users);
+  atexit(bcache_exit);
+  pthread_atfork(NULL, NULL, bcache_fork_child);
+}
+
+static void bcache_do_init() {
+  soplfs_init();   // for the tuning
+  size_t budget = 0;
+  for (size_t m = 0; m < mount_points.size(); m++) {
+    budget = std::max(budget, mount_tuning(m).block_cache);
+  }
+  unsigned long long blocks = budget / BCACHE_BLOCK / BCACHE_WAYS * BCACHE_WAYS;
+  if (blocks == 0) return;
+
+  std::string name = shm_job_segment("blocks");
+  int created = 1;
+  int fd = shm_open(name.c_str(), O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, 0600);
+  if (fd < 0 && errno == EEXIST) {
+    created = 0;
+    fd = shm_open(name.c_str(), O_RDWR | O_CLOEXEC, 0600);
+  }
+  if (fd < 0) {
+    std::cerr << "soplfs: cannot open /dev/shm" << name
+              << ", block cache off" << std::endl;
+    return;
+  }
+
+  void *p = MAP_FAILED;
+  if (created) {
+    if (ftruncate(fd, bcache_size(blocks)) == 0) {
+      p = __libc_mmap(NULL, bcache_size(blocks), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    }
+    if (p != MAP_FAILED) {
+      bcache_header *h = (bcache_header*)p;
+      memcpy(h->magic, BCACHE_MAGIC, 8);
+      h->block_size = BCACHE_BLOCK;
+      h->blocks = blocks;
+      __atomic_store_n(&h->version, BCACHE_VERSION, __ATOMIC_RELEASE);
+    } else {
+      shm_unlink(name.c_str());
+    }
+  } else {
+    // the creator may still be setting it up
+    struct stat st;
+    for (int i = 0; i < 1000; i++) {
+      if (__libc_fstat(fd, &st) == 0 && st.st_size >= (off_t)sizeof(bcache_header)) break;
+      usleep(1000);
+    }
+    if (st.st_size >= (off_t)sizeof(bcache_header)) {
+      p = __libc_mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    }
+    if (p != MAP_FAILED) {
+      bcache_header *h = (bcache_header*)p;
+      for (int i = 0; i < 1000 && __atomic_load_n(&h->version, __ATOMIC_ACQUIRE) == 0; i++) {
+        usleep(1000);
+      }
+      if (memcmp(h->magic, BCACHE_MAGIC, 8) != 0 || h->version != BCACHE_VERSION ||
+          h->block_size != BCACHE_BLOCK || bcache_size(h->blocks) > (size_t)st.st_size) {
+        std::cerr << "soplfs: /dev/shm" << name
+                  << " belongs to another soplfs version, block cache off" << std::endl;
+        __libc_munmap(p, st.st_size);
+        p = MAP_FAILED;
+      } else {
+        blocks = h->blocks;
+      }
+    }
+  }
+  __libc_close(fd);
+  if (p != MAP_FAILED) bcache_attach(p, blocks, name);
+}
+
+static long long bcache_now() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static unsigned long long bcache_mix(unsigned long long h, unsigned long long v) {
+  for (int i = 0; i < 8; i++, v >>= 8) h = (h ^ (v & 0xff)) * 1099511628211ULL;
+  return h;
+}
+
+void bcache_open(plfs_file *pf, int flags) {
+  if ((flags & O_ACCMODE) != O_RDONLY) return;   // its own writes would go stale
+  if (pf->mount < 0 || mount_tuning(pf->mount).block_cache == 0) return;
+  pthread_once(&bcache_once, bcache_do_init);
+  if (bcache_entries == NULL) return;
+
+  // the stamp: from the attribute cache when it is on
+  struct stat st;
+  plfs_error_t plfs_error;
+  if (!acache_get(pf->path->c_str(), pf->mount, &st, &plfs_error, NULL)) {
+    plfs_retry retry(pf->mount);
+    plfs_error = PLFS_EAGAIN;
+    while (retry.again(plfs_error)) {
+      plfs_error = PLFS_CALL(plfs_getattr(pf->fd, NULL, &st, 0));
+    }
+  }
+  if (plfs_error != PLFS_SUCCESS) return;
+
+  bcache_file *bc = new bcache_file();
+  bc->key = 14695981039346656037ULL;   // FNV-1a of the path
+  for (const char *c = pf->path->c_str(); *c; c++) {
+    bc->key = (bc->key ^ (unsigned char)*c) * 1099511628211ULL;
+  }
+  if (bc->key == 0) bc->key = 1;
+  bc->stamp = bcache_mix(bcache_mix(bcache_mix(bcache_mix(
+      14695981039346656037ULL, st.st_ino), st.st_size),
+      st.st_mtim.tv_sec), st.st_mtim.tv_nsec);
+  bc->gen = pf->fl ? flight_gen(pf->fl) : 0;
+  pf->bc = bc;
+}
+
+void bcache_close(plfs_file *pf) {
+  delete pf->bc;
+  pf->bc = NULL;
+}
+
+// 0 once this process has written the container since the handle opened
+int bcache_usable(plfs_file *pf) {
+  return pf->fl == NULL || flight_gen(pf->fl) == pf->bc->gen;
+}
+
+static int bcache_matches(const bcache_entry *e, const bcache_file *bc, unsigned long long block) {
+  return e->key == bc->key && e->stamp == bc->stamp && e->block == block;
+}
+
+// copies [boff, boff + n) of the block out of e; -1 when e changed meanwhile
+static ssize_t bcache_copy(bcache_entry *e, unsigned seq, char *buf, size_t boff, size_t n) {
+  size_t len = e->len;
+  size_t have = len > boff ? std::min(n, len - boff) : 0;
+  memcpy(buf, bcache_data + (e - bcache_entries) * (size_t)BCACHE_BLOCK + boff, have);
+  __atomic_thread_fence(__ATOMIC_ACQUIRE);
+  if (__atomic_load_n(&e->seq, __ATOMIC_RELAXED) != seq) return -1;
+  return have;
+}
+
+// reads [boff, boff + n) of block number block
+static ssize_t bcache_block(plfs_file *pf, unsigned long long block, char *buf,
+                            size_t boff, size_t n) {
+  bcache_file *bc = pf->bc;
+  bcache_entry *set = &bcache_entries[(bcache_mix(bc->key, block) % bcache_sets) * BCACHE_WAYS];
+  int waited = 0;
+
+  while (1) {
+    int filling = 0;
+    for (int i = 0; i < BCACHE_WAYS; i++) {
+      bcache_entry *e = &set[i];
+      unsigned seq = __atomic_load_n(&e->seq, __ATOMIC_ACQUIRE);
+      if (!bcache_matches(e, bc, block)) continue;
+      if (seq & 1) {
+        if (bcache_now() - e->fill_start < BCACHE_STALE_NS) filling = 1;
+        continue;
+      }
+      ssize_t ret = bcache_copy(e, seq, buf, boff, n);
+      if (ret < 0) {
+        filling = 1;   // replaced under us: look again
+        continue;
+      }
+      if (!e->ref) e->ref = 1;
+      stats_event(STATS_EV_BLOCK_HIT, 1);
+      return ret;
+    }
+    if (!filling) break;
+    if (!waited++) stats_event(STATS_EV_BLOCK_WAIT, 1);
+    usleep(BCACHE_WAIT_US);
+  }
+
+  // a victim: free, or not hit since the clock last passed
+  bcache_entry *victim = NULL;
+  unsigned seq = 0;
+  long long now = bcache_now();
+  for (int pass = 0; pass < 2 && victim == NULL; pass++) {
+    for (int i = 0; i < BCACHE_WAYS && victim == NULL; i++) {
+      bcache_entry *e = &set[i];
+      seq = __atomic_load_n(&e->seq, __ATOMIC_RELAXED);
+      if (seq & 1) continue;
+      if (e->key != 0 && e->ref) {
+        e->ref = 0;
+        continue;
+      }
+      if (__sync_bool_compare_and_swap(&e->seq, seq, seq + 1)) victim = e;
+    }
+  }
+  if (victim == NULL) {
+    // the whole set is being filled: read around the cache
+    return plfs_file_pread(pf, buf, n, block * BCACHE_BLOCK + boff);
+  }
+
+  victim->fill_start = now;
+  victim->key = bc->key;
+  victim->stamp = bc->stamp;
+  victim->block = block;
+  victim->ref = 0;
+  __atomic_thread_fence(__ATOMIC_RELEASE);
+
+  char *data = bcache_data + (victim - bcache_entries) * (size_t)BCACHE_BLOCK;
+  ssize_t got = plfs_file_pread(pf, data, BCACHE_BLOCK, block * BCACHE_BLOCK);
+  int err = errno;
+  if (got < 0) {
+    victim->key = 0;
+    __atomic_store_n(&victim->seq, seq + 2, __ATOMIC_RELEASE);
+    errno = err;
+    return -1;
+  }
+  victim->len = got;
+  size_t have = (size_t)got > boff ? std::min(n, got - boff) : 0;
+  memcpy(buf, data + boff, have);
+  __atomic_store_n(&victim->seq, seq + 2, __ATOMIC_RELEASE);
+  stats_event(STATS_EV_BLOCK_FILL, 1);
+  return have;
+}
+
+ssize_t bcache_read(plfs_file *pf, char *buf, size_t count, off_t offset) {
+  size_t done = 0;
+  while (done < count) {
+    off_t at = offset + done;
+    size_t boff = at % BCACHE_BLOCK;
+    size_t n = std::min(count - done, BCACHE_BLOCK - boff);
+    ssize_t ret = bcache_block(pf, at / BCACHE_BLOCK, buf + done, boff, n);
+    if (ret < 0) return done ? (ssize_t)done : -1;
+    done += ret;
+    if ((size_t)ret < n) break;   // end of file
+  }
+  return done;
+}
@@ -0,0 +1,251 @@
+#define _LARGEFILE64_SOURCE
+#include "soplfs_internal.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/stat.h>
+
+#include <vector>
+#include <algorithm>
+
+
+/*
+ * Copy engine for copy_file_range, sendfile, splice and cross-mount
+ * rename
+ *
+ * A copy between two seekable ends is cut into chunks of the mount's
+ * copy_chunk; copy_threads threads (the caller included) each take the
+ * next chunk, read it into a buffer of their own and write it out, so
+ * reads and writes of different chunks overlap.  When either end is a
+ * pipe or socket the chunks have to go in order and the caller copies
+ * them alone.  A copy stops at the end of the source; the result is the
+ * length of the part that was copied without a gap.
+ */
+
+struct xfer_job {
+  xfer_end *in;
+  xfer_end *out;
+  off_t in_off;
+  off_t out_off;
+  size_t len;
+  size_t chunk;
+  pthread_mutex_t lock;
+  size_t next;            // first byte no thread has taken yet
+  size_t end;             // copy up to here: len, or where the source ended
+  size_t failed;          // start of the first chunk that failed, else len
+  int error;
+};
+
+
+static int xfer_seekable(int fd) {
+  struct stat st;
+  if (fstat(fd, &st) < 0) return 0;
+  return S_ISREG(st.st_mode) || S_ISBLK(st.st_mode);
+}
+
+void xfer_open(xfer_end *e, int fd) {
+  e->fd = fd;
+  std::map<int, plfs_file*>::iterator itr = plfs_files.find(fd);
+  e->pf = itr != plfs_files.end() ? itr->second : NULL;
+  e->seekable = e->pf != NULL || xfer_seekable(fd);
+}
+
+// fills buf unless the source ends first; a pipe or socket gives what it has
+static ssize_t xfer_read(xfer_end *e, char *buf, size_t len, off_t offset) {
+  if (e->pf) return plfs_file_pread(e->pf, buf, len, offset);
+  if (!e->seekable) return __libc_read(e->fd, buf, len);
+
+  size_t done = 0;
+  while (done < len) {
+    ssize_t n = __libc_pread(e->fd, buf + done, len - done, offset + done);
+    if (n < 0 && errno == EINTR) continue;
+    if (n < 0) return done ? (ssize_t)done : -1;
+    if (n == 0) break;
+    done += n;
+  }
+  return done;
+}
+
+static ssize_t xfer_write(xfer_end *e, const char *buf, size_t len, off_t offset) {
+  size_t done = 0;
+  while (done < len) {
+    ssize_t n;
+    if (e->pf) {
+      plfs_error_t plfs_error = plfs_file_write(e->pf, buf + done, len - done,
+                                                offset + done, &n);
+      if (plfs_error != PLFS_SUCCESS) {
+        errno = plfs_error_to_errno(plfs_error);
+        n = -1;
+      }
+    } else if (e->seekable) {
+      n = __libc_pwrite(e->fd, buf + done, len - done, offset + done);
+    } else {
+      n = __libc_write(e->fd, buf + done, len - done);
+    }
+    if (n < 0 && errno == EINTR) continue;
+    if (n <= 0) return -1;
+    done += n;
+  }
+  return done;
+}
+
+static void* xfer_worker(void *arg) {
+  xfer_job *job = (xfer_job*)arg;
+  char *buf = (char*)malloc(job->chunk);
+  if (buf == NULL) {
+    // the copy stops where it got to: a short count, or ENOMEM if nothing
+    pthread_mutex_lock(&job->lock);
+    if (job->next < job->failed) {
+      job->failed = job->next;
+      job->error = ENOMEM;
+    }
+    pthread_mutex_unlock(&job->lock);
+    return NULL;
+  }
+
+  while (1) {
+    pthread_mutex_lock(&job->lock);
+    size_t at = job->next;
+    if (at >= job->end || at >= job->failed) {
+      pthread_mutex_unlock(&job->lock);
+      break;
+    }
+    size_t n = std::min(job->chunk, job->end - at);
+    job->next += n;
+    pthread_mutex_unlock(&job->lock);
+
+    ssize_t got = xfer_read(job->in, buf, n, job->in_off + at);
+    ssize_t put = got > 0 ? xfer_write(job->out, buf, got, job->out_off + at) : got;
+
+    pthread_mutex_lock(&job->lock);
+    if (put < 0) {
+      if (at < job->failed) {
+        job->failed = at;
+        job->error = errno;
+      }
+    } else if ((size_t)got < n) {
+      job->end = std::min(job->end, at + got);   // the source ended here
+    }
+    pthread_mutex_unlock(&job->lock);
+  }
+  free(buf);
+  return NULL;
+}
+
+// copies len bytes; the ends' own file positions are left alone
+ssize_t xfer_copy(xfer_end *in, off_t in_off, xfer_end *out, off_t out_off, size_t len) {
+  if (len == 0) return 0;
+  int mount = in->pf ? in->pf->mount : out->pf ? out->pf->mount : -1;
+  const soplfs_tuning &tune = mount_tuning(mount);
+
+  xfer_job job;
+  job.in = in;
+  job.out = out;
+  job.in_off = in_off;
+  job.out_off = out_off;
+  job.len = len;
+  job.chunk = std::max(tune.copy_chunk, (size_t)4096);
+  pthread_mutex_init(&job.lock, NULL);
+  job.next = 0;
+  job.end = len;
+  job.failed = len;
+  job.error = 0;
+
+  if (!in->seekable || !out->seekable) {
+    // in order, by the caller: a pipe read returns what is there
+    char *buf = (char*)malloc(std::min(job.chunk, len));
+    if (buf == NULL) {
+      errno = ENOMEM;
+      return -1;
+    }
+    size_t done = 0;
+    while (done < len) {
+      ssize_t got = xfer_read(in, buf, std::min(job.chunk, len - done), in_off + done);
+      if (got <= 0) {
+        if (got < 0 && done == 0) done = (size_t)-1;
+        break;
+      }
+      if (xfer_write(out, buf, got, out_off + done) < 0) {
+        if (done == 0) done = (size_t)-1;
+        break;
+      }
+      done += got;
+      if (!in->seekable) break;   // what the pipe had, like splice
+    }
+    int err = errno;
+    free(buf);
+    pthread_mutex_destroy(&job.lock);
+    errno = err;
+    return done;
+  }
+
+  int threads = std::max(1, std::min(tune.copy_threads, (int)((len + job.chunk - 1) / job.chunk)));
+  std::vector<pthread_t> tids;
+  for (int i = 1; i < threads; i++) {
+    pthread_t tid;
+    if (pthread_create(&tid, NULL, xfer_worker, &job) == 0) tids.push_back(tid);
+  }
+  xfer_worker(&job);
+  for (size_t i = 0; i < tids.size(); i++) pthread_join(tids[i], NULL);
+  pthread_mutex_destroy(&job.lock);
+
+  size_t done = std::min(job.end, job.failed);
+  if (done == 0 && job.failed == 0) {
+    errno = job.error;
+    return -1;
+  }
+  return done;
+}
+
+static int xfer_unlink(const char *path, int plfs) {
+  if (!plfs) return unlink(path);
+  plfs_error_t plfs_error = PLFS_CALL(plfs_unlink(path));
+  acache_changed(path);
+  if (plfs_error != PLFS_SUCCESS) {
+    errno = plfs_error_to_errno(plfs_error);
+    return -1;
+  }
+  return 0;
+}
+
+// rename between a PLFS mount and anything else: copy, then unlink
+int xfer_rename(const char *from, const char *to, int from_plfs, int to_plfs) {
+  struct stat st;
+  if (stat(from, &st) < 0) return -1;
+  if (!S_ISREG(st.st_mode)) {
+    errno = EXDEV;   // directories and the rest: like the kernel does
+    return -1;
+  }
+
+  int in = open(from, O_RDONLY);
+  if (in < 0) return -1;
+  int out = open(to, O_WRONLY | O_CREAT | O_TRUNC, st.st_mode & 07777);
+  if (out < 0) {
+    int err = errno;
+    close(in);
+    errno = err;
+    return -1;
+  }
+
+  xfer_end src, dst;
+  xfer_open(&src, in);
+  xfer_open(&dst, out);
+  ssize_t n = xfer_copy(&src, 0, &dst, 0, st.st_size);
+  int err = n < 0 ? errno : EIO;   // short: the source shrank meanwhile
+  if (close(out) < 0 && n == st.st_size) {
+    err = errno;
+    n = -1;
+  }
+  close(in);
+
+  if (n != st.st_size) {
+    xfer_unlink(to, to_plfs);
+    errno = err;
+    return -1;
+  }
+  return xfer_unlink(from, from_plfs);
+}
@@ -0,0 +1,230 @@
+#include "soplfs_internal.h"
+
+#include <errno.h>
+#include <string.h>
+#include <pthread.h>
+
+#include <string>
+#include <list>
+#include <map>
+#include <vector>
+#include <algorithm>
+
+
+/*
+ * Single-flight plfs_read
+ *
+ * Handles on the same container share a flight_file that lists the
+ * plfs_reads in progress on it.  A read that overlaps one of them at its
+ * start or its end (or lies inside it) asks that reader for the common
+ * part and reads only the rest itself; the reader copies the part into
+ * the waiter's buffer once its own read is done, so it never waits for
+ * the waiters.  A read only joins reads that started after the last
+ * write through any handle on the container, so it never sees data older
+ * than a write that returned before it.
+ */
+
+// part of a pending read that another read wants
+struct flight_wait {
+  char *buf;
+  off_t offset;
+  size_t count;
+  ssize_t ret;
+  int done;
+};
+
+struct flight {
+  off_t offset;
+  size_t count;
+  unsigned long gen;        // flight_file::gen when the read started
+  int done;
+  std::vector<flight_wait*> waits;
+};
+
+struct flight_file {
+  std::string path;
+  int refs;
+  unsigned long gen;        // bumped by every write
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+  std::list<flight*> pending;
+};
+
+static pthread_once_t flight_once = PTHREAD_ONCE_INIT;
+static pthread_mutex_t flight_lock = PTHREAD_MUTEX_INITIALIZER;   // flight_files
+static std::map<std::string, flight_file*> flight_files SOPLFS_GLOBAL;
+
+
+// a thread forked away in the middle of a read never finishes it
+static void flight_fork_child() {
+  pthread_mutex_init(&flight_lock, NULL);
+  for (std::map<std::string, flight_file*>::iterator itr = flight_files.begin();
+       itr != flight_files.end(); itr++) {
+    pthread_mutex_init(&itr->second->lock, NULL);
+    pthread_cond_init(&itr->second->cond, NULL);
+    itr->second->pending.clear();
+  }
+}
+
+static void flight_do_init() {
+  pthread_atfork(NULL, NULL, flight_fork_child);
+}
+
+flight_file* flight_open(const char *path, int mount) {
+  if (!mount_tuning(mount).read_dedup) return NULL;
+  pthread_once(&flight_once, flight_do_init);
+
+  pthread_mutex_lock(&flight_lock);
+  flight_file *fl;
+  std::map<std::string, flight_file*>::iterator itr = flight_files.find(path);
+  if (itr != flight_files.end()) {
+    fl = itr->second;
+  } else {
+    fl = new flight_file();
+    fl->path = path;
+    fl->refs = 0;
+    fl->gen = 0;
+    pthread_mutex_init(&fl->lock, NULL);
+    pthread_cond_init(&fl->cond, NULL);
+    flight_files[fl->path] = fl;
+  }
+  fl->refs++;
+  pthread_mutex_unlock(&flight_lock);
+  return fl;
+}
+
+void flight_close(flight_file *fl) {
+  pthread_mutex_lock(&flight_lock);
+  if (--fl->refs == 0) {
+    flight_files.erase(fl->path);
+    pthread_mutex_destroy(&fl->lock);
+    pthread_cond_destroy(&fl->cond);
+    delete fl;
+  }
+  pthread_mutex_unlock(&flight_lock);
+}
+
+unsigned long flight_gen(flight_file *fl) {
+  pthread_mutex_lock(&fl->lock);
+  unsigned long gen = fl->gen;
+  pthread_mutex_unlock(&fl->lock);
+  return gen;
+}
+
+void flight_written(flight_file *fl) {
+  pthread_mutex_lock(&fl->lock);
+  fl->gen++;
+  pthread_mutex_unlock(&fl->lock);
+}
+
+// called with fl->lock held: r copies [offset, offset + count) into buf
+static void flight_join(flight *r, flight_wait *w, char *buf, size_t count, off_t offset) {
+  w->buf = buf;
+  w->offset = offset;
+  w->count = count;
+  w->ret = -1;
+  w->done = 0;
+  r->waits.push_back(w);
+}
+
+// called with fl->lock held; returns with it held
+static ssize_t flight_collect(flight_file *fl, flight_wait *w) {
+  while (!w->done) pthread_cond_wait(&fl->cond, &fl->lock);
+  if (w->ret >= 0) {
+    stats_event(STATS_EV_READ_SHARED, 1);
+    stats_event(STATS_EV_READ_SHARED_BYTES, w->ret);
+  }
+  return w->ret;
+}
+
+// our own read of [offset, offset + count), handing out its parts
+static ssize_t flight_issue(plfs_file *pf, flight_file *fl, char *buf, size_t count,
+                            off_t offset) {
+  flight r;
+  r.offset = offset;
+  r.count = count;
+  r.gen = fl->gen;
+  r.done = 0;
+  fl->pending.push_back(&r);
+  pthread_mutex_unlock(&fl->lock);
+
+  ssize_t ret = plfs_file_pread(pf, buf, count, offset);
+  int err = errno;
+
+  // no one joins once done is set, so the list is ours to work on
+  pthread_mutex_lock(&fl->lock);
+  r.done = 1;
+  fl->pending.remove(&r);
+  pthread_mutex_unlock(&fl->lock);
+
+  for (size_t i = 0; i < r.waits.size(); i++) {
+    flight_wait *w = r.waits[i];
+    if (ret < 0) continue;
+    ssize_t skip = w->offset - offset;
+    w->ret = std::max((ssize_t)0, std::min((ssize_t)w->count, ret - skip));
+    memcpy(w->buf, buf + skip, w->ret);
+  }
+
+  pthread_mutex_lock(&fl->lock);
+  for (size_t i = 0; i < r.waits.size(); i++) {
+    r.waits[i]->done = 1;
+  }
+  pthread_cond_broadcast(&fl->cond);
+  pthread_mutex_unlock(&fl->lock);
+
+  errno = err;
+  return ret;
+}
+
+ssize_t flight_read(plfs_file *pf, char *buf, size_t count, off_t offset) {
+  flight_file *fl = pf->fl;
+  off_t end = offset + count;
+
+  pthread_mutex_lock(&fl->lock);
+  for (std::list<flight*>::iterator itr = fl->pending.begin();
+       itr != fl->pending.end(); itr++) {
+    flight *r = *itr;
+    if (r->done || r->gen != fl->gen) continue;
+    off_t lo = std::max(offset, r->offset);
+    off_t hi = std::min(end, r->offset + (off_t)r->count);
+    if (lo >= hi) continue;
+    if (lo != offset && hi != end) continue;   // inside ours: not worth three pieces
+
+    flight_wait w;
+    flight_join(r, &w, buf + (lo - offset), hi - lo, lo);
+
+    if (lo == offset && hi == end) {
+      ssize_t ret = flight_collect(fl, &w);
+      pthread_mutex_unlock(&fl->lock);
+      if (ret >= 0) return ret;
+      return plfs_file_pread(pf, buf, count, offset);   // r failed: on our own
+    }
+    pthread_mutex_unlock(&fl->lock);
+
+    if (lo == offset) {
+      // r has our head: read the tail meanwhile
+      ssize_t tail = flight_read(pf, buf + (hi - offset), end - hi, hi);
+      int err = errno;
+      pthread_mutex_lock(&fl->lock);
+      ssize_t head = flight_collect(fl, &w);
+      pthread_mutex_unlock(&fl->lock);
+      if (head < 0) head = plfs_file_pread(pf, buf, hi - offset, offset);
+      if (head < hi - offset) return head;
+      errno = err;
+      return tail < 0 ? head : head + tail;
+    }
+
+    // r has our tail: read the head meanwhile
+    ssize_t head = flight_read(pf, buf, lo - offset, offset);
+    int err = errno;
+    pthread_mutex_lock(&fl->lock);
+    ssize_t tail = flight_collect(fl, &w);
+    pthread_mutex_unlock(&fl->lock);
+    errno = err;
+    if (head < lo - offset) return head;
+    if (tail < 0) tail = plfs_file_pread(pf, buf + (lo - offset), end - lo, lo);
+    return tail < 0 ? head : head + tail;
+  }
+
+  return flight_issue(pf, fl, buf, count, offset);
+}
@@ -0,0 +1,307 @@
+#include "soplfs_internal.h"
+#include "soplfs_uring.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/stat.h>
+
+#include <list>
+#include <map>
+#include <algorithm>
+
+
+/*
+ * posix_fadvise and readahead on PLFS handles
+ *
+ * WILLNEED (and readahead()) queue the range, in HINT_BLOCK pieces, for
+ * a few prefetch threads that plfs_read it into blocks kept with the
+ * handle; reads take what they can from those blocks before going to
+ * PLFS, waiting for a block still being read.  A handle holds at most
+ * prefetch_max bytes of blocks.  DONTNEED drops the blocks and the
+ * read-ahead window in the range, SEQUENTIAL and RANDOM set the policy
+ * of the read-ahead window, and under SEQUENTIAL a block goes once a
+ * read has reached its end.  A write through the handle drops them all.
+ *
+ * Every hint is also passed on to the FUSE descriptor, for the kernel's
+ * own cache of the small-read route.
+ *
+ * One lock covers every handle's blocks and the queue; data is copied
+ * outside it while the block is pinned.
+ */
+
+#define HINT_BLOCK (1024 * 1024)
+#define HINT_THREADS 4
+#define HINT_EOF ((off_t)(~0ULL >> 1))   // "to the end of the file"
+
+enum { HINT_QUEUED, HINT_READING, HINT_DONE };
+
+struct hint_block {
+  hint_state *hs;
+  off_t offset;
+  size_t len;
+  char *buf;
+  ssize_t ret;
+  int state;
+  int pins;       // readers copying out of buf
+  int dropped;    // no longer in hs->blocks: freed once unused
+};
+
+struct hint_state {
+  plfs_file *pf;
+  std::map<off_t, hint_block*> blocks;   // by offset, never overlapping
+  size_t bytes;                          // held in blocks
+  int reading;                           // blocks a prefetch thread has
+  int advice;
+};
+
+static pthread_once_t hint_once = PTHREAD_ONCE_INIT;
+static pthread_mutex_t hint_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t hint_work = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t hint_done = PTHREAD_COND_INITIALIZER;
+static std::list<hint_block*> &hint_queue = *new std::list<hint_block*>();   // outlives exit()
+static int hint_threads = 0;
+
+
+// called with hint_lock held
+static void hint_free_unused(hint_block *b) {
+  if (!b->dropped || b->state == HINT_READING || b->pins > 0) return;
+  free(b->buf);
+  delete b;
+}
+
+// called with hint_lock held
+static void hint_drop(hint_block *b) {
+  b->hs->blocks.erase(b->offset);
+  b->hs->bytes -= b->len;
+  b->dropped = 1;
+  if (b->state == HINT_QUEUED) {
+    hint_queue.remove(b);
+    b->state = HINT_DONE;
+    b->ret = -1;
+    pthread_cond_broadcast(&hint_done);
+  }
+  hint_free_unused(b);
+}
+
+static void* hint_worker_main(void *) {
+  pthread_mutex_lock(&hint_lock);
+  while (1) {
+    while (hint_queue.empty()) pthread_cond_wait(&hint_work, &hint_lock);
+    hint_block *b = hint_queue.front();
+    hint_queue.pop_front();
+    b->state = HINT_READING;
+    b->hs->reading++;
+    pthread_mutex_unlock(&hint_lock);
+
+    plfs_file_settle(b->hs->pf);
+    ssize_t ret = plfs_file_pread(b->hs->pf, b->buf, b->len, b->offset);
+    if (ret > 0) stats_event(STATS_EV_PREFETCH_BYTES, ret);
+
+    pthread_mutex_lock(&hint_lock);
+    b->ret = ret;
+    b->state = HINT_DONE;
+    b->hs->reading--;
+    pthread_cond_broadcast(&hint_done);
+    hint_free_unused(b);
+  }
+  return NULL;
+}
+
+// the prefetch threads do not survive a fork; what they were reading
+// counts as failed
+static void hint_fork_child() {
+  pthread_mutex_init(&hint_lock, NULL);
+  pthread_cond_init(&hint_work, NULL);
+  pthread_cond_init(&hint_done, NULL);
+  hint_threads = 0;
+  for (std::map<int, plfs_file*>::iterator itr = plfs_files.begin();
+       itr != plfs_files.end(); itr++) {
+    hint_state *hs = itr->second->hint;
+    if (hs == NULL) continue;
+    for (std::map<off_t, hint_block*>::iterator b = hs->blocks.begin();
+         b != hs->blocks.end(); b++) {
+      if (b->second->state != HINT_DONE) b->second->ret = -1;
+      b->second->state = HINT_DONE;
+      b->second->pins = 0;
+    }
+    hs->reading = 0;
+  }
+  hint_queue.clear();
+}
+
+static void hint_do_init() {
+  pthread_atfork(NULL, NULL, hint_fork_child);
+}
+
+// called with hint_lock held
+static void hint_start_threads() {
+  while (hint_threads < HINT_THREADS) {
+    pthread_t tid;
+    if (pthread_create(&tid, NULL, hint_worker_main, NULL) != 0) break;
+    pthread_detach(tid);
+    hint_threads++;
+  }
+}
+
+// called with hint_lock held
+static hint_state* hint_get(plfs_file *pf) {
+  if (pf->hint == NULL) {
+    hint_state *hs = new hint_state();
+    hs->pf = pf;
+    hs->bytes = 0;
+    hs->reading = 0;
+    hs->advice = POSIX_FADV_NORMAL;
+    pf->hint = hs;
+  }
+  return pf->hint;
+}
+
+// called with hint_lock held: drops every block that overlaps the range
+static void hint_drop_range(hint_state *hs, off_t offset, off_t end) {
+  std::map<off_t, hint_block*>::iterator itr = hs->blocks.upper_bound(offset);
+  if (itr != hs->blocks.begin()) itr--;
+  while (itr != hs->blocks.end() && itr->first < end) {
+    hint_block *b = itr->second;
+    itr++;
+    if (b->offset + (off_t)b->len > offset) hint_drop(b);
+  }
+}
+
+static void hint_willneed(plfs_file *pf, off_t offset, off_t len) {
+  size_t budget = mount_tuning(pf->mount).prefetch_max;
+
+  // no further than the end of the file
+  struct stat st;
+  plfs_retry retry(pf->mount);
+  plfs_error_t plfs_error = PLFS_EAGAIN;
+  while (retry.again(plfs_error)) {
+    plfs_error = PLFS_CALL(plfs_getattr(pf->fd, NULL, &st, 1));
+  }
+  if (plfs_error != PLFS_SUCCESS) return;
+  if (len == 0 || offset + len > st.st_size) len = std::max((off_t)0, st.st_size - offset);
+
+  pthread_mutex_lock(&hint_lock);
+  hint_state *hs = hint_get(pf);
+  int queued = 0;
+  off_t at = offset - offset % HINT_BLOCK;
+  for (; at < offset + len && hs->bytes + HINT_BLOCK <= budget; at += HINT_BLOCK) {
+    std::map<off_t, hint_block*>::iterator itr = hs->blocks.find(at);
+    if (itr != hs->blocks.end() && itr->second->ret != -1) continue;   // have it
+    if (itr != hs->blocks.end()) hint_drop(itr->second);                // failed
+
+    char *buf = (char*)malloc(HINT_BLOCK);
+    if (buf == NULL) break;
+    hint_block *b = new hint_block();
+    b->hs = hs;
+    b->offset = at;
+    b->len = HINT_BLOCK;
+    b->buf = buf;
+    b->ret = 0;
+    b->state = HINT_QUEUED;
+    b->pins = 0;
+    b->dropped = 0;
+    hs->blocks[at] = b;
+    hs->bytes += b->len;
+    hint_queue.push_back(b);
+    queued++;
+  }
+  if (queued) {
+    hint_start_threads();
+    pthread_cond_broadcast(&hint_work);
+  }
+  pthread_mutex_unlock(&hint_lock);
+}
+
+int hint_advise(plfs_file *pf, off_t offset, off_t len, int advice) {
+  if (offset < 0 || len < 0) return EINVAL;
+  pthread_once(&hint_once, hint_do_init);
+  plfs_file_settle(pf);
+
+  switch (advice) {
+    case POSIX_FADV_WILLNEED:
+      hint_willneed(pf, offset, len);
+      break;
+    case POSIX_FADV_DONTNEED:
+      pthread_mutex_lock(&hint_lock);
+      if (pf->hint) hint_drop_range(pf->hint, offset, len ? offset + len : HINT_EOF);
+      pthread_mutex_unlock(&hint_lock);
+      if (pf->ra) ra_invalidate(pf->ra);
+      break;
+    case POSIX_FADV_NORMAL:
+    case POSIX_FADV_SEQUENTIAL:
+    case POSIX_FADV_RANDOM:
+      pthread_mutex_lock(&hint_lock);
+      hint_get(pf)->advice = advice;
+      pthread_mutex_unlock(&hint_lock);
+      if (pf->ra) ra_advise(pf->ra, advice);
+      break;
+    case POSIX_FADV_NOREUSE:
+      break;
+    default:
+      return EINVAL;
+  }
+
+  if (pf->rfd >= 0) __libc_posix_fadvise(pf->rfd, offset, len, advice);
+  return 0;
+}
+
+ssize_t hint_read(plfs_file *pf, char *buf, size_t count, off_t offset, int *eof) {
+  *eof = 0;
+  size_t done = 0;
+
+  pthread_mutex_lock(&hint_lock);
+  hint_state *hs = pf->hint;
+  while (hs != NULL && done < count) {
+    off_t at = offset + done;
+    std::map<off_t, hint_block*>::iterator itr = hs->blocks.upper_bound(at);
+    if (itr == hs->blocks.begin()) break;
+    hint_block *b = (--itr)->second;
+    if (at >= b->offset + (off_t)b->len) break;
+
+    b->pins++;
+    while (b->state != HINT_DONE) pthread_cond_wait(&hint_done, &hint_lock);
+    ssize_t have = b->ret - (at - b->offset);
+    size_t n = have > 0 ? std::min(count - done, (size_t)have) : 0;
+    pthread_mutex_unlock(&hint_lock);
+    memcpy(buf + done, b->buf + (at - b->offset), n);
+    pthread_mutex_lock(&hint_lock);
+    b->pins--;
+
+    done += n;
+    if (b->ret >= 0 && (size_t)b->ret < b->len && at + (off_t)n >= b->offset + b->ret) {
+      *eof = 1;   // the file ends inside this block
+    }
+    int used_up = at + (off_t)n >= b->offset + (off_t)b->len;
+    if (!b->dropped && (b->ret < 0 || (used_up && hs->advice == POSIX_FADV_SEQUENTIAL))) {
+      hint_drop(b);
+    } else {
+      hint_free_unused(b);
+    }
+    if (*eof || n == 0) break;
+  }
+  pthread_mutex_unlock(&hint_lock);
+
+  if (done > 0) stats_event(STATS_EV_PREFETCH_HIT_BYTES, done);
+  return done;
+}
+
+void hint_written(plfs_file *pf) {
+  pthread_mutex_lock(&hint_lock);
+  if (pf->hint) hint_drop_range(pf->hint, 0, HINT_EOF);
+  pthread_mutex_unlock(&hint_lock);
+}
+
+void hint_close(plfs_file *pf) {
+  if (pf->hint == NULL) return;
+  pthread_mutex_lock(&hint_lock);
+  hint_state *hs = pf->hint;
+  while (!hs->blocks.empty()) hint_drop(hs->blocks.begin()->second);
+  // a prefetch thread may still be in plfs_read on the handle
+  while (hs->reading > 0) pthread_cond_wait(&hint_done, &hint_lock);
+  pf->hint = NULL;
+  pthread_mutex_unlock(&hint_lock);
+  delete hs;
+}
@@ -0,0 +1,351 @@
+#include "soplfs_internal.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <string>
+#include <vector>
+#include <map>
+#include <algorithm>
+
+
+/*
+ * PLFS handles across fork and exec
+ *
+ * fork: the child shares the parent's open Plfs_fd, which PLFS knows as
+ * the parent's.  Before the child's first write on it, inherit_writer()
+ * plfs_opens the handle again for the child's pid, which adds a writer
+ * to the open handle rather than opening the container anew, so the
+ * child's data lands in droppings of its own.  A child that never
+ * writes leaves the handle to the parent and does not plfs_close it.
+ * Burst-buffer logs stay with the parent and the child writes straight to
+ * PLFS, so fork first waits until the logs are drained: what the parent
+ * staged before it cannot land on top of the child's writes later.
+ *
+ * exec: the tmpfiles behind the descriptors survive it, plfs_files does
+ * not.  inherit_export() drains and syncs the handles and writes one
+ * record per descriptor (handle, flags, path, the FUSE descriptor, and
+ * the device and inode of both to recognize them by) to a memfd that is
+ * left open across exec; the exec and posix_spawn wrappers name it in
+ * SOPLFS_HANDLES.  The new program's soplfs reads it at load time and
+ * plfs_opens every handle whose descriptor is still the same file, so
+ * the descriptors it inherited keep going through PLFS.  Descriptors
+ * that were close-on-exec, or were closed or replaced on the way, are
+ * skipped.
+ *
+ * FUSE descriptors are close-on-exec at all other times: only those of
+ * the records written lose the flag, and inherit_unexport() puts it back
+ * once the exec failed or the spawned child is on its way.  A program
+ * whose environment does not preload soplfs gets neither them nor the
+ * memfd.
+ */
+
+#define INHERIT_MAGIC "SOPLFSIH"
+#define INHERIT_VERSION 1
+#define INHERIT_ENV "SOPLFS_HANDLES"
+#define INHERIT_MEMFD "soplfs-handles"
+
+struct inherit_header {
+  char magic[8];
+  uint32_t version;
+  uint32_t count;
+};
+
+struct inherit_record {
+  int32_t fd;
+  int32_t handle;     // records of dup'ed descriptors share one
+  int32_t flags;
+  int32_t rfd;
+  uint64_t dev;       // of fd
+  uint64_t ino;
+  uint64_t rdev;      // of rfd
+  uint64_t rino;
+  uint32_t path_len;  // the path follows
+  uint32_t pad;
+};
+
+pid_t inherit_pid = 0;
+
+static pthread_mutex_t inherit_lock = PTHREAD_MUTEX_INITIALIZER;
+
+
+// staged writes reach PLFS before anyone else writes the containers
+static void inherit_settle() {
+  for (std::map<int, plfs_file*>::iterator itr = plfs_files.begin();
+       itr != plfs_files.end(); itr++) {
+    plfs_file_settle(itr->second);
+  }
+}
+
+static void inherit_fork_prepare() {
+  if (soplfs_ready) inherit_settle();
+}
+
+// the child's copies of the handles are the parent's until it writes
+static void inherit_fork_child() {
+  inherit_pid = getpid();
+  pthread_mutex_init(&inherit_lock, NULL);
+  for (std::map<int, plfs_file*>::iterator itr = plfs_files.begin();
+       itr != plfs_files.end(); itr++) {
+    itr->second->bb = NULL;   // the parent's log and drain
+  }
+}
+
+plfs_error_t inherit_writer(plfs_file *pf) {
+  pthread_mutex_lock(&inherit_lock);
+  plfs_error_t plfs_error = PLFS_SUCCESS;
+  if (pf->writer != inherit_pid) {
+    // on an open handle plfs_open only adds the pid as a writer
+    int flags = pf->flags & ~(O_CREAT | O_EXCL | O_TRUNC);
+    plfs_retry retry(pf->mount);
+    plfs_error = PLFS_EAGAIN;
+    while (retry.again(plfs_error)) {
+      plfs_error = PLFS_CALL(plfs_open(&pf->fd, pf->path->c_str(), flags, inherit_pid, 0, NULL));
+    }
+    if (plfs_error == PLFS_SUCCESS) {
+      pf->writer = inherit_pid;
+      stats_event(STATS_EV_FORK_WRITER, 1);
+    }
+  }
+  pthread_mutex_unlock(&inherit_lock);
+  return plfs_error;
+}
+
+static int inherit_same(int fd, uint64_t dev, uint64_t ino) {
+  struct stat st;
+  if (fd < 0 || __libc_fstat(fd, &st) < 0) return 0;
+  return (uint64_t)st.st_dev == dev && (uint64_t)st.st_ino == ino;
+}
+
+static int inherit_stat(int fd, uint64_t *dev, uint64_t *ino) {
+  struct stat st;
+  if (__libc_fstat(fd, &st) < 0) return -1;
+  *dev = st.st_dev;
+  *ino = st.st_ino;
+  return 0;
+}
+
+// whether the new program loads soplfs too: its LD_PRELOAD names us
+static int inherit_preloaded(char *const envp[]) {
+  Dl_info info;
+  if (dladdr((void*)inherit_preloaded, &info) == 0 || info.dli_fname == NULL) return 0;
+  const char *self = strrchr(info.dli_fname, '/');
+  self = self ? self + 1 : info.dli_fname;
+
+  for (char *const *e = envp; e != NULL && *e != NULL; e++) {
+    if (strncmp(*e, "LD_PRELOAD=", 11) == 0) return strstr(*e + 11, self) != NULL;
+  }
+  return 0;
+}
+
+int inherit_export(char *const envp[]) {
+  if (!soplfs_ready || plfs_files.empty() || !inherit_preloaded(envp)) return -1;
+  inherit_settle();   // the drain thread does not survive the exec
+  sync_commit_all();   // the new program reopens the containers
+
+  std::string buf(sizeof(inherit_header), '\0');
+  std::map<plfs_file*, int> handles;
+  std::vector<int> rfds;
+  uint32_t count = 0;
+  for (std::map<int, plfs_file*>::iterator itr = plfs_files.begin();
+       itr != plfs_files.end(); itr++) {
+    plfs_file *pf = itr->second;
+    int fdflags = __libc_fcntl(itr->first, F_GETFD);
+    if (fdflags < 0 || (fdflags & FD_CLOEXEC)) continue;
+
+    inherit_record r;
+    memset(&r, 0, sizeof(r));
+    r.fd = itr->first;
+    r.flags = pf->flags;
+    r.rfd = pf->rfd;
+    if (inherit_stat(r.fd, &r.dev, &r.ino) < 0) continue;
+    if (r.rfd >= 0 && inherit_stat(r.rfd, &r.rdev, &r.rino) < 0) r.rfd = -1;
+    std::map<plfs_file*, int>::iterator h = handles.find(pf);
+    if (h == handles.end()) h = handles.insert(std::make_pair(pf, (int)handles.size())).first;
+    r.handle = h->second;
+    r.path_len = pf->path->size();
+
+    buf.append((const char*)&r, sizeof(r));
+    buf.append(*pf->path);
+    if (r.rfd >= 0) rfds.push_back(r.rfd);
+    count++;
+  }
+  if (count == 0) return -1;
+
+  inherit_header *hdr = (inherit_header*)&buf[0];
+  memcpy(hdr->magic, INHERIT_MAGIC, 8);
+  hdr->version = INHERIT_VERSION;
+  hdr->count = count;
+
+  int fd = memfd_create(INHERIT_MEMFD, 0);   // not MFD_CLOEXEC: it is for the exec
+  if (fd < 0) return -1;
+  if (__libc_pwrite(fd, buf.data(), buf.size(), 0) != (ssize_t)buf.size()) {
+    __libc_close(fd);
+    return -1;
+  }
+  for (size_t i = 0; i < rfds.size(); i++) __libc_fcntl(rfds[i], F_SETFD, 0);
+  return fd;
+}
+
+// after the exec failed or the spawn returned: the FUSE descriptors are
+// close-on-exec again
+void inherit_unexport(int fd) {
+  __libc_close(fd);
+  for (std::map<int, plfs_file*>::iterator itr = plfs_files.begin();
+       itr != plfs_files.end(); itr++) {
+    if (itr->second->rfd >= 0) __libc_fcntl(itr->second->rfd, F_SETFD, FD_CLOEXEC);
+  }
+}
+
+// envp with SOPLFS_HANDLES=fd in place of any it had; var holds the string
+void inherit_env(char *const envp[], int fd, std::string *var, std::vector<char*> *env) {
+  char num[16];
+  snprintf(num, sizeof(num), "%d", fd);
+  *var = std::string(INHERIT_ENV "=") + num;
+
+  size_t len = strlen(INHERIT_ENV);
+  for (char *const *e = envp; e != NULL && *e != NULL; e++) {
+    if (strncmp(*e, INHERIT_ENV, len) == 0 && (*e)[len] == '=') continue;
+    env->push_back(*e);
+  }
+  env->push_back(&(*var)[0]);
+  env->push_back(NULL);
+}
+
+static plfs_file* inherit_reopen(const inherit_record &r, const std::string &path,
+                                 const std::vector<std::pair<int, int> > &rfds) {
+  plfs_file *pf = new plfs_file();
+  pf->mount = plfs_mount_of(path.c_str());
+  int flags = r.flags & ~(O_CREAT | O_EXCL | O_TRUNC);   // done before exec
+
+  plfs_retry retry(pf->mount);
+  plfs_error_t plfs_error = PLFS_EAGAIN;
+  while (retry.again(plfs_error)) {
+    plfs_error = PLFS_CALL(plfs_open(&pf->fd, path.c_str(), flags, inherit_pid, 0, NULL));
+  }
+  if (plfs_error != PLFS_SUCCESS) {
+    std::cerr << "soplfs: cannot reopen inherited " << path << ": "
+              << strerror(plfs_error_to_errno(plfs_error)) << std::endl;
+    delete pf;
+    return NULL;
+  }
+
+  // the FUSE descriptor came along unless something closed it
+  int rfd = -1;
+  for (size_t i = 0; i < rfds.size(); i++) {
+    if (rfds[i].first == r.rfd && rfds[i].second) rfd = r.rfd;
+  }
+  if (rfd >= 0) {
+    __libc_fcntl(rfd, F_SETFD, FD_CLOEXEC);   // as it was before the exec
+  } else {
+    rfd = __libc_open(path.c_str(), flags | O_CLOEXEC);
+  }
+  if (rfd < 0) {
+    int num_refs = 0;
+    PLFS_CALL(plfs_close(pf->fd, inherit_pid, getuid(), flags, NULL, &num_refs));
+    delete pf;
+    return NULL;
+  }
+
+  pf->path = new std::string(path);
+  pf->flags = r.flags;
+  pf->rfd = rfd;
+  pf->tmp_file = NULL;
+  plfs_file_attach(pf, 0);
+  return pf;
+}
+
+// takes over the handles the program that exec'ed us had open
+static void inherit_restore() {
+  const char *v = getenv(INHERIT_ENV);
+  if (v == NULL || *v == '\0') return;
+  int fd = atoi(v);
+  unsetenv(INHERIT_ENV);   // not for our own children
+
+  // a program without soplfs in between may have passed the variable on
+  // and reused the number
+  char link[64], target[64];
+  snprintf(link, sizeof(link), "/proc/self/fd/%d", fd);
+  ssize_t len = readlink(link, target, sizeof(target) - 1);
+  if (len < 0) return;
+  target[len] = '\0';
+  if (strncmp(target, "/memfd:" INHERIT_MEMFD, strlen("/memfd:" INHERIT_MEMFD)) != 0) return;
+
+  struct stat st;
+  if (__libc_fstat(fd, &st) < 0) return;
+  std::string buf(std::max((size_t)st.st_size, sizeof(inherit_header)), '\0');
+  ssize_t n = __libc_pread(fd, &buf[0], st.st_size, 0);
+  __libc_close(fd);
+  inherit_header *hdr = (inherit_header*)&buf[0];
+  if (n != st.st_size || memcmp(hdr->magic, INHERIT_MAGIC, 8) != 0 ||
+      hdr->version != INHERIT_VERSION) {
+    return;
+  }
+
+  std::vector<inherit_record> records;
+  std::vector<std::string> paths;
+  size_t at = sizeof(inherit_header);
+  for (uint32_t i = 0; i < hdr->count; i++) {
+    if (at + sizeof(inherit_record) > buf.size()) return;
+    inherit_record r;
+    memcpy(&r, &buf[at], sizeof(r));
+    at += sizeof(r);
+    if (at + r.path_len > buf.size()) return;
+    records.push_back(r);
+    paths.push_back(buf.substr(at, r.path_len));
+    at += r.path_len;
+  }
+
+  // which FUSE descriptors are still what they were
+  std::vector<std::pair<int, int> > rfds;
+  for (size_t i = 0; i < records.size(); i++) {
+    const inherit_record &r = records[i];
+    if (r.rfd >= 0) rfds.push_back(std::make_pair(r.rfd, inherit_same(r.rfd, r.rdev, r.rino)));
+  }
+
+  std::map<int, plfs_file*> handles;
+  std::vector<int> used;
+  for (size_t i = 0; i < records.size(); i++) {
+    const inherit_record &r = records[i];
+    if (!inherit_same(r.fd, r.dev, r.ino)) continue;
+
+    std::map<int, plfs_file*>::iterator h = handles.find(r.handle);
+    if (h == handles.end()) {
+      plfs_file *pf = inherit_reopen(r, paths[i], rfds);
+      h = handles.insert(std::make_pair(r.handle, pf)).first;
+      if (pf != NULL) {
+        used.push_back(pf->rfd);
+        stats_event(STATS_EV_HANDLES, 1);
+        stats_event(STATS_EV_INHERITED, 1);
+      }
+    }
+    if (h->second != NULL) plfs_files.insert(std::make_pair((int)r.fd, h->second));
+  }
+
+  // FUSE descriptors whose handle did not make it across
+  for (size_t i = 0; i < rfds.size(); i++) {
+    if (!rfds[i].second) continue;
+    int still = 0;
+    for (size_t j = 0; j < used.size(); j++) still |= used[j] == rfds[i].first;
+    if (!still) {
+      __libc_close(rfds[i].first);
+      for (size_t j = i + 1; j < rfds.size(); j++) {
+        if (rfds[j].first == rfds[i].first) rfds[j].second = 0;
+      }
+    }
+  }
+}
+
+void inherit_init() {
+  inherit_pid = getpid();
+  pthread_atfork(inherit_fork_prepare, NULL, inherit_fork_child);
+  inherit_restore();
+}
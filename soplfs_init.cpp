@@ -0,0 +1,27 @@
+#include "soplfs_internal.h"
+#include "soplfs_uring.h"
+
+
+/*
+ * Load-time initialization
+ *
+ * This constructor uses the C++ globals of every other file.  Those are
+ * marked SOPLFS_GLOBAL and built at a higher priority, so the link order
+ * does not matter.  The modules read their options and start their
+ * threads here, before main(), instead of in the first call that needs
+ * them.
+ */
+
+// std::cerr, before the other files' own ios_base::Init objects
+static std::ios_base::Init soplfs_ioinit SOPLFS_GLOBAL;
+
+__attribute__((constructor(SOPLFS_INIT_PRIORITY))) static void soplfs_constructor() {
+  soplfs_loaded = 1;
+  soplfs_init();
+  stats_init();
+  bb_init();
+  sync_init();
+  ra_init();
+  route_init();
+  inherit_init();   // last: reopens handles from before exec
+}
@@ -0,0 +1,512 @@
+#ifndef SOPLFS_INTERNAL_H
+#define SOPLFS_INTERNAL_H
+
+#include "plfs.h"
+#include "soplfs_stats.h"
+
+#include <stdio.h>
+#include <aio.h>
+#include <ftw.h>
+#include <fts.h>
+#include <dlfcn.h>
+#include <time.h>
+#include <sys/types.h>
+
+#include <string>
+#include <map>
+#include <vector>
+#include <iostream>
+
+
+// the constructor binds every symbol; only calls made before it ran
+// (from other libraries' constructors) take the dlsym branch
+#define MAP(func, ret) \
+    if (__builtin_expect(!(__libc_ ## func), 0)) { \
+        __libc_ ## func = (ret) dlsym(RTLD_NEXT, #func); \
+        if (!(__libc_ ## func)) std::cerr  << "Failed to link symbol: " << #func << std::endl; \
+    }
+
+
+struct bb_log;
+struct sync_group;
+struct ra_state;
+struct flight_file;
+struct hint_state;
+struct bcache_file;
+struct paio_list;
+
+struct plfs_file_t {
+  Plfs_fd *fd;
+  std::string *path;
+  int rfd;   // for small reads, through FUSE
+  int flags;
+  FILE* tmp_file;
+  bb_log *bb;  // node-local staging log, NULL unless SOPLFS_BB_DIR is set
+  sync_group *sg;
+  ra_state *ra;  // read-ahead window over rfd
+  flight_file *fl;  // plfs_reads in progress on the container
+  hint_state *hint;  // blocks prefetched on posix_fadvise, NULL until a hint
+  bcache_file *bc;  // reads go through the node's block cache, NULL: they don't
+  int mount;     // index into mount_points
+  pid_t writer;  // process fd is open for; a forked child is not, until it writes
+  plfs_file_t(): fd(NULL), path(NULL), rfd(-1), flags(0), bb(NULL), sg(NULL), ra(NULL), fl(NULL), hint(NULL), bc(NULL), mount(-1), writer(0) {}
+};
+typedef plfs_file_t plfs_file;
+extern std::map<int, plfs_file*> plfs_files;
+
+extern std::vector<std::string> mount_points;
+extern std::map<std::string, std::string> phys_paths;
+
+int plfs_mount_of(const char *path);
+
+
+/*
+ * Per-mount tuning (soplfs_tune.cpp)
+ *
+ * "soplfs_<key>: <value>" lines in plfsrc set a knob for the mount_point
+ * above them, or for every mount when they come before the first one;
+ * SOPLFS_<KEY> in the environment overrides both.  mount_tuning(-1)
+ * serves paths on no mount and the process-wide knobs (aio_threads).
+ */
+
+struct soplfs_tuning {
+  size_t read_split;        // read()s smaller than this go through FUSE
+  int pread_split;          // split pread() the same way, else always plfs_read
+  int read_adapt;           // learn the cheaper route per size class (soplfs_route.cpp)
+  int read_dedup;           // share concurrent plfs_reads of a range (soplfs_flight.cpp)
+  int eagain_retries;       // retries of a call PLFS failed with EAGAIN, -1: no limit
+  int eagain_backoff_us;    // pause before each retry
+  size_t readahead;         // read-ahead window of small reads, 0: off
+  int readahead_chunks;     // parallel reads per window
+  size_t mmap_readahead;    // largest range a page fault on a PLFS mapping reads
+  size_t prefetch_max;      // most a handle holds prefetched on POSIX_FADV_WILLNEED
+  long attr_ttl;            // ms a cached stat of a path is good for, 0: no cache
+  size_t block_cache;       // node-wide cache of read-only files' blocks, 0: none
+  size_t aio_coalesce;      // largest merged lio_listio request
+  int aio_threads;          // aio worker pool, process-wide
+  long sync_interval;       // ms a handle may stay dirty, 0: no limit
+  size_t sync_bytes;        // unsynced bytes a handle may hold, 0: no limit
+  size_t copy_chunk;        // unit of copy_file_range/sendfile/splice on PLFS
+  int copy_threads;         // chunks of one such copy in flight at once
+  int walk_threads;         // listing/stat threads of an nftw or fts walk, 0: libc's walk
+  int seek_holes;           // ask FUSE for the holes on SEEK_DATA/SEEK_HOLE
+};
+
+void tune_set(int mount, const std::string &key, const std::string &value);
+void tune_done(size_t mounts);
+const soplfs_tuning& mount_tuning(int mount);
+int tune_retry(int mount, int tries);
+
+// EAGAIN from PLFS: retry as the mount says
+//   plfs_retry retry(mount);
+//   while (retry.again(plfs_error)) plfs_error = PLFS_CALL(...);
+struct plfs_retry {
+  int mount;
+  int tries;
+  plfs_retry(int mount) : mount(mount), tries(0) {}
+  int again(plfs_error_t e) {
+    if (e != PLFS_EAGAIN) return 0;
+    return tries++ == 0 || tune_retry(mount, tries - 1);
+  }
+};
+
+
+/*
+ * Adaptive read routing (soplfs_route.cpp)
+ *
+ * route_pick() chooses between FUSE (STATS_PLFS_SMALL) and plfs_read
+ * (STATS_PLFS) for a read from what each has cost the mount at that
+ * size lately; seed is the route the static read_split rules give.
+ * route_done() feeds back the time the read took.
+ */
+
+void route_init();
+int route_pick(plfs_file *pf, size_t count, int seed);
+void route_done(plfs_file *pf, size_t count, int route, unsigned long long ticks);
+std::string route_report(double ns_per_tick);
+
+
+/*
+ * Single-flight reads (soplfs_flight.cpp)
+ *
+ * A plfs_read that falls inside one already in progress on the same
+ * container, from any handle, waits for it and copies its result.
+ */
+
+flight_file* flight_open(const char *path, int mount);
+void flight_close(flight_file *fl);
+void flight_written(flight_file *fl);
+unsigned long flight_gen(flight_file *fl);   // writes so far
+ssize_t flight_read(plfs_file *pf, char *buf, size_t count, off_t offset);
+
+
+/*
+ * mmap of PLFS files (soplfs_mmap.cpp)
+ *
+ * PLFS mappings are anonymous memory that a userfaultfd handler fills
+ * from plfs_read as it is touched, with read-ahead from the fault
+ * pattern and madvise.
+ */
+
+void* pmap_map(plfs_file *pf, void *addr, size_t len, int prot, int flags, off_t offset);
+void pmap_unmap(void *addr, size_t len);
+int pmap_advise(void *addr, size_t len, int advice);
+
+
+/*
+ * posix_fadvise and readahead on PLFS files (soplfs_hint.cpp)
+ *
+ * WILLNEED prefetches the range with plfs_read in the background into
+ * blocks that later reads on the handle are served from; DONTNEED drops
+ * them, SEQUENTIAL and RANDOM steer the read-ahead window.
+ */
+
+int hint_advise(plfs_file *pf, off_t offset, off_t len, int advice);
+ssize_t hint_read(plfs_file *pf, char *buf, size_t count, off_t offset, int *eof);
+void hint_written(plfs_file *pf);
+void hint_close(plfs_file *pf);
+
+
+/*
+ * Node-wide attribute cache (soplfs_acache.cpp)
+ *
+ * stat of a PLFS path is answered from a /dev/shm table shared by the
+ * job's processes on the node while the mount's attr_ttl lasts; a
+ * process that changes a path expires it for all of them with
+ * acache_changed(), or acache_written() when only the file's data did.
+ */
+
+int acache_get(const char *path, int mount, struct stat *st, plfs_error_t *err,
+               unsigned *gen);
+void acache_put(const char *path, int mount, const struct stat *st, plfs_error_t err,
+                unsigned gen);
+void acache_changed(const char *path);
+void acache_written(const char *path, int mount);
+std::string shm_job_segment(const char *kind);   // "/soplfs-<kind>.<uid>.<job>"
+
+// pids attached to a job segment; the last to detach removes it
+#define SHM_USERS 1024
+struct shm_users {
+  int pid[SHM_USERS];
+};
+void shm_job_attach(shm_users *u);
+void shm_job_detach(shm_users *u, const std::string &name);
+
+
+/*
+ * Node-wide block cache (soplfs_bcache.cpp)
+ *
+ * plfs_reads on read-only handles go through 1M blocks in a /dev/shm
+ * segment shared by the job's processes on the node, keyed by path and
+ * block and checked against the container's stamp at open.
+ */
+
+void bcache_open(plfs_file *pf, int flags);
+void bcache_close(plfs_file *pf);
+int bcache_usable(plfs_file *pf);
+ssize_t bcache_read(plfs_file *pf, char *buf, size_t count, off_t offset);
+
+
+/*
+ * In-process copies (soplfs_copy.cpp)
+ *
+ * copy_file_range, sendfile and splice with a PLFS descriptor on either
+ * side, and rename between a PLFS mount and elsewhere, copy through
+ * plfs_read/plfs_write in parallel chunks.
+ */
+
+struct xfer_end {
+  int fd;
+  plfs_file *pf;            // NULL: not a PLFS descriptor
+  int seekable;             // 0: pipe or socket, read and written in order
+};
+
+void xfer_open(xfer_end *e, int fd);
+ssize_t xfer_copy(xfer_end *in, off_t in_off, xfer_end *out, off_t out_off, size_t len);
+int xfer_rename(const char *from, const char *to, int from_plfs, int to_plfs);
+
+
+/*
+ * Handles across fork and exec (soplfs_inherit.cpp)
+ *
+ * A forked child adds itself as a writer of an inherited handle before
+ * its first write; exec and posix_spawn pass the open handles to the new
+ * program in a memfd named by SOPLFS_HANDLES, which its soplfs reopens
+ * on the descriptors it got.
+ */
+
+extern pid_t inherit_pid;   // getpid(), kept current across fork
+
+void inherit_init();
+plfs_error_t inherit_writer(plfs_file *pf);
+int inherit_export(char *const envp[]);
+void inherit_unexport(int fd);
+void inherit_env(char *const envp[], int fd, std::string *var, std::vector<char*> *env);
+
+
+/*
+ * Parallel tree walks (soplfs_walk.cpp)
+ *
+ * nftw, ftw and fts over a PLFS tree: walk_threads threads list and
+ * stat directories ahead of the caller, whose callbacks and fts_read
+ * results come on its own thread in the order its flags ask for.
+ */
+
+typedef int (*walk_nftw_fn)(const char *path, const struct stat *st, int type,
+                            struct FTW *ftw);
+typedef int (*walk_ftw_fn)(const char *path, const struct stat *st, int type);
+
+int walk_wanted(const char *cpath);
+int walk_nftw(const char *path, const char *cpath, walk_nftw_fn fn, walk_ftw_fn old_fn,
+              int flags);
+FTS* walk_fts_open(char *const *argv, const std::vector<std::string> &cpaths, int options,
+                   int (*compar)(const FTSENT**, const FTSENT**));
+int walk_fts_owns(FTS *ftsp);
+FTSENT* walk_fts_read(FTS *ftsp);
+FTSENT* walk_fts_children(FTS *ftsp, int instr);
+int walk_fts_set(FTS *ftsp, FTSENT *p, int instr);
+int walk_fts_close(FTS *ftsp);
+
+
+// the load-time constructor (soplfs_init.cpp) runs at SOPLFS_INIT_PRIORITY;
+// every C++ global with a constructor is marked SOPLFS_GLOBAL so that it
+// is built before, whatever the link order
+#define SOPLFS_GLOBAL_PRIORITY 200
+#define SOPLFS_INIT_PRIORITY 300
+#define SOPLFS_GLOBAL __attribute__((init_priority(SOPLFS_GLOBAL_PRIORITY)))
+
+extern int soplfs_loaded;         // the load-time constructor has started
+extern int soplfs_ready;          // symbols, mounts and phys paths are set up
+extern long long soplfs_init_ns;  // how long that took
+void soplfs_init();
+
+inline void soplfs_check() {
+  if (__builtin_expect(!soplfs_ready, 0)) soplfs_init();
+}
+
+
+extern int (*__libc_open)(const char* path, int flags, ...);
+extern int (*__libc_close)(int fd);
+extern ssize_t (*__libc_read)(int fd, void* buf, size_t count);
+extern ssize_t (*__libc_write)(int fd, const void* buf, size_t count);
+extern ssize_t (*__libc_pread)(int fd, void* buf, size_t count, off_t offset);
+extern ssize_t (*__libc_pwrite)(int fd, const void* buf, size_t count, off_t offset);
+extern int (*__libc_fdatasync)(int fd);
+extern int (*__libc_lio_listio)(int mode, struct aiocb *const list[], int nent,
+                                 struct sigevent *sevp);
+extern int (*__libc_aio_suspend)(const struct aiocb *const list[], int nent,
+                                 const struct timespec *timeout);
+extern void* (*__libc_mmap)(void *addr, size_t len, int prot, int flags, int fd, off_t offset);
+extern int (*__libc_munmap)(void *addr, size_t len);
+extern int (*__libc_madvise)(void *addr, size_t len, int advice);
+extern int (*__libc_stat)(const char* pathname, struct stat* statbuf);
+extern int (*__libc_fstat)(int fd, struct stat *buf);
+extern int (*__libc_posix_fadvise)(int fd, off_t offset, off_t len, int advice);
+extern int (*__libc_fcntl)(int fildes, int cmd, ...);
+
+
+plfs_error_t plfs_file_write(plfs_file *pf, const char *buf, size_t count,
+                             off_t offset, ssize_t *written);
+plfs_error_t plfs_stat_path(const char *cpath, struct stat *buf);
+plfs_error_t plfs_file_sync(plfs_file *pf);
+ssize_t plfs_file_pread(plfs_file *pf, void *buf, size_t count, off_t offset);
+void plfs_file_attach(plfs_file *pf, mode_t mode);
+
+
+/*
+ * Burst-buffer write staging (soplfs_bb.cpp)
+ *
+ * Writes on a PLFS handle are appended to a node-local log and replayed
+ * into plfs_write by a drain thread.  Enabled by SOPLFS_BB_DIR.
+ */
+
+int bb_enabled();
+void bb_init();
+bb_log* bb_open(Plfs_fd *fd, const char *path, int flags, mode_t mode);
+plfs_error_t bb_write(bb_log *log, const char *buf, size_t count,
+                      off_t offset, ssize_t *written);
+plfs_error_t bb_wait(bb_log *log);
+plfs_error_t bb_sync(bb_log *log);
+int bb_close(bb_log *log, plfs_error_t *err);
+
+
+/*
+ * Group commit (soplfs_sync.cpp)
+ *
+ * Concurrent syncs of one container, through any of its handles, share a
+ * single sync pass; an optional flusher thread syncs dirty containers by
+ * age or size.
+ */
+
+void sync_init();
+sync_group* sync_open(plfs_file *pf);
+void sync_mark(sync_group *sg, plfs_file *pf, size_t bytes);
+plfs_error_t sync_commit(sync_group *sg, plfs_file *pf);
+plfs_error_t sync_commit_all();
+void sync_start(sync_group *sg);
+void sync_close(sync_group *sg, plfs_file *pf);
+
+
+// staged writes have to reach PLFS before the handle is read back
+inline void plfs_file_settle(plfs_file *pf) {
+  if (pf->bb) bb_wait(pf->bb);
+}
+
+
+/*
+ * POSIX AIO engine (soplfs_aio.cpp)
+ *
+ * aiocbs on PLFS descriptors run on soplfs' own worker pool; lio_listio
+ * merges adjacent ranges into single backend calls.  paio_list_start()
+ * runs such a list for soplfs' own list I/O (soplfs.h).
+ */
+
+int paio_submit(plfs_file *pf, struct aiocb *cb, int op);
+int paio_listio(int mode, struct aiocb *const list[], int nent, struct sigevent *sevp);
+int paio_owns(const struct aiocb *cb);
+int paio_error(const struct aiocb *cb);
+ssize_t paio_return(struct aiocb *cb);
+int paio_suspend(const struct aiocb *const list[], int nent,
+                 const struct timespec *timeout);
+int paio_cancel(plfs_file *pf, struct aiocb *cb);
+void paio_forget(const struct aiocb *cb);
+void paio_close(plfs_file *pf);
+paio_list* paio_list_start(struct aiocb *const list[], int nent);
+int paio_list_done(paio_list *pl);
+void paio_list_wait(paio_list *pl);
+
+
+/*
+ * Per-call statistics (soplfs_stats.cpp)
+ *
+ * Every entry point opens a stats_call naming its operation and, once
+ * it knows, the route the call took; PLFS_CALL() around a plfs_* call
+ * charges its time and EAGAIN retries to that entry point.  Counters and
+ * log2 latency histograms are kept in per-thread slots (soplfs_stats.h)
+ * and written out as JSON at exit, and on SOPLFS_STATS_SIGNAL, when
+ * SOPLFS_STATS names a file.  SOPLFS_STATS_SHM=1 publishes the slots
+ * for soplfs-top while the process runs.
+ */
+
+struct stats_call {
+  int op;
+  int route;
+  size_t bytes;
+  int mount;                  // -1: not on a PLFS mount
+  unsigned long long start;   // 0: not counted
+  unsigned long long plfs_mark;
+  unsigned long long plfs_ticks;
+  unsigned plfs_calls;
+  unsigned eagain;
+
+  // the call's arguments, for SOPLFS_TRACE
+  long long handle;
+  long long offset;
+  long long result;
+  size_t size;
+  int flags;
+
+  inline stats_call(int op);
+  inline ~stats_call();
+  inline void trace_fd(long long handle, size_t size, long long offset = -1);
+  inline void trace_path(const char *path, int flags = 0, unsigned mode = 0,
+                         const char *to = NULL);
+  void trace_result(long long r) { result = r; }
+};
+
+extern int stats_enabled;   // -1 until SOPLFS_STATS has been read
+extern __thread stats_call *stats_current __attribute__((tls_model("initial-exec")));
+extern __thread stats_thread *stats_self __attribute__((tls_model("initial-exec")));
+
+void stats_init();
+stats_thread* stats_thread_get();
+void stats_record(stats_call *sc);
+void stats_dump();
+
+inline int stats_on() {
+  if (__builtin_expect(stats_enabled < 0, 0)) stats_init();
+  return stats_enabled;
+}
+
+inline stats_thread* stats_slot() {
+  return stats_self != NULL ? stats_self : stats_thread_get();
+}
+
+// the outermost entry point on a thread owns the call; nested ones
+// (fprintf -> vfprintf, soplfs calling itself) are not counted twice
+inline stats_call::stats_call(int op)
+  : op(op), route(STATS_PASS), bytes(0), mount(-1), start(0),
+    plfs_mark(0), plfs_ticks(0), plfs_calls(0), eagain(0),
+    handle(-1), offset(-1), result(0), size(0), flags(0) {
+  if (stats_on() <= 0 || stats_current != NULL) return;
+  stats_current = this;
+  start = stats_ticks();
+
+  // published so a reader can tell a stalled call from an idle process
+  stats_thread *st = stats_slot();
+  if (st) {
+    st->inflight_op = op;
+    st->inflight_start = start;
+  }
+}
+
+inline stats_call::~stats_call() {
+  if (start == 0) return;
+  stats_record(this);
+  stats_current = NULL;
+}
+
+inline void stats_plfs_begin() {
+  if (stats_current) stats_current->plfs_mark = stats_ticks();
+}
+
+inline plfs_error_t stats_plfs_end(plfs_error_t err) {
+  stats_call *sc = stats_current;
+  if (sc) {
+    sc->plfs_ticks += stats_ticks() - sc->plfs_mark;
+    sc->plfs_calls++;
+    if (err == PLFS_EAGAIN) sc->eagain++;
+  }
+  return err;
+}
+
+// gauges and cache counters that are not tied to one call
+inline void stats_event(int ev, long long n) {
+  if (stats_on() <= 0) return;
+  stats_thread *st = stats_slot();
+  if (st) st->events[ev] += n;
+}
+
+#define PLFS_CALL(call) (stats_plfs_begin(), stats_plfs_end(call))
+
+
+/*
+ * I/O trace (soplfs_trace.cpp)
+ *
+ * With SOPLFS_TRACE set, every call that took a PLFS route is appended,
+ * with the arguments its entry point noted through trace_fd() or
+ * trace_path() and trace_result(), to a per-thread ring that a flusher
+ * thread writes out to the trace file (format in soplfs_trace.h).
+ */
+
+extern int trace_enabled;
+
+void trace_init(const char *file);
+void trace_save_path(const char *path, const char *to);
+void trace_add(const stats_call *sc, unsigned long long ticks);
+
+inline void stats_call::trace_fd(long long handle, size_t size, long long offset) {
+  this->handle = handle;
+  this->size = size;
+  this->offset = offset;
+}
+
+// the path is copied now: entry points free theirs before returning
+inline void stats_call::trace_path(const char *path, int flags, unsigned mode,
+                                   const char *to) {
+  this->flags = flags;
+  this->size = mode;
+  if (start != 0 && trace_enabled) trace_save_path(path, to);
+}
+
+#endif
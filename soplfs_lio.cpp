@@ -0,0 +1,133 @@
+#include "soplfs_internal.h"
+#include "soplfs.h"
+
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+
+#include <vector>
+
+
+/*
+ * Native list I/O (soplfs.h)
+ *
+ * A list becomes one aiocb per segment, handed to the AIO engine as a
+ * list of its own: the engine sorts it, merges adjacent segments and
+ * runs the pieces on its worker pool, as for lio_listio.  Waiting
+ * collects every aiocb's result in segment order.
+ */
+
+struct soplfs_lio {
+  std::vector<struct aiocb> cbs;
+  std::vector<struct aiocb*> list;   // NULL for empty segments
+  paio_list *pl;
+};
+
+
+static soplfs_lio* lio_start(stats_call &sc, int fd, const struct soplfs_seg *segs,
+                             int nsegs, int op) {
+  soplfs_check();
+  if (nsegs < 0 || (nsegs > 0 && segs == NULL)) {
+    errno = EINVAL;
+    return NULL;
+  }
+
+  std::map<int, plfs_file*>::iterator itr = plfs_files.find(fd);
+  int mode = itr != plfs_files.end() ? itr->second->flags & O_ACCMODE : -1;
+  if (mode < 0 || (op == LIO_READ && mode == O_WRONLY) ||
+      (op == LIO_WRITE && mode == O_RDONLY)) {
+    errno = EBADF;
+    return NULL;
+  }
+  sc.route = STATS_PLFS;
+  sc.mount = itr->second->mount;
+
+  soplfs_lio *lio = new soplfs_lio();
+  lio->cbs.resize(nsegs);
+  lio->list.resize(nsegs);
+  size_t total = 0;
+  for (int i = 0; i < nsegs; i++) {
+    struct aiocb *cb = &lio->cbs[i];
+    memset(cb, 0, sizeof(*cb));
+    cb->aio_fildes = fd;
+    cb->aio_offset = segs[i].offset;
+    cb->aio_nbytes = segs[i].len;
+    cb->aio_buf = segs[i].buf;
+    cb->aio_lio_opcode = op;
+    cb->aio_sigevent.sigev_notify = SIGEV_NONE;
+    lio->list[i] = segs[i].len ? cb : NULL;
+    total += segs[i].len;
+  }
+  sc.bytes = total;
+  sc.trace_fd(fd, total, nsegs ? segs[0].offset : 0);
+
+  lio->pl = paio_list_start(nsegs ? &lio->list[0] : NULL, nsegs);
+  return lio;
+}
+
+static ssize_t lio_finish(soplfs_lio *lio) {
+  paio_list_wait(lio->pl);
+
+  ssize_t total = 0;
+  int error = 0;
+  for (size_t i = 0; i < lio->list.size(); i++) {
+    if (lio->list[i] == NULL) continue;
+    errno = 0;
+    ssize_t n = paio_return(lio->list[i]);
+    if (n < 0 && error == 0) error = errno ? errno : EIO;
+    if (n > 0) total += n;
+  }
+  delete lio;
+
+  if (error) {
+    errno = error;
+    return -1;
+  }
+  return total;
+}
+
+#pragma GCC visibility push(default)
+
+extern "C" {
+
+ssize_t soplfs_read_list(int fd, const struct soplfs_seg *segs, int nsegs) {
+  stats_call sc(STATS_LIO_LISTIO);
+  soplfs_lio *lio = lio_start(sc, fd, segs, nsegs, LIO_READ);
+  ssize_t ret = lio ? lio_finish(lio) : -1;
+  sc.trace_result(ret);
+  return ret;
+}
+
+ssize_t soplfs_write_list(int fd, const struct soplfs_seg *segs, int nsegs) {
+  stats_call sc(STATS_LIO_LISTIO);
+  soplfs_lio *lio = lio_start(sc, fd, segs, nsegs, LIO_WRITE);
+  ssize_t ret = lio ? lio_finish(lio) : -1;
+  sc.trace_result(ret);
+  return ret;
+}
+
+soplfs_lio* soplfs_read_list_start(int fd, const struct soplfs_seg *segs, int nsegs) {
+  stats_call sc(STATS_LIO_LISTIO);
+  soplfs_lio *lio = lio_start(sc, fd, segs, nsegs, LIO_READ);
+  sc.trace_result(lio ? 0 : -1);
+  return lio;
+}
+
+soplfs_lio* soplfs_write_list_start(int fd, const struct soplfs_seg *segs, int nsegs) {
+  stats_call sc(STATS_LIO_LISTIO);
+  soplfs_lio *lio = lio_start(sc, fd, segs, nsegs, LIO_WRITE);
+  sc.trace_result(lio ? 0 : -1);
+  return lio;
+}
+
+int soplfs_lio_test(soplfs_lio *lio) {
+  return paio_list_done(lio->pl);
+}
+
+ssize_t soplfs_lio_wait(soplfs_lio *lio) {
+  return lio_finish(lio);
+}
+
+}
+
+#pragma GCC visibility pop
@@ -0,0 +1,413 @@
+#include "soplfs_internal.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/userfaultfd.h>
+
+#include <map>
+#include <algorithm>
+
+
+/*
+ * mmap of PLFS files
+ *
+ * The descriptor of a PLFS file is a placeholder, so mapping it would
+ * map an empty file.  Instead a PLFS mapping is private anonymous memory
+ * registered with userfaultfd: a handler thread fills each missing page
+ * range with plfs_read through a handle of the mapping's own (a mapping
+ * outlives its descriptor).  Faults that continue where the last one
+ * ended double the range up to the mount's mmap_readahead; others get
+ * PMAP_CHUNK, or one page after MADV_RANDOM.  MADV_SEQUENTIAL reads the
+ * full window every time and MADV_WILLNEED reads the range right away.
+ *
+ * Mappings are read-only views of the file as of the fault: MAP_SHARED
+ * with PROT_WRITE is refused, and writes to a MAP_PRIVATE mapping stay
+ * private as usual.  Pages past the end of the file read as zeros.
+ * Mappings are not inherited by fork (MADV_DONTFORK): the child has no
+ * handler to fill them, and sets up a userfaultfd of its own on its first
+ * PLFS mmap.
+ *
+ * Faults are filled one at a time by the single handler thread, so a
+ * slow read does hold up the faults queued behind it.  pmap_lock guards
+ * the region map but is not held across a backend read, so munmap,
+ * madvise and MADV_WILLNEED fills in other threads do not wait for it.
+ * A region unmapped meanwhile is only marked dead and freed by the last
+ * reader, which then installs nothing.
+ *
+ * Without userfaultfd (kernel or vm.unprivileged_userfaultfd) the file
+ * is mapped through the FUSE mount instead.
+ */
+
+#define PMAP_CHUNK (64 * 1024)
+
+struct pmap_region {
+  char *start;
+  size_t len;
+  off_t offset;           // file offset of start
+  size_t live;            // bytes not unmapped yet
+  plfs_file pf;           // fd, path and mount of the mapping's own handle
+  int advice;             // MADV_NORMAL, MADV_SEQUENTIAL or MADV_RANDOM
+  char *next;             // where a sequential fault lands
+  size_t window;          // current read-ahead
+  int busy;               // fills reading without pmap_lock
+  int dead;               // unmapped while busy: the last fill frees it
+};
+
+static pthread_once_t pmap_once = PTHREAD_ONCE_INIT;
+static pthread_mutex_t pmap_lock = PTHREAD_MUTEX_INITIALIZER;
+static std::map<char*, pmap_region*> pmap_regions SOPLFS_GLOBAL;   // by start
+static int pmap_count = 0;    // regions; read without the lock by munmap
+static int pmap_uffd = -1;
+static long pmap_page = 4096;
+static char *pmap_buf = NULL;   // the handler's read buffer
+static size_t pmap_buf_size = 0;
+static int pmap_atfork = 0;
+
+
+static int pmap_copy(char *dst, const char *src, size_t len, char *fault) {
+  size_t done = 0;
+  int woken = 0;
+  while (done < len) {
+    struct uffdio_copy c;
+    c.dst = (unsigned long)(dst + done);
+    c.src = (unsigned long)(src + done);
+    c.len = len - done;
+    c.mode = 0;
+    c.copy = 0;
+    if (ioctl(pmap_uffd, UFFDIO_COPY, &c) == 0) {
+      if (dst + done <= fault) woken = 1;
+      break;
+    }
+    if (c.copy > 0) {
+      if (dst + done <= fault && fault < dst + done + c.copy) woken = 1;
+      done += c.copy;
+    } else if (errno == EEXIST) {
+      done += pmap_page;   // filled meanwhile: skip it
+    } else if (errno != EAGAIN) {
+      return -1;           // ENOENT, ESRCH: unmapped or process exiting
+    }
+  }
+
+  // the faulting page was already there: its thread still sleeps
+  if (fault != NULL && !woken) {
+    struct uffdio_range r;
+    r.start = (unsigned long)fault;
+    r.len = pmap_page;
+    ioctl(pmap_uffd, UFFDIO_WAKE, &r);
+  }
+  return 0;
+}
+
+static void pmap_release(pmap_region *rg) {
+  int num_refs;
+  PLFS_CALL(plfs_close(rg->pf.fd, getpid(), getuid(), O_RDONLY, NULL, &num_refs));
+  delete rg->pf.path;
+  delete rg;
+}
+
+// reads [addr, addr + len) of the region into *buf and installs it.
+// Called with pmap_lock held, which is dropped for the read; returns 0
+// if the region was unmapped meanwhile (rg is then gone)
+static int pmap_fill(pmap_region *rg, char *addr, size_t len, char *fault,
+                     char **buf, size_t *buf_size) {
+  len = std::min(len, (size_t)(rg->start + rg->len - addr));
+  rg->busy++;
+  pthread_mutex_unlock(&pmap_lock);
+
+  if (len > *buf_size) {
+    char *bigger;
+    if (posix_memalign((void**)&bigger, pmap_page, len) == 0) {
+      free(*buf);
+      *buf = bigger;
+      *buf_size = len;
+    } else {
+      len = *buf_size;   // read less; addr is the faulting page
+    }
+  }
+
+  ssize_t n = plfs_file_pread(&rg->pf, *buf, len, rg->offset + (addr - rg->start));
+  if (n < 0) {
+    std::cerr << "soplfs: mmap of " << *rg->pf.path << " failed to read at "
+              << rg->offset + (addr - rg->start) << ", filling zeros" << std::endl;
+    n = 0;
+  }
+  memset(*buf + n, 0, len - n);
+
+  pthread_mutex_lock(&pmap_lock);
+  rg->busy--;
+  if (rg->dead) {
+    if (rg->busy == 0) pmap_release(rg);
+    return 0;
+  }
+  stats_event(STATS_EV_MMAP_FAULT, 1);
+  stats_event(STATS_EV_MMAP_BYTES, len);
+  pmap_copy(addr, *buf, len, fault);
+  return 1;
+}
+
+static pmap_region* pmap_find(const char *addr) {
+  std::map<char*, pmap_region*>::iterator itr = pmap_regions.upper_bound((char*)addr);
+  if (itr == pmap_regions.begin()) return NULL;
+  --itr;
+  pmap_region *rg = itr->second;
+  return addr < rg->start + rg->len ? rg : NULL;
+}
+
+static void pmap_fault(char *addr) {
+  char *page = (char*)((unsigned long)addr & ~(pmap_page - 1));
+
+  pthread_mutex_lock(&pmap_lock);
+  pmap_region *rg = pmap_find(page);
+  if (rg != NULL) {
+    size_t max = std::max(mount_tuning(rg->pf.mount).mmap_readahead, (size_t)pmap_page);
+    size_t len;
+    if (rg->advice == MADV_RANDOM) {
+      len = pmap_page;
+    } else if (rg->advice == MADV_SEQUENTIAL) {
+      len = max;
+    } else if (page == rg->next) {
+      len = rg->window = std::min(rg->window * 2, max);
+    } else {
+      len = rg->window = std::min((size_t)PMAP_CHUNK, max);
+    }
+    if (pmap_fill(rg, page, len, page, &pmap_buf, &pmap_buf_size)) rg->next = page + len;
+  }
+  pthread_mutex_unlock(&pmap_lock);
+}
+
+static void* pmap_handler_main(void *arg) {
+  struct pollfd pfd;
+  pfd.fd = pmap_uffd;
+  pfd.events = POLLIN;
+
+  while (1) {
+    if (poll(&pfd, 1, -1) < 0) continue;
+
+    struct uffd_msg msg[16];
+    ssize_t n = __libc_read(pmap_uffd, msg, sizeof(msg));
+    if (n <= 0) continue;
+    for (int i = 0; i < n / (ssize_t)sizeof(msg[0]); i++) {
+      if (msg[i].event == UFFD_EVENT_PAGEFAULT) {
+        pmap_fault((char*)msg[i].arg.pagefault.address);
+      }
+    }
+  }
+  return NULL;
+}
+
+// the userfaultfd is tied to the parent's address space and the handler
+// stayed with the parent, as did the mappings; the next PLFS mmap starts
+// over.  The regions' PLFS handles are the parent's to close
+static void pmap_fork_child() {
+  pthread_mutex_init(&pmap_lock, NULL);
+  if (pmap_uffd >= 0) __libc_close(pmap_uffd);
+  pmap_uffd = -1;
+  for (std::map<char*, pmap_region*>::iterator itr = pmap_regions.begin();
+       itr != pmap_regions.end(); itr++) {
+    delete itr->second->pf.path;
+    delete itr->second;
+  }
+  pmap_regions.clear();
+  pmap_count = 0;
+  free(pmap_buf);
+  pmap_buf = NULL;
+  pmap_buf_size = 0;
+  pmap_once = PTHREAD_ONCE_INIT;
+}
+
+static void pmap_do_init() {
+  if (!pmap_atfork) {
+    pthread_atfork(NULL, NULL, pmap_fork_child);
+    pmap_atfork = 1;
+  }
+  pmap_page = sysconf(_SC_PAGESIZE);
+
+  int fd = syscall(SYS_userfaultfd, O_CLOEXEC | O_NONBLOCK);
+  if (fd < 0) return;
+  struct uffdio_api api;
+  memset(&api, 0, sizeof(api));
+  api.api = UFFD_API;
+  if (ioctl(fd, UFFDIO_API, &api) < 0) {
+    __libc_close(fd);
+    return;
+  }
+  pmap_buf_size = PMAP_CHUNK;
+  if (posix_memalign((void**)&pmap_buf, pmap_page, pmap_buf_size) != 0) {
+    __libc_close(fd);
+    return;
+  }
+  pmap_uffd = fd;
+
+  pthread_t tid;
+  pthread_attr_t attr;
+  pthread_attr_init(&attr);
+  pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+  if (pthread_create(&tid, &attr, pmap_handler_main, NULL) != 0) {
+    __libc_close(fd);
+    pmap_uffd = -1;
+  }
+  pthread_attr_destroy(&attr);
+}
+
+void* pmap_map(plfs_file *pf, void *addr, size_t len, int prot, int flags, off_t offset) {
+  pthread_once(&pmap_once, pmap_do_init);
+
+  if ((pf->flags & O_ACCMODE) == O_WRONLY) {
+    errno = EACCES;
+    return MAP_FAILED;
+  }
+  if (len == 0 || offset < 0 || offset % pmap_page != 0) {
+    errno = EINVAL;
+    return MAP_FAILED;
+  }
+  plfs_file_settle(pf);
+
+  if (pmap_uffd < 0) {
+    if (pf->rfd < 0) {
+      errno = ENODEV;
+      return MAP_FAILED;
+    }
+    return __libc_mmap(addr, len, prot, flags, pf->rfd, offset);
+  }
+  if ((flags & MAP_SHARED) && (prot & PROT_WRITE)) {
+    errno = ENODEV;
+    return MAP_FAILED;
+  }
+
+  pmap_region *rg = new pmap_region();
+  plfs_error_t plfs_error = PLFS_CALL(plfs_open(&rg->pf.fd, pf->path->c_str(), O_RDONLY,
+                                                getpid(), 0, NULL));
+  if (plfs_error != PLFS_SUCCESS) {
+    delete rg;
+    errno = plfs_error_to_errno(plfs_error);
+    return MAP_FAILED;
+  }
+
+  // MAP_POPULATE is done as MADV_WILLNEED once the region is known
+  int anon = MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE |
+             (flags & (MAP_FIXED | MAP_FIXED_NOREPLACE | MAP_32BIT));
+  char *p = (char*)__libc_mmap(addr, len, prot, anon, -1, 0);
+  if (p == MAP_FAILED) {
+    int err = errno;
+    int num_refs;
+    PLFS_CALL(plfs_close(rg->pf.fd, getpid(), getuid(), O_RDONLY, NULL, &num_refs));
+    delete rg;
+    errno = err;
+    return MAP_FAILED;
+  }
+
+  // whatever we still have there was unmapped (or replaced by MAP_FIXED);
+  // forget it before registering, so a fill still reading for it cannot
+  // install its pages into the new mapping
+  size_t span = (len + pmap_page - 1) & ~(pmap_page - 1);
+  pmap_unmap(p, span);
+  struct uffdio_register reg;
+  reg.range.start = (unsigned long)p;
+  reg.range.len = span;
+  reg.mode = UFFDIO_REGISTER_MODE_MISSING;
+  if (ioctl(pmap_uffd, UFFDIO_REGISTER, &reg) < 0) {
+    int err = errno;
+    __libc_munmap(p, len);
+    int num_refs;
+    PLFS_CALL(plfs_close(rg->pf.fd, getpid(), getuid(), O_RDONLY, NULL, &num_refs));
+    delete rg;
+    errno = err;
+    return MAP_FAILED;
+  }
+  __libc_madvise(p, span, MADV_DONTFORK);
+
+  rg->start = p;
+  rg->len = span;
+  rg->offset = offset;
+  rg->live = span;
+  rg->pf.path = new std::string(*pf->path);
+  rg->pf.flags = O_RDONLY;
+  rg->pf.mount = pf->mount;
+  rg->advice = MADV_NORMAL;
+  rg->next = NULL;
+  rg->window = PMAP_CHUNK;
+  rg->busy = 0;
+  rg->dead = 0;
+
+  pthread_mutex_lock(&pmap_lock);
+  pmap_regions[p] = rg;
+  pmap_count++;
+  pthread_mutex_unlock(&pmap_lock);
+
+  if (flags & MAP_POPULATE) pmap_advise(p, span, MADV_WILLNEED);
+  return p;
+}
+
+// the bookkeeping half of munmap; the caller unmaps the memory
+void pmap_unmap(void *addr, size_t len) {
+  if (pmap_count == 0) return;
+  char *lo = (char*)addr;
+  char *hi = lo + len;
+
+  pthread_mutex_lock(&pmap_lock);
+  std::map<char*, pmap_region*>::iterator itr = pmap_regions.upper_bound(lo);
+  if (itr != pmap_regions.begin()) --itr;
+  while (itr != pmap_regions.end() && itr->first < hi) {
+    pmap_region *rg = itr->second;
+    char *from = std::max(lo, rg->start);
+    char *to = std::min(hi, rg->start + rg->len);
+    if (from < to) rg->live -= std::min(rg->live, (size_t)(to - from));
+    if (rg->live == 0 || (from == rg->start && to == rg->start + rg->len)) {
+      pmap_regions.erase(itr++);
+      pmap_count--;
+      if (rg->busy) {
+        rg->dead = 1;
+      } else {
+        pmap_release(rg);
+      }
+    } else {
+      itr++;
+    }
+  }
+  pthread_mutex_unlock(&pmap_lock);
+}
+
+// 1 if addr lies in a PLFS mapping and the advice was taken care of
+int pmap_advise(void *addr, size_t len, int advice) {
+  if (pmap_count == 0) return 0;
+  char *lo = (char*)addr;
+
+  pthread_mutex_lock(&pmap_lock);
+  pmap_region *rg = pmap_find(lo);
+  if (rg == NULL) {
+    pthread_mutex_unlock(&pmap_lock);
+    return 0;
+  }
+  int done = 1;
+  switch (advice) {
+    case MADV_NORMAL:
+    case MADV_SEQUENTIAL:
+    case MADV_RANDOM:
+      rg->advice = advice;
+      break;
+    case MADV_WILLNEED: {
+      char *end = std::min(lo + len, rg->start + rg->len);
+      size_t step = std::max(mount_tuning(rg->pf.mount).mmap_readahead, (size_t)pmap_page);
+      char *buf = NULL;   // the handler's buffer is the handler's
+      size_t buf_size = 0;
+      for (char *p = lo; p < end; p += step) {
+        size_t n = std::min(step, (size_t)(end - p));
+        if (!pmap_fill(rg, p, (n + pmap_page - 1) & ~(pmap_page - 1), NULL, &buf, &buf_size)) break;
+      }
+      free(buf);
+      break;
+    }
+    default:
+      done = 0;   // DONTNEED and the rest act on the memory itself
+  }
+  pthread_mutex_unlock(&pmap_lock);
+  return done;
+}
@@ -0,0 +1,82 @@
+#ifndef SOPLFS_PROBES_H
+#define SOPLFS_PROBES_H
+
+#include <time.h>
+
+
+/*
+ * USDT probes on the PLFS routes (bpftrace scripts in tools/)
+ *
+ * Every PLFS-routed open, read, read_small (through FUSE), write,
+ * getattr, readdir, sync and close fires soplfs:<op>_entry and
+ * soplfs:<op>_return with the same argument layout:
+ *
+ *   <op>_entry   fd, offset, size, path
+ *   <op>_return  fd, offset, result, path, latency (ns)
+ *
+ * fd is -1 for calls on a path, offset -1 for calls without one; open
+ * passes the flags as size and returns the new fd.  latency is 0 if the
+ * return probe was attached while the call was running.
+ *
+ * The probes are built when <sys/sdt.h> is found (systemtap-sdt-dev) and
+ * SOPLFS_NO_SDT is not defined.  A probe is a nop until a tracer attaches;
+ * the clock is only read while someone is attached to a return probe.
+ */
+
+#if !defined(SOPLFS_NO_SDT) && defined(__has_include)
+#if __has_include(<sys/sdt.h>)
+#define SOPLFS_SDT 1
+#endif
+#endif
+
+#ifdef SOPLFS_SDT
+
+#define _SDT_HAS_SEMAPHORES 1
+#include <sys/sdt.h>
+
+// set by the kernel while a tracer is attached; each file that fires
+// probes has its own, which the notes of its probe sites point at
+#define PROBE_SEMAPHORE(name) \
+  __extension__ static volatile unsigned short soplfs_ ## name ## _semaphore \
+    __attribute__((used, section(".probes")))
+
+#define PROBE_OP(op) PROBE_SEMAPHORE(op ## _entry); PROBE_SEMAPHORE(op ## _return)
+
+PROBE_OP(open); PROBE_OP(read); PROBE_OP(read_small); PROBE_OP(write);
+PROBE_OP(getattr); PROBE_OP(readdir); PROBE_OP(sync); PROBE_OP(close);
+
+#define PROBE_ENABLED(name) __builtin_expect(soplfs_ ## name ## _semaphore != 0, 0)
+#define PROBE4(name, a, b, c, d) STAP_PROBE4(soplfs, name, a, b, c, d)
+#define PROBE5(name, a, b, c, d, e) STAP_PROBE5(soplfs, name, a, b, c, d, e)
+
+#else
+
+#define PROBE_ENABLED(name) 0
+#define PROBE4(name, a, b, c, d) do {} while (0)
+#define PROBE5(name, a, b, c, d, e) do {} while (0)
+
+#endif
+
+// start time of a probed call, taken only if its return probe is on
+struct probe_timer {
+  long long start;
+  probe_timer(int on) : start(on ? now() : 0) {}
+  long long ns() const { return start ? now() - start : 0; }
+  static long long now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+  }
+};
+
+// one pair per scope: PROBE_ENTRY(read, ...) ... PROBE_RETURN(read, ...)
+#define PROBE_ENTRY(op, fd, offset, size, path) \
+  probe_timer probe_ ## op(PROBE_ENABLED(op ## _return)); \
+  PROBE4(op ## _entry, (long long)(fd), (long long)(offset), (long long)(size), \
+         (const char*)(path))
+
+#define PROBE_RETURN(op, fd, offset, result, path) \
+  PROBE5(op ## _return, (long long)(fd), (long long)(offset), (long long)(result), \
+         (const char*)(path), probe_ ## op.ns())
+
+#endif
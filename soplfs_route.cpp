@@ -0,0 +1,150 @@
+#include "soplfs_internal.h"
+
+#include <stdio.h>
+#include <pthread.h>
+
+#include <string>
+#include <algorithm>
+
+
+/*
+ * Adaptive read routing
+ *
+ * A read on a PLFS handle can go through FUSE (rfd, with read-ahead) or
+ * straight to plfs_read, and which one is cheaper depends on the mount,
+ * the request size and the access pattern.  Every mount keeps, per
+ * power-of-two size class, a moving average of what each route cost per
+ * KiB.  Reads take the class's current route; every ROUTE_PROBE_EVERY-th
+ * read takes the other one to keep its average fresh, and the class only
+ * switches when the other route has been ROUTE_MARGIN percent cheaper.
+ *
+ * The static rules (read_split, pread_split) pick the first route of a
+ * class, and all of them while read_adapt is off for the mount, which is
+ * the default: probes send reads that the rules keep on plfs_read
+ * (pread, say) through FUSE, which may not see this process' unsynced
+ * writes yet.
+ *
+ * The averages are updated without a lock; a lost sample does no harm.
+ */
+
+#define ROUTE_CLASSES 16        // < 4k, 4k, 8k, ... 64M and above
+#define ROUTE_WARMUP 8          // samples of each route before comparing
+#define ROUTE_PROBE_EVERY 64    // 1 read in this many takes the other route
+#define ROUTE_MARGIN 25         // percent the other route has to be cheaper
+#define ROUTE_EWMA_SHIFT 3      // weight 1/8 for a new sample
+
+struct route_class {
+  int route;                          // STATS_PLFS or STATS_PLFS_SMALL, -1: unused
+  long long cost[STATS_ROUTES];       // ticks per KiB
+  unsigned samples[STATS_ROUTES];
+  unsigned calls;
+  unsigned switches;
+};
+
+static pthread_once_t route_once = PTHREAD_ONCE_INIT;
+static route_class (*route_tables)[ROUTE_CLASSES] = NULL;   // [mount + 1]
+static size_t route_mounts = 0;
+
+
+static void route_do_init() {
+  soplfs_init();   // for the mount points
+  route_mounts = mount_points.size() + 1;
+  route_tables = new route_class[route_mounts][ROUTE_CLASSES];
+  for (size_t m = 0; m < route_mounts; m++) {
+    for (int i = 0; i < ROUTE_CLASSES; i++) {
+      route_class *c = &route_tables[m][i];
+      c->route = -1;
+      std::fill(c->cost, c->cost + STATS_ROUTES, 0);
+      std::fill(c->samples, c->samples + STATS_ROUTES, 0);
+      c->calls = 0;
+      c->switches = 0;
+    }
+  }
+}
+
+void route_init() {
+  pthread_once(&route_once, route_do_init);
+}
+
+static int route_class_of(size_t count) {
+  int i = 0;
+  for (size_t s = count >> 12; s != 0 && i < ROUTE_CLASSES - 1; s >>= 1) i++;
+  return i;
+}
+
+static route_class* route_class_get(int mount, size_t count) {
+  route_init();
+  if (mount < 0 || (size_t)mount + 1 >= route_mounts) return NULL;
+  return &route_tables[mount + 1][route_class_of(count)];
+}
+
+static int route_other(int route) {
+  return route == STATS_PLFS ? STATS_PLFS_SMALL : STATS_PLFS;
+}
+
+int route_pick(plfs_file *pf, size_t count, int seed) {
+  if (!mount_tuning(pf->mount).read_adapt || pf->rfd < 0) return seed;
+  route_class *c = route_class_get(pf->mount, count);
+  if (c == NULL) return seed;
+
+  int route = c->route;
+  if (route < 0) route = c->route = seed;
+  if (c->samples[route] < ROUTE_WARMUP) return route;
+
+  int other = route_other(route);
+  if (c->samples[other] < ROUTE_WARMUP ||
+      __sync_add_and_fetch(&c->calls, 1) % ROUTE_PROBE_EVERY == 0) {
+    stats_event(STATS_EV_ROUTE_PROBE, 1);
+    return other;
+  }
+  return route;
+}
+
+void route_done(plfs_file *pf, size_t count, int route, unsigned long long ticks) {
+  if (!mount_tuning(pf->mount).read_adapt) return;
+  route_class *c = route_class_get(pf->mount, count);
+  if (c == NULL || c->route < 0) return;
+
+  long long cost = ticks * 1024 / std::max(count, (size_t)1);
+  if (c->samples[route] == 0) {
+    c->cost[route] = cost;
+  } else {
+    c->cost[route] += (cost - c->cost[route]) >> ROUTE_EWMA_SHIFT;
+  }
+  c->samples[route]++;
+
+  int cur = c->route;
+  int other = route_other(cur);
+  if (c->samples[cur] >= ROUTE_WARMUP && c->samples[other] >= ROUTE_WARMUP &&
+      c->cost[other] * 100 < c->cost[cur] * (100 - ROUTE_MARGIN)) {
+    c->route = other;
+    c->switches++;
+    stats_event(STATS_EV_ROUTE_SWITCH, 1);
+  }
+}
+
+// the classes that have seen reads, as JSON objects for the stats report
+std::string route_report(double ns_per_tick) {
+  std::string out;
+  if (route_tables == NULL) return out;
+
+  for (size_t m = 1; m < route_mounts; m++) {
+    for (int i = 0; i < ROUTE_CLASSES; i++) {
+      const route_class &c = route_tables[m][i];
+      if (c.route < 0) continue;
+
+      char buf[512];
+      snprintf(buf, sizeof(buf),
+               "%s{\"mount\":\"%s\",\"size\":%llu,\"route\":\"%s\","
+               "\"plfs_ns_kib\":%.0f,\"plfs_samples\":%u,"
+               "\"plfs_small_ns_kib\":%.0f,\"plfs_small_samples\":%u,\"switches\":%u}",
+               out.empty() ? "" : ",", mount_points[m - 1].c_str(),
+               i == 0 ? 0ULL : 1ULL << (i + 11), stats_route_names[c.route],
+               c.cost[STATS_PLFS] * ns_per_tick, c.samples[STATS_PLFS],
+               c.cost[STATS_PLFS_SMALL] * ns_per_tick, c.samples[STATS_PLFS_SMALL],
+               c.switches);
+      out += buf;
+    }
+  }
+  return out;
+}
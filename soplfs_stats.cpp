@@ -0,0 +1,376 @@
+#include "soplfs_internal.h"
+
+#include <stdarg.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+#include <string>
+#include <algorithm>
+
+
+int stats_enabled = -1;
+__thread stats_call *stats_current __attribute__((tls_model("initial-exec"))) = NULL;
+__thread stats_thread *stats_self __attribute__((tls_model("initial-exec"))) = NULL;
+
+static pthread_once_t stats_once = PTHREAD_ONCE_INIT;
+static pthread_key_t stats_key;
+
+// header and STATS_SLOTS slots, in /dev/shm when stats_shm is set
+static stats_shm_header *stats_hdr = NULL;
+static stats_thread *stats_slots = NULL;
+static int stats_shm = 0;
+static char stats_shm_name[64];
+
+static std::string stats_file SOPLFS_GLOBAL;
+static unsigned long long stats_start_ticks;
+static struct timespec stats_start_time;
+static sem_t stats_signalled;
+
+
+static size_t stats_map_size() {
+  return sizeof(stats_shm_header) + STATS_SLOTS * sizeof(stats_thread);
+}
+
+static void stats_cmdline(char *buf, size_t size) {
+  buf[0] = '\0';
+  int fd = __libc_open("/proc/self/cmdline", O_RDONLY | O_CLOEXEC);
+  if (fd < 0) return;
+  ssize_t n = __libc_read(fd, buf, size - 1);
+  __libc_close(fd);
+  if (n <= 0) return;
+  for (ssize_t i = 0; i < n - 1; i++) {
+    if (buf[i] == '\0') buf[i] = ' ';
+  }
+  buf[n] = '\0';
+}
+
+// a fresh, zeroed set of slots; falls back to private memory when the
+// segment cannot be created
+static void stats_map() {
+  void *p = MAP_FAILED;
+
+  if (stats_shm) {
+    snprintf(stats_shm_name, sizeof(stats_shm_name), "/" STATS_SHM_PREFIX "%d", (int)getpid());
+    shm_unlink(stats_shm_name);
+    int fd = shm_open(stats_shm_name, O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, 0644);
+    if (fd >= 0) {
+      if (ftruncate(fd, stats_map_size()) == 0) {
+        p = mmap(NULL, stats_map_size(), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+      }
+      __libc_close(fd);
+      if (p == MAP_FAILED) shm_unlink(stats_shm_name);
+    }
+    if (p == MAP_FAILED) {
+      std::cerr << "soplfs: cannot create /dev/shm" << stats_shm_name
+                << ", statistics stay private" << std::endl;
+      stats_shm_name[0] = '\0';
+    }
+  }
+  if (p == MAP_FAILED) {
+    p = mmap(NULL, stats_map_size(), PROT_READ | PROT_WRITE,
+             MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  }
+  if (p == MAP_FAILED) {
+    stats_hdr = NULL;
+    stats_slots = NULL;
+    return;
+  }
+
+  stats_hdr = (stats_shm_header*)p;
+  stats_slots = (stats_thread*)(stats_hdr + 1);
+
+  stats_hdr->version = STATS_SHM_VERSION;
+  stats_hdr->pid = getpid();
+  stats_hdr->start_ticks = stats_start_ticks;
+  stats_hdr->start_ns = stats_start_time.tv_sec * 1000000000LL + stats_start_time.tv_nsec;
+  stats_cmdline(stats_hdr->cmdline, sizeof(stats_hdr->cmdline));
+  int n = 0;
+  for (size_t i = 0; i < mount_points.size() && n < STATS_MOUNTS; i++, n++) {
+    snprintf(stats_hdr->mount[n], STATS_PATH_MAX, "%s", mount_points[i].c_str());
+  }
+  stats_hdr->mounts = n;
+
+  // readers ignore the segment until the magic is there
+  __sync_synchronize();
+  memcpy(stats_hdr->magic, STATS_SHM_MAGIC, sizeof(stats_hdr->magic));
+}
+
+// the slot keeps its counts for the next thread that claims it
+static void stats_thread_exit(void *p) {
+  stats_thread *st = (stats_thread*)p;
+  st->inflight_start = 0;
+  __sync_synchronize();
+  if (st->owner > 0) st->owner = 0;
+  stats_self = NULL;
+}
+
+stats_thread* stats_thread_get() {
+  if (stats_self != NULL) return stats_self;
+  if (stats_slots == NULL) return NULL;
+
+  int tid = syscall(SYS_gettid);
+  stats_thread *st = &stats_slots[STATS_SLOTS - 1];
+  for (int i = 0; i < STATS_SLOTS - 1; i++) {
+    if (stats_slots[i].owner == 0 && __sync_bool_compare_and_swap(&stats_slots[i].owner, 0, tid)) {
+      st = &stats_slots[i];
+      break;
+    }
+  }
+
+  // more threads than slots share the last one, which may lose counts
+  if (st == &stats_slots[STATS_SLOTS - 1]) st->owner = -1;
+
+  unsigned used = st - stats_slots + 1;
+  unsigned seen;
+  while ((seen = stats_hdr->slots) < used &&
+         !__sync_bool_compare_and_swap(&stats_hdr->slots, seen, used));
+
+  pthread_setspecific(stats_key, st);
+  stats_self = st;
+  return st;
+}
+
+void stats_record(stats_call *sc) {
+  unsigned long long ticks = stats_ticks() - sc->start;
+  if (trace_enabled && sc->route != STATS_PASS) trace_add(sc, ticks);
+
+  stats_thread *st = stats_slot();
+  if (st == NULL) return;
+
+  stats_counter &c = st->c[sc->op][sc->route];
+  c.calls++;
+  c.bytes += sc->bytes;
+  c.ticks += ticks;
+  c.plfs_calls += sc->plfs_calls;
+  c.plfs_ticks += sc->plfs_ticks;
+  c.eagain += sc->eagain;
+
+  int b = ticks == 0 ? 0 : 64 - __builtin_clzll(ticks);
+  c.hist[b < STATS_BUCKETS ? b : STATS_BUCKETS - 1]++;
+
+  if (sc->route != STATS_PASS && sc->mount >= 0 && sc->mount < STATS_MOUNTS) {
+    stats_mount_counter &m = st->m[sc->mount];
+    m.calls++;
+    m.bytes += sc->bytes;
+    m.ticks += ticks;
+  }
+  st->inflight_start = 0;
+}
+
+
+static long long stats_elapsed_ns() {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (now.tv_sec - stats_start_time.tv_sec) * 1000000000LL +
+         (now.tv_nsec - stats_start_time.tv_nsec);
+}
+
+// ticks are converted against the wall clock over the whole run
+static double stats_ns_per_tick() {
+#if defined(__x86_64__) || defined(__i386__)
+  while (stats_elapsed_ns() < 10000000);   // at least 10 ms to calibrate
+  return (double)stats_elapsed_ns() / (stats_ticks() - stats_start_ticks);
+#else
+  return 1.0;
+#endif
+}
+
+static void stats_append(std::string &out, const char *fmt, ...) {
+  char buf[256];
+  va_list ap;
+  va_start(ap, fmt);
+  int n = vsnprintf(buf, sizeof(buf), fmt, ap);
+  va_end(ap);
+  if (n > 0) out.append(buf, std::min(n, (int)sizeof(buf) - 1));
+}
+
+static void stats_add(stats_thread *to, const stats_thread *from) {
+  for (int op = 0; op < STATS_OPS; op++) {
+    for (int r = 0; r < STATS_ROUTES; r++) {
+      const stats_counter &f = from->c[op][r];
+      stats_counter &t = to->c[op][r];
+      if (f.calls == 0) continue;
+      t.calls += f.calls;
+      t.bytes += f.bytes;
+      t.ticks += f.ticks;
+      t.plfs_calls += f.plfs_calls;
+      t.plfs_ticks += f.plfs_ticks;
+      t.eagain += f.eagain;
+      for (int b = 0; b < STATS_BUCKETS; b++) t.hist[b] += f.hist[b];
+    }
+  }
+  for (int i = 0; i < STATS_MOUNTS; i++) {
+    to->m[i].calls += from->m[i].calls;
+    to->m[i].bytes += from->m[i].bytes;
+    to->m[i].ticks += from->m[i].ticks;
+  }
+  for (int e = 0; e < STATS_EVENTS; e++) to->events[e] += from->events[e];
+}
+
+void stats_dump() {
+  if (stats_on() <= 0 || stats_file.empty() || stats_hdr == NULL) return;
+
+  // other threads keep counting; their words are read without a lock
+  stats_thread *total = (stats_thread*)calloc(1, sizeof(stats_thread));
+  if (total == NULL) return;
+  for (unsigned i = 0; i < stats_hdr->slots && i < STATS_SLOTS; i++) {
+    stats_add(total, &stats_slots[i]);
+  }
+
+  double npt = stats_ns_per_tick();
+  std::string out;
+  stats_append(out, "{\"pid\":%d,\"elapsed_s\":%.3f,\"init_us\":%.1f,\"events\":{",
+               (int)getpid(), stats_elapsed_ns() / 1e9, soplfs_init_ns / 1e3);
+  for (int e = 0; e < STATS_EVENTS; e++) {
+    stats_append(out, "%s\"%s\":%lld", e ? "," : "", stats_event_names[e], total->events[e]);
+  }
+  out.append("},\"mounts\":[");
+  for (int i = 0; i < stats_hdr->mounts; i++) {
+    const stats_mount_counter &m = total->m[i];
+    stats_append(out, "%s{\"mount\":\"%s\",\"calls\":%llu,\"bytes\":%llu,\"ns\":%.0f}",
+                 i ? "," : "", stats_hdr->mount[i], m.calls, m.bytes, m.ticks * npt);
+  }
+  out.append("],\"routes\":[");
+  out.append(route_report(npt));
+  out.append("],\"ops\":[");
+
+  const char *sep = "\n";
+  for (int op = 0; op < STATS_OPS; op++) {
+    for (int r = 0; r < STATS_ROUTES; r++) {
+      const stats_counter &c = total->c[op][r];
+      if (c.calls == 0) continue;
+
+      stats_append(out, "%s {\"op\":\"%s\",\"route\":\"%s\",\"calls\":%llu,\"bytes\":%llu,"
+                   "\"ns\":%.0f,\"plfs_calls\":%llu,\"plfs_ns\":%.0f,\"eagain\":%llu,\"hist\":[",
+                   sep, stats_op_names[op], stats_route_names[r], c.calls, c.bytes,
+                   c.ticks * npt, c.plfs_calls, c.plfs_ticks * npt, c.eagain);
+      const char *hsep = "";
+      for (int b = 0; b < STATS_BUCKETS; b++) {
+        if (c.hist[b] == 0) continue;
+        stats_append(out, "%s[%.0f,%llu]", hsep, (double)(1ULL << b) * npt, c.hist[b]);
+        hsep = ",";
+      }
+      out.append("]}");
+      sep = ",\n";
+    }
+  }
+  out.append("\n]}\n");
+  free(total);
+
+  // %p in the file name becomes the pid, for one report per rank
+  std::string file = stats_file;
+  size_t p = file.find("%p");
+  if (p != std::string::npos) {
+    char pid[16];
+    snprintf(pid, sizeof(pid), "%d", (int)getpid());
+    file.replace(p, 2, pid);
+  }
+
+  int fd = 2;
+  if (file != "-") {
+    fd = __libc_open(file.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0) {
+      std::cerr << "soplfs: cannot write statistics to " << file << std::endl;
+      return;
+    }
+  }
+  for (size_t done = 0; done < out.size(); ) {
+    ssize_t n = __libc_write(fd, out.data() + done, out.size() - done);
+    if (n <= 0) break;
+    done += n;
+  }
+  if (fd != 2) __libc_close(fd);
+}
+
+static void stats_exit() {
+  stats_dump();
+  if (stats_shm_name[0] != '\0') shm_unlink(stats_shm_name);
+}
+
+// a forked child reports only its own calls, in a segment of its own
+static void stats_fork_child() {
+  clock_gettime(CLOCK_MONOTONIC, &stats_start_time);
+  stats_start_ticks = stats_ticks();
+
+  if (stats_hdr != NULL) munmap(stats_hdr, stats_map_size());
+  pthread_setspecific(stats_key, NULL);
+  stats_self = NULL;
+  stats_map();
+}
+
+static void stats_on_signal(int sig) {
+  sem_post(&stats_signalled);
+}
+
+// the handler only posts; the report is written from an ordinary thread
+static void* stats_signal_main(void *arg) {
+  while (1) {
+    if (sem_wait(&stats_signalled) == 0) stats_dump();
+  }
+  return NULL;
+}
+
+static void stats_do_init() {
+  MAP(open, int (*)(const char*, int, ...));
+  MAP(close, int (*)(int));
+  MAP(read, ssize_t (*)(int, void*, size_t));
+  MAP(write, ssize_t (*)(int, const void*, size_t));
+
+  const char *v = getenv("SOPLFS_STATS");
+  if (v != NULL) stats_file = v;
+  v = getenv("SOPLFS_STATS_SHM");
+  stats_shm = v != NULL && atoi(v) > 0;
+  const char *trace = getenv("SOPLFS_TRACE");
+  if (trace != NULL && *trace == '\0') trace = NULL;
+  if (stats_file.empty() && !stats_shm && trace == NULL) {
+    stats_enabled = 0;
+    return;
+  }
+
+  soplfs_init();   // for the mount points
+  clock_gettime(CLOCK_MONOTONIC, &stats_start_time);
+  stats_start_ticks = stats_ticks();
+  stats_map();
+  if (stats_hdr == NULL) {
+    stats_enabled = 0;
+    return;
+  }
+  pthread_key_create(&stats_key, stats_thread_exit);
+
+  v = getenv("SOPLFS_STATS_SIGNAL");
+  int sig = v != NULL ? atoi(v) : 0;
+  if (sig > 0 && sig < NSIG) {
+    sem_init(&stats_signalled, 0, 0);
+
+    pthread_t tid;
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    if (pthread_create(&tid, &attr, stats_signal_main, NULL) == 0) {
+      struct sigaction sa;
+      memset(&sa, 0, sizeof(sa));
+      sa.sa_handler = stats_on_signal;
+      sa.sa_flags = SA_RESTART;
+      sigemptyset(&sa.sa_mask);
+      sigaction(sig, &sa, NULL);
+    }
+    pthread_attr_destroy(&attr);
+  }
+
+  pthread_atfork(NULL, NULL, stats_fork_child);
+  atexit(stats_exit);
+  if (trace != NULL) trace_init(trace);
+  stats_enabled = 1;
+}
+
+void stats_init() {
+  if (!soplfs_loaded) return;   // see soplfs_init()
+  pthread_once(&stats_once, stats_do_init);
+}
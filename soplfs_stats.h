@@ -0,0 +1,152 @@
+#ifndef SOPLFS_STATS_H
+#define SOPLFS_STATS_H
+
+#include <time.h>
+
+
+/*
+ * Layout of soplfs' call statistics (soplfs_stats.cpp)
+ *
+ * Counters live in per-thread slots that only their owning thread
+ * writes.  With SOPLFS_STATS_SHM=1 the slots are placed in a shared
+ * memory segment /dev/shm/soplfs.<pid> behind a stats_shm_header, so
+ * soplfs-top can read them while the process runs.  A slot keeps its
+ * counts when its thread exits and is handed to the next new thread,
+ * so every sum over the slots only ever grows.
+ *
+ * Times are in rdtsc ticks on x86 and ns elsewhere; start_ticks and
+ * start_ns in the header let a reader convert them.
+ *
+ * This file does not depend on PLFS so soplfs-top can include it.
+ */
+
+#define STATS_BUCKETS 40
+#define STATS_MOUNTS 8
+#define STATS_SLOTS 128
+#define STATS_PATH_MAX 256
+
+#define STATS_SHM_PREFIX "soplfs."
+#define STATS_SHM_MAGIC "SOPLFSST"
+#define STATS_SHM_VERSION 11
+
+enum stats_op {
+  STATS_OPEN, STATS_CLOSE, STATS_READ, STATS_WRITE, STATS_PREAD, STATS_PWRITE,
+  STATS_FOPEN, STATS_FCLOSE, STATS_FREAD, STATS_FWRITE, STATS_FGETC, STATS_FGETS,
+  STATS_FPUTC, STATS_FPUTS, STATS_FPRINTF, STATS_FFLUSH,
+  STATS_STAT, STATS_FSTAT, STATS_CHMOD, STATS_MKDIR, STATS_RMDIR, STATS_RENAME,
+  STATS_OPENDIR, STATS_READDIR, STATS_CLOSEDIR, STATS_CHDIR, STATS_GETCWD,
+  STATS_FCNTL, STATS_FSYNC, STATS_AIO, STATS_LIO_LISTIO, STATS_LSEEK,
+  STATS_MMAP, STATS_COPY, STATS_FADVISE,
+  STATS_OPS
+};
+
+static const char *const stats_op_names[STATS_OPS] = {
+  "open", "close", "read", "write", "pread", "pwrite",
+  "fopen", "fclose", "fread", "fwrite", "fgetc", "fgets",
+  "fputc", "fputs", "fprintf", "fflush",
+  "stat", "fstat", "chmod", "mkdir", "rmdir", "rename",
+  "opendir", "readdir", "closedir", "chdir", "getcwd",
+  "fcntl", "fsync", "aio", "lio_listio", "lseek",
+  "mmap", "copy", "fadvise"
+};
+
+// ops whose bytes are data read or data written
+inline int stats_op_reads(int op) {
+  return op == STATS_READ || op == STATS_PREAD || op == STATS_FREAD;
+}
+
+inline int stats_op_writes(int op) {
+  return op == STATS_WRITE || op == STATS_PWRITE || op == STATS_FWRITE;
+}
+
+enum stats_route {
+  STATS_PASS,         // not a PLFS file: straight to libc
+  STATS_PLFS,         // through the PLFS API
+  STATS_PLFS_SMALL,   // PLFS file, small read served through FUSE
+  STATS_ROUTES
+};
+
+static const char *const stats_route_names[STATS_ROUTES] = {
+  "passthrough", "plfs", "plfs_small"
+};
+
+// counts that are not calls; summed over slots like everything else
+enum stats_event {
+  STATS_EV_HANDLES,   // opens minus closes of PLFS files
+  STATS_EV_RA_HIT,    // small reads served from the read-ahead window
+  STATS_EV_RA_MISS,   // small reads that went to FUSE
+  STATS_EV_ROUTE_PROBE,    // reads sent down the route not currently chosen
+  STATS_EV_ROUTE_SWITCH,   // size classes that changed route
+  STATS_EV_READ_SHARED,    // plfs_reads saved by joining one in flight
+  STATS_EV_READ_SHARED_BYTES,
+  STATS_EV_MMAP_FAULT,     // page ranges read into PLFS mappings
+  STATS_EV_MMAP_BYTES,
+  STATS_EV_PREFETCH_BYTES,       // read on POSIX_FADV_WILLNEED
+  STATS_EV_PREFETCH_HIT_BYTES,   // of those, served to reads
+  STATS_EV_ATTR_HIT,       // stats answered by the node's attribute cache
+  STATS_EV_ATTR_MISS,
+  STATS_EV_BLOCK_HIT,      // block reads served by the node's block cache
+  STATS_EV_BLOCK_FILL,     // blocks this process read into it
+  STATS_EV_BLOCK_WAIT,     // reads that waited for another's fill
+  STATS_EV_FORK_WRITER,    // inherited handles a forked child became a writer of
+  STATS_EV_INHERITED,      // handles taken over from before exec
+  STATS_EV_WALK_AHEAD,     // directories a tree walk found listed before it got there
+  STATS_EVENTS
+};
+
+static const char *const stats_event_names[STATS_EVENTS] = {
+  "handles", "readahead_hit", "readahead_miss", "route_probe", "route_switch",
+  "read_shared", "read_shared_bytes", "mmap_fault", "mmap_bytes",
+  "prefetch_bytes", "prefetch_hit_bytes", "attr_hit", "attr_miss",
+  "block_hit", "block_fill", "block_wait", "fork_writer", "inherited",
+  "walk_ahead"
+};
+
+struct stats_counter {
+  unsigned long long calls;
+  unsigned long long bytes;
+  unsigned long long ticks;
+  unsigned long long plfs_calls;
+  unsigned long long plfs_ticks;
+  unsigned long long eagain;
+  unsigned long long hist[STATS_BUCKETS];   // bucket b: ticks < 2^b
+};
+
+struct stats_mount_counter {
+  unsigned long long calls;
+  unsigned long long bytes;
+  unsigned long long ticks;
+};
+
+struct stats_thread {
+  int owner;                          // thread id, 0 when free
+  int inflight_op;
+  unsigned long long inflight_start;  // ticks; 0 when no call is running
+  stats_counter c[STATS_OPS][STATS_ROUTES];
+  stats_mount_counter m[STATS_MOUNTS];   // PLFS calls by mount point
+  long long events[STATS_EVENTS];
+};
+
+struct stats_shm_header {
+  char magic[8];
+  unsigned version;
+  int pid;
+  unsigned slots;                     // slots handed out so far
+  int mounts;
+  unsigned long long start_ticks;
+  long long start_ns;                 // CLOCK_MONOTONIC at start_ticks
+  char cmdline[STATS_PATH_MAX];
+  char mount[STATS_MOUNTS][STATS_PATH_MAX];
+};
+
+inline unsigned long long stats_ticks() {
+#if defined(__x86_64__) || defined(__i386__)
+  return __builtin_ia32_rdtsc();
+#else
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+#endif
+}
+
+#endif
@@ -0,0 +1,322 @@
+#define _LARGEFILE64_SOURCE
+#include "soplfs_internal.h"
+
+#include <stdlib.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+
+#include <map>
+#include <set>
+#include <string>
+#include <vector>
+#include <algorithm>
+
+
+/*
+ * Group commit for fsync/fdatasync/fflush on PLFS handles
+ *
+ * Each open container (mount and path) has one sync_group, shared by all
+ * of its handles and counted by them.  A caller needs a sync that
+ * *starts* after it arrived: if one is already running, every caller that
+ * shows up meanwhile, through any handle of the container, waits for the
+ * next one, and only the first of them issues it.  A sync covers the
+ * handles written since the last one started; the others are skipped.
+ * A handle whose plfs_sync failed is dirty again, and keeps the error
+ * until an fsync, fdatasync or sync_file_range on it has returned it.
+ *
+ * With sync_interval (milliseconds) and/or sync_bytes set for a mount, a
+ * flusher thread commits its dirty handles once they have been dirty for
+ * the interval or have that many unsynced bytes.
+ */
+
+struct sync_group {
+  int mount;
+  std::string path;
+  int refs;                         // handles open on the container
+  std::set<plfs_file*> members;     // written since the last sync started
+  unsigned long started;   // number of syncs started
+  unsigned long done;      // highest sync number finished
+  int running;
+  size_t dirty;            // bytes written since the last sync started
+  struct timespec dirty_since;
+  int flush;               // commit requested by sync_start/sync_commit_all
+  plfs_error_t error;      // result of the last finished sync
+  std::map<plfs_file*, plfs_error_t> failed;   // not returned to the handle yet
+  long interval_ms;        // the mount's sync_interval and sync_bytes
+  size_t bytes;
+};
+
+static pthread_once_t sync_once = PTHREAD_ONCE_INIT;
+static pthread_mutex_t sync_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t sync_done = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t sync_kick = PTHREAD_COND_INITIALIZER;
+typedef std::map<std::pair<int, std::string>, sync_group*> sync_map;
+static sync_map sync_groups SOPLFS_GLOBAL;
+
+static long sync_wait_ms = 1000;   // shortest sync_interval of any mount
+static int sync_flusher = 0;
+
+
+static void sync_now(struct timespec *ts) {
+  clock_gettime(CLOCK_MONOTONIC, ts);
+}
+
+static long sync_elapsed_ms(const struct timespec *from) {
+  struct timespec now;
+  sync_now(&now);
+  return (now.tv_sec - from->tv_sec) * 1000 + (now.tv_nsec - from->tv_nsec) / 1000000;
+}
+
+// called with sync_lock held; returns with it held
+static plfs_error_t sync_group_commit(sync_group *sg) {
+  sg->flush = 0;
+  if (sg->dirty == 0 && !sg->running) return PLFS_SUCCESS;
+
+  // a clean handle only has to wait for the sync already in flight
+  unsigned long need = sg->dirty ? sg->started + 1 : sg->started;
+  while (sg->done < need) {
+    if (sg->running) {
+      pthread_cond_wait(&sync_done, &sync_lock);
+      continue;
+    }
+
+    sg->running = 1;
+    unsigned long gen = ++sg->started;
+    sg->dirty = 0;
+    std::vector<plfs_file*> members(sg->members.begin(), sg->members.end());
+    sg->members.clear();
+    pthread_mutex_unlock(&sync_lock);
+
+    // sync_close waits for us, so none of these is closed meanwhile
+    plfs_error_t plfs_error = PLFS_SUCCESS;
+    std::vector<std::pair<plfs_file*, plfs_error_t> > failed;
+    for (size_t i = 0; i < members.size(); i++) {
+      plfs_error_t member_error = plfs_file_sync(members[i]);
+      if (member_error != PLFS_SUCCESS) {
+        plfs_error = member_error;
+        failed.push_back(std::make_pair(members[i], member_error));
+      }
+    }
+
+    pthread_mutex_lock(&sync_lock);
+    // the next sync tries them again; their size is not known any more
+    for (size_t i = 0; i < failed.size(); i++) {
+      sg->failed[failed[i].first] = failed[i].second;
+      sg->members.insert(failed[i].first);
+      if (sg->dirty == 0) sync_now(&sg->dirty_since);
+      sg->dirty++;
+    }
+    sg->running = 0;
+    sg->done = gen;
+    sg->error = plfs_error;
+    pthread_cond_broadcast(&sync_done);
+  }
+
+  return sg->error;
+}
+
+static void* sync_flusher_main(void *) {
+  pthread_mutex_lock(&sync_lock);
+  while (1) {
+    long wait_ms = sync_wait_ms;
+    struct timespec deadline;
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += wait_ms / 1000;
+    deadline.tv_nsec += (wait_ms % 1000) * 1000000;
+    if (deadline.tv_nsec >= 1000000000) {
+      deadline.tv_sec++;
+      deadline.tv_nsec -= 1000000000;
+    }
+    pthread_cond_timedwait(&sync_kick, &sync_lock, &deadline);
+
+    // commit one group at a time: the list may change while unlocked
+    int again = 1;
+    while (again) {
+      again = 0;
+      for (sync_map::iterator itr = sync_groups.begin();
+           itr != sync_groups.end(); itr++) {
+        sync_group *sg = itr->second;
+        if (sg->dirty == 0 || sg->running) continue;
+
+        if (sg->flush || (sg->bytes != 0 && sg->dirty >= sg->bytes) ||
+            (sg->interval_ms > 0 && sync_elapsed_ms(&sg->dirty_since) >= sg->interval_ms)) {
+          sync_group_commit(sg);
+          again = 1;
+          break;
+        }
+      }
+    }
+  }
+
+  pthread_mutex_unlock(&sync_lock);
+  return NULL;
+}
+
+static void sync_start_flusher() {
+  pthread_t tid;
+  pthread_attr_t attr;
+  pthread_attr_init(&attr);
+  pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+  if (pthread_create(&tid, &attr, sync_flusher_main, NULL) == 0) {
+    sync_flusher = 1;
+  } else {
+    std::cerr << "soplfs: cannot start the flusher thread" << std::endl;
+  }
+  pthread_attr_destroy(&attr);
+}
+
+// the flusher, the syncs in flight and what was written so far stay
+// with the parent
+static void sync_fork_child() {
+  pthread_mutex_init(&sync_lock, NULL);
+  pthread_cond_init(&sync_done, NULL);
+  pthread_cond_init(&sync_kick, NULL);
+  for (sync_map::iterator itr = sync_groups.begin();
+       itr != sync_groups.end(); itr++) {
+    sync_group *sg = itr->second;
+    sg->running = 0;
+    sg->done = sg->started;
+    sg->dirty = 0;
+    sg->members.clear();
+    sg->failed.clear();
+    sg->flush = 0;
+  }
+  if (sync_flusher) {
+    sync_flusher = 0;
+    sync_start_flusher();
+  }
+}
+
+static void sync_do_init() {
+  pthread_atfork(NULL, NULL, sync_fork_child);
+
+  // one flusher serves every mount that wants one
+  int wanted = 0;
+  for (int m = -1; m < (int)mount_points.size(); m++) {
+    const soplfs_tuning &tune = mount_tuning(m);
+    if (tune.sync_interval > 0) sync_wait_ms = std::min(sync_wait_ms, tune.sync_interval);
+    if (tune.sync_interval > 0 || tune.sync_bytes != 0) wanted = 1;
+  }
+  if (wanted) sync_start_flusher();
+}
+
+void sync_init() {
+  pthread_once(&sync_once, sync_do_init);
+}
+
+sync_group* sync_open(plfs_file *pf) {
+  sync_init();
+
+  std::pair<int, std::string> key(pf->mount, *pf->path);
+  pthread_mutex_lock(&sync_lock);
+  sync_map::iterator itr = sync_groups.find(key);
+  if (itr != sync_groups.end()) {
+    itr->second->refs++;
+    pthread_mutex_unlock(&sync_lock);
+    return itr->second;
+  }
+
+  sync_group *sg = new sync_group();
+  sg->mount = pf->mount;
+  sg->path = *pf->path;
+  sg->refs = 1;
+  sg->started = sg->done = 0;
+  sg->running = 0;
+  sg->dirty = 0;
+  sg->flush = 0;
+  sg->error = PLFS_SUCCESS;
+  sg->interval_ms = mount_tuning(pf->mount).sync_interval;
+  sg->bytes = mount_tuning(pf->mount).sync_bytes;
+  sync_groups[key] = sg;
+  pthread_mutex_unlock(&sync_lock);
+
+  return sg;
+}
+
+void sync_mark(sync_group *sg, plfs_file *pf, size_t bytes) {
+  if (bytes == 0) return;
+
+  pthread_mutex_lock(&sync_lock);
+  if (sg->dirty == 0) sync_now(&sg->dirty_since);
+  size_t before = sg->dirty;
+  sg->dirty += bytes;
+  sg->members.insert(pf);
+  if (sync_flusher && sg->bytes != 0 && before < sg->bytes && sg->dirty >= sg->bytes) {
+    pthread_cond_signal(&sync_kick);
+  }
+  pthread_mutex_unlock(&sync_lock);
+}
+
+// what pf wrote is synced; returns the first error pf has not seen yet,
+// from this sync or an earlier one
+plfs_error_t sync_commit(sync_group *sg, plfs_file *pf) {
+  pthread_mutex_lock(&sync_lock);
+  sync_group_commit(sg);
+  plfs_error_t plfs_error = PLFS_SUCCESS;
+  std::map<plfs_file*, plfs_error_t>::iterator itr = sg->failed.find(pf);
+  if (itr != sg->failed.end()) {
+    plfs_error = itr->second;
+    sg->failed.erase(itr);
+  }
+  pthread_mutex_unlock(&sync_lock);
+
+  return plfs_error;
+}
+
+// ask the flusher to commit soon, without waiting for it
+void sync_start(sync_group *sg) {
+  pthread_mutex_lock(&sync_lock);
+  if (sync_flusher && sg->dirty != 0) {
+    sg->flush = 1;
+    pthread_cond_signal(&sync_kick);
+  }
+  pthread_mutex_unlock(&sync_lock);
+}
+
+plfs_error_t sync_commit_all() {
+  plfs_error_t ret = PLFS_SUCCESS;
+
+  pthread_mutex_lock(&sync_lock);
+  // only handles dirty on entry, so writers cannot keep us here forever
+  for (sync_map::iterator itr = sync_groups.begin();
+       itr != sync_groups.end(); itr++) {
+    if (itr->second->dirty != 0 || itr->second->running) itr->second->flush = 1;
+  }
+
+  int again = 1;
+  while (again) {
+    again = 0;
+    for (sync_map::iterator itr = sync_groups.begin();
+         itr != sync_groups.end(); itr++) {
+      if (itr->second->flush) {
+        plfs_error_t plfs_error = sync_group_commit(itr->second);
+        if (plfs_error != PLFS_SUCCESS) ret = plfs_error;
+        again = 1;
+        break;
+      }
+    }
+  }
+  pthread_mutex_unlock(&sync_lock);
+
+  return ret;
+}
+
+// the handle's own close flushes what it wrote; the group goes with the
+// container's last handle
+void sync_close(sync_group *sg, plfs_file *pf) {
+  pthread_mutex_lock(&sync_lock);
+  while (sg->running) {
+    pthread_cond_wait(&sync_done, &sync_lock);
+  }
+  sg->members.erase(pf);
+  sg->failed.erase(pf);
+  if (--sg->refs > 0) {
+    pthread_mutex_unlock(&sync_lock);
+    return;
+  }
+  sync_groups.erase(std::make_pair(sg->mount, sg->path));
+  pthread_mutex_unlock(&sync_lock);
+
+  delete sg;
+}
@@ -0,0 +1,308 @@
+#include "soplfs_internal.h"
+#include "soplfs_trace.h"
+
+#include <errno.h>
+#include <limits.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/uio.h>
+#include <sys/syscall.h>
+
+#include <string>
+#include <algorithm>
+
+
+#define TRACE_FLUSH_MS 200   // how often the flusher writes out the rings
+
+// one per thread; the owner appends at head, a drain writes out
+// [tail, head) under lock, either the flusher or the owner when full
+struct trace_thread {
+  pthread_mutex_t lock;
+  trace_record *ring;
+  volatile unsigned long long head;
+  unsigned long long tail;
+  int tid;
+  int dead;                      // the thread has exited
+  unsigned path_len;             // path of the call in progress
+  char path[2 * PATH_MAX];
+  trace_thread *next;
+};
+
+int trace_enabled = 0;
+
+static __thread trace_thread *trace_self __attribute__((tls_model("initial-exec"))) = NULL;
+
+static pthread_mutex_t trace_lock = PTHREAD_MUTEX_INITIALIZER;        // trace_threads
+static pthread_mutex_t trace_file_lock = PTHREAD_MUTEX_INITIALIZER;   // trace_fd
+static pthread_key_t trace_key;
+static trace_thread *trace_threads = NULL;
+static unsigned trace_records = 16384;   // per thread, a power of two
+static std::string trace_name SOPLFS_GLOBAL;
+static int trace_fd = -1;
+static unsigned long long trace_start_ticks;   // the header's clock point
+static long long trace_start_ns;
+static unsigned long long trace_dropped = 0;
+
+
+static long long trace_now_ns() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static void trace_write(const struct iovec *iov, int n) {
+  if (writev(trace_fd, iov, n) < 0) __sync_fetch_and_add(&trace_dropped, 1);
+}
+
+// the file is created on the first flush, so processes that never
+// touch PLFS (an exec'ed helper, say) leave no trace behind.  Without %p
+// the pid is appended: forked and exec'ed children inherit SOPLFS_TRACE
+// and must not truncate their parent's file
+static int trace_out() {
+  pthread_mutex_lock(&trace_file_lock);
+  if (trace_fd < 0) {
+    std::string file = trace_name;
+    char pid[16];
+    snprintf(pid, sizeof(pid), "%d", (int)getpid());
+    size_t p = file.find("%p");
+    if (p != std::string::npos) {
+      file.replace(p, 2, pid);
+    } else {
+      file = file + "." + pid;
+    }
+
+    trace_fd = __libc_open(file.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_APPEND | O_CLOEXEC, 0644);
+    if (trace_fd < 0) {
+      std::cerr << "soplfs: cannot write trace to " << file << std::endl;
+      trace_enabled = 0;
+    } else {
+      trace_file_header h;
+      memset(&h, 0, sizeof(h));
+      memcpy(h.magic, TRACE_MAGIC, sizeof(h.magic));
+      h.version = TRACE_VERSION;
+      h.record_size = sizeof(trace_record);
+      h.pid = getpid();
+      h.start_ticks = trace_start_ticks;
+      h.start_ns = trace_start_ns;
+
+      int fd = __libc_open("/proc/self/cmdline", O_RDONLY | O_CLOEXEC);
+      if (fd >= 0) {
+        ssize_t n = __libc_read(fd, h.cmdline, sizeof(h.cmdline) - 1);
+        for (ssize_t i = 0; i < n - 1; i++) {
+          if (h.cmdline[i] == '\0') h.cmdline[i] = ' ';
+        }
+        __libc_close(fd);
+      }
+
+      struct iovec iov = { &h, sizeof(h) };
+      trace_write(&iov, 1);
+    }
+  }
+  pthread_mutex_unlock(&trace_file_lock);
+  return trace_fd;
+}
+
+static void trace_clock() {
+  if (trace_out() < 0) return;
+  trace_record r;
+  memset(&r, 0, sizeof(r));
+  r.op = TRACE_CLOCK;
+  r.start = stats_ticks();
+  r.result = trace_now_ns();
+  r.handle = -1;
+  r.offset = -1;
+  struct iovec iov = { &r, sizeof(r) };
+  trace_write(&iov, 1);
+}
+
+// one writev per drain keeps a thread's batch whole in the O_APPEND file
+static void trace_drain(trace_thread *t) {
+  pthread_mutex_lock(&t->lock);
+  unsigned long long head = t->head;
+  __sync_synchronize();
+  if (head != t->tail && trace_out() >= 0) {
+    unsigned first = t->tail & (trace_records - 1);
+    unsigned n = head - t->tail;
+    struct iovec iov[2];
+    int niov = 1;
+    iov[0].iov_base = &t->ring[first];
+    iov[0].iov_len = std::min(n, trace_records - first) * sizeof(trace_record);
+    if (first + n > trace_records) {
+      iov[1].iov_base = &t->ring[0];
+      iov[1].iov_len = (first + n - trace_records) * sizeof(trace_record);
+      niov = 2;
+    }
+    trace_write(iov, niov);
+  }
+  t->tail = head;
+  pthread_mutex_unlock(&t->lock);
+}
+
+static void trace_thread_exit(void *p) {
+  trace_thread *t = (trace_thread*)p;
+  trace_drain(t);
+  t->dead = 1;   // the flusher frees it
+  trace_self = NULL;
+}
+
+static trace_thread* trace_thread_get() {
+  if (trace_self != NULL) return trace_self;
+
+  trace_thread *t = (trace_thread*)calloc(1, sizeof(trace_thread));
+  if (t == NULL) return NULL;
+  t->ring = (trace_record*)malloc(trace_records * sizeof(trace_record));
+  if (t->ring == NULL) {
+    free(t);
+    return NULL;
+  }
+  pthread_mutex_init(&t->lock, NULL);
+  t->tid = syscall(SYS_gettid);
+
+  pthread_mutex_lock(&trace_lock);
+  t->next = trace_threads;
+  trace_threads = t;
+  pthread_mutex_unlock(&trace_lock);
+
+  pthread_setspecific(trace_key, t);
+  trace_self = t;
+  return t;
+}
+
+void trace_save_path(const char *path, const char *to) {
+  trace_thread *t = trace_thread_get();
+  if (t == NULL || path == NULL) return;
+
+  size_t len = strnlen(path, PATH_MAX - 1);
+  memcpy(t->path, path, len);
+  if (to != NULL) {
+    t->path[len++] = '\0';
+    size_t tolen = strnlen(to, PATH_MAX - 1);
+    memcpy(t->path + len, to, tolen);
+    len += tolen;
+  }
+  t->path_len = len;
+}
+
+void trace_add(const stats_call *sc, unsigned long long ticks) {
+  int err = errno;
+  trace_thread *t = trace_thread_get();
+  if (t == NULL) return;
+
+  unsigned len = t->path_len;
+  t->path_len = 0;
+  unsigned slots = 1 + trace_path_slots(len);
+  if (t->head + slots - t->tail > trace_records) trace_drain(t);
+
+  unsigned mask = trace_records - 1;
+  trace_record *r = &t->ring[t->head & mask];
+  r->start = sc->start;
+  r->ticks = ticks;
+  r->handle = sc->handle;
+  r->offset = sc->offset;
+  r->size = sc->size;
+  r->result = sc->result;
+  r->tid = t->tid;
+  r->err = sc->result < 0 ? err : 0;
+  r->op = sc->op;
+  r->route = sc->route;
+  r->path_len = len;
+  r->flags = sc->flags;
+
+  for (unsigned i = 1; i < slots; i++) {
+    unsigned done = (i - 1) * sizeof(trace_record);
+    memcpy(&t->ring[(t->head + i) & mask], t->path + done,
+           std::min((unsigned)sizeof(trace_record), len - done));
+  }
+
+  __sync_synchronize();
+  t->head += slots;
+  errno = err;
+}
+
+static void trace_flush_all() {
+  pthread_mutex_lock(&trace_lock);
+  for (trace_thread **pp = &trace_threads; *pp != NULL; ) {
+    trace_thread *t = *pp;
+    trace_drain(t);
+    if (t->dead) {
+      *pp = t->next;
+      pthread_mutex_destroy(&t->lock);
+      free(t->ring);
+      free(t);
+    } else {
+      pp = &t->next;
+    }
+  }
+  pthread_mutex_unlock(&trace_lock);
+  if (trace_fd >= 0) trace_clock();
+}
+
+static void* trace_flusher_main(void *arg) {
+  while (1) {
+    usleep(TRACE_FLUSH_MS * 1000);
+    trace_flush_all();
+  }
+  return NULL;
+}
+
+static void trace_start_flusher() {
+  pthread_t tid;
+  pthread_attr_t attr;
+  pthread_attr_init(&attr);
+  pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+  pthread_create(&tid, &attr, trace_flusher_main, NULL);
+  pthread_attr_destroy(&attr);
+}
+
+static void trace_exit() {
+  trace_flush_all();
+  if (trace_dropped) {
+    std::cerr << "soplfs: " << trace_dropped << " trace writes failed" << std::endl;
+  }
+}
+
+// a forked child traces into a file of its own; the parent's unflushed
+// records stay with the parent
+static void trace_fork_child() {
+  pthread_mutex_init(&trace_lock, NULL);
+  pthread_mutex_init(&trace_file_lock, NULL);
+  for (trace_thread *t = trace_threads; t != NULL; ) {
+    trace_thread *next = t->next;
+    free(t->ring);
+    free(t);
+    t = next;
+  }
+  trace_threads = NULL;
+  pthread_setspecific(trace_key, NULL);
+  trace_self = NULL;
+  if (trace_fd >= 0) __libc_close(trace_fd);
+  trace_fd = -1;
+  trace_start_ticks = stats_ticks();
+  trace_start_ns = trace_now_ns();
+  trace_start_flusher();
+}
+
+// called from stats_init when SOPLFS_TRACE is set
+void trace_init(const char *file) {
+  trace_name = file;
+
+  const char *v = getenv("SOPLFS_TRACE_RECORDS");
+  if (v != NULL && atoi(v) > 0) {
+    unsigned n = atoi(v);
+    trace_records = 256;   // room for the longest pair of paths
+    while (trace_records < n) trace_records <<= 1;
+  }
+
+  // the clock records that follow are converted against this point
+  trace_start_ticks = stats_ticks();
+  trace_start_ns = trace_now_ns();
+
+  pthread_key_create(&trace_key, trace_thread_exit);
+  trace_start_flusher();
+  pthread_atfork(NULL, NULL, trace_fork_child);
+  atexit(trace_exit);
+  trace_enabled = 1;
+}
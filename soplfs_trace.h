@@ -0,0 +1,57 @@
+#ifndef SOPLFS_TRACE_H
+#define SOPLFS_TRACE_H
+
+#include <stdint.h>
+
+
+/*
+ * Binary I/O trace format (soplfs_trace.cpp, tools/soplfs_replay.cpp)
+ *
+ * A trace file is a trace_file_header followed by 64-byte records.
+ * Within a thread records are in call order; threads flush in batches,
+ * so across threads they are not and readers sort by start.  A record
+ * with path_len > 0 is followed by trace_path_slots(path_len) slots
+ * holding the path (rename: both paths, separated by a NUL).
+ *
+ * Times are in stats_ticks() units; TRACE_CLOCK records pair a tick
+ * count (start) with CLOCK_MONOTONIC ns (result) so readers can convert
+ * them and line up the traces of several processes on a node.
+ *
+ * This file does not depend on PLFS so soplfs-replay can include it.
+ */
+
+#define TRACE_MAGIC "SOPLFSTR"
+#define TRACE_VERSION 1
+#define TRACE_CLOCK 0xff   // op of a clock record
+
+struct trace_file_header {
+  char magic[8];
+  uint32_t version;
+  uint32_t record_size;
+  int32_t pid;
+  uint32_t reserved;
+  uint64_t start_ticks;
+  int64_t start_ns;        // CLOCK_MONOTONIC at start_ticks
+  char cmdline[216];
+};
+
+struct trace_record {
+  uint64_t start;          // ticks
+  uint64_t ticks;          // latency
+  int64_t handle;          // fd, DIR* for directory calls, -1 for path calls
+  int64_t offset;          // file position the call worked at, -1 if none
+  uint64_t size;           // bytes asked for; mode for open, mkdir, chmod
+  int64_t result;          // return value; the new fd or DIR* of an open
+  uint32_t tid;
+  int32_t err;             // errno of a failed call
+  uint8_t op;              // stats_op, or TRACE_CLOCK
+  uint8_t route;           // stats_route
+  uint16_t path_len;
+  uint32_t flags;          // open flags, fcntl command, LIO_READ/LIO_WRITE
+};
+
+inline unsigned trace_path_slots(unsigned path_len) {
+  return (path_len + sizeof(trace_record) - 1) / sizeof(trace_record);
+}
+
+#endif
@@ -0,0 +1,186 @@
+#include "soplfs_internal.h"
+
+#include <ctype.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <stddef.h>
+#include <unistd.h>
+
+#include <string>
+#include <vector>
+#include <utility>
+
+
+/*
+ * Per-mount tuning
+ *
+ * loadMounts() hands every "soplfs_<key>: <value>" line of plfsrc to
+ * tune_set(), with the mount_point it follows (-1 before the first one
+ * in its file).  tune_done() then builds each mount's soplfs_tuning from
+ * the compiled-in defaults, the keys given for all mounts, the mount's
+ * own keys and finally SOPLFS_<KEY> from the environment.
+ */
+
+enum { TUNE_SIZE, TUNE_INT, TUNE_LONG, TUNE_BOOL };
+
+struct tune_key {
+  const char *name;   // plfsrc soplfs_<name>, environment SOPLFS_<NAME>
+  int type;
+  size_t offset;
+};
+
+#define TUNE(name, type) { #name, type, offsetof(soplfs_tuning, name) }
+
+static const tune_key tune_keys[] = {
+  TUNE(read_split, TUNE_SIZE),
+  TUNE(pread_split, TUNE_BOOL),
+  TUNE(read_adapt, TUNE_BOOL),
+  TUNE(read_dedup, TUNE_BOOL),
+  TUNE(eagain_retries, TUNE_INT),
+  TUNE(eagain_backoff_us, TUNE_INT),
+  TUNE(readahead, TUNE_SIZE),
+  TUNE(readahead_chunks, TUNE_INT),
+  TUNE(mmap_readahead, TUNE_SIZE),
+  TUNE(prefetch_max, TUNE_SIZE),
+  TUNE(attr_ttl, TUNE_LONG),
+  TUNE(block_cache, TUNE_SIZE),
+  TUNE(aio_coalesce, TUNE_SIZE),
+  TUNE(aio_threads, TUNE_INT),
+  TUNE(sync_interval, TUNE_LONG),
+  TUNE(sync_bytes, TUNE_SIZE),
+  TUNE(copy_chunk, TUNE_SIZE),
+  TUNE(copy_threads, TUNE_INT),
+  TUNE(walk_threads, TUNE_INT),
+  TUNE(seek_holes, TUNE_BOOL),
+};
+
+#undef TUNE
+
+#define TUNE_KEYS (sizeof(tune_keys) / sizeof(tune_keys[0]))
+
+typedef std::vector<std::pair<std::string, std::string> > tune_list;
+
+static std::vector<tune_list> tune_given SOPLFS_GLOBAL;           // [mount + 1]
+static std::vector<soplfs_tuning> tune_mounts SOPLFS_GLOBAL;      // [mount + 1]
+
+
+static void tune_defaults(soplfs_tuning *t) {
+  t->read_split = 1024 * 1024;
+  t->pread_split = 0;
+  t->read_adapt = 0;
+  t->read_dedup = 0;
+  t->seek_holes = 0;
+  t->eagain_retries = -1;
+  t->eagain_backoff_us = 0;
+  t->readahead = 1024 * 1024;
+  t->readahead_chunks = 8;
+  t->mmap_readahead = 1024 * 1024;
+  t->prefetch_max = 64 * 1024 * 1024;
+  t->attr_ttl = 0;
+  t->block_cache = 0;
+  t->aio_coalesce = 16 * 1024 * 1024;
+  t->aio_threads = 4;
+  t->sync_interval = 0;
+  t->sync_bytes = 0;
+  t->copy_chunk = 4 * 1024 * 1024;
+  t->copy_threads = 4;
+  t->walk_threads = 8;
+}
+
+// sizes take a k, m or g suffix; booleans also yes/no, on/off, true/false
+static int tune_parse(const tune_key &k, const char *v, soplfs_tuning *t) {
+  char *end = NULL;
+  long long n;
+  if (k.type == TUNE_BOOL && strchr("yYtT", *v) != NULL) {
+    n = 1;
+  } else if (k.type == TUNE_BOOL && (strchr("nNfF", *v) != NULL ||
+                                     strncasecmp(v, "off", 3) == 0)) {
+    n = 0;
+  } else if (k.type == TUNE_BOOL && strncasecmp(v, "on", 2) == 0) {
+    n = 1;
+  } else {
+    n = strtoll(v, &end, 10);
+    if (end == v) return -1;
+    if (k.type == TUNE_SIZE) {
+      switch (*end) {
+        case 'k': case 'K': n <<= 10; break;
+        case 'm': case 'M': n <<= 20; break;
+        case 'g': case 'G': n <<= 30; break;
+      }
+    }
+  }
+
+  char *field = (char*)t + k.offset;
+  switch (k.type) {
+    case TUNE_SIZE: *(size_t*)field = n < 0 ? 0 : n; break;
+    case TUNE_LONG: *(long*)field = n; break;
+    default:        *(int*)field = n; break;
+  }
+  return 0;
+}
+
+static void tune_apply(const tune_list &given, soplfs_tuning *t) {
+  for (tune_list::const_iterator itr = given.begin(); itr != given.end(); itr++) {
+    for (size_t i = 0; i < TUNE_KEYS; i++) {
+      if (itr->first != tune_keys[i].name) continue;
+      if (tune_parse(tune_keys[i], itr->second.c_str(), t) < 0) {
+        std::cerr << "soplfs: bad value for soplfs_" << itr->first << ": "
+                  << itr->second << std::endl;
+      }
+    }
+  }
+}
+
+void tune_set(int mount, const std::string &key, const std::string &value) {
+  size_t i = 0;
+  while (i < TUNE_KEYS && key != tune_keys[i].name) i++;
+  if (i == TUNE_KEYS) {
+    std::cerr << "soplfs: unknown plfsrc key soplfs_" << key << std::endl;
+    return;
+  }
+
+  if (tune_given.size() < (size_t)mount + 2) tune_given.resize(mount + 2);
+  tune_given[mount + 1].push_back(std::make_pair(key, value));
+}
+
+void tune_done(size_t mounts) {
+  tune_given.resize(mounts + 1);
+
+  // the environment wins over every plfsrc line
+  tune_list env;
+  for (size_t i = 0; i < TUNE_KEYS; i++) {
+    std::string name = "SOPLFS_";
+    for (const char *c = tune_keys[i].name; *c; c++) name += toupper(*c);
+    const char *v = getenv(name.c_str());
+    if (v != NULL && *v != '\0') env.push_back(std::make_pair(tune_keys[i].name, v));
+  }
+
+  tune_mounts.resize(mounts + 1);
+  for (size_t m = 0; m <= mounts; m++) {
+    soplfs_tuning *t = &tune_mounts[m];
+    tune_defaults(t);
+    tune_apply(tune_given[0], t);
+    if (m > 0) tune_apply(tune_given[m], t);
+    tune_apply(env, t);
+  }
+  tune_given.clear();
+}
+
+const soplfs_tuning& mount_tuning(int mount) {
+  if (tune_mounts.empty()) {
+    // before tune_done: only calls made by the initialization get here
+    static soplfs_tuning defaults;
+    tune_defaults(&defaults);
+    return defaults;
+  }
+  if (mount < 0 || (size_t)mount + 1 >= tune_mounts.size()) return tune_mounts[0];
+  return tune_mounts[mount + 1];
+}
+
+int tune_retry(int mount, int tries) {
+  const soplfs_tuning &t = mount_tuning(mount);
+  if (t.eagain_retries >= 0 && tries > t.eagain_retries) return 0;
+  if (t.eagain_backoff_us > 0) usleep(t.eagain_backoff_us);
+  return 1;
+}
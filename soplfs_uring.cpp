@@ -0,0 +1,346 @@
+#include "soplfs_uring.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <linux/io_uring.h>
+
+#include <algorithm>
+
+
+#define URING_DEPTH 64
+
+struct uring {
+  int fd;
+  void *sq_ptr;
+  void *cq_ptr;
+  size_t sq_size;
+  size_t cq_size;
+  unsigned *sq_head;
+  unsigned *sq_tail;
+  unsigned *sq_mask;
+  unsigned *sq_array;
+  unsigned *cq_head;
+  unsigned *cq_tail;
+  unsigned *cq_mask;
+  struct io_uring_sqe *sqes;
+  struct io_uring_cqe *cqes;
+  struct iovec iov[URING_DEPTH];
+};
+
+unsigned long uring_syscalls = 0;
+
+static pthread_once_t uring_once = PTHREAD_ONCE_INIT;
+static pthread_key_t uring_key;
+static int uring_disabled = 0;
+
+
+
+static void uring_free(void *p) {
+  uring *r = (uring*)p;
+  if (r == NULL) return;
+
+  munmap(r->sqes, URING_DEPTH * sizeof(struct io_uring_sqe));
+  if (r->cq_ptr != r->sq_ptr) munmap(r->cq_ptr, r->cq_size);
+  munmap(r->sq_ptr, r->sq_size);
+  close(r->fd);
+  delete r;
+}
+
+// the forking thread's ring is shared with the parent; the child sets
+// up its own
+static void uring_fork_child() {
+  uring *r = (uring*)pthread_getspecific(uring_key);
+  pthread_setspecific(uring_key, NULL);
+  uring_free(r);
+}
+
+static void uring_do_init() {
+  const char *v = getenv("SOPLFS_URING");
+  if (v != NULL && strcmp(v, "0") == 0) uring_disabled = 1;
+
+  pthread_key_create(&uring_key, uring_free);
+  pthread_atfork(NULL, NULL, uring_fork_child);
+}
+
+// one ring per thread: submission is then lock free
+static uring* uring_get() {
+  pthread_once(&uring_once, uring_do_init);
+  if (uring_disabled) return NULL;
+
+  uring *r = (uring*)pthread_getspecific(uring_key);
+  if (r != NULL) return r;
+
+  struct io_uring_params p;
+  memset(&p, 0, sizeof(p));
+  int fd = syscall(__NR_io_uring_setup, URING_DEPTH, &p);
+  if (fd < 0) {
+    // ENOSYS, or forbidden by seccomp/sysctl: stay on pread for good
+    uring_disabled = 1;
+    return NULL;
+  }
+
+  r = new uring();
+  r->fd = fd;
+  r->sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+  r->cq_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+  if (p.features & IORING_FEAT_SINGLE_MMAP) {
+    r->sq_size = r->cq_size = std::max(r->sq_size, r->cq_size);
+  }
+
+  r->sq_ptr = mmap(NULL, r->sq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                   fd, IORING_OFF_SQ_RING);
+  r->cq_ptr = r->sq_ptr;
+  if (r->sq_ptr != MAP_FAILED && !(p.features & IORING_FEAT_SINGLE_MMAP)) {
+    r->cq_ptr = mmap(NULL, r->cq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                     fd, IORING_OFF_CQ_RING);
+  }
+  r->sqes = (struct io_uring_sqe*)mmap(NULL, p.sq_entries * sizeof(struct io_uring_sqe),
+                                       PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                                       fd, IORING_OFF_SQES);
+  if (r->sq_ptr == MAP_FAILED || r->cq_ptr == MAP_FAILED || r->sqes == MAP_FAILED) {
+    close(fd);
+    delete r;
+    uring_disabled = 1;
+    return NULL;
+  }
+
+  char *sq = (char*)r->sq_ptr;
+  char *cq = (char*)r->cq_ptr;
+  r->sq_head = (unsigned*)(sq + p.sq_off.head);
+  r->sq_tail = (unsigned*)(sq + p.sq_off.tail);
+  r->sq_mask = (unsigned*)(sq + p.sq_off.ring_mask);
+  r->sq_array = (unsigned*)(sq + p.sq_off.array);
+  r->cq_head = (unsigned*)(cq + p.cq_off.head);
+  r->cq_tail = (unsigned*)(cq + p.cq_off.tail);
+  r->cq_mask = (unsigned*)(cq + p.cq_off.ring_mask);
+  r->cqes = (struct io_uring_cqe*)(cq + p.cq_off.cqes);
+
+  pthread_setspecific(uring_key, r);
+  return r;
+}
+
+int uring_available() {
+  return uring_get() != NULL;
+}
+
+static int uring_pread_chunks(uring_io *ios, int n) {
+  for (int i = 0; i < n; i++) {
+    __sync_fetch_and_add(&uring_syscalls, 1);
+    ios[i].res = syscall(SYS_pread64, ios[i].fd, ios[i].buf, ios[i].len, ios[i].offset);
+    if (ios[i].res < 0) ios[i].res = -errno;
+  }
+  return 0;
+}
+
+// waits for the CQEs of the SQEs the kernel took; called when a batch
+// fails half way, so none of them lands in a later batch's buffers
+static int uring_drain(uring *r, int submitted, int reaped) {
+  while (reaped < submitted) {
+    __sync_fetch_and_add(&uring_syscalls, 1);
+    int rc = syscall(__NR_io_uring_enter, r->fd, 0, submitted - reaped,
+                     IORING_ENTER_GETEVENTS, NULL, 0);
+    if (rc < 0 && errno != EINTR) return -1;
+
+    unsigned head = *r->cq_head;
+    while (head != __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE)) {
+      head++;
+      reaped++;
+    }
+    __atomic_store_n(r->cq_head, head, __ATOMIC_RELEASE);
+  }
+  return 0;
+}
+
+// returns -1 with no SQE or CQE of the batch left in the ring; the
+// chunks' results are then meaningless
+int uring_read_chunks(uring_io *ios, int n) {
+  uring *r = uring_get();
+  if (r == NULL || n > URING_DEPTH) return uring_pread_chunks(ios, n);
+
+  unsigned first = *r->sq_tail;
+  unsigned tail = first;
+  for (int i = 0; i < n; i++) {
+    unsigned idx = tail & *r->sq_mask;
+    struct io_uring_sqe *sqe = &r->sqes[idx];
+
+    r->iov[i].iov_base = ios[i].buf;
+    r->iov[i].iov_len = ios[i].len;
+
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = IORING_OP_READV;
+    sqe->fd = ios[i].fd;
+    sqe->addr = (unsigned long)&r->iov[i];
+    sqe->len = 1;
+    sqe->off = ios[i].offset;
+    sqe->user_data = i;
+
+    r->sq_array[idx] = idx;
+    tail++;
+  }
+  __atomic_store_n(r->sq_tail, tail, __ATOMIC_RELEASE);
+
+  int submitted = 0;
+  int reaped = 0;
+  while (reaped < n) {
+    __sync_fetch_and_add(&uring_syscalls, 1);
+    int rc = syscall(__NR_io_uring_enter, r->fd, n - submitted, n - reaped,
+                     IORING_ENTER_GETEVENTS, NULL, 0);
+    if (rc < 0) {
+      if (errno == EINTR) continue;
+
+      // take back what the kernel has not taken, wait for the rest
+      __atomic_store_n(r->sq_tail, first + submitted, __ATOMIC_RELEASE);
+      if (submitted == 0) return uring_pread_chunks(ios, n);
+      if (uring_drain(r, submitted, reaped) < 0) {
+        // the ring is stuck with our buffers in it: drop it for good
+        pthread_setspecific(uring_key, NULL);
+        uring_free(r);
+        uring_disabled = 1;
+      }
+      return -1;
+    }
+    submitted += rc;
+
+    unsigned head = *r->cq_head;
+    while (head != __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE)) {
+      struct io_uring_cqe *cqe = &r->cqes[head & *r->cq_mask];
+      ios[cqe->user_data].res = cqe->res;
+      head++;
+      reaped++;
+    }
+    __atomic_store_n(r->cq_head, head, __ATOMIC_RELEASE);
+  }
+
+  return 0;
+}
+
+
+void ra_init() {
+  pthread_once(&uring_once, uring_do_init);
+}
+
+ra_state* ra_create(size_t window, int chunks) {
+  ra_init();
+
+  ra_state *ra = new ra_state();
+  pthread_mutex_init(&ra->lock, NULL);
+  ra->buf = NULL;
+  ra->start = 0;
+  ra->len = 0;
+  ra->eof = 0;
+  ra->next = -1;
+  ra->sequential = 0;
+  ra->advice = POSIX_FADV_NORMAL;
+  ra->window = window;
+  ra->chunks = std::max(1, std::min(chunks, URING_DEPTH));
+  return ra;
+}
+
+void ra_invalidate(ra_state *ra) {
+  pthread_mutex_lock(&ra->lock);
+  ra->len = 0;
+  ra->eof = 0;
+  pthread_mutex_unlock(&ra->lock);
+}
+
+void ra_advise(ra_state *ra, int advice) {
+  pthread_mutex_lock(&ra->lock);
+  ra->advice = advice;
+  if (advice == POSIX_FADV_RANDOM) ra->len = 0;
+  pthread_mutex_unlock(&ra->lock);
+}
+
+void ra_destroy(ra_state *ra) {
+  pthread_mutex_destroy(&ra->lock);
+  free(ra->buf);
+  delete ra;
+}
+
+// called with ra->lock held
+static void ra_fill(ra_state *ra, int fd, off_t offset) {
+  if (ra->buf == NULL) ra->buf = (char*)malloc(ra->window);
+  ra->len = 0;
+  ra->eof = 0;
+  if (ra->buf == NULL) return;
+
+  uring_io ios[URING_DEPTH];
+  size_t chunk = (ra->window + ra->chunks - 1) / ra->chunks;
+  int n = 0;
+  for (size_t done = 0; done < ra->window; done += chunk, n++) {
+    ios[n].fd = fd;
+    ios[n].buf = ra->buf + done;
+    ios[n].len = std::min(chunk, ra->window - done);
+    ios[n].offset = offset + done;
+    ios[n].res = 0;
+  }
+
+  if (uring_available()) {
+    // a failed batch leaves no window; ra_read falls back to pread
+    if (uring_read_chunks(ios, n) < 0) return;
+  } else {
+    // without io_uring one large pread beats several small ones
+    ios[0].len = ra->window;
+    uring_pread_chunks(ios, 1);
+    n = 1;
+  }
+
+  // the window holds what was read contiguously from offset
+  for (int i = 0; i < n; i++) {
+    if (ios[i].res < 0) break;
+    ra->len += ios[i].res;
+    if ((size_t)ios[i].res < ios[i].len) {
+      ra->eof = 1;
+      break;
+    }
+  }
+  ra->start = offset;
+}
+
+ssize_t ra_read(ra_state *ra, int fd, void *buf, size_t count, off_t offset, int *hit) {
+  pthread_mutex_lock(&ra->lock);
+
+  int inside = (offset >= ra->start && offset < ra->start + (off_t)ra->len);
+  if ((inside || (ra->eof && offset == ra->start + (off_t)ra->len)) &&
+      (offset + (off_t)count <= ra->start + (off_t)ra->len || ra->eof)) {
+    size_t n = std::min((off_t)count, ra->start + (off_t)ra->len - offset);
+    memcpy(buf, ra->buf + (offset - ra->start), n);
+    ra->next = offset + n;
+    pthread_mutex_unlock(&ra->lock);
+    if (hit) *hit = 1;
+    return n;
+  }
+
+  ra->sequential = (offset == ra->next) ? ra->sequential + 1 : 0;
+  ra->next = offset + count;
+
+  // read ahead only for a sequential stream of reads smaller than the
+  // window, or any read the application said was part of one
+  int stream = ra->advice == POSIX_FADV_SEQUENTIAL ? 1 :
+               ra->advice == POSIX_FADV_RANDOM ? 0 : ra->sequential >= 2;
+  if (ra->window == 0 || !stream || count >= ra->window / 2) {
+    pthread_mutex_unlock(&ra->lock);
+
+    __sync_fetch_and_add(&uring_syscalls, 1);
+    return syscall(SYS_pread64, fd, buf, count, offset);
+  }
+
+  ra_fill(ra, fd, offset);
+  size_t n = std::min(count, ra->len);
+  memcpy(buf, ra->buf, n);
+  ra->next = offset + n;
+  ssize_t ret = n;
+  if (ra->len == 0 && !ra->eof) ret = -1;   // the fill failed
+  pthread_mutex_unlock(&ra->lock);
+
+  if (ret < 0) {
+    __sync_fetch_and_add(&uring_syscalls, 1);
+    ret = syscall(SYS_pread64, fd, buf, count, offset);
+  }
+  return ret;
+}
@@ -0,0 +1,58 @@
+#ifndef SOPLFS_URING_H
+#define SOPLFS_URING_H
+
+#include <sys/types.h>
+#include <pthread.h>
+
+
+/*
+ * Batched reads for the FUSE side-channel (soplfs_uring.cpp)
+ *
+ * uring_read_chunks() issues a set of positional reads with one
+ * io_uring_enter when io_uring is available (SOPLFS_URING=0 turns it
+ * off) and falls back to pread otherwise.  ra_read() sits on top of it
+ * and serves sequential small reads of a descriptor from a read-ahead
+ * window fetched as a few parallel reads; soplfs sizes the window per
+ * mount (SOPLFS_READAHEAD, SOPLFS_READAHEAD_CHUNKS).
+ *
+ * This file does not depend on PLFS so the benchmarks can link it.
+ */
+
+struct uring_io {
+  int fd;
+  void *buf;
+  size_t len;
+  off_t offset;
+  ssize_t res;   // bytes read or -errno
+};
+
+int uring_available();
+int uring_read_chunks(uring_io *ios, int n);
+
+// syscalls issued by this file, for the benchmarks and the stats
+extern unsigned long uring_syscalls;
+
+struct ra_state {
+  pthread_mutex_t lock;
+  char *buf;
+  off_t start;      // file offset of buf[0]
+  size_t len;       // valid bytes in buf
+  int eof;          // the window ends at end of file
+  off_t next;       // where a sequential read would start
+  int sequential;   // consecutive sequential reads seen
+  int advice;       // POSIX_FADV_NORMAL, _SEQUENTIAL or _RANDOM
+  size_t window;    // bytes fetched per fill, 0: no read-ahead
+  int chunks;       // parallel reads per fill
+};
+
+void ra_init();   // reads SOPLFS_URING
+ra_state* ra_create(size_t window, int chunks);
+void ra_invalidate(ra_state *ra);
+// SEQUENTIAL: read ahead from the first read, RANDOM: never
+void ra_advise(ra_state *ra, int advice);
+void ra_destroy(ra_state *ra);
+// *hit, if given, is set when the window served the whole read
+ssize_t ra_read(ra_state *ra, int fd, void *buf, size_t count, off_t offset,
+                int *hit = NULL);
+
+#endif
@@ -0,0 +1,869 @@
+#include "soplfs_internal.h"
+
+#include <stdlib.h>
+#include <stddef.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <limits.h>
+#include <pthread.h>
+#include <sys/stat.h>
+
+#include <string>
+#include <vector>
+#include <set>
+#include <map>
+#include <algorithm>
+
+
+/*
+ * Parallel tree walks for nftw, ftw and fts
+ *
+ * Walked one opendir/readdir/stat at a time, a PLFS tree costs a round
+ * trip to the backend per file.  Here a walk gets walk_threads threads
+ * of its own that plfs_readdir a directory and then plfs_getattr its
+ * entries, WALK_CHUNK at a time spread over the threads, while the
+ * caller is still busy further up.
+ *
+ * The caller drives: walk_enter() takes the listing of the directory it
+ * descends into (waiting for it, and moving it to the head of the queue,
+ * if the threads have not got to it), walk_plan() names the
+ * subdirectories it is going to enter, in its order, and the threads
+ * list those ahead, up to WALK_AHEAD directories, the soonest first.  A
+ * queued directory's key is its position in the walk (the plan index at
+ * every level down to it), so the threads always pick the one the
+ * caller will reach next.  Subdirectories the caller passes over
+ * (walk_pass) or leaves behind are dropped.
+ *
+ * nftw and fts callbacks and results stay on the caller's thread, in the
+ * order the flags ask for; directories come in name order (sorted by
+ * compar for fts).  plfs_getattr does not follow symbolic links: when
+ * the flags ask for it (nftw without FTW_PHYS, ftw, FTS_LOGICAL, roots
+ * with FTS_COMFOLLOW) the threads stat a link's target through the
+ * mount.  A directory reached twice that way is walked once (nftw) or
+ * reported as FTS_DC (fts).  The walk holds no descriptors, so nopenfd
+ * is not used, and fts never changes directory (as with FTS_NOCHDIR).
+ * The walk itself is not one stats_call: the callbacks' own calls are
+ * counted as usual, and the threads count one readdir per directory and
+ * one stat per entry.
+ */
+
+#define WALK_AHEAD 1024   // directories queued or listed ahead of the caller
+#define WALK_CHUNK 64     // entries one thread stats at a time
+
+enum { WALK_QUEUED, WALK_LISTING, WALK_STATING, WALK_READY };
+
+typedef std::vector<size_t> walk_key;   // plan index per level; empty: wanted now
+
+struct walk_entry {
+  std::string name;
+  struct stat st;
+  int err;                      // of the stat; st is only good when 0
+};
+
+struct walk_dir {
+  std::string path;
+  walk_key key;
+  std::vector<walk_entry> entries;   // name order, without . and ..
+  int err;                      // of the listing
+  int state;
+  size_t stat_next;             // first entry no thread has taken
+  int stat_busy;                // threads stating entries of it
+  int dropped;                  // the caller will not take it: the thread frees it
+};
+
+struct walk_frame {
+  walk_dir *dir;
+  std::vector<std::string> plan;   // subdirectories in the order they are entered
+  size_t next;                  // plan entries entered or passed over
+  size_t ahead;                 // plan entries queued (or entered) so far
+};
+
+struct walk_tree {
+  int mount;
+  pthread_mutex_t lock;
+  pthread_cond_t work;
+  pthread_cond_t ready;
+  std::map<std::string, walk_dir*> dirs;   // queued or listed, not taken yet
+  std::map<walk_key, walk_dir*> queue;
+  std::map<walk_key, walk_dir*> stating;   // listed, entries left to stat
+  std::vector<pthread_t> threads;
+  std::vector<walk_frame*> stack;          // the caller's, no lock
+  int follow;                   // entries that are links are stat'ed through them
+  int quit;
+};
+
+
+static void walk_join(std::string *path, const std::string &name) {
+  if (path->empty() || (*path)[path->size() - 1] != '/') *path += '/';
+  *path += name;
+}
+
+static std::string walk_trim(const char *path) {
+  std::string s(path);
+  while (s.size() > 1 && s[s.size() - 1] == '/') s.erase(s.size() - 1);
+  return s;
+}
+
+static void walk_list(walk_tree *t, walk_dir *d) {
+  stats_call sc(STATS_READDIR);
+  sc.route = STATS_PLFS;
+  sc.mount = t->mount;
+  sc.trace_path(d->path.c_str());
+
+  std::set<std::string> names;
+  plfs_retry retry(t->mount);
+  plfs_error_t plfs_error = PLFS_EAGAIN;
+  while (retry.again(plfs_error)) {
+    names.clear();
+    plfs_error = PLFS_CALL(plfs_readdir(d->path.c_str(), (void*)&names));
+  }
+  if (plfs_error != PLFS_SUCCESS) {
+    d->err = plfs_error_to_errno(plfs_error);
+    sc.trace_result(-1);
+    return;
+  }
+
+  d->entries.reserve(names.size());
+  for (std::set<std::string>::iterator itr = names.begin(); itr != names.end(); itr++) {
+    if (*itr == "." || *itr == "..") continue;
+    d->entries.push_back(walk_entry());
+    d->entries.back().name = *itr;
+    d->entries.back().err = 0;
+  }
+  sc.trace_result(d->entries.size());
+}
+
+// a link is followed on request; one that leads nowhere stays a link
+static int walk_stat(int mount, const std::string &path, struct stat *st, int follow) {
+  stats_call sc(STATS_STAT);
+  sc.route = STATS_PLFS;
+  sc.mount = mount;
+  sc.trace_path(path.c_str());
+  plfs_error_t plfs_error = plfs_stat_path(path.c_str(), st);
+  int err = plfs_error == PLFS_SUCCESS ? 0 : plfs_error_to_errno(plfs_error);
+  if (!err && follow && S_ISLNK(st->st_mode)) {
+    MAP(stat, int (*)(const char*, struct stat*));
+    struct stat target;
+    if (__libc_stat(path.c_str(), &target) == 0) *st = target;
+  }
+  sc.trace_result(err ? -1 : 0);
+  return err;
+}
+
+// with the lock held: every entry of d is stat'ed
+static void walk_ready(walk_tree *t, walk_dir *d) {
+  if (d->dropped) {
+    delete d;
+    return;
+  }
+  d->state = WALK_READY;
+  pthread_cond_broadcast(&t->ready);
+}
+
+// with the lock held: lists the most urgent queued directory or stats a
+// chunk of the most urgent listed one (only want's, when given); 0 when
+// there is nothing to do
+static int walk_step(walk_tree *t, walk_dir *want) {
+  walk_dir *q = t->queue.empty() ? NULL : t->queue.begin()->second;
+  walk_dir *s = t->stating.empty() ? NULL : t->stating.begin()->second;
+  if (want && q != want) q = NULL;
+  if (want && s != want) s = NULL;
+
+  if (s != NULL && (q == NULL || s->key < q->key)) {
+    size_t from = s->stat_next;
+    size_t to = std::min(from + WALK_CHUNK, s->entries.size());
+    s->stat_next = to;
+    if (to == s->entries.size()) t->stating.erase(s->key);
+    s->stat_busy++;
+    pthread_mutex_unlock(&t->lock);
+
+    for (size_t i = from; i < to; i++) {
+      std::string path(s->path);
+      walk_join(&path, s->entries[i].name);
+      s->entries[i].err = walk_stat(t->mount, path, &s->entries[i].st, t->follow);
+    }
+
+    pthread_mutex_lock(&t->lock);
+    if (--s->stat_busy == 0 && (s->dropped || s->stat_next == s->entries.size())) {
+      walk_ready(t, s);
+    }
+    return 1;
+  }
+
+  if (q != NULL) {
+    t->queue.erase(q->key);
+    q->state = WALK_LISTING;
+    pthread_mutex_unlock(&t->lock);
+
+    walk_list(t, q);
+
+    pthread_mutex_lock(&t->lock);
+    if (q->err || q->entries.empty() || q->dropped) {
+      walk_ready(t, q);
+    } else {
+      q->state = WALK_STATING;
+      t->stating[q->key] = q;
+      pthread_cond_broadcast(&t->work);
+    }
+    return 1;
+  }
+  return 0;
+}
+
+static void* walk_worker(void *arg) {
+  walk_tree *t = (walk_tree*)arg;
+  pthread_mutex_lock(&t->lock);
+  while (!t->quit) {
+    if (!walk_step(t, NULL)) pthread_cond_wait(&t->work, &t->lock);
+  }
+  pthread_mutex_unlock(&t->lock);
+  return NULL;
+}
+
+// with the lock held
+static walk_dir* walk_queue(walk_tree *t, const std::string &path, const walk_key &key) {
+  walk_dir *d = new walk_dir();
+  d->path = path;
+  d->key = key;
+  d->err = 0;
+  d->state = WALK_QUEUED;
+  d->stat_next = 0;
+  d->stat_busy = 0;
+  d->dropped = 0;
+  t->dirs[path] = d;
+  t->queue[key] = d;
+  pthread_cond_signal(&t->work);
+  return d;
+}
+
+// lists and stats path as soon as a thread is free; waits until it is done
+static walk_dir* walk_take(walk_tree *t, const std::string &path) {
+  pthread_mutex_lock(&t->lock);
+  walk_dir *d;
+  std::map<std::string, walk_dir*>::iterator itr = t->dirs.find(path);
+  if (itr == t->dirs.end()) {
+    d = walk_queue(t, path, walk_key());
+  } else {
+    d = itr->second;
+    std::map<walk_key, walk_dir*> *line = d->state == WALK_QUEUED ? &t->queue :
+                                          d->state == WALK_STATING ? &t->stating : NULL;
+    if (line != NULL && line->erase(d->key)) {
+      d->key.clear();
+      (*line)[d->key] = d;
+    }
+    if (d->state == WALK_READY) stats_event(STATS_EV_WALK_AHEAD, 1);
+  }
+  // the caller lends a hand rather than wait idle
+  while (d->state != WALK_READY) {
+    if (!walk_step(t, d)) pthread_cond_wait(&t->ready, &t->lock);
+  }
+  t->dirs.erase(path);
+  pthread_mutex_unlock(&t->lock);
+  return d;
+}
+
+// the caller will not take path after all
+static void walk_drop(walk_tree *t, const std::string &path) {
+  pthread_mutex_lock(&t->lock);
+  std::map<std::string, walk_dir*>::iterator itr = t->dirs.find(path);
+  if (itr != t->dirs.end()) {
+    walk_dir *d = itr->second;
+    t->dirs.erase(itr);
+    if (d->state == WALK_QUEUED) {
+      t->queue.erase(d->key);
+      delete d;
+    } else if (d->state == WALK_READY) {
+      delete d;
+    } else {
+      if (d->state == WALK_STATING && d->stat_next < d->entries.size()) t->stating.erase(d->key);
+      d->dropped = 1;
+      if (d->state == WALK_STATING && d->stat_busy == 0) delete d;
+    }
+  }
+  pthread_mutex_unlock(&t->lock);
+}
+
+// queues what the caller will enter next, deepest level first, while
+// there is room
+static void walk_fill(walk_tree *t) {
+  walk_key key;
+  for (size_t i = 0; i < t->stack.size(); i++) key.push_back(t->stack[i]->next - 1);
+
+  pthread_mutex_lock(&t->lock);
+  for (size_t i = t->stack.size(); i-- > 0; ) {
+    walk_frame *f = t->stack[i];
+    key.resize(i + 1);
+    for (; f->ahead < f->plan.size(); f->ahead++) {
+      if (t->dirs.size() >= WALK_AHEAD) {
+        pthread_mutex_unlock(&t->lock);
+        return;
+      }
+      key[i] = f->ahead;
+      if (t->dirs.find(f->plan[f->ahead]) == t->dirs.end()) walk_queue(t, f->plan[f->ahead], key);
+    }
+  }
+  pthread_mutex_unlock(&t->lock);
+}
+
+// the listing of path, which becomes the walk's current directory; a
+// subdirectory has to be the next one in its parent's plan
+static walk_dir* walk_enter(walk_tree *t, const std::string &path) {
+  if (!t->stack.empty()) {
+    walk_frame *f = t->stack.back();
+    f->next++;
+    f->ahead = std::max(f->ahead, f->next);
+  }
+  walk_frame *f = new walk_frame();
+  f->dir = walk_take(t, path);
+  f->next = 0;
+  f->ahead = 0;
+  t->stack.push_back(f);
+  return f->dir;
+}
+
+// the subdirectories of the current directory the caller will enter
+// or pass over, in that order
+static void walk_plan(walk_tree *t, std::vector<std::string> &plan) {
+  t->stack.back()->plan.swap(plan);
+  walk_fill(t);
+}
+
+// the next subdirectory in the current directory's plan is not entered
+static void walk_pass(walk_tree *t) {
+  walk_frame *f = t->stack.back();
+  if (f->next < f->ahead) walk_drop(t, f->plan[f->next]);
+  f->next++;
+  f->ahead = std::max(f->ahead, f->next);
+}
+
+// back to the parent directory
+static void walk_leave(walk_tree *t) {
+  walk_frame *f = t->stack.back();
+  t->stack.pop_back();
+  for (size_t i = f->next; i < f->ahead && i < f->plan.size(); i++) walk_drop(t, f->plan[i]);
+  delete f->dir;
+  delete f;
+  walk_fill(t);
+}
+
+static walk_tree* walk_begin(int mount, int follow) {
+  walk_tree *t = new walk_tree();
+  t->mount = mount;
+  t->follow = follow;
+  pthread_mutex_init(&t->lock, NULL);
+  pthread_cond_init(&t->work, NULL);
+  pthread_cond_init(&t->ready, NULL);
+  t->quit = 0;
+
+  // without any the caller does the work itself in walk_take
+  for (int i = 0; i < mount_tuning(mount).walk_threads; i++) {
+    pthread_t tid;
+    if (pthread_create(&tid, NULL, walk_worker, t) == 0) t->threads.push_back(tid);
+  }
+  return t;
+}
+
+static void walk_end(walk_tree *t) {
+  while (!t->stack.empty()) walk_leave(t);
+
+  pthread_mutex_lock(&t->lock);
+  t->quit = 1;
+  pthread_cond_broadcast(&t->work);
+  pthread_mutex_unlock(&t->lock);
+  for (size_t i = 0; i < t->threads.size(); i++) pthread_join(t->threads[i], NULL);
+
+  for (std::map<std::string, walk_dir*>::iterator itr = t->dirs.begin();
+       itr != t->dirs.end(); itr++) {
+    delete itr->second;
+  }
+  pthread_mutex_destroy(&t->lock);
+  pthread_cond_destroy(&t->work);
+  pthread_cond_destroy(&t->ready);
+  delete t;
+}
+
+int walk_wanted(const char *cpath) {
+  int mount = plfs_mount_of(cpath);
+  return mount >= 0 && mount_tuning(mount).walk_threads > 0;
+}
+
+
+/*
+ * nftw and ftw
+ */
+
+struct walk_nftw_job {
+  walk_tree *t;
+  int flags;
+  walk_nftw_fn fn;
+  walk_ftw_fn old_fn;           // ftw: the callback takes no struct FTW
+  std::string upath;            // as the caller spelled it, for the callback
+  std::string cpath;            // the same on the mount
+  dev_t dev;                    // of the root, for FTW_MOUNT
+  std::set<std::pair<dev_t, ino_t> > seen;   // directories entered, without FTW_PHYS
+};
+
+static int walk_call(walk_nftw_job *j, const struct stat *st, int type, int base, int level) {
+  if (j->old_fn) return j->old_fn(j->upath.c_str(), st, type);
+  struct FTW ftw;
+  ftw.base = base;
+  ftw.level = level;
+  return j->fn(j->upath.c_str(), st, type, &ftw);
+}
+
+// what a callback's result does to the walk: nonzero ends it with that
+// value; FTW_ACTIONRETVAL results can also skip a subtree or the rest of
+// a directory
+static int walk_action(walk_nftw_job *j, int r, int *siblings, int *subtree) {
+  if (!(j->flags & FTW_ACTIONRETVAL)) return r;
+  if (r == FTW_SKIP_SIBLINGS) *siblings = 1;
+  if (r == FTW_SKIP_SUBTREE && subtree) *subtree = 1;
+  return r == FTW_STOP ? FTW_STOP : 0;
+}
+
+// with FTW_MOUNT, entries on another file system are left out entirely
+static int walk_away(walk_nftw_job *j, const walk_entry &e) {
+  return (j->flags & FTW_MOUNT) && !e.err && e.st.st_dev != j->dev;
+}
+
+static void walk_chdir_parent(const std::string &cpath) {
+  size_t slash = cpath.rfind('/');
+  chdir(slash == 0 ? "/" : cpath.substr(0, slash).c_str());
+}
+
+// the entry at j's paths and, for a directory, everything under it
+static int walk_nftw_at(walk_nftw_job *j, const struct stat *st, int err, int base,
+                        int level, int *siblings) {
+  if (err || !S_ISDIR(st->st_mode)) {
+    // a link that was to be followed leads nowhere (ftw has no FTW_SLN)
+    int type = err ? FTW_NS : !S_ISLNK(st->st_mode) ? FTW_F :
+               (j->flags & FTW_PHYS) ? FTW_SL : j->old_fn ? FTW_NS : FTW_SLN;
+    return walk_action(j, walk_call(j, st, type, base, level), siblings, NULL);
+  }
+  if (!(j->flags & FTW_PHYS) && !j->seen.insert(std::make_pair(st->st_dev, st->st_ino)).second) {
+    if (level > 0) walk_pass(j->t);   // reached again through a link
+    return 0;
+  }
+
+  walk_dir *d = walk_enter(j->t, j->cpath);
+  if (d->err) {
+    walk_leave(j->t);
+    return walk_action(j, walk_call(j, st, FTW_DNR, base, level), siblings, NULL);
+  }
+  if (!(j->flags & FTW_DEPTH)) {
+    int subtree = 0;
+    int r = walk_action(j, walk_call(j, st, FTW_D, base, level), siblings, &subtree);
+    if (r || subtree || *siblings) {
+      walk_leave(j->t);
+      return r;
+    }
+  }
+
+  std::vector<std::string> plan;
+  for (size_t i = 0; i < d->entries.size(); i++) {
+    walk_entry &e = d->entries[i];
+    if (e.err || !S_ISDIR(e.st.st_mode) || walk_away(j, e)) continue;
+    plan.push_back(j->cpath);
+    walk_join(&plan.back(), e.name);
+  }
+  walk_plan(j->t, plan);
+
+  if (j->flags & FTW_CHDIR) chdir(j->cpath.c_str());
+  size_t ulen = j->upath.size(), clen = j->cpath.size();
+  int r = 0, skip = 0;
+  for (size_t i = 0; i < d->entries.size() && r == 0 && !skip; i++) {
+    walk_entry &e = d->entries[i];
+    if (walk_away(j, e)) continue;
+    walk_join(&j->upath, e.name);
+    walk_join(&j->cpath, e.name);
+    r = walk_nftw_at(j, &e.st, e.err, j->upath.size() - e.name.size(), level + 1, &skip);
+    j->upath.resize(ulen);
+    j->cpath.resize(clen);
+  }
+  if (j->flags & FTW_CHDIR) walk_chdir_parent(j->cpath);
+  walk_leave(j->t);
+
+  if (r == 0 && (j->flags & FTW_DEPTH)) {
+    r = walk_action(j, walk_call(j, st, FTW_DP, base, level), siblings, NULL);
+  }
+  return r;
+}
+
+int walk_nftw(const char *path, const char *cpath, walk_nftw_fn fn, walk_ftw_fn old_fn,
+              int flags) {
+  walk_nftw_job j;
+  j.flags = flags;
+  j.fn = fn;
+  j.old_fn = old_fn;
+  j.upath = walk_trim(path);
+  j.cpath = walk_trim(cpath);
+  size_t slash = j.upath.rfind('/');
+  int base = slash == std::string::npos || j.upath.size() == 1 ? 0 : slash + 1;
+
+  int mount = plfs_mount_of(j.cpath.c_str());
+  int follow = !(flags & FTW_PHYS);
+  struct stat st;
+  int err = walk_stat(mount, j.cpath, &st, follow);
+  if (err) {
+    errno = err;
+    return -1;
+  }
+  j.dev = st.st_dev;
+
+  char cwd[PATH_MAX];
+  if (flags & FTW_CHDIR) {
+    if (getcwd(cwd, sizeof(cwd)) == NULL) return -1;
+    walk_chdir_parent(j.cpath);
+  }
+
+  j.t = walk_begin(mount, follow);
+  int siblings = 0;
+  int r = walk_nftw_at(&j, &st, 0, base, 0, &siblings);
+  walk_end(j.t);
+
+  if (flags & FTW_CHDIR) {
+    int e = errno;
+    chdir(cwd);
+    errno = e;
+  }
+  return r;
+}
+
+
+/*
+ * fts
+ *
+ * The FTS handle is a walk_fts; fts_children reads a directory ahead
+ * for the fts_read that descends into it.  An FTSENT lives until the
+ * walk leaves its parent directory (roots until fts_close), so
+ * fts_number and fts_pointer of the directories above stay usable.
+ */
+
+struct walk_ent {
+  char *cpath;                  // on the mount
+  struct stat st;
+  FTSENT ent;                   // last: fts_name runs on past it
+};
+
+struct walk_fts_level {
+  FTSENT *dir;
+  std::vector<FTSENT*> kids;
+  size_t next;
+};
+
+struct walk_fts {
+  walk_tree *t;
+  int options;
+  int (*compar)(const FTSENT**, const FTSENT**);
+  FTSENT *parent;               // of the roots, at FTS_ROOTPARENTLEVEL
+  std::vector<walk_fts_level> levels;   // [0]: the roots
+  FTSENT *cur;                  // what fts_read returned last
+  FTSENT *built_for;            // fts_children read cur's directory
+  std::vector<FTSENT*> built;
+  int built_err;
+  dev_t dev;                    // of the root being walked, for FTS_XDEV
+  int done;
+};
+
+static pthread_mutex_t walk_lock = PTHREAD_MUTEX_INITIALIZER;
+static std::set<FTS*> walk_open SOPLFS_GLOBAL;
+
+static walk_ent* walk_ent_of(FTSENT *p) {
+  return (walk_ent*)((char*)p - offsetof(walk_ent, ent));
+}
+
+static FTSENT* walk_ent_new(const std::string &path, const std::string &cpath,
+                            const std::string &name, int level, FTSENT *parent) {
+  walk_ent *we = (walk_ent*)calloc(1, sizeof(walk_ent) + name.size());
+  we->cpath = strdup(cpath.c_str());
+  FTSENT *p = &we->ent;
+  p->fts_parent = parent;
+  p->fts_path = strdup(path.c_str());
+  p->fts_accpath = p->fts_path;
+  p->fts_pathlen = path.size();
+  p->fts_namelen = name.size();
+  memcpy(p->fts_name, name.c_str(), name.size() + 1);
+  p->fts_level = level;
+  p->fts_symfd = -1;
+  p->fts_instr = FTS_NOINSTR;
+  p->fts_statp = &we->st;
+  return p;
+}
+
+static void walk_ent_free(FTSENT *p) {
+  walk_ent *we = walk_ent_of(p);
+  free(we->cpath);
+  free(p->fts_path);
+  free(we);
+}
+
+// follow: st is what a link led to, so a link here leads nowhere
+static void walk_ent_stat(FTSENT *p, const struct stat *st, int err, int nostat, int follow) {
+  if (err) {
+    p->fts_info = FTS_NS;
+    p->fts_errno = err;
+    return;
+  }
+  *p->fts_statp = *st;
+  p->fts_ino = st->st_ino;
+  p->fts_dev = st->st_dev;
+  p->fts_nlink = st->st_nlink;
+  if (S_ISDIR(st->st_mode)) {
+    p->fts_info = FTS_D;
+  } else if (nostat) {
+    p->fts_info = FTS_NSOK;
+  } else {
+    p->fts_info = !S_ISLNK(st->st_mode) ? (S_ISREG(st->st_mode) ? FTS_F : FTS_DEFAULT) :
+                  follow ? FTS_SLNONE : FTS_SL;
+  }
+}
+
+// a directory that is also one of its ancestors (through a link) is
+// not entered again
+static void walk_ent_cycle(FTSENT *p) {
+  if (p->fts_info != FTS_D) return;
+  for (FTSENT *a = p->fts_parent; a != NULL && a->fts_level >= FTS_ROOTLEVEL; a = a->fts_parent) {
+    if (a->fts_dev == p->fts_dev && a->fts_ino == p->fts_ino) {
+      p->fts_info = FTS_DC;
+      p->fts_cycle = a;
+      return;
+    }
+  }
+}
+
+// with FTS_XDEV, a directory on another file system is not entered
+static int walk_fts_away(walk_fts *w, FTSENT *p) {
+  return (w->options & FTS_XDEV) && p->fts_level > FTS_ROOTLEVEL && p->fts_dev != w->dev;
+}
+
+static void walk_sort(walk_fts *w, std::vector<FTSENT*> *list) {
+  if (w->compar && list->size() > 1) {
+    qsort(&(*list)[0], list->size(), sizeof(FTSENT*),
+          (int (*)(const void*, const void*))w->compar);
+  }
+  for (size_t i = 0; i < list->size(); i++) {
+    (*list)[i]->fts_link = i + 1 < list->size() ? (*list)[i + 1] : NULL;
+  }
+}
+
+static void walk_free_list(std::vector<FTSENT*> *list) {
+  for (size_t i = 0; i < list->size(); i++) walk_ent_free((*list)[i]);
+  list->clear();
+}
+
+// enters p's directory and makes its entries; errno of the listing or 0
+static int walk_fts_build(walk_fts *w, FTSENT *p, std::vector<FTSENT*> *kids) {
+  walk_dir *d = walk_enter(w->t, walk_ent_of(p)->cpath);
+  if (d->err) return d->err;
+
+  std::string path(p->fts_path), cpath(walk_ent_of(p)->cpath);
+  if (w->options & FTS_SEEDOT) {
+    const char *dots[] = { ".", ".." };
+    for (int i = 0; i < 2; i++) {
+      std::string upath(path), dpath(cpath);
+      walk_join(&upath, dots[i]);
+      walk_join(&dpath, dots[i]);
+      FTSENT *dot = walk_ent_new(upath, dpath, dots[i], p->fts_level + 1, p);
+      FTSENT *of = i == 0 || p->fts_level == FTS_ROOTLEVEL ? p : p->fts_parent;
+      walk_ent_stat(dot, of->fts_statp, 0, 0, 0);
+      dot->fts_info = FTS_DOT;
+      kids->push_back(dot);
+    }
+  }
+  for (size_t i = 0; i < d->entries.size(); i++) {
+    walk_entry &e = d->entries[i];
+    std::string upath(path), epath(cpath);
+    walk_join(&upath, e.name);
+    walk_join(&epath, e.name);
+    FTSENT *kid = walk_ent_new(upath, epath, e.name, p->fts_level + 1, p);
+    // a logical walk stats everything, as libc's does
+    walk_ent_stat(kid, &e.st, e.err, (w->options & FTS_NOSTAT) && !w->t->follow, w->t->follow);
+    walk_ent_cycle(kid);
+    kids->push_back(kid);
+  }
+  walk_sort(w, kids);
+
+  std::vector<std::string> plan;
+  for (size_t i = 0; i < kids->size(); i++) {
+    if ((*kids)[i]->fts_info == FTS_D) plan.push_back(walk_ent_of((*kids)[i])->cpath);
+  }
+  walk_plan(w->t, plan);
+  return 0;
+}
+
+FTS* walk_fts_open(char *const *argv, const std::vector<std::string> &cpaths, int options,
+                   int (*compar)(const FTSENT**, const FTSENT**)) {
+  walk_fts *w = new walk_fts();
+  w->options = options;
+  w->compar = compar;
+  w->cur = NULL;
+  w->built_for = NULL;
+  w->built_err = 0;
+  w->dev = 0;
+  w->done = 0;
+  w->parent = walk_ent_new("", "", "", FTS_ROOTPARENTLEVEL, NULL);
+  w->parent->fts_info = FTS_INIT;
+
+  int mount = plfs_mount_of(cpaths[0].c_str());
+  int follow = (options & FTS_LOGICAL) != 0;
+  int follow_roots = (options & (FTS_LOGICAL | FTS_COMFOLLOW)) != 0;
+  walk_fts_level roots;
+  roots.dir = w->parent;
+  roots.next = 0;
+  for (size_t i = 0; i < cpaths.size(); i++) {
+    std::string cpath = walk_trim(cpaths[i].c_str());
+    FTSENT *p = walk_ent_new(argv[i], cpath, argv[i], FTS_ROOTLEVEL, w->parent);
+    struct stat st;
+    int err = walk_stat(plfs_mount_of(cpath.c_str()), cpath, &st, follow_roots);
+    walk_ent_stat(p, &st, err, 0, follow_roots);   // roots are stat'ed even with FTS_NOSTAT
+    roots.kids.push_back(p);
+  }
+  walk_sort(w, &roots.kids);
+  for (size_t i = 0; i < roots.kids.size(); i++) {
+    // sorted by the whole path, named by what follows its last slash,
+    // as libc's fts does
+    FTSENT *p = roots.kids[i];
+    char *slash = strrchr(p->fts_name, '/');
+    if (slash != NULL && (slash != p->fts_name || slash[1] != '\0')) {
+      p->fts_namelen = strlen(slash + 1);
+      memmove(p->fts_name, slash + 1, p->fts_namelen + 1);
+    }
+  }
+  w->levels.push_back(roots);
+  w->t = walk_begin(mount, follow);
+
+  pthread_mutex_lock(&walk_lock);
+  walk_open.insert((FTS*)w);
+  pthread_mutex_unlock(&walk_lock);
+  return (FTS*)w;
+}
+
+int walk_fts_owns(FTS *ftsp) {
+  pthread_mutex_lock(&walk_lock);
+  int owns = walk_open.count(ftsp) != 0;
+  pthread_mutex_unlock(&walk_lock);
+  return owns;
+}
+
+FTSENT* walk_fts_read(FTS *ftsp) {
+  walk_fts *w = (walk_fts*)ftsp;
+  FTSENT *p = w->cur;
+  if (w->done) {
+    errno = 0;
+    return NULL;
+  }
+  if (p != NULL && p->fts_instr == FTS_AGAIN) {
+    p->fts_instr = FTS_NOINSTR;
+    return p;
+  }
+
+  if (p != NULL && p->fts_info == FTS_D) {
+    if (p->fts_level == FTS_ROOTLEVEL) w->dev = p->fts_dev;
+    int skip = p->fts_instr == FTS_SKIP || walk_fts_away(w, p);
+    p->fts_instr = FTS_NOINSTR;
+    walk_fts_level level;
+    level.dir = p;
+    level.next = 0;
+    int err;
+    if (w->built_for == p) {
+      level.kids.swap(w->built);
+      err = w->built_err;
+      w->built_for = NULL;
+    } else if (skip) {
+      if (p->fts_level > FTS_ROOTLEVEL) walk_pass(w->t);
+      p->fts_info = FTS_DP;
+      return p;
+    } else {
+      err = walk_fts_build(w, p, &level.kids);
+    }
+
+    if (skip || err) {
+      walk_free_list(&level.kids);
+      walk_leave(w->t);
+      p->fts_info = skip ? FTS_DP : FTS_DNR;
+      p->fts_errno = err;
+      return p;
+    }
+    w->levels.push_back(level);
+  }
+
+  for (;;) {
+    walk_fts_level &top = w->levels.back();
+    if (top.next < top.kids.size()) {
+      p = top.kids[top.next++];
+      if (p->fts_instr == FTS_SKIP && top.next > 1) {
+        // set through fts_children; like libc's fts, not on the first entry
+        if (p->fts_info == FTS_D && p->fts_level > FTS_ROOTLEVEL) walk_pass(w->t);
+        continue;
+      }
+      w->cur = p;
+      return p;
+    }
+    if (w->levels.size() == 1) {
+      w->cur = NULL;
+      w->done = 1;
+      errno = 0;
+      return NULL;
+    }
+    p = top.dir;
+    walk_free_list(&top.kids);
+    w->levels.pop_back();
+    walk_leave(w->t);
+    p->fts_info = FTS_DP;
+    p->fts_instr = FTS_NOINSTR;
+    w->cur = p;
+    return p;
+  }
+}
+
+FTSENT* walk_fts_children(FTS *ftsp, int instr) {
+  walk_fts *w = (walk_fts*)ftsp;
+  if (instr != 0 && instr != FTS_NAMEONLY) {
+    errno = EINVAL;
+    return NULL;
+  }
+  errno = 0;
+  FTSENT *p = w->cur;
+  if (w->done) return NULL;
+  if (p == NULL) return w->levels[0].kids.empty() ? NULL : w->levels[0].kids[0];
+  if (p->fts_info != FTS_D) return NULL;
+
+  if (w->built_for != p) {
+    w->built_err = walk_fts_build(w, p, &w->built);
+    w->built_for = p;
+  }
+  if (w->built_err) {
+    errno = w->built_err;
+    return NULL;
+  }
+  return w->built.empty() ? NULL : w->built[0];
+}
+
+int walk_fts_set(FTS *ftsp, FTSENT *p, int instr) {
+  (void)ftsp;
+  if (instr != 0 && instr != FTS_AGAIN && instr != FTS_FOLLOW &&
+      instr != FTS_NOINSTR && instr != FTS_SKIP) {
+    errno = EINVAL;
+    return -1;
+  }
+  p->fts_instr = instr;
+  return 0;
+}
+
+int walk_fts_close(FTS *ftsp) {
+  walk_fts *w = (walk_fts*)ftsp;
+  pthread_mutex_lock(&walk_lock);
+  walk_open.erase(ftsp);
+  pthread_mutex_unlock(&walk_lock);
+
+  walk_end(w->t);
+  walk_free_list(&w->built);
+  while (!w->levels.empty()) {
+    walk_free_list(&w->levels.back().kids);
+    w->levels.pop_back();
+  }
+  walk_ent_free(w->parent);
+  delete w;
+  return 0;
+}
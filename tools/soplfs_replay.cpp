@@ -0,0 +1,524 @@
+/*
+ * soplfs-replay: re-issue the calls of soplfs traces
+ *
+ * Reads files written with SOPLFS_TRACE and issues the same calls
+ * again, normally under LD_PRELOAD=libsoplfs.so so they go through
+ * soplfs and PLFS as they did in the traced run:
+ *
+ *   PLFSRC=... LD_PRELOAD=./libsoplfs.so ./soplfs-replay trace.1234 trace.1235
+ *
+ * Every traced thread of every trace gets a replay thread that issues
+ * its calls in order.  A call also waits for every call, in any thread
+ * or trace, that had finished before it started in the trace, so a
+ * file is created before another rank opens it and a write lands
+ * before the read that followed it.  On top of that order, -s sets the
+ * pace: 1 (the default) keeps the traced inter-arrival times, 10
+ * compresses them tenfold, 0 issues each call as soon as the calls it
+ * depends on are done.
+ *
+ * Descriptors and directory streams are mapped from the trace to the
+ * replay.  read and write re-position with lseek when the traced
+ * offset differs from where the replay is; stdio calls become read and
+ * write on the descriptor, fflush becomes fsync and aio_read and
+ * aio_write become pread and pwrite.  The rest of AIO, fcntl other
+ * than F_DUPFD, chdir and getcwd are not replayed.  -r old=new rewrites
+ * path prefixes, to replay into a scratch directory.
+ *
+ * Prints, per operation, the calls replayed and skipped, the mean
+ * latency in the trace and in the replay, and the calls whose success
+ * differed (-v lists them).
+ */
+#include "../soplfs_stats.h"
+#include "../soplfs_trace.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <aio.h>
+#include <sys/stat.h>
+
+#include <map>
+#include <string>
+#include <vector>
+#include <utility>
+#include <algorithm>
+
+
+struct event {
+  trace_record r;
+  std::string path;
+  std::string to;          // rename target
+  long long start_ns;      // node clock, from the trace
+  long long end_ns;
+  double trace_ns;         // latency in the trace
+  int file;
+  int slot;                // replay handle the call uses, -1 if none
+  int opens;               // replay handle the call creates, -1 if none
+  int need;                // calls, in end order, that must be done first
+  int end_rank;
+  int skip;
+  long long replay_ns;
+  long long replay_result;
+};
+
+// a descriptor or directory stream of the replay
+struct slot {
+  int fd;
+  DIR *dir;
+  long long pos;
+};
+
+struct op_total {
+  long calls;
+  long skipped;
+  long differ;
+  double trace_ns;
+  double replay_ns;
+};
+
+static std::vector<event> events;
+static std::vector<slot> slots;
+static std::vector<std::pair<std::string, std::string> > rewrites;
+
+static double speed = 1.0;
+static int verbose = 0;
+
+// calls done in end order, and how long that done prefix is
+static std::vector<char> done;
+static int done_prefix = 0;
+static pthread_mutex_t done_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t done_cond = PTHREAD_COND_INITIALIZER;
+
+static long long replay_start;
+static long long trace_start;
+
+
+static long long now_ns() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static std::string rewrite(const std::string &path) {
+  for (size_t i = 0; i < rewrites.size(); i++) {
+    const std::string &from = rewrites[i].first;
+    if (path.compare(0, from.size(), from) == 0) {
+      return rewrites[i].second + path.substr(from.size());
+    }
+  }
+  return path;
+}
+
+static int load(const char *name, int file) {
+  FILE *f = fopen(name, "r");
+  if (f == NULL) {
+    perror(name);
+    return -1;
+  }
+
+  trace_file_header h;
+  if (fread(&h, sizeof(h), 1, f) != 1 || memcmp(h.magic, TRACE_MAGIC, sizeof(h.magic)) != 0 ||
+      h.version != TRACE_VERSION || h.record_size != sizeof(trace_record)) {
+    fprintf(stderr, "%s: not a soplfs trace\n", name);
+    fclose(f);
+    return -1;
+  }
+
+  std::vector<event> loaded;
+  unsigned long long clock_ticks = h.start_ticks;
+  long long clock_ns = h.start_ns;
+  trace_record r;
+  while (fread(&r, sizeof(r), 1, f) == 1) {
+    if (r.op == TRACE_CLOCK) {
+      clock_ticks = r.start;
+      clock_ns = r.result;
+      continue;
+    }
+
+    event e;
+    memset(&e.r, 0, sizeof(e.r));
+    e.r = r;
+    if (r.path_len > 0) {
+      std::vector<char> buf(trace_path_slots(r.path_len) * sizeof(trace_record));
+      if (fread(&buf[0], buf.size(), 1, f) != 1) break;
+      std::string both(&buf[0], r.path_len);
+      size_t nul = both.find('\0');
+      e.path = rewrite(both.substr(0, nul));
+      if (nul != std::string::npos) e.to = rewrite(both.substr(nul + 1));
+    }
+    e.file = file;
+    e.slot = -1;
+    e.opens = -1;
+    e.skip = 0;
+    e.replay_ns = 0;
+    e.replay_result = 0;
+    loaded.push_back(e);
+  }
+  fclose(f);
+
+  // ticks to ns over the whole trace, from its first and last clock points
+  double npt = 1.0;
+  if (clock_ticks > h.start_ticks && clock_ns > h.start_ns) {
+    npt = (double)(clock_ns - h.start_ns) / (clock_ticks - h.start_ticks);
+  }
+  for (size_t i = 0; i < loaded.size(); i++) {
+    event &e = loaded[i];
+    e.start_ns = h.start_ns + (long long)(((long long)e.r.start - (long long)h.start_ticks) * npt);
+    e.trace_ns = e.r.ticks * npt;
+    e.end_ns = e.start_ns + (long long)e.trace_ns;
+    events.push_back(e);
+  }
+
+  fprintf(stderr, "%s: pid %d, %zu calls: %s\n", name, h.pid, loaded.size(), h.cmdline);
+  return 0;
+}
+
+static int is_dir_op(int op) {
+  return op == STATS_OPENDIR || op == STATS_READDIR || op == STATS_CLOSEDIR;
+}
+
+static int is_open(int op) {
+  return op == STATS_OPEN || op == STATS_FOPEN || op == STATS_OPENDIR;
+}
+
+// calls on a descriptor or stream rather than a path
+static int on_handle(int op) {
+  return !(is_open(op) || op == STATS_STAT ||
+           op == STATS_CHMOD || op == STATS_MKDIR || op == STATS_RMDIR || op == STATS_RENAME ||
+           op == STATS_CHDIR || op == STATS_GETCWD);
+}
+
+static int is_dup(const event &e) {
+  return e.r.op == STATS_FCNTL && (e.r.flags == F_DUPFD || e.r.flags == F_DUPFD_CLOEXEC);
+}
+
+static bool by_start(const event &a, const event &b) {
+  return a.start_ns < b.start_ns;
+}
+
+// maps traced handles to replay slots.  An open's descriptor exists from
+// the end of the call, anything else uses its handle from the start: a
+// slow open in one thread may return the fd another thread just closed
+static void assign_slots() {
+  std::map<std::pair<std::pair<int, int>, long long>, int> live;   // (file, dir?), handle
+
+  std::vector<std::pair<long long, int> > order(events.size());
+  for (size_t i = 0; i < events.size(); i++) {
+    order[i] = std::make_pair(is_open(events[i].r.op) ? events[i].end_ns : events[i].start_ns, (int)i);
+  }
+  std::stable_sort(order.begin(), order.end());
+
+  for (size_t i = 0; i < order.size(); i++) {
+    event &e = events[order[i].second];
+    int op = e.r.op;
+    std::pair<std::pair<int, int>, long long> key(std::make_pair(e.file, is_dir_op(op)), e.r.handle);
+
+    if (is_open(op)) {
+      if (e.r.result == -1) continue;
+      key.second = e.r.result;
+      e.opens = slots.size();
+      slot s = { -1, NULL, 0 };
+      slots.push_back(s);
+      live[key] = e.opens;
+      continue;
+    }
+
+    if (e.r.handle == -1) continue;
+    std::map<std::pair<std::pair<int, int>, long long>, int>::iterator it = live.find(key);
+    if (it == live.end()) {
+      e.skip = 1;   // opened before the trace began
+      continue;
+    }
+    e.slot = it->second;
+
+    if (op == STATS_CLOSE || op == STATS_FCLOSE || op == STATS_CLOSEDIR) {
+      live.erase(it);
+    } else if (is_dup(e) && e.r.result >= 0) {
+      e.opens = slots.size();
+      slot s = { -1, NULL, 0 };
+      slots.push_back(s);
+      key.second = e.r.result;
+      live[key] = e.opens;
+    }
+  }
+}
+
+// a call depends on every call that ended before it started
+static void assign_dependencies() {
+  std::vector<std::pair<long long, int> > ends(events.size());
+  for (size_t i = 0; i < events.size(); i++) ends[i] = std::make_pair(events[i].end_ns, (int)i);
+  std::sort(ends.begin(), ends.end());
+
+  for (size_t i = 0; i < ends.size(); i++) events[ends[i].second].end_rank = i;
+  for (size_t i = 0; i < events.size(); i++) {
+    events[i].need = std::lower_bound(ends.begin(), ends.end(),
+                                      std::make_pair(events[i].start_ns, -1)) - ends.begin();
+  }
+  done.assign(events.size(), 0);
+}
+
+static void wait_for(const event &e) {
+  pthread_mutex_lock(&done_lock);
+  while (done_prefix < e.need) pthread_cond_wait(&done_cond, &done_lock);
+  pthread_mutex_unlock(&done_lock);
+
+  if (speed > 0) {
+    long long at = replay_start + (long long)((e.start_ns - trace_start) / speed);
+    long long wait = at - now_ns();
+    if (wait > 0) {
+      struct timespec ts = { wait / 1000000000LL, wait % 1000000000LL };
+      nanosleep(&ts, NULL);
+    }
+  }
+}
+
+static void mark_done(const event &e) {
+  pthread_mutex_lock(&done_lock);
+  done[e.end_rank] = 1;
+  while (done_prefix < (int)done.size() && done[done_prefix]) done_prefix++;
+  pthread_cond_broadcast(&done_cond);
+  pthread_mutex_unlock(&done_lock);
+}
+
+static void seek_to(slot &s, long long offset) {
+  if (offset >= 0 && offset != s.pos) {
+    lseek(s.fd, offset, SEEK_SET);
+    s.pos = offset;
+  }
+}
+
+static long long moved(slot &s, long long ret) {
+  if (ret > 0) s.pos += ret;
+  return ret;
+}
+
+// issues one call; returns its result, or sets e.skip
+static long long issue(event &e, std::vector<char> &buf) {
+  const trace_record &r = e.r;
+  slot *s = e.slot >= 0 ? &slots[e.slot] : NULL;
+  if (on_handle(r.op) && (s == NULL || (s->fd < 0 && s->dir == NULL))) {
+    e.skip = 1;   // not opened in the trace, or its open failed here
+    return -1;
+  }
+
+  switch (r.op) {
+    case STATS_OPEN:
+    case STATS_FOPEN: {
+      int fd = open(e.path.c_str(), r.flags, (mode_t)r.size);
+      if (fd >= 0 && e.opens >= 0) {
+        slots[e.opens].fd = fd;
+        slots[e.opens].pos = 0;
+      } else if (fd >= 0) {
+        close(fd);   // failed in the trace; don't keep it
+      }
+      return fd;
+    }
+    case STATS_CLOSE:
+    case STATS_FCLOSE: {
+      int fd = s->fd;
+      s->fd = -1;
+      return close(fd);
+    }
+    case STATS_READ:
+    case STATS_FREAD:
+    case STATS_FGETC:
+    case STATS_FGETS:
+      seek_to(*s, r.offset);
+      return moved(*s, read(s->fd, &buf[0], r.size));
+    case STATS_WRITE:
+    case STATS_FWRITE:
+    case STATS_FPUTC:
+    case STATS_FPUTS:
+    case STATS_FPRINTF:
+      seek_to(*s, r.offset);
+      return moved(*s, write(s->fd, &buf[0], r.size));
+    case STATS_PREAD:
+      return pread(s->fd, &buf[0], r.size, r.offset);
+    case STATS_PWRITE:
+      return pwrite(s->fd, &buf[0], r.size, r.offset);
+    case STATS_LSEEK: {
+      off_t pos = lseek(s->fd, r.offset, r.flags);
+      if (pos >= 0) s->pos = pos;
+      return pos;
+    }
+    case STATS_AIO:
+      if (r.size == 0) break;
+      if (r.flags == LIO_WRITE) return pwrite(s->fd, &buf[0], r.size, r.offset) < 0 ? -1 : 0;
+      return pread(s->fd, &buf[0], r.size, r.offset) < 0 ? -1 : 0;
+    case STATS_STAT: {
+      struct stat st;
+      return stat(e.path.c_str(), &st);
+    }
+    case STATS_FSTAT: {
+      struct stat st;
+      return fstat(s->fd, &st);
+    }
+    case STATS_CHMOD:
+      return chmod(e.path.c_str(), (mode_t)r.size);
+    case STATS_MKDIR:
+      return mkdir(e.path.c_str(), (mode_t)r.size);
+    case STATS_RMDIR:
+      return rmdir(e.path.c_str());
+    case STATS_RENAME:
+      return rename(e.path.c_str(), e.to.c_str());
+    case STATS_OPENDIR: {
+      DIR *d = opendir(e.path.c_str());
+      if (d != NULL && e.opens >= 0) slots[e.opens].dir = d;
+      else if (d != NULL) closedir(d);
+      return d != NULL ? 1 : -1;
+    }
+    case STATS_READDIR:
+      return readdir(s->dir) != NULL;
+    case STATS_CLOSEDIR: {
+      DIR *d = s->dir;
+      s->dir = NULL;
+      return closedir(d);
+    }
+    case STATS_FFLUSH:
+    case STATS_FSYNC:
+      return fsync(s->fd);
+    case STATS_FCNTL:
+      if (!is_dup(e)) break;
+      {
+        int fd = fcntl(s->fd, r.flags, 0);
+        if (fd >= 0 && e.opens >= 0) {
+          slots[e.opens].fd = fd;
+          slots[e.opens].pos = s->pos;
+        }
+        return fd;
+      }
+  }
+  e.skip = 1;
+  return 0;
+}
+
+static void* thread_main(void *arg) {
+  std::vector<int> &mine = *(std::vector<int>*)arg;
+
+  size_t largest = 1;
+  for (size_t i = 0; i < mine.size(); i++) {
+    const trace_record &r = events[mine[i]].r;
+    if (r.handle != -1) largest = std::max(largest, (size_t)r.size);
+  }
+  std::vector<char> buf(largest, 'r');
+
+  for (size_t i = 0; i < mine.size(); i++) {
+    event &e = events[mine[i]];
+    wait_for(e);
+    if (!e.skip) {
+      long long t0 = now_ns();
+      e.replay_result = issue(e, buf);
+      e.replay_ns = now_ns() - t0;
+    }
+    mark_done(e);
+  }
+  return NULL;
+}
+
+static void report(long long wall_ns) {
+  std::vector<op_total> totals(STATS_OPS);
+  memset(&totals[0], 0, totals.size() * sizeof(op_total));
+  long long trace_end = trace_start;
+
+  for (size_t i = 0; i < events.size(); i++) {
+    const event &e = events[i];
+    trace_end = std::max(trace_end, e.end_ns);
+    if (e.r.op >= STATS_OPS) continue;
+    op_total &t = totals[e.r.op];
+    if (e.skip) {
+      t.skipped++;
+      continue;
+    }
+    t.calls++;
+    t.trace_ns += e.trace_ns;
+    t.replay_ns += e.replay_ns;
+    if ((e.r.result >= 0) != (e.replay_result >= 0)) {
+      t.differ++;
+      if (verbose) {
+        fprintf(stderr, "differs: %s %s handle %lld offset %lld size %llu: trace %lld (%s), replay %lld\n",
+                stats_op_names[e.r.op], e.path.c_str(), (long long)e.r.handle, (long long)e.r.offset,
+                (unsigned long long)e.r.size, (long long)e.r.result, strerror(e.r.err), e.replay_result);
+      }
+    }
+  }
+
+  printf("%-12s %9s %9s %12s %12s %8s\n", "op", "calls", "skipped", "trace_us", "replay_us", "differ");
+  long differ = 0;
+  for (int op = 0; op < STATS_OPS; op++) {
+    const op_total &t = totals[op];
+    if (t.calls == 0 && t.skipped == 0) continue;
+    printf("%-12s %9ld %9ld %12.2f %12.2f %8ld\n", stats_op_names[op], t.calls, t.skipped,
+           t.calls ? t.trace_ns / t.calls / 1e3 : 0.0, t.calls ? t.replay_ns / t.calls / 1e3 : 0.0,
+           t.differ);
+    differ += t.differ;
+  }
+  printf("traced %.3fs, replayed in %.3fs at speed %g, %ld calls differ\n",
+         (trace_end - trace_start) / 1e9, wall_ns / 1e9, speed, differ);
+}
+
+static void usage(const char *self) {
+  fprintf(stderr,
+          "usage: %s [-s speed] [-r old=new]... [-v] trace...\n"
+          "  -s  1 keeps traced timing, N is N times faster, 0 only keeps the order\n"
+          "  -r  replay paths under old/ under new/ instead\n"
+          "  -v  list calls whose success differed from the trace\n", self);
+  exit(1);
+}
+
+int main(int argc, char **argv) {
+  int opt;
+  while ((opt = getopt(argc, argv, "s:r:v")) != -1) {
+    switch (opt) {
+      case 's': speed = atof(optarg); break;
+      case 'r': {
+        const char *eq = strchr(optarg, '=');
+        if (eq == NULL) usage(argv[0]);
+        rewrites.push_back(std::make_pair(std::string(optarg, eq - optarg), std::string(eq + 1)));
+        break;
+      }
+      case 'v': verbose = 1; break;
+      default: usage(argv[0]);
+    }
+  }
+  if (optind == argc || speed < 0) usage(argv[0]);
+
+  for (int i = optind; i < argc; i++) {
+    if (load(argv[i], i - optind) != 0) return 1;
+  }
+  if (events.empty()) {
+    fprintf(stderr, "no calls to replay\n");
+    return 1;
+  }
+
+  std::stable_sort(events.begin(), events.end(), by_start);
+  trace_start = events[0].start_ns;
+  assign_slots();
+  assign_dependencies();
+
+  // one replay thread per traced thread
+  std::map<std::pair<int, unsigned>, std::vector<int> > threads;
+  for (size_t i = 0; i < events.size(); i++) {
+    threads[std::make_pair(events[i].file, events[i].r.tid)].push_back(i);
+  }
+
+  replay_start = now_ns();
+  std::vector<pthread_t> tids;
+  for (std::map<std::pair<int, unsigned>, std::vector<int> >::iterator it = threads.begin();
+       it != threads.end(); ++it) {
+    pthread_t tid;
+    if (pthread_create(&tid, NULL, thread_main, &it->second) != 0) {
+      perror("pthread_create");
+      return 1;
+    }
+    tids.push_back(tid);
+  }
+  for (size_t i = 0; i < tids.size(); i++) pthread_join(tids[i], NULL);
+
+  report(now_ns() - replay_start);
+  return 0;
+}
@@ -0,0 +1,345 @@
+/*
+ * soplfs-top: live view of soplfs statistics on this node
+ *
+ * Processes run with SOPLFS_STATS_SHM=1 publish their counters in
+ * /dev/shm/soplfs.<pid> (layout in soplfs_stats.h).  soplfs-top maps
+ * every such segment read-only and prints, each interval, the rates
+ * since the previous sample:
+ *
+ *   per process  PLFS ops/s, passthrough ops/s, read and write MiB/s,
+ *                p99 latency of PLFS calls, share of the time spent in
+ *                plfs_*, EAGAIN retries/s, open PLFS handles, read-ahead
+ *                hit rate and the age of the oldest call still running
+ *   per mount    PLFS ops/s, MiB/s and mean latency over all processes
+ *
+ * A call running longer than -s seconds marks its process STALLED.
+ * Segments of processes that died without cleaning up (killed, or
+ * exec'ed) are shown as dead; -g removes them.
+ *
+ *   soplfs-top [-d seconds] [-n samples] [-s stall_seconds] [-p pid] [-b] [-g]
+ */
+#include "../soplfs_stats.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+
+#include <map>
+#include <string>
+#include <vector>
+#include <algorithm>
+
+
+#define SHM_DIR "/dev/shm"
+
+// one process, summed over its slots
+struct sample {
+  long long ns;                 // CLOCK_MONOTONIC
+  unsigned long long plfs_calls;
+  unsigned long long pass_calls;
+  unsigned long long rbytes;
+  unsigned long long wbytes;
+  unsigned long long plfs_ticks;
+  unsigned long long eagain;
+  unsigned long long hist[STATS_BUCKETS];
+  long long events[STATS_EVENTS];
+  stats_mount_counter m[STATS_MOUNTS];
+  unsigned long long oldest;    // ticks the oldest running call has taken
+  int oldest_op;
+  int threads;                  // slots owned by a live thread
+};
+
+struct segment {
+  std::string name;
+  const stats_shm_header *hdr;
+  const stats_thread *slots;
+  size_t size;
+  ino_t ino;
+  sample prev;
+  int seen;
+};
+
+struct mount_rate {
+  double calls;
+  double ops;
+  double bytes;
+  double ns;
+};
+
+static std::map<int, segment> segments;
+
+static double interval = 2.0;
+static int samples = 0;
+static double stall_secs = 10.0;
+static int only_pid = 0;
+static int batch = 0;
+static int collect = 0;
+
+
+static long long now_ns() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static size_t segment_size() {
+  return sizeof(stats_shm_header) + STATS_SLOTS * sizeof(stats_thread);
+}
+
+// ns per tick of this node's clock, from the segment's own start point
+static double ns_per_tick(const stats_shm_header *hdr) {
+  unsigned long long ticks = stats_ticks();
+  long long ns = now_ns();
+  if (ticks <= hdr->start_ticks || ns <= hdr->start_ns) return 1.0;
+  return (double)(ns - hdr->start_ns) / (ticks - hdr->start_ticks);
+}
+
+static int attach(int pid, const std::string &name) {
+  std::string path = std::string(SHM_DIR "/") + name;
+  int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+  if (fd < 0) return -1;
+
+  struct stat st;
+  void *p = MAP_FAILED;
+  if (fstat(fd, &st) == 0 && (size_t)st.st_size >= segment_size()) {
+    p = mmap(NULL, segment_size(), PROT_READ, MAP_SHARED, fd, 0);
+  }
+  close(fd);
+  if (p == MAP_FAILED) return -1;
+
+  const stats_shm_header *hdr = (const stats_shm_header*)p;
+  if (memcmp(hdr->magic, STATS_SHM_MAGIC, sizeof(hdr->magic)) != 0 ||
+      hdr->version != STATS_SHM_VERSION || hdr->pid != pid) {
+    munmap(p, segment_size());   // not ready yet, or not ours
+    return -1;
+  }
+
+  segment &seg = segments[pid];
+  seg.name = name;
+  seg.hdr = hdr;
+  seg.slots = (const stats_thread*)(hdr + 1);
+  seg.size = segment_size();
+  seg.ino = st.st_ino;
+  memset(&seg.prev, 0, sizeof(seg.prev));
+  seg.prev.ns = hdr->start_ns;   // the first rates are since process start
+  seg.seen = 1;
+  return 0;
+}
+
+static void detach(std::map<int, segment>::iterator it) {
+  munmap((void*)it->second.hdr, it->second.size);
+  segments.erase(it);
+}
+
+// picks up new segments and drops the ones that were removed
+static void scan() {
+  for (std::map<int, segment>::iterator it = segments.begin(); it != segments.end(); ++it) {
+    it->second.seen = 0;
+  }
+
+  DIR *d = opendir(SHM_DIR);
+  if (d == NULL) return;
+  size_t plen = strlen(STATS_SHM_PREFIX);
+  struct dirent *e;
+  while ((e = readdir(d)) != NULL) {
+    if (strncmp(e->d_name, STATS_SHM_PREFIX, plen) != 0) continue;
+    char *end;
+    long pid = strtol(e->d_name + plen, &end, 10);
+    if (*end != '\0' || pid <= 0) continue;
+    if (only_pid && pid != only_pid) continue;
+
+    std::map<int, segment>::iterator it = segments.find(pid);
+    if (it != segments.end()) {
+      // a pid reused by a new process gets a new segment
+      struct stat st;
+      std::string path = std::string(SHM_DIR "/") + e->d_name;
+      if (stat(path.c_str(), &st) == 0 && st.st_ino == it->second.ino) {
+        it->second.seen = 1;
+        continue;
+      }
+      detach(it);
+    }
+    attach(pid, e->d_name);
+  }
+  closedir(d);
+
+  for (std::map<int, segment>::iterator it = segments.begin(); it != segments.end(); ) {
+    std::map<int, segment>::iterator cur = it++;
+    if (!cur->second.seen) detach(cur);
+  }
+}
+
+static void take(const segment &seg, sample &s) {
+  memset(&s, 0, sizeof(s));
+  s.ns = now_ns();
+  unsigned long long now = stats_ticks();
+
+  unsigned n = std::min(seg.hdr->slots, (unsigned)STATS_SLOTS);
+  for (unsigned i = 0; i < n; i++) {
+    const stats_thread &st = seg.slots[i];
+    for (int op = 0; op < STATS_OPS; op++) {
+      for (int r = 0; r < STATS_ROUTES; r++) {
+        const stats_counter &c = st.c[op][r];
+        if (c.calls == 0) continue;
+        if (r == STATS_PASS) {
+          s.pass_calls += c.calls;
+          continue;
+        }
+        s.plfs_calls += c.calls;
+        if (stats_op_reads(op)) s.rbytes += c.bytes;
+        if (stats_op_writes(op)) s.wbytes += c.bytes;
+        s.plfs_ticks += c.plfs_ticks;
+        s.eagain += c.eagain;
+        for (int b = 0; b < STATS_BUCKETS; b++) s.hist[b] += c.hist[b];
+      }
+    }
+    for (int m = 0; m < STATS_MOUNTS; m++) {
+      s.m[m].calls += st.m[m].calls;
+      s.m[m].bytes += st.m[m].bytes;
+      s.m[m].ticks += st.m[m].ticks;
+    }
+    for (int e = 0; e < STATS_EVENTS; e++) s.events[e] += st.events[e];
+
+    if (st.owner != 0) s.threads++;
+    unsigned long long start = st.inflight_start;
+    if (st.owner != 0 && start != 0 && start < now && now - start > s.oldest) {
+      s.oldest = now - start;
+      s.oldest_op = st.inflight_op;
+    }
+  }
+}
+
+// upper bound of the bucket holding the p-th fraction of the calls
+static double percentile(const unsigned long long *hist, double p) {
+  unsigned long long total = 0;
+  for (int b = 0; b < STATS_BUCKETS; b++) total += hist[b];
+  if (total == 0) return 0;
+  unsigned long long want = (unsigned long long)(total * p), seen = 0;
+  for (int b = 0; b < STATS_BUCKETS; b++) {
+    seen += hist[b];
+    if (seen > want) return (double)(1ULL << b);
+  }
+  return (double)(1ULL << (STATS_BUCKETS - 1));
+}
+
+static void human_age(char *buf, size_t size, double secs) {
+  if (secs < 1e-3) snprintf(buf, size, "-");
+  else if (secs < 1) snprintf(buf, size, "%.0fms", secs * 1e3);
+  else if (secs < 600) snprintf(buf, size, "%.1fs", secs);
+  else snprintf(buf, size, "%.0fm", secs / 60);
+}
+
+static void show() {
+  std::map<std::string, mount_rate> mounts;
+
+  if (!batch) printf("\033[H\033[2J");
+  time_t t = time(NULL);
+  char when[32];
+  strftime(when, sizeof(when), "%H:%M:%S", localtime(&t));
+  printf("soplfs-top %s, %zu processes, every %.1fs\n\n", when, segments.size(), interval);
+  printf("%7s %4s %9s %9s %8s %8s %8s %5s %8s %6s %5s %7s  %s\n",
+         "PID", "THR", "PLFS/s", "PASS/s", "RD_MiB/s", "WR_MiB/s", "P99_ms",
+         "PLFS%", "EAGAIN/s", "HANDLE", "RA%", "OLDEST", "COMMAND");
+
+  for (std::map<int, segment>::iterator it = segments.begin(); it != segments.end(); ++it) {
+    segment &seg = it->second;
+    sample cur;
+    take(seg, cur);
+    const sample &prev = seg.prev;
+    double npt = ns_per_tick(seg.hdr);
+    double dt = (cur.ns - prev.ns) / 1e9;
+    if (dt <= 0) dt = 1e-9;
+
+    unsigned long long hist[STATS_BUCKETS];
+    for (int b = 0; b < STATS_BUCKETS; b++) hist[b] = cur.hist[b] - prev.hist[b];
+
+    long long hits = cur.events[STATS_EV_RA_HIT] - prev.events[STATS_EV_RA_HIT];
+    long long misses = cur.events[STATS_EV_RA_MISS] - prev.events[STATS_EV_RA_MISS];
+    char ra[16];
+    if (hits + misses > 0) snprintf(ra, sizeof(ra), "%.0f", 100.0 * hits / (hits + misses));
+    else snprintf(ra, sizeof(ra), "-");
+
+    int alive = kill(it->first, 0) == 0 || errno != ESRCH;
+    double oldest = alive ? cur.oldest * npt / 1e9 : 0;
+    char age[16];
+    human_age(age, sizeof(age), oldest);
+
+    const char *state = !alive ? "[dead] " : oldest >= stall_secs ? "[STALLED] " : "";
+
+    printf("%7d %4d %9.0f %9.0f %8.1f %8.1f %8.3f %5.0f %8.0f %6lld %5s %7s  %s%s%s%s\n",
+           it->first, cur.threads,
+           (cur.plfs_calls - prev.plfs_calls) / dt,
+           (cur.pass_calls - prev.pass_calls) / dt,
+           (cur.rbytes - prev.rbytes) / dt / 1048576.0,
+           (cur.wbytes - prev.wbytes) / dt / 1048576.0,
+           percentile(hist, 0.99) * npt / 1e6,
+           100.0 * (cur.plfs_ticks - prev.plfs_ticks) * npt / 1e9 / dt,
+           (cur.eagain - prev.eagain) / dt,
+           cur.events[STATS_EV_HANDLES], ra, age, state,
+           oldest >= 1e-3 ? stats_op_names[cur.oldest_op] : "",
+           oldest >= 1e-3 ? ": " : "", seg.hdr->cmdline);
+
+    for (int m = 0; m < seg.hdr->mounts && m < STATS_MOUNTS; m++) {
+      mount_rate &r = mounts[std::string(seg.hdr->mount[m], strnlen(seg.hdr->mount[m], STATS_PATH_MAX))];
+      r.calls += cur.m[m].calls - prev.m[m].calls;
+      r.ops += (cur.m[m].calls - prev.m[m].calls) / dt;
+      r.bytes += (cur.m[m].bytes - prev.m[m].bytes) / dt;
+      r.ns += (cur.m[m].ticks - prev.m[m].ticks) * npt;
+    }
+
+    if (!alive && collect) {
+      shm_unlink(("/" + seg.name).c_str());
+      printf("%7s removed " SHM_DIR "/%s\n", "", seg.name.c_str());
+    }
+    seg.prev = cur;
+  }
+
+  if (!mounts.empty()) {
+    printf("\n%-40s %9s %9s %10s\n", "MOUNT", "OPS/s", "MiB/s", "MEAN_ms");
+    for (std::map<std::string, mount_rate>::iterator it = mounts.begin(); it != mounts.end(); ++it) {
+      const mount_rate &r = it->second;
+      printf("%-40s %9.0f %9.1f %10.3f\n", it->first.c_str(), r.ops, r.bytes / 1048576.0,
+             r.calls > 0 ? r.ns / r.calls / 1e6 : 0.0);
+    }
+  }
+  if (batch) printf("\n");
+  fflush(stdout);
+}
+
+static void usage(const char *self) {
+  fprintf(stderr,
+          "usage: %s [-d seconds] [-n samples] [-s stall_seconds] [-p pid] [-b] [-g]\n"
+          "  -b  batch: no screen clearing, for logs\n"
+          "  -g  remove segments of processes that are gone\n", self);
+  exit(1);
+}
+
+int main(int argc, char **argv) {
+  int opt;
+  while ((opt = getopt(argc, argv, "d:n:s:p:bg")) != -1) {
+    switch (opt) {
+      case 'd': interval = atof(optarg); break;
+      case 'n': samples = atoi(optarg); break;
+      case 's': stall_secs = atof(optarg); break;
+      case 'p': only_pid = atoi(optarg); break;
+      case 'b': batch = 1; break;
+      case 'g': collect = 1; break;
+      default: usage(argv[0]);
+    }
+  }
+  if (interval <= 0 || samples < 0) usage(argv[0]);
+
+  for (int i = 0; samples == 0 || i < samples; i++) {
+    if (i > 0) usleep((useconds_t)(interval * 1e6));
+    scan();
+    show();
+  }
+  return 0;
+}